@@ -0,0 +1,33 @@
+/* Copyright 2016 Google Inc.
+ *
+ * See LICENSE for details.
+ *
+ * Guest output sink. Everything the guest prints, whichever way it prints
+ * it, goes through here: each source has a lock-free ring that a writer
+ * thread drains in batches to stdout or to a file, optionally timestamped
+ * and rotated by size. */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Rotated files kept besides the current one: path.1 ... path.N. */
+#define GUESTOUT_KEEP 4
+#define GUESTOUT_MAX_SRCS 4
+
+struct guestout_src;
+
+/* Starts the sink. With path NULL, output goes to stdout and is never
+ * rotated; otherwise it is appended to path, which is rotated once it has
+ * grown by rotate_size bytes, if rotate_size is not 0. Timestamps, if asked
+ * for, are seconds since the sink started, at the start of each line. */
+int guestout_init(char *path, uint64_t rotate_size, bool timestamps);
+
+/* A new source, whose lines start with prefix. Each source must only be
+ * written from one thread. */
+struct guestout_src *guestout_source(char *prefix);
+
+/* Queues len bytes of buf. Waits only if the writer is a whole ring behind. */
+void guestout_write(struct guestout_src *s, void *buf, size_t len);
@@ -0,0 +1,46 @@
+/* Copyright 2016 Google Inc.
+ *
+ * See LICENSE for details.
+ *
+ * Timer wheel. All of the VMM's deadlines (the LAPIC timers of every vCPU)
+ * live on one hierarchical wheel, run by one thread sleeping on a timerfd
+ * armed for the earliest of them. With nothing pending, the timerfd is
+ * disarmed and the thread never wakes up. */
+
+#pragma once
+
+#include <stdint.h>
+
+/* The wheel counts in ticks of a microsecond. Each level has 64 slots, each
+ * a tick of the level above: 8 levels cover 2^48 ticks, about 8 years. */
+#define TW_TICK_NS 1000
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 8
+
+struct tw_timer {
+	struct tw_timer *next;
+	struct tw_timer **pprev;	/* NULL if the timer is not pending */
+	uint64_t expires;	/* in ticks */
+	uint64_t period;	/* in ticks, 0 for one-shot timers */
+	int level;
+	int slot;
+	/* Runs on the wheel's thread, with the wheel locked: it must not set
+	 * or cancel timers. Periodic timers are requeued after it returns. */
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+/* Starts the wheel. Returns 0, or -1 with errno set. */
+int timer_wheel_init(void);
+
+/* Time on the wheel's clock, in ns since it started. */
+uint64_t timer_wheel_now(void);
+
+void tw_timer_init(struct tw_timer *t, void (*fn)(void *arg), void *arg);
+
+/* (Re)arms t to fire at expires, in ns on the wheel's clock, and then every
+ * period ns if period is not 0. Expiry times in the past fire at once. */
+void tw_timer_set(struct tw_timer *t, uint64_t expires, uint64_t period);
+
+void tw_timer_cancel(struct tw_timer *t);
@@ -59,6 +59,7 @@ void showscatterlist(struct scatterlist *sg, int num);
 unsigned int wait_for_vq_desc(struct virtqueue *vq,
 				 struct scatterlist iov[],
 				 unsigned int *out_num, unsigned int *in_num);
+bool vq_desc_available(struct virtqueue *vq);
 void add_used(struct virtqueue *vq, unsigned int head, int len);
 
 /**
@@ -160,12 +160,16 @@ struct vq {
 };
 
 // a vqdev has a name; magic number; features ( we MUST have features);
-// and an array of vqs.
+// an optional config space; and an array of vqs.
 struct vqdev {
 	/* Set up usually as a static initializer */
 	char *name;
 	uint32_t dev; // e.g. VIRTIO_ID_CONSOLE);
 	uint64_t device_features, driver_features;
+	/* device specific config space, read by the guest past
+	 * VIRTIO_MMIO_CONFIG. NULL if the device has none. */
+	void *cfg;
+	int cfgsize;
 	int numvqs;
 	struct vq vqs[];
 };
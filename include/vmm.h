@@ -14,3 +14,16 @@ char *regname(uint8_t reg);
 int decode(struct vmctl *v, uint64_t *gpa, uint8_t *destreg, uint64_t **regp,
            int *store, int *size, int *advance);
 int io(struct vmctl *v);
+
+/* LAPIC timer registers, as xAPIC register numbers (offset >> 4); the
+ * x2APIC MSRs are 0x800 plus these. */
+#define LAPIC_LVT_TIMER		0x32
+#define LAPIC_INITIAL_COUNT	0x38
+#define LAPIC_CURRENT_COUNT	0x39
+#define LAPIC_DIVIDE_CONFIG	0x3e
+
+/* Per vCPU LAPIC timers, on the timer wheel. inject posts vector to vcpu;
+ * it is called from the wheel's thread. */
+void lapic_timer_init(void (*inject)(int vcpu, int vector));
+uint32_t lapic_timer_read(int vcpu, uint32_t reg);
+void lapic_timer_write(int vcpu, uint32_t reg, uint32_t value);
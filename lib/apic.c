@@ -26,6 +26,7 @@
 #include <vmm/virtio_mmio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
+#include <vmm/timerwheel.h>
 
 
 #define APIC_CONFIG 0x100
@@ -37,6 +38,36 @@ int debug_apic = 1;
 
 static struct apicinfo apicinfo;
 
+/* The timer counts this clock, divided by the divide configuration. The
+ * guest is told with lapictimerfreq on its command line, so it never has to
+ * calibrate it. */
+#define LAPIC_TIMER_HZ 1000000
+#define LAPIC_MAX_VCPUS 64
+
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_TIMER_MODE(lvt) (((lvt) >> 17) & 3)
+
+enum {
+	LAPIC_TIMER_ONESHOT,
+	LAPIC_TIMER_PERIODIC,
+	LAPIC_TIMER_TSC_DEADLINE,	/* not offered: the guest gets notscdeadline */
+};
+
+/* The timer of a vCPU. The count is never stored: it is worked out from
+ * when it was loaded, and the expiry is a timer on the wheel. */
+struct lapic_timer {
+	int vcpu;
+	uint32_t lvt;
+	uint32_t initial;
+	uint32_t divide;
+	uint64_t start;		/* ns when the count was loaded */
+	uint64_t ns_per_count;	/* from the divide configuration, at load */
+	struct tw_timer timer;
+};
+
+static struct lapic_timer lapic_timers[LAPIC_MAX_VCPUS];
+static void (*lapic_inject)(int vcpu, int vector);
+
 enum {
 	reserved,
 	readonly = 1,
@@ -116,7 +147,141 @@ struct {
 [0x3F] {.name = "Reserved", .mode =  reserved},
 };
 
-static uint32_t apic_read(uint64_t offset)
+static uint64_t lapic_timer_ns_per_count(uint32_t divide)
+{
+	int shift = (((divide & 3) | ((divide & 8) >> 1)) + 1) & 7;
+
+	return (1000000000ULL / LAPIC_TIMER_HZ) << shift;
+}
+
+static struct lapic_timer *lapic_timer(int vcpu)
+{
+	if (vcpu < 0 || vcpu >= LAPIC_MAX_VCPUS) {
+		fprintf(stderr, "LAPIC timer of vcpu %d: only %d vcpus\n", vcpu,
+			LAPIC_MAX_VCPUS);
+		return NULL;
+	}
+	return &lapic_timers[vcpu];
+}
+
+static uint32_t lapic_timer_count(struct lapic_timer *lt, uint64_t now)
+{
+	uint64_t elapsed;
+
+	if (!lt->initial)
+		return 0;
+	elapsed = (now - lt->start) / lt->ns_per_count;
+	if (LAPIC_TIMER_MODE(lt->lvt) == LAPIC_TIMER_PERIODIC)
+		return lt->initial - elapsed % lt->initial;
+	return elapsed < lt->initial ? lt->initial - elapsed : 0;
+}
+
+/* Puts the next expiry of the current count on the wheel. */
+static void lapic_timer_arm(struct lapic_timer *lt, uint64_t now)
+{
+	uint64_t period = (uint64_t)lt->initial * lt->ns_per_count;
+
+	if (!lt->initial) {
+		tw_timer_cancel(&lt->timer);
+		return;
+	}
+	switch (LAPIC_TIMER_MODE(lt->lvt)) {
+	case LAPIC_TIMER_ONESHOT:
+		if (now - lt->start < period)
+			tw_timer_set(&lt->timer, lt->start + period, 0);
+		else
+			tw_timer_cancel(&lt->timer);
+		break;
+	case LAPIC_TIMER_PERIODIC:
+		tw_timer_set(&lt->timer,
+			     lt->start + ((now - lt->start) / period + 1) * period,
+			     period);
+		break;
+	default:
+		tw_timer_cancel(&lt->timer);
+		break;
+	}
+}
+
+/* On the wheel's thread. A masked timer still counts, but is silent. */
+static void lapic_timer_fire(void *arg)
+{
+	struct lapic_timer *lt = arg;
+	uint32_t lvt = lt->lvt;
+
+	if (!(lvt & LAPIC_LVT_MASKED))
+		lapic_inject(lt->vcpu, lvt & 0xff);
+}
+
+void lapic_timer_init(void (*inject)(int vcpu, int vector))
+{
+	int i;
+
+	lapic_inject = inject;
+	for (i = 0; i < LAPIC_MAX_VCPUS; i++) {
+		lapic_timers[i].vcpu = i;
+		lapic_timers[i].lvt = LAPIC_LVT_MASKED;
+		lapic_timers[i].ns_per_count = lapic_timer_ns_per_count(0);
+		tw_timer_init(&lapic_timers[i].timer, lapic_timer_fire,
+			      &lapic_timers[i]);
+	}
+}
+
+uint32_t lapic_timer_read(int vcpu, uint32_t reg)
+{
+	struct lapic_timer *lt = lapic_timer(vcpu);
+
+	if (!lt)
+		return 0;
+	switch (reg) {
+	case LAPIC_LVT_TIMER:
+		return lt->lvt;
+	case LAPIC_INITIAL_COUNT:
+		return lt->initial;
+	case LAPIC_CURRENT_COUNT:
+		return lapic_timer_count(lt, timer_wheel_now());
+	case LAPIC_DIVIDE_CONFIG:
+		return lt->divide;
+	}
+	return 0;
+}
+
+void lapic_timer_write(int vcpu, uint32_t reg, uint32_t value)
+{
+	struct lapic_timer *lt = lapic_timer(vcpu);
+	uint64_t now = timer_wheel_now();
+	uint32_t count;
+
+	if (!lt)
+		return;
+	switch (reg) {
+	case LAPIC_LVT_TIMER:
+		if (LAPIC_TIMER_MODE(value) == LAPIC_TIMER_MODE(lt->lvt)) {
+			lt->lvt = value;
+			break;
+		}
+		/* the count goes on from where it is, in the new mode */
+		count = lapic_timer_count(lt, now);
+		lt->lvt = value;
+		if (count)
+			lt->start = now - (uint64_t)(lt->initial - count)
+			                  * lt->ns_per_count;
+		lapic_timer_arm(lt, now);
+		break;
+	case LAPIC_INITIAL_COUNT:
+		lt->initial = value;
+		lt->start = now;
+		lt->ns_per_count = lapic_timer_ns_per_count(lt->divide);
+		lapic_timer_arm(lt, now);
+		break;
+	case LAPIC_DIVIDE_CONFIG:
+		/* applies from the next count loaded */
+		lt->divide = value & 0xb;
+		break;
+	}
+}
+
+static uint32_t apic_read(int vcpu, uint64_t offset)
 {
 
 	uint32_t low;
@@ -130,8 +295,12 @@ static uint32_t apic_read(uint64_t offset)
 		return (uint32_t) -1;
 	}
 
-	// no special cases yet.
 	switch (offset) {
+	case LAPIC_LVT_TIMER:
+	case LAPIC_INITIAL_COUNT:
+	case LAPIC_CURRENT_COUNT:
+	case LAPIC_DIVIDE_CONFIG:
+		return lapic_timer_read(vcpu, offset);
 	default:
 		DPRINTF("%s: return %08x\n", apicregs[offset].name, apicregs[offset].value);
 		return apicregs[offset].value;
@@ -140,7 +309,7 @@ static uint32_t apic_read(uint64_t offset)
 	return 0;
 }
 
-static void apic_write(uint64_t offset, uint32_t value)
+static void apic_write(int vcpu, uint64_t offset, uint32_t value)
 {
 	uint64_t val64;
 	uint32_t low, high;
@@ -155,6 +324,11 @@ static void apic_write(uint64_t offset, uint32_t value)
 	}
 
 	switch (offset) {
+	case LAPIC_LVT_TIMER:
+	case LAPIC_INITIAL_COUNT:
+	case LAPIC_DIVIDE_CONFIG:
+		lapic_timer_write(vcpu, offset, value);
+		break;
 	default:
 		DPRINTF("%s: Set to %08x\n", apicregs[offset].name, value);
 		apicregs[offset].value = value;
@@ -184,10 +358,10 @@ int apic(struct vmctl *v, uint64_t gpa, int destreg, uint64_t *regp, int store)
 	}
 
 	if (store) {
-		apic_write(offset, *regp);
+		apic_write(v->core, offset, *regp);
 		DPRINTF("Write: mov %s to %s @%p val %p\n", regname(destreg), apicregs[offset].name, gpa, *regp);
 	} else {
-		*regp = apic_read(offset);
+		*regp = apic_read(v->core, offset);
 		DPRINTF("Read: Set %s from %s @%p to %p\n", regname(destreg), apicregs[offset].name, gpa, *regp);
 	}
 
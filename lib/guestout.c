@@ -0,0 +1,353 @@
+/*
+ * Guest output sink
+ *
+ * Copyright 2016 Google Inc.
+ *
+ * See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <parlib/arch/arch.h>
+#include <parlib/ros_debug.h>
+#include <parlib/uthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ros/arch/membar.h>
+#include <vmm/guestout.h>
+
+/* Per source ring. A writer several rings behind means the output can't keep
+ * up anyway; then the guest waits. */
+#define RING_SIZE (256 * 1024)
+/* The writer collects this much before it writes. */
+#define OUTBUF_SIZE (64 * 1024)
+
+/* Records in the ring are a header and the data, padded to 8 bytes. */
+struct record {
+	uint64_t tsc;
+	uint32_t len;
+	uint32_t pad;
+};
+
+/* One producer, the source's thread, moves head; the writer moves tail. */
+struct guestout_src {
+	char *prefix;
+	uint8_t *ring;
+	volatile uint64_t head;
+	volatile uint64_t tail;
+	bool bol;	/* the next byte starts a line; writer only */
+};
+
+static struct {
+	struct guestout_src srcs[GUESTOUT_MAX_SRCS];
+	volatile int nsrcs;
+	char *path;
+	int fd;
+	uint64_t rotate_size;
+	uint64_t written;
+	bool timestamps;
+	uint64_t start_tsc;
+	uint64_t tsc_freq;
+	char out[OUTBUF_SIZE];
+	size_t outlen;
+	pthread_t thread;
+	/* Nobody polls. The writer sleeps on work once every ring is empty,
+	 * and a producer with a full ring sleeps on room. Each side only
+	 * takes the lock to wake the other when its flag says it sleeps. */
+	uth_mutex_t lock;
+	uth_cond_var_t work;
+	uth_cond_var_t room;
+	volatile bool writer_waiting;
+	volatile int producers_waiting;
+} sink = {.fd = 1};
+
+static void ring_copy_in(struct guestout_src *s, uint64_t pos, void *src,
+			 size_t len)
+{
+	size_t off = pos % RING_SIZE;
+	size_t first = len < RING_SIZE - off ? len : RING_SIZE - off;
+
+	memmove(s->ring + off, src, first);
+	memmove(s->ring, (uint8_t *)src + first, len - first);
+}
+
+static void ring_copy_out(struct guestout_src *s, uint64_t pos, void *dst,
+			  size_t len)
+{
+	size_t off = pos % RING_SIZE;
+	size_t first = len < RING_SIZE - off ? len : RING_SIZE - off;
+
+	memmove(dst, s->ring + off, first);
+	memmove((uint8_t *)dst + first, s->ring, len - first);
+}
+
+static size_t round8(size_t x)
+{
+	return (x + 7) & ~7UL;
+}
+
+/* Waits for the writer to free need bytes of s. */
+static void wait_room(struct guestout_src *s, size_t need)
+{
+	uth_mutex_lock(&sink.lock);
+	sink.producers_waiting++;
+	/* counted before we look at tail: the writer moves tail, then looks
+	 * at the count. */
+	mb();
+	while (RING_SIZE - (s->head - s->tail) < need)
+		uth_cond_var_wait(&sink.room, &sink.lock);
+	sink.producers_waiting--;
+	uth_mutex_unlock(&sink.lock);
+}
+
+static void wake_writer(void)
+{
+	/* head must be out before we look at the flag: the writer sets it,
+	 * then looks at head. */
+	mb();
+	if (!sink.writer_waiting)
+		return;
+	uth_mutex_lock(&sink.lock);
+	uth_cond_var_signal(&sink.work);
+	uth_mutex_unlock(&sink.lock);
+}
+
+void guestout_write(struct guestout_src *s, void *buf, size_t len)
+{
+	struct record r = {.tsc = read_tsc()};
+	/* a record never takes more than half the ring, so one always fits
+	 * once the writer has caught up. */
+	size_t max = RING_SIZE / 2 - sizeof(r);
+	uint64_t head;
+
+	while (len) {
+		r.len = len < max ? len : max;
+		head = s->head;
+		if (RING_SIZE - (head - s->tail) < sizeof(r) + round8(r.len))
+			wait_room(s, sizeof(r) + round8(r.len));
+		/* read tail before we overwrite what it freed. */
+		rmb();
+		ring_copy_in(s, head, &r, sizeof(r));
+		ring_copy_in(s, head + sizeof(r), buf, r.len);
+		/* the record must be there before the writer sees it. */
+		wmb();
+		s->head = head + sizeof(r) + round8(r.len);
+		wake_writer();
+		buf = (uint8_t *)buf + r.len;
+		len -= r.len;
+	}
+}
+
+static int write_all(int fd, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Moves path to path.1, path.1 to path.2 and so on, and starts a new path. */
+static void rotate(void)
+{
+	char from[strlen(sink.path) + 16], to[strlen(sink.path) + 16];
+	int i;
+
+	close(sink.fd);
+	for (i = GUESTOUT_KEEP - 1; i > 0; i--) {
+		snprintf(from, sizeof(from), "%s.%d", sink.path, i);
+		snprintf(to, sizeof(to), "%s.%d", sink.path, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", sink.path);
+	rename(sink.path, to);
+	sink.fd = open(sink.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (sink.fd < 0) {
+		perror(sink.path);
+		sink.fd = 2;
+		sink.path = NULL;
+	}
+	sink.written = 0;
+}
+
+static void flush(void)
+{
+	if (!sink.outlen)
+		return;
+	if (write_all(sink.fd, sink.out, sink.outlen) < 0)
+		fprintf(stderr, "guestout: %s\n", strerror(errno));
+	sink.written += sink.outlen;
+	sink.outlen = 0;
+	if (sink.path && sink.rotate_size && sink.written >= sink.rotate_size)
+		rotate();
+}
+
+static void emit(char *buf, size_t len)
+{
+	size_t amt;
+
+	while (len) {
+		if (sink.outlen == OUTBUF_SIZE)
+			flush();
+		amt = OUTBUF_SIZE - sink.outlen;
+		if (amt > len)
+			amt = len;
+		memmove(sink.out + sink.outlen, buf, amt);
+		sink.outlen += amt;
+		buf += amt;
+		len -= amt;
+	}
+}
+
+static void emit_line_start(struct guestout_src *s, uint64_t tsc)
+{
+	char ts[32];
+	uint64_t d, sec, usec;
+
+	if (sink.timestamps) {
+		/* seconds first: d * 1000000 would overflow within hours. */
+		d = tsc - sink.start_tsc;
+		sec = d / sink.tsc_freq;
+		usec = d % sink.tsc_freq * 1000000 / sink.tsc_freq;
+		emit(ts, snprintf(ts, sizeof(ts), "[%5llu.%06llu] ",
+				  (unsigned long long)sec,
+				  (unsigned long long)usec));
+	}
+	emit(s->prefix, strlen(s->prefix));
+}
+
+/* Copies the records of s to the output buffer, starting each line with
+ * its timestamp and the source's prefix. Returns how many there were. */
+static int drain(struct guestout_src *s)
+{
+	static char data[RING_SIZE / 2];
+	struct record r;
+	uint64_t tail = s->tail;
+	char *p, *nl;
+	int n = 0;
+
+	while (tail != s->head) {
+		/* read head before the record it covers. */
+		rmb();
+		ring_copy_out(s, tail, &r, sizeof(r));
+		ring_copy_out(s, tail + sizeof(r), data, r.len);
+		tail += sizeof(r) + round8(r.len);
+		/* done with it: the producer can have the room. */
+		mb();
+		s->tail = tail;
+		for (p = data; p < data + r.len; p = nl) {
+			if (s->bol)
+				emit_line_start(s, r.tsc);
+			nl = memchr(p, '\n', data + r.len - p);
+			s->bol = nl != NULL;
+			nl = nl ? nl + 1 : data + r.len;
+			emit(p, nl - p);
+		}
+		n++;
+	}
+	return n;
+}
+
+static bool pending(void)
+{
+	int i;
+
+	for (i = 0; i < sink.nsrcs; i++)
+		if (sink.srcs[i].head != sink.srcs[i].tail)
+			return true;
+	return false;
+}
+
+static void *writer(void *arg)
+{
+	int i, n;
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < sink.nsrcs; i++)
+			n += drain(&sink.srcs[i]);
+		if (n) {
+			/* tail must be out before we look at the count. */
+			mb();
+			if (sink.producers_waiting) {
+				uth_mutex_lock(&sink.lock);
+				uth_cond_var_broadcast(&sink.room);
+				uth_mutex_unlock(&sink.lock);
+			}
+			flush();
+			continue;
+		}
+		flush();
+		uth_mutex_lock(&sink.lock);
+		sink.writer_waiting = true;
+		/* the flag must be out before we look at head. */
+		mb();
+		if (!pending())
+			uth_cond_var_wait(&sink.work, &sink.lock);
+		sink.writer_waiting = false;
+		uth_mutex_unlock(&sink.lock);
+	}
+	return NULL;
+}
+
+struct guestout_src *guestout_source(char *prefix)
+{
+	struct guestout_src *s;
+
+	if (sink.nsrcs == GUESTOUT_MAX_SRCS) {
+		fprintf(stderr, "guestout: at most %d sources\n",
+			GUESTOUT_MAX_SRCS);
+		return NULL;
+	}
+	s = &sink.srcs[sink.nsrcs];
+	s->prefix = prefix;
+	s->bol = true;
+	s->ring = malloc(RING_SIZE);
+	if (!s->ring) {
+		perror("guestout ring");
+		return NULL;
+	}
+	/* the source must be complete before the writer looks at it. */
+	wmb();
+	sink.nsrcs++;
+	return s;
+}
+
+int guestout_init(char *path, uint64_t rotate_size, bool timestamps)
+{
+	if (path) {
+		sink.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (sink.fd < 0) {
+			perror(path);
+			return -1;
+		}
+		sink.path = path;
+		sink.rotate_size = rotate_size;
+		sink.written = lseek(sink.fd, 0, SEEK_END);
+	}
+	sink.timestamps = timestamps;
+	uth_mutex_init(&sink.lock);
+	uth_cond_var_init(&sink.work);
+	uth_cond_var_init(&sink.room);
+	sink.tsc_freq = get_tsc_freq();
+	sink.start_tsc = read_tsc();
+	if (pthread_create(&sink.thread, NULL, writer, NULL)) {
+		perror("guestout writer");
+		return -1;
+	}
+	return 0;
+}
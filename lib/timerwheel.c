@@ -0,0 +1,220 @@
+/*
+ * Timer wheel
+ *
+ * Copyright 2016 Google Inc.
+ *
+ * See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <parlib/arch/arch.h>
+#include <parlib/ros_debug.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <vmm/timerwheel.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_NEVER UINT64_MAX
+
+/* A timer sits at the highest level at which its expiry differs from now,
+ * in the slot of that level's digit of its expiry. So level 0 holds what
+ * expires in the current 64 ticks, at their exact tick, and a slot of a
+ * higher level is reached, and its timers moved down, when the ticks below
+ * it roll over. Nothing sits at or before the current digit of a level but
+ * for level 0, where the current slot holds the timers due now. */
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	struct timespec base;	/* the wheel's clock starts here */
+	uint64_t now;		/* ticks run so far */
+	uint64_t armed;		/* tick the timerfd is set for */
+	uint64_t occupied[TW_LEVELS];
+	struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+} tw = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.armed = TW_NEVER,
+};
+
+static pthread_t tw_thread_struct;
+
+uint64_t timer_wheel_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - tw.base.tv_sec) * 1000000000ULL
+	       + ts.tv_nsec - tw.base.tv_nsec;
+}
+
+static void tw_enqueue(struct tw_timer *t)
+{
+	uint64_t expires = t->expires < tw.now ? tw.now : t->expires;
+	uint64_t diff = expires ^ tw.now;
+	int level = diff ? (63 - __builtin_clzll(diff)) / TW_BITS : 0;
+	int slot = (expires >> (level * TW_BITS)) & TW_MASK;
+
+	t->level = level;
+	t->slot = slot;
+	t->next = tw.slots[level][slot];
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = &tw.slots[level][slot];
+	tw.slots[level][slot] = t;
+	tw.occupied[level] |= 1ULL << slot;
+}
+
+static void tw_dequeue(struct tw_timer *t)
+{
+	if (!t->pprev)
+		return;
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	if (!tw.slots[t->level][t->slot])
+		tw.occupied[t->level] &= ~(1ULL << t->slot);
+	t->pprev = NULL;
+}
+
+/* The level of the next slot to run and, in tick, when it is due. Returns
+ * -1 if the wheel is empty. */
+static int tw_next(uint64_t *tick)
+{
+	int level, shift, digit;
+	uint64_t pending;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		shift = level * TW_BITS;
+		digit = (tw.now >> shift) & TW_MASK;
+		pending = tw.occupied[level] & (~0ULL << digit << (level ? 1 : 0));
+		if (pending) {
+			*tick = ((tw.now >> shift >> TW_BITS << TW_BITS)
+			         | __builtin_ctzll(pending)) << shift;
+			return level;
+		}
+	}
+	return -1;
+}
+
+/* Fires or moves down the timers of the current slot of level. */
+static void tw_run_slot(int level)
+{
+	int slot = (tw.now >> (level * TW_BITS)) & TW_MASK;
+	struct tw_timer *t = tw.slots[level][slot], *next;
+
+	tw.slots[level][slot] = NULL;
+	tw.occupied[level] &= ~(1ULL << slot);
+	for (; t; t = next) {
+		next = t->next;
+		t->pprev = NULL;
+		if (t->expires <= tw.now) {
+			t->fn(t->arg);
+			if (!t->period)
+				continue;
+			/* a periodic timer that fell behind skips the lost
+			 * periods, the way the interrupts would coalesce */
+			t->expires += t->period;
+			if (t->expires <= tw.now)
+				t->expires += (tw.now - t->expires) / t->period
+				              * t->period + t->period;
+		}
+		tw_enqueue(t);
+	}
+}
+
+/* Runs the wheel up to tick target. */
+static void tw_run(uint64_t target)
+{
+	uint64_t tick;
+	int level;
+
+	while ((level = tw_next(&tick)) >= 0 && tick <= target) {
+		tw.now = tick;
+		tw_run_slot(level);
+	}
+	if (target > tw.now)
+		tw.now = target;
+}
+
+static void tw_arm(uint64_t tick)
+{
+	struct itimerspec its = {};
+	uint64_t ns;
+
+	if (tick != TW_NEVER) {
+		ns = tick * TW_TICK_NS;
+		its.it_value.tv_sec = tw.base.tv_sec + ns / 1000000000;
+		its.it_value.tv_nsec = tw.base.tv_nsec + ns % 1000000000;
+		if (its.it_value.tv_nsec >= 1000000000) {
+			its.it_value.tv_sec++;
+			its.it_value.tv_nsec -= 1000000000;
+		}
+	}
+	if (timerfd_settime(tw.fd, TFD_TIMER_ABSTIME, &its, NULL))
+		perror("timer wheel: timerfd_settime");
+	tw.armed = tick;
+}
+
+static void *tw_thread(void *arg)
+{
+	uint64_t expirations, tick;
+
+	while (1) {
+		if (read(tw.fd, &expirations, sizeof(expirations)) < 0
+		    && errno != EINTR && errno != EAGAIN) {
+			perror("timer wheel: read");
+			return NULL;
+		}
+		pthread_mutex_lock(&tw.lock);
+		tw_run(timer_wheel_now() / TW_TICK_NS);
+		tw_arm(tw_next(&tick) < 0 ? TW_NEVER : tick);
+		pthread_mutex_unlock(&tw.lock);
+	}
+}
+
+int timer_wheel_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &tw.base);
+	tw.fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (tw.fd < 0)
+		return -1;
+	if (pthread_create(&tw_thread_struct, NULL, tw_thread, NULL)) {
+		close(tw.fd);
+		return -1;
+	}
+	return 0;
+}
+
+void tw_timer_init(struct tw_timer *t, void (*fn)(void *arg), void *arg)
+{
+	memset(t, 0, sizeof(*t));
+	t->fn = fn;
+	t->arg = arg;
+}
+
+void tw_timer_set(struct tw_timer *t, uint64_t expires, uint64_t period)
+{
+	pthread_mutex_lock(&tw.lock);
+	tw_dequeue(t);
+	t->expires = (expires + TW_TICK_NS - 1) / TW_TICK_NS;
+	t->period = period ? (period + TW_TICK_NS - 1) / TW_TICK_NS : 0;
+	tw_enqueue(t);
+	/* the thread rearms after it runs; until then, only an earlier
+	 * deadline needs the timerfd moved */
+	if (t->expires < tw.armed)
+		tw_arm(t->expires < tw.now ? tw.now : t->expires);
+	pthread_mutex_unlock(&tw.lock);
+}
+
+void tw_timer_cancel(struct tw_timer *t)
+{
+	pthread_mutex_lock(&tw.lock);
+	tw_dequeue(t);
+	pthread_mutex_unlock(&tw.lock);
+}
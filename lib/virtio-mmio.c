@@ -137,8 +137,19 @@ static uint32_t virtio_mmio_read(uint64_t gpa)
 	}
 
 
-    // WTF? Does this happen? 
     if (offset >= VIRTIO_MMIO_CONFIG) {
+	    offset -= VIRTIO_MMIO_CONFIG;
+	    /* We don't know the access size, so hand back the 32 bits at
+	     * offset; byte and word reads just use the low part. */
+	    if (mmio.vqdev->cfg && offset < mmio.vqdev->cfgsize) {
+		    int len = mmio.vqdev->cfgsize - offset;
+
+		    low = 0;
+		    memmove(&low, (uint8_t *)mmio.vqdev->cfg + offset,
+			    len < sizeof(low) ? len : sizeof(low));
+		    DPRINTF("config read @0x%x: 0x%x\n", offset, low);
+		    return low;
+	    }
 	    fprintf(stderr, "Whoa. %p Reading past mmio config space? What gives?\n", gpa);
 	    return -1;
 #if 0
@@ -1090,6 +1090,21 @@ unsigned int wait_for_vq_desc(struct virtqueue *_vq,
 	return head;
 }
 
+/*
+ * Tells if the Guest has made another buffer available, without waiting.  A
+ * device thread uses this to gather a batch of buffers after
+ * wait_for_vq_desc() returned the first one, and handles them all at once.
+ */
+bool vq_desc_available(struct virtqueue *_vq)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+	bool ret = lg_last_avail(vq) != vq->vring.avail->idx;
+
+	/* Read the descriptor number only after the ring index. */
+	rmb();
+	return ret;
+}
+
 /*
  * After we've used one of their buffers, we tell the Guest about it.  Sometime
  * later we'll want to send them an interrupt using trigger_irq(); note that
@@ -23,6 +23,7 @@
 #include <sys/mman.h>
 #include <ros/vmm.h>
 #include <ros/arch/msr-index.h>
+#include <vmm/vmm.h>
 #include <vmm/virtio.h>
 #include <vmm/virtio_mmio.h>
 #include <vmm/virtio_ids.h>
@@ -80,8 +81,14 @@ int emsr_readzero(struct vmctl *vcpu, struct emmsr *, uint32_t);
 int emsr_fakewrite(struct vmctl *vcpu, struct emmsr *, uint32_t);
 int emsr_ok(struct vmctl *vcpu, struct emmsr *, uint32_t);
 
-int emsr_lapicvec(struct vmctl *vcpu, struct emmsr *msr, uint32_t opcode);
-int emsr_lapicinitialcount(struct vmctl *vcpu, struct emmsr *msr, uint32_t opcode);
+int emsr_lapictimer(struct vmctl *vcpu, struct emmsr *msr, uint32_t opcode);
+
+#ifndef MSR_LAPIC_CURRENT_COUNT
+#define MSR_LAPIC_CURRENT_COUNT 0x00000839
+#endif
+#ifndef MSR_LAPIC_DIVIDE_CONFIG
+#define MSR_LAPIC_DIVIDE_CONFIG 0x0000083e
+#endif
 
 struct emmsr emmsrs[] = {
 	{MSR_IA32_MISC_ENABLE, "MSR_IA32_MISC_ENABLE", emsr_miscenable},
@@ -125,10 +132,11 @@ struct emmsr emmsrs[] = {
 	// mostly harmless.
 	{MSR_TSC_AUX, "MSR_TSC_AUX", emsr_fakewrite},
 	{MSR_RAPL_POWER_UNIT, "MSR_RAPL_POWER_UNIT", emsr_readzero},
-	{MSR_LAPIC_TIMER, "MSR_LAPIC_TIMER", emsr_lapicvec},
+	{MSR_LAPIC_TIMER, "MSR_LAPIC_TIMER", emsr_lapictimer},
 	{MSR_LAPIC_THERMAL, "MSR_LAPIC_THERMAL", emsr_fakewrite},
-	{MSR_LAPIC_INITCOUNT, "MSR_LAPIC_INITCOUNT", emsr_lapicinitialcount},
-	//{MSR_LAPIC_INITCOUNT, "MSR_LAPIC_INITCOUNT", emsr_fakewrite},
+	{MSR_LAPIC_INITCOUNT, "MSR_LAPIC_INITCOUNT", emsr_lapictimer},
+	{MSR_LAPIC_CURRENT_COUNT, "MSR_LAPIC_CURRENT_COUNT", emsr_lapictimer},
+	{MSR_LAPIC_DIVIDE_CONFIG, "MSR_LAPIC_DIVIDE_CONFIG", emsr_lapictimer},
 };
 
 static uint64_t set_low32(uint64_t hi, uint32_t lo)
@@ -274,54 +282,21 @@ int emsr_fakewrite(struct vmctl *vcpu, struct emmsr *msr, uint32_t opcode)
 	return 0;
 }
 
-int emsr_lapicvec(struct vmctl *vcpu, struct emmsr *msr, uint32_t opcode)
+/* The timer registers of the x2APIC are those of the xAPIC at 0x800. The
+ * current count is read only: writing it fails, and the MSR exit handler
+ * turns any failure into a #GP for the guest, as on hardware. */
+int emsr_lapictimer(struct vmctl *vcpu, struct emmsr *msr, uint32_t opcode)
 {
-	uint32_t eax, edx;
+	uint32_t reg = msr->reg & 0xff;
 
 	if (opcode == EXIT_REASON_MSR_WRITE) {
-		edx = vcpu->regs.tf_rdx;
-		eax = vcpu->regs.tf_rax;
-		// Read the written value into vcpu
-		vcpu->timer_msr = ((uint64_t)edx << 32) | eax;
-		msr->written = true;
-	} else {
-		if (!msr->written)
-			if (read_msr(vcpu, msr->reg, &edx, &eax) < 0) {
-				return SHUTDOWN_UNHANDLED_EXIT_REASON;
-			}
-		else {
-			edx = (uint32_t)(vcpu->timer_msr >> 32);
-			eax = (uint32_t)vcpu->timer_msr;
-		}
-		vcpu->regs.tf_rax = set_low32(vcpu->regs.tf_rax, eax);
-		vcpu->regs.tf_rdx = set_low32(vcpu->regs.tf_rdx, edx);
-	}
-	return 0;
-}
-
-int emsr_lapicinitialcount(struct vmctl *vcpu, struct emmsr *msr, uint32_t opcode)
-{
-	uint32_t eax, edx;
-
-	//fprintf(stderr, "WE ARE HEREEEEE\n");
-
-	if (opcode == EXIT_REASON_MSR_WRITE) {
-		edx = vcpu->regs.tf_rdx;
-		eax = vcpu->regs.tf_rax;
-		// Read the written value into vcpu
-		vcpu->initial_count = ((uint64_t)edx << 32) | eax;
-		msr->written = true;
+		if (reg == LAPIC_CURRENT_COUNT)
+			return SHUTDOWN_UNHANDLED_EXIT_REASON;
+		lapic_timer_write(vcpu->core, reg, (uint32_t)vcpu->regs.tf_rax);
 	} else {
-		if (!msr->written)
-			if (read_msr(vcpu, msr->reg, &edx, &eax) < 0) {
-				return SHUTDOWN_UNHANDLED_EXIT_REASON;
-			}
-		else {
-			edx = (uint32_t)(vcpu->initial_count >> 32);
-			eax = (uint32_t)vcpu->initial_count;
-		}
-		vcpu->regs.tf_rax = set_low32(vcpu->regs.tf_rax, eax);
-		vcpu->regs.tf_rdx = set_low32(vcpu->regs.tf_rdx, edx);
+		vcpu->regs.tf_rax = set_low32(vcpu->regs.tf_rax,
+					      lapic_timer_read(vcpu->core, reg));
+		vcpu->regs.tf_rdx = set_low32(vcpu->regs.tf_rdx, 0);
 	}
 	return 0;
 }
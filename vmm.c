@@ -6,6 +6,11 @@
 #include <parlib/arch/arch.h>
 #include <parlib/ros_debug.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #include <errno.h>
 #include <dirent.h>
 #include <stdlib.h>
@@ -23,6 +28,9 @@
 #include <virtio_mmio.h>
 #include <virtio_ids.h>
 #include <virtio_config.h>
+#include <virtio_console.h>
+#include <guestout.h>
+#include <timerwheel.h>
 
 int msrio(struct vmctl *vcpu, uint32_t opcode);
 
@@ -155,6 +163,14 @@ volatile int quit = 0;
 int mcp = 1;
 int virtioirq = 17;
 
+/* Guest output hypercall: vmcall with rax = VMCALL_PRINTBUF prints the rsi
+ * bytes at guest physical address rdi and returns the count in rax, or -1.
+ * Any other rax prints the single byte in rdi. */
+#define VMCALL_PRINTBUF 0x7072696e74627566ULL /* "printbuf" */
+
+/* Where vmcall output goes, through the guest output sink. */
+static struct guestout_src *vmcall_out;
+
 /* total hack. If the vm runs away we want to get control again. */
 unsigned int maxresume = (unsigned int) -1;
 
@@ -188,88 +204,176 @@ static void set_posted_interrupt(int vector);
 #define ADDR				BITOP_ADDR(addr)
 static inline int test_and_set_bit(int nr, volatile unsigned long *addr);
 
-static int timer_started;
-static pthread_t timerthread_struct;
+/* LAPIC timer interrupts are posted from the timer wheel's thread, which
+ * then pokes the guest through here. timerdata, like consdata, wakes a
+ * halted guest. This VMM runs a single vCPU, the one vmctl, so vcpu is
+ * always 0 and the interrupt goes to it. */
+static int timer_vmctl_fd;
+volatile int timerdata = 0;
 
-void *timer_thread(void *arg)
+static void timer_inject(int vcpu, int vector)
 {
-	int fd = open("#cons/vmctl", O_RDWR), ret;
-	int initcount;
+	set_posted_interrupt(vector);
+	timerdata = 1;
+	pwrite(timer_vmctl_fd, &vmctl, sizeof(vmctl), 1<<12);
+}
 
-	fprintf(stderr, "TIMER THREAD START 0x%llx\n", vmctl.timer_msr);
+/* Room for the descriptors of a batch of console buffers. A batch stops
+ * growing when a whole ring's worth of descriptors might not fit anymore. */
+#define CONS_IOV 1024
+
+/* Ring sizes: the console is interactive and small; named ports carry bulk
+ * streams (logs, metrics) and get deep rings so the guest can keep large
+ * buffers in flight while we write them out. */
+#define CONS_QNUM 64
+#define CONS_BULK_QNUM 256
+
+/* Port 0 is the console on stdin/stdout. With -p name=path, more ports are
+ * bound to host files, fifos or unix sockets; the guest sees them as
+ * /dev/vport0pN, named through /sys/class/virtio-ports/vport0pN/name. Each
+ * port has its own pair of queues and threads, so a slow or busy port never
+ * holds up the console. */
+#define CONS_MAX_PORTS 8
+
+struct cons_port {
+	char *name;
+	int infd;	/* -1 if the guest gets no input on this port */
+	int outfd;
+	struct guestout_src *sink;	/* if set, output goes here, not outfd */
+	bool guest_open;
+};
+
+static struct cons_port cons_ports[CONS_MAX_PORTS] = {
+	{name: "console", infd: 0, outfd: 1},
+};
+static int cons_nr_ports = 1;
+static struct virtio_console_config cons_config;
 
-	// We only begin injection when linux writes a non zero initial count
-	initcount = vmctl.initial_count;
-	while (!initcount) {
-		uthread_usleep(10000);
-		initcount = vmctl.initial_count;
+/* Control messages on their way to the guest. Writers put one message into
+ * the pipe with a single write, so they arrive whole and in order. */
+static int cons_ctl_pipe[2] = {-1, -1};
+
+/* Converts the scatterlist sg of num entries to iov. */
+static void sg_to_iov(struct iovec *iov, struct scatterlist *sg, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = sg[i].v;
+		iov[i].iov_len = sg[i].length;
 	}
-	fprintf(stderr, "INJECTING TIMER 0x%llx\n", vmctl.timer_msr);
+}
 
-	fflush(stderr);
-	while (1) {
-		if (initcount) {
-			set_posted_interrupt(vmctl.timer_msr & 0xff);
-			//set_posted_interrupt(0xff);
-			pwrite(fd, &vmctl, sizeof(vmctl), 1<<12);
+/* Writes all of iov to fd. A short write just means fd is slow: we keep
+ * writing, and the guest gets its buffers back only once they are out. That
+ * is the back pressure: a guest that floods the console runs out of buffers
+ * and waits for us, instead of us buffering without bound. */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+		while (iovcnt > 0 && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
 		}
-		uthread_usleep(10000);
-		// check initcount again to make sure linux still wants it
-		initcount = vmctl.initial_count;
 	}
-	close(fd);
+	return 0;
+}
+
+/* Tells the guest there is something in its used rings. */
+static void cons_interrupt(int vmctl_fd)
+{
+	// Send spurious for testing (Gan)
+	set_posted_interrupt(0xE5);
+	virtio_mmio_set_vring_irq();
+
+	pwrite(vmctl_fd, &vmctl, sizeof(vmctl), 1<<12);
+}
+
+/* Queues a control message for the guest. name, if not NULL, follows the
+ * message, as PORT_NAME wants it. */
+static void cons_ctl_send(uint32_t id, uint16_t event, uint16_t value,
+			  char *name)
+{
+	char msg[sizeof(uint32_t) + sizeof(struct virtio_console_control) + 64];
+	struct virtio_console_control *c = (void *)(msg + sizeof(uint32_t));
+	uint32_t len = sizeof(*c);
+
+	c->id = id;
+	c->event = event;
+	c->value = value;
+	if (name) {
+		strncpy((char *)(c + 1), name, sizeof(msg) - sizeof(uint32_t) - len);
+		len += strnlen((char *)(c + 1), sizeof(msg) - sizeof(uint32_t) - len);
+	}
+	memmove(msg, &len, sizeof(len));
+	if (write(cons_ctl_pipe[1], msg, sizeof(len) + len) < 0)
+		fprintf(stderr, "cons_ctl_send: %s\n", strerror(errno));
 }
 
 void *consout(void *arg)
 {
-	char *line, *consline, *outline;
-	static struct scatterlist out[] = { {NULL, sizeof(outline)}, };
-	static struct scatterlist in[] = { {NULL, sizeof(line)}, };
-	static struct scatterlist iov[32];
 	struct virtio_threadarg *a = arg;
-	static unsigned int inlen, outlen, conslen;
 	struct virtqueue *v = a->arg->virtio;
-	fprintf(stderr, "talk thread ..\n");
-	uint16_t head, gaveit = 0, gotitback = 0;
-	uint32_t vv;
+	struct cons_port *p = &cons_ports[(uintptr_t)a->arg->arg];
+	unsigned int ringsize = virtqueue_get_vring_size(v);
+	struct scatterlist *sg = calloc(CONS_IOV, sizeof(*sg));
+	struct iovec *iov = calloc(CONS_IOV, sizeof(*iov));
+	unsigned int *heads = calloc(CONS_IOV, sizeof(*heads));
+	unsigned int inlen, outlen, nheads, niov;
 	int i;
-	int num;
-	if (debug) {
-		fprintf(stderr, "----------------------- TT a %p\n", a);
-		fprintf(stderr, "talk thread ttargs %x v %x\n", a, v);
-	}
 
-	for(num = 0;;num++) {
-		//int debug = 1;
-		/* host: use any buffers we should have been sent. */
-		head = wait_for_vq_desc(v, iov, &outlen, &inlen);
-		if (debug)
-			fprintf(stderr, "CCC: vq desc head %d, gaveit %d gotitback %d\n", head, gaveit, gotitback);
-		for(i = 0; debug && i < outlen + inlen; i++)
-			fprintf(stderr, "CCC: v[%d/%d] v %p len %d\n", i, outlen + inlen, iov[i].v, iov[i].length);
-		/* host: if we got an output buffer, just output it. */
-		for(i = 0; i < outlen; i++) {
-			num++;
-			int j;
-			if (debug) {
-				fprintf(stderr, "CCC: IOV length is %d\n", iov[i].length);
-			}
-			for (j = 0; j < iov[i].length; j++)
-				printf("%c", ((char *)iov[i].v)[j]);
-		}
-		fflush(stdout);
+	if (!sg || !iov || !heads) {
+		fprintf(stderr, "consout %s: no memory\n", p->name);
+		return NULL;
+	}
+	fprintf(stderr, "talk thread for %s ..\n", p->name);
+	if (debug)
+		fprintf(stderr, "talk thread ttargs %p v %p\n", a, v);
+
+	for (;;) {
+		/* host: wait for one buffer, then take all the others the guest
+		 * has queued meanwhile, and write them out with one writev. */
+		nheads = niov = 0;
+		do {
+			heads[nheads++] = wait_for_vq_desc(v, sg + niov, &outlen, &inlen);
+			/* writeable buffers make no sense here; they go back empty. */
+			niov += outlen;
+		} while (niov + ringsize <= CONS_IOV && vq_desc_available(v));
 		if (debug)
-			fprintf(stderr, "CCC: outlen is %d; inlen is %d\n", outlen, inlen);
-		/* host: fill in the writeable buffers. */
-		/* why we're getting these I don't know. */
-		for (i = outlen; i < outlen + inlen; i++) {
-			if (debug) fprintf(stderr, "CCC: send back empty writeable");
-			iov[i].length = 0;
+			fprintf(stderr, "CCC %s: %d buffers, %d iovs\n", p->name,
+				nheads, niov);
+		sg_to_iov(iov, sg, niov);
+		if (p->sink) {
+			for (i = 0; i < niov; i++)
+				guestout_write(p->sink, iov[i].iov_base, iov[i].iov_len);
+		/* if the other end went away, the data is dropped: the guest
+		 * still needs its buffers back. */
+		} else if (writev_all(p->outfd, iov, niov) < 0) {
+			fprintf(stderr, "consout %s: writev: %s\n", p->name,
+				strerror(errno));
 		}
-		if (debug) fprintf(stderr, "CCC: call add_used\n");
 		/* host: now ack that we used them all. */
-		add_used(v, head, outlen+inlen);
-		if (debug) fprintf(stderr, "CCC: DONE call add_used\n");
+		for (i = 0; i < nheads; i++)
+			add_used(v, heads[i], 0);
 	}
 	fprintf(stderr, "All done\n");
 	return NULL;
@@ -278,82 +382,272 @@ void *consout(void *arg)
 // FIXME.
 volatile int consdata = 0;
 
+/* Returns true if fd has input within timeout ms; -1 waits forever. */
+static bool cons_readable(int fd, int timeout)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+	return poll(&pfd, 1, timeout) > 0;
+}
+
+/* Reads what the non-blocking fd has, up to the size of the num entries of sg.
+ * iov is scratch space for as many entries. Returns the number of bytes read,
+ * 0 if there is nothing, or -1 on an error or at end of file. */
+static ssize_t cons_fill(int fd, struct scatterlist *sg, int num,
+			 struct iovec *iov)
+{
+	ssize_t ret;
+
+	sg_to_iov(iov, sg, num);
+	do {
+		ret = readv(fd, iov, num);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && errno == EAGAIN)
+		return 0;
+	return ret ? ret : -1;
+}
+
 void *consin(void *arg)
 {
 	struct virtio_threadarg *a = arg;
-	char *line, *outline;
-	static char consline[128];
-	static struct scatterlist iov[32];
-	static struct scatterlist out[] = { {NULL, sizeof(outline)}, };
-	static struct scatterlist in[] = { {NULL, sizeof(line)}, };
+	uintptr_t id = (uintptr_t)a->arg->arg;
+	struct cons_port *p = &cons_ports[id];
+	struct virtqueue *v = a->arg->virtio;
+	struct scatterlist *sg = calloc(CONS_IOV, sizeof(*sg));
+	struct iovec *iov = calloc(CONS_IOV, sizeof(*iov));
+	unsigned int inlen, outlen, head;
+	ssize_t n;
+	int fd;
+
+	if (p->infd < 0)
+		return NULL;
+	if (!sg || !iov) {
+		fprintf(stderr, "consin %s: no memory\n", p->name);
+		return NULL;
+	}
+	fd = open("#cons/vmctl", O_RDWR);
+	fprintf(stderr, "consin thread for %s ..\n", p->name);
+	/* we only ever read what is there; waiting is done with poll. */
+	fcntl(p->infd, F_SETFL, fcntl(p->infd, F_GETFL) | O_NONBLOCK);
+
+	while (!quit) {
+		/* host: fill as many of the buffers as the input at hand takes,
+		 * then interrupt the guest once. The first buffer waits for
+		 * input; the others only get what is already there. */
+		do {
+			head = wait_for_vq_desc(v, sg, &outlen, &inlen);
+			cons_readable(p->infd, -1);
+			n = cons_fill(p->infd, sg + outlen, inlen, iov);
+			if (n < 0) {
+				if (id == 0)
+					exit(0);
+				/* the other end is gone: tell the guest the
+				 * host side of the port is closed. */
+				add_used(v, head, 0);
+				cons_ctl_send(id, VIRTIO_CONSOLE_PORT_OPEN, 0, NULL);
+				cons_interrupt(fd);
+				fprintf(stderr, "consin %s: closed\n", p->name);
+				return NULL;
+			}
+			if (debug)
+				fprintf(stderr, "CONSIN %s: %zd bytes into %d iovs\n",
+					p->name, n, inlen);
+			if (id == 0 && n > 0 && n < 3 &&
+			    ((char *)sg[outlen].v)[0] == 'q') {
+				quit = 1;
+				break;
+			}
+			add_used(v, head, n);
+		} while (vq_desc_available(v) && cons_readable(p->infd, 0));
 
-	static unsigned int inlen, outlen, conslen;
+		cons_interrupt(fd);
+	}
+	fprintf(stderr, "All done\n");
+	return NULL;
+}
+
+/* Control receive queue: hands the guest the control messages queued with
+ * cons_ctl_send, one per buffer. */
+void *consctlin(void *arg)
+{
+	struct virtio_threadarg *a = arg;
 	struct virtqueue *v = a->arg->virtio;
-	fprintf(stderr, "consin thread ..\n");
-	uint16_t head, gaveit = 0, gotitback = 0;
-	uint32_t vv;
-	int i;
-	int num;
-	//char c[1];
+	struct scatterlist sg[CONS_QNUM];
+	char msg[sizeof(struct virtio_console_control) + 64];
+	unsigned int inlen, outlen, head, done, i;
+	uint32_t len;
+	int fd = open("#cons/vmctl", O_RDWR);
+
+	fprintf(stderr, "console control thread ..\n");
+	while (!quit) {
+		do {
+			if (read(cons_ctl_pipe[0], &len, sizeof(len)) != sizeof(len) ||
+			    read(cons_ctl_pipe[0], msg, len) != len) {
+				fprintf(stderr, "consctlin: %s\n", strerror(errno));
+				return NULL;
+			}
+			head = wait_for_vq_desc(v, sg, &outlen, &inlen);
+			for (done = 0, i = outlen; i < outlen + inlen && done < len; i++) {
+				int amt = sg[i].length < len - done ?
+					  sg[i].length : len - done;
 
-	int fd = open("#cons/vmctl", O_RDWR), ret;
+				memmove(sg[i].v, msg + done, amt);
+				done += amt;
+			}
+			add_used(v, head, done);
+		} while (vq_desc_available(v) && cons_readable(cons_ctl_pipe[0], 0));
 
-	if (debug) fprintf(stderr, "Spin on console being read, print num queues, halt\n");
+		cons_interrupt(fd);
+	}
+	return NULL;
+}
 
-	for(num = 0;! quit;num++) {
-		//int debug = 1;
-		/* host: use any buffers we should have been sent. */
-		head = wait_for_vq_desc(v, iov, &outlen, &inlen);
-		if (debug)
-			fprintf(stderr, "vq desc head %d, gaveit %d gotitback %d\n", head, gaveit, gotitback);
-		for(i = 0; debug && i < outlen + inlen; i++)
-			fprintf(stderr, "v[%d/%d] v %p len %d\n", i, outlen + inlen, iov[i].v, iov[i].length);
+/* Control transmit queue: what the guest tells us about the ports. */
+void *consctlout(void *arg)
+{
+	struct virtio_threadarg *a = arg;
+	struct virtqueue *v = a->arg->virtio;
+	struct scatterlist sg[CONS_QNUM];
+	struct virtio_console_control c;
+	unsigned int inlen, outlen, head, done, i;
+
+	for (;;) {
+		head = wait_for_vq_desc(v, sg, &outlen, &inlen);
+		for (done = 0, i = 0; i < outlen && done < sizeof(c); i++) {
+			int amt = sg[i].length < sizeof(c) - done ?
+				  sg[i].length : sizeof(c) - done;
+
+			memmove((char *)&c + done, sg[i].v, amt);
+			done += amt;
+		}
+		add_used(v, head, 0);
+		if (done < sizeof(c))
+			continue;
 		if (debug)
-			fprintf(stderr, "outlen is %d; inlen is %d\n", outlen, inlen);
-		/* host: fill in the writeable buffers. */
-		for (i = outlen; i < outlen + inlen; i++) {
-			/* host: read a line. */
-			memset(consline, 0, 128);
-			if (read(0, consline, 1) < 0) {
-				exit(0);
+			fprintf(stderr, "CONSCTL: port %d event %d value %d\n",
+				c.id, c.event, c.value);
+		switch (c.event) {
+		case VIRTIO_CONSOLE_DEVICE_READY:
+			if (!c.value) {
+				fprintf(stderr, "console: guest driver failed\n");
+				break;
 			}
-			if (debug) fprintf(stderr, "CONSIN: GOT A LINE:%s:\n", consline);
-			if (debug) fprintf(stderr, "CONSIN: OUTLEN:%d:\n", outlen);
-			if (strlen(consline) < 3 && consline[0] == 'q' ) {
-				quit = 1;
+			for (i = 0; i < cons_nr_ports; i++)
+				cons_ctl_send(i, VIRTIO_CONSOLE_PORT_ADD, 0, NULL);
+			break;
+		case VIRTIO_CONSOLE_PORT_READY:
+			if (c.id >= (uint32_t)cons_nr_ports || !c.value) {
+				fprintf(stderr, "console: port %d failed\n", c.id);
 				break;
 			}
-
-			memmove(iov[i].v, consline, strlen(consline)+ 1);
-			iov[i].length = strlen(consline) + 1;
+			if (c.id == 0)
+				cons_ctl_send(c.id, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+			else
+				cons_ctl_send(c.id, VIRTIO_CONSOLE_PORT_NAME, 0,
+					      cons_ports[c.id].name);
+			/* our end is always connected. */
+			cons_ctl_send(c.id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+			break;
+		case VIRTIO_CONSOLE_PORT_OPEN:
+			if (c.id < (uint32_t)cons_nr_ports)
+				cons_ports[c.id].guest_open = c.value;
+			break;
+		default:
+			fprintf(stderr, "console: unexpected control event %d\n",
+				c.event);
 		}
-		if (debug) fprintf(stderr, "call add_used\n");
-		/* host: now ack that we used them all. */
-		add_used(v, head, outlen+inlen);
-		// consdata = 1;
-		if (debug) fprintf(stderr, "DONE call add_used\n");
-
-		// Send spurious for testing (Gan)
-		set_posted_interrupt(0xE5);
-		virtio_mmio_set_vring_irq();
-
-		pwrite(fd, &vmctl, sizeof(vmctl), 1<<12);
 	}
-	fprintf(stderr, "All done\n");
 	return NULL;
 }
 
+#define CONS_PORT_VQS(n) \
+	{name: "port" #n "in", maxqnum: CONS_BULK_QNUM, f: consin, arg: (void *)n}, \
+	{name: "port" #n "out", maxqnum: CONS_BULK_QNUM, f: consout, arg: (void *)n}
+
 static struct vqdev vqdev= {
 name: "console",
 dev: VIRTIO_ID_CONSOLE,
 device_features: 0, /* Can't do it: linux console device does not support it. VIRTIO_F_VERSION_1*/
 numvqs: 2,
 vqs: {
-		{name: "consin", maxqnum: 64, f: consin, arg: (void *)0},
-		{name: "consout", maxqnum: 64, f: consout, arg: (void *)0},
+		{name: "consin", maxqnum: CONS_QNUM, f: consin, arg: (void *)0},
+		{name: "consout", maxqnum: CONS_QNUM, f: consout, arg: (void *)0},
+		{name: "consctlin", maxqnum: CONS_QNUM, f: consctlin},
+		{name: "consctlout", maxqnum: CONS_QNUM, f: consctlout},
+		CONS_PORT_VQS(1),
+		CONS_PORT_VQS(2),
+		CONS_PORT_VQS(3),
+		CONS_PORT_VQS(4),
+		CONS_PORT_VQS(5),
+		CONS_PORT_VQS(6),
+		CONS_PORT_VQS(7),
 	}
 };
 
+/* Binds a new port to what spec, name=path, names. A unix socket is
+ * connected to, a fifo or device is read and written, and anything else is
+ * a file the port's output is appended to. */
+static int cons_bind_port(char *spec)
+{
+	struct cons_port *p = &cons_ports[cons_nr_ports];
+	char *path = strchr(spec, '=');
+	struct stat st;
+
+	if (!path || path == spec) {
+		fprintf(stderr, "console port: want name=path, not %s\n", spec);
+		return -1;
+	}
+	if (cons_nr_ports == CONS_MAX_PORTS) {
+		fprintf(stderr, "console port %s: at most %d ports\n", spec,
+			CONS_MAX_PORTS - 1);
+		return -1;
+	}
+	*path++ = 0;
+	p->name = spec;
+	p->infd = -1;
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+		struct sockaddr_un sun = {.sun_family = AF_UNIX};
+
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+		p->outfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (p->outfd >= 0 &&
+		    connect(p->outfd, (struct sockaddr *)&sun, sizeof(sun))) {
+			close(p->outfd);
+			p->outfd = -1;
+		}
+		p->infd = p->outfd;
+	} else if (!stat(path, &st) && !S_ISREG(st.st_mode)) {
+		p->outfd = p->infd = open(path, O_RDWR);
+	} else {
+		p->outfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	}
+	if (p->outfd < 0) {
+		perror(path);
+		return -1;
+	}
+	cons_nr_ports++;
+	return 0;
+}
+
+/* With ports bound, switch the console to multiport: control queues, the
+ * port count in config space, and a queue pair per port. */
+static void cons_setup(void)
+{
+	if (cons_nr_ports == 1)
+		return;
+	if (pipe(cons_ctl_pipe)) {
+		perror("console control pipe");
+		exit(1);
+	}
+	/* a port whose reader went away must not take the vmm with it. */
+	signal(SIGPIPE, SIG_IGN);
+	cons_config.max_nr_ports = cons_nr_ports;
+	vqdev.cfg = &cons_config;
+	vqdev.cfgsize = sizeof(cons_config);
+	vqdev.device_features |= 1ULL << VIRTIO_CONSOLE_F_MULTIPORT;
+	vqdev.numvqs = 2 + 2 * cons_nr_ports;
+}
+
 void lowmem() {
 	__asm__ __volatile__ (".section .lowmem, \"aw\"\n\tlow: \n\t.=0x1000\n\t.align 0x100000\n\t.previous\n");
 }
@@ -462,6 +756,9 @@ int main(int argc, char **argv)
 	void *coreboot_tables = (void *) 0x1165000;
 	void *a_page;
 	uint64_t tsc_freq_khz;
+	char *outpath = NULL;
+	uint64_t rotate_size = 0;
+	bool timestamps = false;
 fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT, PML1_PTE_REACH);
 
 	// mmap is not working for us at present.
@@ -520,6 +817,22 @@ fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT, PML1_PTE_REACH);
 			argc--,argv++;
 			virtioirq = strtoull(argv[0], 0, 0);
 			break;
+		case 'p':
+			argc--,argv++;
+			if (cons_bind_port(argv[0]))
+				exit(1);
+			break;
+		case 'o':
+			argc--,argv++;
+			outpath = argv[0];
+			break;
+		case 'r':
+			argc--,argv++;
+			rotate_size = strtoull(argv[0], 0, 0);
+			break;
+		case 't':
+			timestamps = true;
+			break;
 		default:
 			fprintf(stderr, "BMAFR\n");
 			break;
@@ -527,7 +840,7 @@ fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT, PML1_PTE_REACH);
 		argc--,argv++;
 	}
 	if (argc < 1) {
-		fprintf(stderr, "Usage: %s vmimage [-n (no vmcall printf)] [coreboot_tables [loadaddress [entrypoint]]]\n", argv[0]);
+		fprintf(stderr, "Usage: %s vmimage [-n (no vmcall printf)] [-p name=path (console port)] [-o outfile [-r rotatesize]] [-t (timestamps)] [coreboot_tables [loadaddress [entrypoint]]]\n", argv[0]);
 		exit(1);
 	}
 	if (argc > 1)
@@ -782,22 +1095,31 @@ fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT, PML1_PTE_REACH);
 	vmctl.regs.tf_rsp = (uint64_t) &stack[1024];
 	vmctl.regs.tf_rsi = (uint64_t) bp;
 	if (mcp) {
+		/* guest output: vmcall lines are marked with a %, as ever. */
+		if (guestout_init(outpath, rotate_size, timestamps))
+			exit(1);
+		vmcall_out = guestout_source("%");
+		cons_ports[0].sink = guestout_source("");
+		if (!vmcall_out || !cons_ports[0].sink) {
+			fprintf(stderr, "Could not set up guest output\n");
+			exit(1);
+		}
 		/* set up virtio bits, which depend on threads being enabled. */
+		cons_setup();
 		register_virtio_mmio(&vqdev, virtio_mmio_base);
 	}
 	fprintf(stderr, "threads started\n");
 	fprintf(stderr, "Writing command :%s:\n", cmd);
 
-	// Start up timer thread
-	if (1 && !timer_started && mcp) {
-		// Start up timer thread
-		if (pthread_create(&timerthread_struct, NULL, timer_thread, NULL)) {
-			fprintf(stderr, "pth_create failed for timer thread.\n");
-			perror("pth_create");
-		} else {
-			fprintf(stderr, "Starting Timer\n");
-			timer_started = 1;
+	/* LAPIC timers: nothing runs until the guest loads a count, and then
+	 * only when it is due. */
+	if (mcp) {
+		timer_vmctl_fd = open("#cons/vmctl", O_RDWR);
+		if (timer_vmctl_fd < 0 || timer_wheel_init()) {
+			perror("timer wheel");
+			exit(1);
 		}
+		lapic_timer_init(timer_inject);
 	}
 
 	if(debug) vapic_status_dump(stderr, (void *)vmctl.vapic);
@@ -877,9 +1199,22 @@ fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT, PML1_PTE_REACH);
 		} else if (vmctl.shutdown == SHUTDOWN_UNHANDLED_EXIT_REASON) {
 			switch(vmctl.ret_code){
 			case  EXIT_REASON_VMCALL:
-				byte = vmctl.regs.tf_rdi;
-				printf("%c", byte);
-				if (byte == '\n') printf("%c", '%');
+				if (vmctl.regs.tf_rax == VMCALL_PRINTBUF) {
+					uint64_t buf = vmctl.regs.tf_rdi;
+					uint64_t len = vmctl.regs.tf_rsi;
+
+					/* guest RAM is mapped 1:1 at GKERNBASE. */
+					if (buf >= GKERNBASE && buf < KERNSIZE &&
+					    len <= KERNSIZE - buf) {
+						guestout_write(vmcall_out, (void *)buf, len);
+						vmctl.regs.tf_rax = len;
+					} else {
+						vmctl.regs.tf_rax = (uint64_t)-1;
+					}
+				} else {
+					byte = vmctl.regs.tf_rdi;
+					guestout_write(vmcall_out, &byte, 1);
+				}
 				vmctl.regs.tf_rip += 3;
 				break;
 			case EXIT_REASON_EXTERNAL_INTERRUPT:
@@ -931,8 +1266,9 @@ fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT, PML1_PTE_REACH);
 			  fflush(stdout);
 				if (debug)fprintf(stderr, "\n================== Guest MWAIT. =======================\n");
 				if (debug)fprintf(stderr, "Wait for cons data\n");
-				while (!consdata)
+				while (!consdata && !timerdata)
 					;
+				timerdata = 0;
 				//debug = 1;
 				if(debug) vapic_status_dump(stderr, (void *)vmctl.vapic);
 				if (debug)fprintf(stderr, "Resume with consdata ...\n");
@@ -948,8 +1284,9 @@ fprintf(stderr, "%p %p %p %p\n", PGSIZE, PGSHIFT, PML1_SHIFT, PML1_PTE_REACH);
 				fflush(stdout);
 				if (debug)fprintf(stderr, "\n================== Guest halted. =======================\n");
 				if (debug)fprintf(stderr, "Wait for cons data\n");
-				while (!consdata)
+				while (!consdata && !timerdata)
 					;
+				timerdata = 0;
 				//debug = 1;
 				if (debug)fprintf(stderr, "Resume with consdata ...\n");
 				vmctl.regs.tf_rip += 1;
@@ -39,7 +39,7 @@ vmnet_read_blocking(interface_ref interface, struct vmpktdesc *packets, int *pkt
 
 // This function is inspired by vmn_create() from
 // https://github.com/machyve/xhyve/blob/master/src/pci_virtio_net_vmnet.c
-uint32_t create_interface(interface_ref* ref_p, char* mac, uint16_t* mtu) {
+uint32_t create_interface(interface_ref* ref_p, char* mac, uint16_t* mtu, uint32_t* max_pkts) {
     @autoreleasepool {
         pthread_rwlock_wrlock(&lock);
         if (start_semaphores == nil) {
@@ -59,6 +59,7 @@ uint32_t create_interface(interface_ref* ref_p, char* mac, uint16_t* mtu) {
             if (status == VMNET_SUCCESS) {
                 memcpy(mac, xpc_dictionary_get_string(interface_param, vmnet_mac_address_key), MAC_STR_LENGTH);
                 *mtu = (uint16_t)xpc_dictionary_get_uint64(interface_param, vmnet_mtu_key);
+                *max_pkts = (uint32_t)xpc_dictionary_get_uint64(interface_param, vmnet_max_packet_count_key);
             }
             dispatch_semaphore_signal(s);
         });
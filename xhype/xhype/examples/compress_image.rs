@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*!
+This example converts a raw disk image to a read-only compressed image, which
+can be used anywhere a raw image can, e.g. as BLK_PATH of xhype_linux.
+
+Usage:
+    `cargo run --example compress_image <raw image> <compressed image> [chunk size in KiB]`
+!*/
+
+use std::env;
+use xhype::virtio::compressed::{CompressedImage, DEFAULT_CHUNK_SIZE};
+
+fn main() {
+    let args: Vec<String> = env::args().collect();
+    if args.len() < 3 {
+        eprintln!(
+            "usage: {} <raw image> <compressed image> [chunk size in KiB]",
+            args[0]
+        );
+        std::process::exit(1);
+    }
+    let chunk_size = args
+        .get(3)
+        .map(|kib| kib.parse::<u32>().unwrap() * 1024)
+        .unwrap_or(DEFAULT_CHUNK_SIZE);
+    CompressedImage::create(&args[1], &args[2], chunk_size).unwrap();
+    let raw_size = std::fs::metadata(&args[1]).unwrap().len();
+    let compressed_size = std::fs::metadata(&args[2]).unwrap().len();
+    println!(
+        "{} -> {}: {} bytes -> {} bytes",
+        args[1], args[2], raw_size, compressed_size
+    );
+}
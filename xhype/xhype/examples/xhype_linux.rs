@@ -9,12 +9,52 @@ Necessary environment variables:
 
 Optional environment variables:
     RD_PATH:    complete path to a ramdisk file
+    BLK_PATH:   complete path to a disk image, exposed as a virtio block device
+    SCSI_PATHS: comma-separated paths to disk images, exposed as the LUNs
+                of a virtio SCSI controller
+    BLK_QOS:    I/O limits of the virtio block device, e.g. iops=2000,bps=100M
+    SCSI_QOS:   I/O limits of the virtio SCSI controller, same format as BLK_QOS
+    PMEM_PATH:  complete path to a file mapped into the guest as a virtio-pmem
+                device, e.g. a root file system mounted with `-o dax`
+    VHOST_USER_BLK: path of the unix socket of a vhost-user block backend;
+                guest memory is then allocated as shared memory
+    VSOCK_PATH: path of a unix socket through which host processes connect to
+                the guest's virtio-vsock ports by writing `CONNECT <port>\n`;
+                guest connections to host port P go to `<VSOCK_PATH>_P`
+    NET_BACKEND: backend of the virtio-net device instead of vmnet:
+                `unix:<path>,<peer>` for a unix datagram socket bound to
+                path that exchanges frames with the socket at peer, and on
+                Linux `tap:<name>` or `packet:<interface>`
+    NET_PCAP:   capture the frames of the virtio-net queues into a pcapng
+                file, `<path>[,<snaplen>]`; snaplen defaults to 128 bytes
+    BALLOON:    add a virtio-balloon device holding the given number of MiB
+                of guest memory, `<MiB>[,oom][,auto]`; with `oom` the guest
+                may deflate it when it runs out of memory, with `auto` its
+                size follows the host's memory pressure and the guest's
+                needs. Free guest memory is returned to the host through free
+                page reporting either way
+    WSS:        sample the guest's working set every given number of seconds,
+                `<secs>[,<window>]`; pages touched in the last window samples
+                (default 10) count as in use. Estimates are logged at the
+                debug level and let `BALLOON=...,auto` size guests whose
+                balloon does not report their available memory
+    HOTPLUG_MEM: add a virtio-mem device with room for the given number of
+                MiB of hot-pluggable memory, `<MiB>[,<MiB plugged at boot>]`;
+                the guest needs Linux 5.16 or later, for
+                VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE, and
+                `memhp_default_state=online_movable` in its command line
+    SHARE_DIR:  export a host directory to the guest over virtio-9p,
+                `<tag>=<path>`; the guest mounts it with
+                `mount -t 9p -o trans=virtio,version=9p2000.L <tag> <dir>`
     RUST_LOG:   log level: trace, debug, info, warn, error, none; see
                 https://docs.rs/flexi_logger/0.15.10/flexi_logger/struct.LogSpecification.html for details.
     LOG_DIR:    directory to save log files
     XHYPE_UNKNOWN_PORT: policy regarding guests' access to unknown IO ports
     XHYPE_UNKNOWN_MSR: policy regarding guests' access to unknown MSRs
 
+Disk images are either raw images or read-only compressed images created by
+    `cargo run --example compress_image <raw image> <compressed image>`
+
 Set policy regarding guests' access to unknown IO ports:
     format: [random|allone];[apply|except];[list of port numbers in hex]
     examples:
@@ -51,12 +91,49 @@ kill the program. So to kill it, run `killall xhype_linux` in another terminal.
 
 use std::env;
 use std::sync::Arc;
+use std::time::Duration;
 use xhype::consts::*;
 use xhype::err::Error;
 use xhype::utils::{parse_msr_policy, parse_port_policy};
-use xhype::virtio::VirtioDevice;
+use xhype::virtio::balloon::Balloon;
+use xhype::virtio::capture::PacketCapture;
+use xhype::virtio::disk::open_image;
+use xhype::virtio::mem::HotplugMemory;
+use xhype::virtio::net_backend::{NetBackend, UnixDgram, Vmnet};
+use xhype::virtio::overcommit::{OvercommitController, OvercommitPolicy};
+use xhype::virtio::qos::{IoThrottle, QosLimits};
+use xhype::virtio::{VirtioDevice, VirtioId};
+use xhype::wss::WorkingSetSampler;
 use xhype::{linux, VMManager};
 
+fn qos_from_env(name: &str) -> Option<Arc<IoThrottle>> {
+    let limits: QosLimits = env::var(name).ok()?.parse().unwrap();
+    Some(IoThrottle::new(limits))
+}
+
+fn net_backend_from_env(queues: usize) -> Arc<dyn NetBackend> {
+    let spec = match env::var("NET_BACKEND") {
+        Ok(spec) => spec,
+        Err(_) => return Arc::new(Vmnet::new().unwrap()),
+    };
+    let mut parts = spec.splitn(2, ':');
+    let kind = parts.next().unwrap();
+    let arg = parts.next().unwrap_or("");
+    match kind {
+        "unix" => {
+            let mut paths = arg.splitn(2, ',');
+            let path = paths.next().unwrap();
+            let peer = paths.next().expect("unix:<path>,<peer>");
+            Arc::new(UnixDgram::connect(path, peer, None).unwrap())
+        }
+        #[cfg(target_os = "linux")]
+        "tap" => Arc::new(xhype::virtio::net_backend::Tap::open(arg, queues, None).unwrap()),
+        #[cfg(target_os = "linux")]
+        "packet" => Arc::new(xhype::virtio::net_backend::Packet::open(arg, queues, None).unwrap()),
+        _ => panic!("unknown NET_BACKEND {}", spec),
+    }
+}
+
 fn boot_linux() {
     let (port_policy, port_list) = parse_port_policy();
     let (msr_policy, msr_list) = parse_msr_policy();
@@ -66,19 +143,140 @@ fn boot_linux() {
     let kn_path = env::var("KN_PATH").unwrap();
     let rd_path = env::var("RD_PATH").ok();
     let cmd_line = env::var("CMD_Line").unwrap_or("auto".to_string());
-    let mut vm = vmm.create_vm(1, low_mem_size).unwrap();
-    vm.add_virtio_mmio_device(VirtioDevice::new_vmnet(
-        "virtio-vmnet".to_string(),
+    let num_cpus = 1;
+    let vhost_user_blk = env::var("VHOST_USER_BLK").ok();
+    let mut vm = if vhost_user_blk.is_some() {
+        vmm.create_shared_vm(num_cpus, low_mem_size).unwrap()
+    } else {
+        vmm.create_vm(num_cpus, low_mem_size).unwrap()
+    };
+    let capture = PacketCapture::new();
+    vm.add_virtio_mmio_device(VirtioDevice::new_net(
+        "virtio-net".to_string(),
         0,
         vm.irq_sender.clone(),
         vm.gpa2hva.clone(),
+        net_backend_from_env(num_cpus as usize),
+        num_cpus as u16,
+        &capture,
     ));
+    if let Ok(pcap) = env::var("NET_PCAP") {
+        let mut args = pcap.splitn(2, ',');
+        let path = args.next().unwrap();
+        let snaplen = args.next().map(|s| s.parse().unwrap()).unwrap_or(128);
+        capture.start(path, snaplen).unwrap();
+    }
     vm.add_virtio_mmio_device(VirtioDevice::new_rng(
         "virtio-rng".into(),
         1,
         vm.irq_sender.clone(),
         vm.gpa2hva.clone(),
     ));
+    if let Ok(blk_path) = env::var("BLK_PATH") {
+        let disk = open_image(&blk_path, false).unwrap();
+        vm.add_virtio_mmio_device(VirtioDevice::new_blk(
+            "virtio-blk".into(),
+            3,
+            vm.irq_sender.clone(),
+            vm.gpa2hva.clone(),
+            disk,
+            qos_from_env("BLK_QOS"),
+        ));
+    }
+    if let Ok(scsi_paths) = env::var("SCSI_PATHS") {
+        let luns = scsi_paths
+            .split(',')
+            .map(|path| open_image(path, false).unwrap())
+            .collect();
+        vm.add_virtio_mmio_device(VirtioDevice::new_scsi(
+            "virtio-scsi".into(),
+            5,
+            vm.irq_sender.clone(),
+            vm.gpa2hva.clone(),
+            luns,
+            num_cpus,
+            qos_from_env("SCSI_QOS"),
+        ));
+    }
+    if let Ok(pmem_path) = env::var("PMEM_PATH") {
+        let pmem = VirtioDevice::new_pmem("virtio-pmem".into(), 6, &vm, &pmem_path, false);
+        vm.add_virtio_mmio_device(pmem.unwrap());
+    }
+    if let Some(socket) = vhost_user_blk {
+        let blk = VirtioDevice::new_vhost_user(
+            "vhost-user-blk".into(),
+            VirtioId::Block,
+            7,
+            &vm,
+            socket,
+            num_cpus as usize,
+        );
+        vm.add_virtio_mmio_device(blk.unwrap());
+    }
+    if let Ok(vsock_path) = env::var("VSOCK_PATH") {
+        let vsock = VirtioDevice::new_vsock(
+            "virtio-vsock".into(),
+            8,
+            vm.irq_sender.clone(),
+            vm.gpa2hva.clone(),
+            3,
+            vsock_path,
+        );
+        vm.add_virtio_mmio_device(vsock.unwrap());
+    }
+    let sampler = env::var("WSS").ok().map(|spec| {
+        let mut args = spec.splitn(2, ',');
+        let secs: f64 = args.next().unwrap().parse().unwrap();
+        let window: u8 = args.next().map(|s| s.parse().unwrap()).unwrap_or(10);
+        let sampler = WorkingSetSampler::new(&vm, window);
+        sampler.start(Duration::from_secs_f64(secs)).unwrap();
+        sampler
+    });
+    if let Ok(spec) = env::var("BALLOON") {
+        let mut args = spec.split(',');
+        let mib: u32 = args.next().unwrap().parse().unwrap();
+        let opts: Vec<&str> = args.collect();
+        let deflate_on_oom = opts.contains(&"oom");
+        let balloon = Balloon::new();
+        // the balloon counts pages of 4 KiB
+        balloon.set_target(mib * (MiB / 4096) as u32);
+        let dev =
+            VirtioDevice::new_balloon("virtio-balloon".into(), 9, &vm, &balloon, deflate_on_oom);
+        vm.add_virtio_mmio_device(dev);
+        if opts.contains(&"auto") {
+            let controller = OvercommitController::new(OvercommitPolicy::default());
+            let guest_mem = memory_size + low_mem_size.unwrap_or(0);
+            controller.add_guest("guest".into(), balloon, guest_mem as u64);
+            if let Some(sampler) = sampler {
+                controller.track_working_set("guest", sampler);
+            }
+            controller.start();
+        }
+    }
+    if let Ok(spec) = env::var("HOTPLUG_MEM") {
+        let mut args = spec.splitn(2, ',');
+        let size: usize = args.next().unwrap().parse().unwrap();
+        let plugged: u64 = args.next().map(|s| s.parse().unwrap()).unwrap_or(0);
+        let mem = HotplugMemory::new(&vm, size * MiB, 2 * MiB).unwrap();
+        mem.set_requested_size(plugged * MiB as u64);
+        let dev = VirtioDevice::new_mem("virtio-mem".into(), 11, &vm, &mem);
+        vm.add_virtio_mmio_device(dev);
+    }
+    if let Ok(spec) = env::var("SHARE_DIR") {
+        let mut args = spec.splitn(2, '=');
+        let tag = args.next().unwrap();
+        let path = args.next().expect("<tag>=<path>");
+        let share = VirtioDevice::new_9p(
+            "virtio-9p".into(),
+            10,
+            vm.irq_sender.clone(),
+            vm.gpa2hva.clone(),
+            tag,
+            path,
+            4,
+        );
+        vm.add_virtio_mmio_device(share.unwrap());
+    }
     vm.port_list = port_list;
     vm.port_policy = port_policy;
     vm.msr_list = msr_list;
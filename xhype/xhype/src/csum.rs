@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! The Internet checksum (RFC 1071), the ones' complement sum of 16-bit words.
+
+The ones' complement sum does not depend on the byte order of the words
+(RFC 1071, 2.(B)), so [`sum()`] adds little-endian words, which is what the
+vector units do natively, and [`fold()`] swaps the bytes of the result once.
+On x86_64 the bulk of the data is summed with AVX2 if the CPU supports it and
+with SSE2 otherwise.
+
+A checksum over several pieces of data is computed by passing the partial sum
+of one piece to the next. The sum of a piece that starts at an odd offset is
+computed separately and added after [`rotate()`].
+*/
+
+/// Adds the 16-bit words of `data` to the partial sum `sum`.
+pub fn sum(data: &[u8], sum: u64) -> u64 {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            return unsafe { x86::sum_avx2(data, sum) };
+        }
+        unsafe { x86::sum_sse2(data, sum) }
+    }
+    #[cfg(not(target_arch = "x86_64"))]
+    sum_scalar(data, sum)
+}
+
+fn sum_scalar(data: &[u8], mut sum: u64) -> u64 {
+    let mut chunks = data.chunks_exact(4);
+    for c in &mut chunks {
+        sum += u32::from_le_bytes([c[0], c[1], c[2], c[3]]) as u64;
+    }
+    let rest = chunks.remainder();
+    let mut words = rest.chunks_exact(2);
+    for w in &mut words {
+        sum += u16::from_le_bytes([w[0], w[1]]) as u64;
+    }
+    if let [b] = words.remainder() {
+        sum += *b as u64;
+    }
+    sum
+}
+
+fn reduce(mut sum: u64) -> u16 {
+    while sum >> 16 != 0 {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    sum as u16
+}
+
+/// Folds a partial sum into the 16-bit checksum, i.e., the ones' complement of
+/// the ones' complement sum. The result is in host byte order: its
+/// `to_be_bytes()` go on the wire.
+pub fn fold(sum: u64) -> u16 {
+    !reduce(sum).swap_bytes()
+}
+
+/// Converts the partial sum of a piece of data that starts at an odd offset of
+/// the checksummed data, so that it can be added to the sum of the rest.
+pub fn rotate(sum: u64) -> u64 {
+    reduce(sum).swap_bytes() as u64
+}
+
+/// The checksum of `data`.
+pub fn checksum(data: &[u8]) -> u16 {
+    fold(sum(data, 0))
+}
+
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use std::arch::x86_64::*;
+
+    /// The 32-bit lanes of the accumulators grow by at most 2 * 0xffff per
+    /// iteration, so they are flushed before they can overflow.
+    const FLUSH_ITERATIONS: usize = 0x8000;
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn sum_avx2(data: &[u8], mut sum: u64) -> u64 {
+        let mask = _mm256_set1_epi32(0xffff);
+        let mut blocks = data.chunks_exact(32);
+        loop {
+            let mut acc = _mm256_setzero_si256();
+            let mut n = 0;
+            for block in &mut blocks {
+                let v = _mm256_loadu_si256(block.as_ptr() as *const __m256i);
+                acc = _mm256_add_epi32(acc, _mm256_and_si256(v, mask));
+                acc = _mm256_add_epi32(acc, _mm256_srli_epi32(v, 16));
+                n += 1;
+                if n == FLUSH_ITERATIONS {
+                    break;
+                }
+            }
+            let mut lanes = [0u32; 8];
+            _mm256_storeu_si256(lanes.as_mut_ptr() as *mut __m256i, acc);
+            sum += lanes.iter().map(|&l| l as u64).sum::<u64>();
+            if n < FLUSH_ITERATIONS {
+                break;
+            }
+        }
+        sum_sse2(blocks.remainder(), sum)
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn sum_sse2(data: &[u8], mut sum: u64) -> u64 {
+        let mask = _mm_set1_epi32(0xffff);
+        let mut blocks = data.chunks_exact(16);
+        loop {
+            let mut acc = _mm_setzero_si128();
+            let mut n = 0;
+            for block in &mut blocks {
+                let v = _mm_loadu_si128(block.as_ptr() as *const __m128i);
+                acc = _mm_add_epi32(acc, _mm_and_si128(v, mask));
+                acc = _mm_add_epi32(acc, _mm_srli_epi32(v, 16));
+                n += 1;
+                if n == FLUSH_ITERATIONS {
+                    break;
+                }
+            }
+            let mut lanes = [0u32; 4];
+            _mm_storeu_si128(lanes.as_mut_ptr() as *mut __m128i, acc);
+            sum += lanes.iter().map(|&l| l as u64).sum::<u64>();
+            if n < FLUSH_ITERATIONS {
+                break;
+            }
+        }
+        super::sum_scalar(blocks.remainder(), sum)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn checksum_test() {
+        // the IPv4 header example from Wikipedia
+        let header = [
+            0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11, 0x00, 0x00, 0xc0, 0xa8,
+            0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7,
+        ];
+        assert_eq!(checksum(&header), 0xb861);
+        assert_eq!(checksum(&[0xab]), !0xab00);
+        // a sum over two pieces equals the sum over the whole
+        assert_eq!(fold(sum(&header[10..], sum(&header[..10], 0))), 0xb861);
+        assert_eq!(
+            fold(sum(&header[..9], 0) + rotate(sum(&header[9..], 0))),
+            0xb861
+        );
+    }
+
+    #[test]
+    fn checksum_simd_test() {
+        let mut x = 0x2545f491u32;
+        let data: Vec<u8> = (0..70000)
+            .map(|_| {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                x as u8
+            })
+            .collect();
+        for &(start, len) in &[(0, 0), (1, 31), (3, 64), (5, 1001), (0, 70000)] {
+            let piece = &data[start..start + len];
+            let expected = fold(sum_scalar(piece, 0));
+            assert_eq!(checksum(piece), expected);
+            #[cfg(target_arch = "x86_64")]
+            unsafe {
+                assert_eq!(fold(x86::sum_sse2(piece, 0)), expected);
+                if is_x86_feature_detected!("avx2") {
+                    assert_eq!(fold(x86::sum_avx2(piece, 0)), expected);
+                }
+            }
+        }
+        // enough data to flush the accumulators
+        let big = vec![0xffu8; 0x8000 * 32 + 100];
+        assert_eq!(checksum(&big), fold(sum_scalar(&big, 0)));
+    }
+}
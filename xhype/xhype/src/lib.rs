@@ -3,11 +3,13 @@ pub mod apic;
 pub mod bios;
 pub mod consts;
 pub mod cpuid;
+pub mod csum;
 pub mod decode;
 pub mod err;
 pub mod hv;
 pub mod ioapic;
 pub mod linux;
+pub mod lz4;
 pub mod mach;
 pub mod multiboot;
 pub mod pci;
@@ -17,6 +19,7 @@ pub mod utils;
 pub mod virtio;
 pub mod vmexit;
 pub mod vthread;
+pub mod wss;
 
 use apic::Apic;
 use consts::x86::*;
@@ -37,6 +40,7 @@ use serial::Serial;
 use std::collections::{HashMap, HashSet};
 use std::fs::File;
 use std::io::Read;
+use std::os::unix::io::RawFd;
 use std::sync::{Arc, Mutex, RwLock};
 use virtio::{mmio::VirtioMmioDev, VirtioDevice};
 use vmexit::*;
@@ -60,7 +64,18 @@ impl VMManager {
         low_mem_size: Option<usize>,
     ) -> Result<VirtualMachine, Error> {
         assert_eq!(cores, 1); //FIXME: currently only one core is supported
-        VirtualMachine::new(&self, cores, low_mem_size)
+        VirtualMachine::new(&self, cores, low_mem_size, false)
+    }
+
+    /// Creates a VM whose guest memory is backed by shared memory objects,
+    /// which can be handed to other processes, e.g., vhost-user backends.
+    pub fn create_shared_vm(
+        &self,
+        cores: u32,
+        low_mem_size: Option<usize>,
+    ) -> Result<VirtualMachine, Error> {
+        assert_eq!(cores, 1); //FIXME: currently only one core is supported
+        VirtualMachine::new(&self, cores, low_mem_size, true)
     }
 }
 
@@ -89,6 +104,34 @@ pub enum MsrPolicy {
     GP,
 }
 
+/// A range of guest memory backed by a shared memory object
+#[derive(Debug, Clone, Copy)]
+pub struct GuestMemRegion {
+    pub gpa: u64,
+    pub size: u64,
+    pub hva: usize,
+    pub fd: RawFd,
+}
+
+/// A range of guest RAM and where xhype maps it
+#[derive(Debug, Clone, Copy)]
+pub struct GuestRamRegion {
+    pub gpa: u64,
+    pub size: u64,
+    pub hva: usize,
+    /// backed by a shared memory object rather than anonymous memory
+    pub shared: bool,
+}
+
+/// Looks up the host address of `len` bytes of guest RAM at `gpa`. Returns
+/// None if the range is not entirely within one region of `regions`.
+pub fn guest_ram_hva(regions: &[GuestRamRegion], gpa: u64, len: u64) -> Option<(usize, bool)> {
+    regions
+        .iter()
+        .find(|r| gpa >= r.gpa && len <= r.size && gpa - r.gpa <= r.size - len)
+        .map(|r| (r.hva + (gpa - r.gpa) as usize, r.shared))
+}
+
 #[derive(Debug)]
 pub enum PolicyList<T> {
     Apply(HashSet<T>),
@@ -98,10 +141,16 @@ pub enum PolicyList<T> {
 /// A VirtualMachine is the physical hardware seen by a guest, including physical
 /// memory, number of cpu cores, etc.
 pub struct VirtualMachine {
-    pub(crate) mem_space: RwLock<MemSpace>,
+    pub(crate) mem_space: Arc<RwLock<MemSpace>>,
     cores: u32,
     pub low_mem: Option<RwLock<MachVMBlock>>, // memory below 4GiB
     pub(crate) high_mem: RwLock<Vec<MachVMBlock>>,
+    /// whether guest memory is allocated from shared memory objects
+    shared_mem: bool,
+    /// the shared guest memory, empty unless `shared_mem`
+    pub mem_regions: Arc<RwLock<Vec<GuestMemRegion>>>,
+    /// all of guest RAM
+    pub ram_regions: Arc<RwLock<Vec<GuestRamRegion>>>,
     pub(crate) virtio_mmio_devices: Vec<Mutex<VirtioMmioDev>>,
     // serial ports
     pub(crate) com1: Mutex<Serial>,
@@ -122,7 +171,12 @@ pub struct VirtualMachine {
 impl VirtualMachine {
     // make it private to force user to create a vm by calling create_vm to make
     // sure that hv_vm_create() is called before hv_vm_space_create() is called
-    fn new(_vmm: &VMManager, cores: u32, low_mem_size: Option<usize>) -> Result<Self, Error> {
+    fn new(
+        _vmm: &VMManager,
+        cores: u32,
+        low_mem_size: Option<usize>,
+        shared_mem: bool,
+    ) -> Result<Self, Error> {
         let ioapic = Arc::new(RwLock::new(IoApic::new()));
         let vector_senders = Arc::new(Mutex::new(None));
         let (irq_sender, irq_receiver) = channel::<u32>();
@@ -130,8 +184,28 @@ impl VirtualMachine {
         let mut mem_space = MemSpace::create()?;
         Self::map_host_mem(&mut mem_space)?;
         let virtio_base;
+        let mut mem_regions = Vec::new();
+        let mut ram_regions = Vec::new();
         let (low_mem, gpa2hva): (_, AddressConverter) = if let Some(size) = low_mem_size {
-            let low_mem_block = MachVMBlock::new(size)?;
+            let low_mem_block = if shared_mem {
+                MachVMBlock::new_shared(size)?
+            } else {
+                MachVMBlock::new(size)?
+            };
+            if let Some(fd) = low_mem_block.fd() {
+                mem_regions.push(GuestMemRegion {
+                    gpa: 0,
+                    size: size as u64,
+                    hva: low_mem_block.start,
+                    fd,
+                });
+            }
+            ram_regions.push(GuestRamRegion {
+                gpa: 0,
+                size: size as u64,
+                hva: low_mem_block.start,
+                shared: low_mem_block.fd().is_some(),
+            });
             mem_space.map(
                 low_mem_block.start,
                 0,
@@ -154,7 +228,7 @@ impl VirtualMachine {
             (None, Arc::new(converter))
         };
         let vm = VirtualMachine {
-            mem_space: RwLock::new(mem_space),
+            mem_space: Arc::new(RwLock::new(mem_space)),
             cores,
             com1: Mutex::new(Serial::new(4, irq_sender.clone())),
             pci_bus: Mutex::new(PciBus::new()),
@@ -171,6 +245,9 @@ impl VirtualMachine {
             irq_sender: irq_sender,
             low_mem,
             high_mem: RwLock::new(vec![]),
+            shared_mem,
+            mem_regions: Arc::new(RwLock::new(mem_regions)),
+            ram_regions: Arc::new(RwLock::new(ram_regions)),
             virtio_base,
         };
         // start a thread for IO APIC to collect interrupts
@@ -207,6 +284,35 @@ impl VirtualMachine {
         Ok(())
     }
 
+    /// Allocates a block of guest memory, from a shared memory object if the
+    /// VM was created by `create_shared_vm()`.
+    pub(crate) fn alloc_guest_mem(&self, size: usize, align: usize) -> Result<MachVMBlock, Error> {
+        if self.shared_mem {
+            MachVMBlock::new_shared_aligned(size, align)
+        } else {
+            MachVMBlock::new_aligned(size, align)
+        }
+    }
+
+    /// Records that `block` is guest RAM mapped at `gpa`, so that the memory
+    /// can be shared if it is backed by a shared memory object.
+    pub(crate) fn add_guest_mem(&self, gpa: u64, block: &MachVMBlock) {
+        self.ram_regions.write().unwrap().push(GuestRamRegion {
+            gpa,
+            size: block.size as u64,
+            hva: block.start,
+            shared: block.fd().is_some(),
+        });
+        if let Some(fd) = block.fd() {
+            self.mem_regions.write().unwrap().push(GuestMemRegion {
+                gpa,
+                size: block.size as u64,
+                hva: block.start,
+                fd,
+            });
+        }
+    }
+
     pub unsafe fn read_guest_mem<T>(&self, gpa: u64, index: u64) -> &T {
         let hva = (self.gpa2hva)(gpa);
         let ptr = (hva + index as usize * std::mem::size_of::<T>()) as *const T;
@@ -8,7 +8,6 @@ use crate::err::Error;
 use crate::hv::ffi::*;
 use crate::hv::vmx::*;
 use crate::hv::*;
-use crate::mach::MachVMBlock;
 use crate::utils::round_up_4k;
 use crate::{GuestThread, VirtualMachine};
 use crossbeam_channel::unbounded as channel;
@@ -212,7 +211,7 @@ pub fn load_linux64(
     let pml4_offset = gdt_offset - PAGE_SIZE;
     let first_pdpt_offset = pml4_offset - PAGE_SIZE;
 
-    let mut high_mem = MachVMBlock::new_aligned(mem_size, header.kernel_alignment as usize)?;
+    let mut high_mem = vm.alloc_guest_mem(mem_size, header.kernel_alignment as usize)?;
 
     let mut bp = BootParams::new();
     bp.hdr = header;
@@ -375,6 +374,7 @@ pub fn load_linux64(
         HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC,
     )?;
 
+    vm.add_guest_mem(high_mem.start as u64, &high_mem);
     vm.high_mem.write().unwrap().push(high_mem);
     let mut guest_threads = Vec::with_capacity(num_gth as usize);
     let mut vector_senders = Vec::with_capacity(num_gth as usize);
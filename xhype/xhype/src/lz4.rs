@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! A small implementation of the [LZ4 block format](https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md).
+
+The compressor is the greedy single-probe hash table variant of the reference
+implementation, which favours speed over ratio. The decompressor checks every
+length and offset, so corrupted input results in an error instead of reading
+or writing out of bounds.
+*/
+
+const MIN_MATCH: usize = 4;
+/// The last match must start at least 12 bytes before the end of the input.
+const MF_LIMIT: usize = 12;
+/// The last 5 bytes are always literals.
+const LAST_LITERALS: usize = 5;
+const MAX_OFFSET: usize = 65535;
+const HASH_LOG: u32 = 14;
+
+#[derive(Debug, PartialEq, Eq)]
+pub enum Lz4Error {
+    /// The input ends in the middle of a sequence.
+    Truncated,
+    /// A match refers to data before the start of the output.
+    BadOffset,
+    /// The output does not fit in the destination buffer.
+    OutputTooSmall,
+}
+
+/// The size of the largest output `compress()` may produce for an input of
+/// `len` bytes.
+pub fn compress_bound(len: usize) -> usize {
+    len + len / 255 + 16
+}
+
+#[inline]
+fn read_u32(src: &[u8], pos: usize) -> u32 {
+    u32::from_le_bytes([src[pos], src[pos + 1], src[pos + 2], src[pos + 3]])
+}
+
+#[inline]
+fn hash(v: u32) -> usize {
+    (v.wrapping_mul(2654435761) >> (32 - HASH_LOG)) as usize
+}
+
+fn write_length(dst: &mut Vec<u8>, mut len: usize) {
+    while len >= 255 {
+        dst.push(255);
+        len -= 255;
+    }
+    dst.push(len as u8);
+}
+
+fn write_sequence(dst: &mut Vec<u8>, literals: &[u8], offset: usize, match_len: usize) {
+    let lit_token = std::cmp::min(literals.len(), 15) as u8;
+    let match_token = match match_len {
+        0 => 0,
+        n => std::cmp::min(n - MIN_MATCH, 15) as u8,
+    };
+    dst.push(lit_token << 4 | match_token);
+    if literals.len() >= 15 {
+        write_length(dst, literals.len() - 15);
+    }
+    dst.extend_from_slice(literals);
+    if match_len == 0 {
+        return;
+    }
+    dst.extend_from_slice(&(offset as u16).to_le_bytes());
+    if match_len - MIN_MATCH >= 15 {
+        write_length(dst, match_len - MIN_MATCH - 15);
+    }
+}
+
+/// Compresses `src` and appends the LZ4 block to `dst`.
+pub fn compress(src: &[u8], dst: &mut Vec<u8>) {
+    dst.reserve(compress_bound(src.len()));
+    let mut anchor = 0;
+    if src.len() > MF_LIMIT {
+        let mut table = vec![0u32; 1 << HASH_LOG];
+        let match_limit = src.len() - LAST_LITERALS;
+        let mut pos = 0;
+        while pos + MF_LIMIT <= src.len() {
+            let seq = read_u32(src, pos);
+            let h = hash(seq);
+            let candidate = table[h] as usize;
+            table[h] = pos as u32;
+            if candidate >= pos || pos - candidate > MAX_OFFSET || read_u32(src, candidate) != seq {
+                pos += 1;
+                continue;
+            }
+            // extend the match backwards over pending literals and forwards
+            let (mut start, mut cand) = (pos, candidate);
+            while start > anchor && cand > 0 && src[start - 1] == src[cand - 1] {
+                start -= 1;
+                cand -= 1;
+            }
+            let mut end = pos + MIN_MATCH;
+            while end < match_limit && src[end] == src[end - pos + candidate] {
+                end += 1;
+            }
+            write_sequence(dst, &src[anchor..start], start - cand, end - start);
+            anchor = end;
+            pos = end;
+        }
+    }
+    write_sequence(dst, &src[anchor..], 0, 0);
+}
+
+fn read_length(src: &[u8], pos: &mut usize) -> Result<usize, Lz4Error> {
+    let mut len = 0;
+    loop {
+        let b = *src.get(*pos).ok_or(Lz4Error::Truncated)?;
+        *pos += 1;
+        len += b as usize;
+        if b != 255 {
+            return Ok(len);
+        }
+    }
+}
+
+/// Decompresses the LZ4 block `src` into `dst` and returns the number of bytes
+/// written.
+pub fn decompress(src: &[u8], dst: &mut [u8]) -> Result<usize, Lz4Error> {
+    let (mut ip, mut op) = (0, 0);
+    loop {
+        let token = *src.get(ip).ok_or(Lz4Error::Truncated)?;
+        ip += 1;
+        let mut lit_len = (token >> 4) as usize;
+        if lit_len == 15 {
+            lit_len += read_length(src, &mut ip)?;
+        }
+        let literals = src.get(ip..ip + lit_len).ok_or(Lz4Error::Truncated)?;
+        dst.get_mut(op..op + lit_len)
+            .ok_or(Lz4Error::OutputTooSmall)?
+            .copy_from_slice(literals);
+        ip += lit_len;
+        op += lit_len;
+        if ip == src.len() {
+            return Ok(op);
+        }
+        let offset = src
+            .get(ip..ip + 2)
+            .map(|b| u16::from_le_bytes([b[0], b[1]]) as usize)
+            .ok_or(Lz4Error::Truncated)?;
+        ip += 2;
+        if offset == 0 || offset > op {
+            return Err(Lz4Error::BadOffset);
+        }
+        let mut match_len = (token & 0xf) as usize;
+        if match_len == 15 {
+            match_len += read_length(src, &mut ip)?;
+        }
+        match_len += MIN_MATCH;
+        if op + match_len > dst.len() {
+            return Err(Lz4Error::OutputTooSmall);
+        }
+        if offset >= match_len {
+            dst.copy_within(op - offset..op - offset + match_len, op);
+        } else {
+            // overlapping copy, which repeats the last `offset` bytes
+            for i in op..op + match_len {
+                dst[i] = dst[i - offset];
+            }
+        }
+        op += match_len;
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn roundtrip(data: &[u8]) -> usize {
+        let mut compressed = Vec::new();
+        compress(data, &mut compressed);
+        assert!(compressed.len() <= compress_bound(data.len()));
+        let mut out = vec![0u8; data.len()];
+        assert_eq!(decompress(&compressed, &mut out), Ok(data.len()));
+        assert_eq!(out, data);
+        compressed.len()
+    }
+
+    #[test]
+    fn lz4_roundtrip_test() {
+        roundtrip(b"");
+        roundtrip(b"a");
+        roundtrip(b"abcdefghijklm");
+        assert!(roundtrip(&[0u8; 65536]) < 512);
+        let text: Vec<u8> = b"the quick brown fox jumps over the lazy dog. "
+            .iter()
+            .cycle()
+            .take(10000)
+            .cloned()
+            .collect();
+        assert!(roundtrip(&text) < 1000);
+        let mut x = 0x12345678u32;
+        let noise: Vec<u8> = (0..5000)
+            .map(|_| {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                x as u8
+            })
+            .collect();
+        roundtrip(&noise);
+    }
+
+    #[test]
+    fn lz4_decompress_test() {
+        // "abcabcabcabcabcabc" + "xyzxyz": 3 literals, a 15-byte match at
+        // offset 3, then 6 trailing literals
+        let block = [
+            0x3b, b'a', b'b', b'c', 3, 0, 0x60, b'x', b'y', b'z', b'x', b'y', b'z',
+        ];
+        let mut out = [0u8; 24];
+        assert_eq!(decompress(&block, &mut out), Ok(24));
+        assert_eq!(&out, b"abcabcabcabcabcabcxyzxyz");
+        assert_eq!(
+            decompress(&block, &mut out[..10]),
+            Err(Lz4Error::OutputTooSmall)
+        );
+        assert_eq!(decompress(&block[..5], &mut out), Err(Lz4Error::Truncated));
+        let bad = [0x10, b'a', 2, 0, 0x00];
+        assert_eq!(decompress(&bad, &mut out), Err(Lz4Error::BadOffset));
+    }
+}
@@ -3,8 +3,11 @@
 #![allow(non_camel_case_types)]
 
 use super::err::Error;
+use crate::PAGE_SIZE;
+use std::io;
 use std::mem::size_of;
 use std::ops::{Index, IndexMut};
+use std::os::unix::io::RawFd;
 use std::slice;
 use std::slice::SliceIndex;
 
@@ -115,21 +118,65 @@ pub fn vm_deallocate(addr: usize, size: usize) -> Result<(), Error> {
     }
 }
 
+/// Creates an anonymous shared memory object of `size` bytes, which other
+/// processes can map through its file descriptor.
+fn shm_create(size: usize) -> Result<RawFd, Error> {
+    #[cfg(target_os = "linux")]
+    let fd = unsafe { libc::memfd_create(b"xhype\0".as_ptr() as *const _, libc::MFD_CLOEXEC) };
+    #[cfg(not(target_os = "linux"))]
+    let fd = {
+        use std::sync::atomic::{AtomicUsize, Ordering};
+        static COUNT: AtomicUsize = AtomicUsize::new(0);
+        let name = format!(
+            "/xhype.{}.{}\0",
+            std::process::id(),
+            COUNT.fetch_add(1, Ordering::Relaxed)
+        );
+        let name = name.as_ptr() as *const libc::c_char;
+        unsafe {
+            let fd = libc::shm_open(name, libc::O_RDWR | libc::O_CREAT | libc::O_EXCL, 0o600);
+            if fd >= 0 {
+                libc::shm_unlink(name);
+            }
+            fd
+        }
+    };
+    if fd < 0 {
+        return Err(io::Error::last_os_error())?;
+    }
+    if unsafe { libc::ftruncate(fd, size as libc::off_t) } < 0 {
+        let e = io::Error::last_os_error();
+        unsafe { libc::close(fd) };
+        return Err(e)?;
+    }
+    Ok(fd)
+}
+
 #[derive(Debug)]
 pub struct MachVMBlock {
     pub start: usize,
     pub size: usize,
+    /// the shared memory object backing the block, if any
+    fd: Option<RawFd>,
 }
 
 impl MachVMBlock {
     pub fn new(size: usize) -> Result<Self, Error> {
         let start = vm_allocate(size)?;
-        Ok(MachVMBlock { start, size })
+        Ok(MachVMBlock {
+            start,
+            size,
+            fd: None,
+        })
     }
 
     pub fn new_fixed(start: usize, size: usize) -> Result<Self, Error> {
         vm_allocate_fixed(start, size)?;
-        Ok(MachVMBlock { start, size })
+        Ok(MachVMBlock {
+            start,
+            size,
+            fd: None,
+        })
     }
 
     pub fn new_aligned(size: usize, align: usize) -> Result<Self, Error> {
@@ -140,9 +187,62 @@ impl MachVMBlock {
         Ok(MachVMBlock {
             start: start_aligned,
             size: size,
+            fd: None,
+        })
+    }
+
+    /// Allocates a block backed by an anonymous shared memory object, such
+    /// that other processes can map the same memory through [`fd()`].
+    ///
+    /// [`fd()`]: #method.fd
+    pub fn new_shared(size: usize) -> Result<Self, Error> {
+        Self::new_shared_aligned(size, PAGE_SIZE)
+    }
+
+    /// Like [`new_shared()`], at an address that is a multiple of `align`,
+    /// which is rounded up to whole pages.
+    ///
+    /// [`new_shared()`]: #method.new_shared
+    pub fn new_shared_aligned(size: usize, align: usize) -> Result<Self, Error> {
+        let align = std::cmp::max(align, PAGE_SIZE);
+        let fd = shm_create(size)?;
+        // reserve an aligned range and map the shared memory object over it
+        let start = vm_allocate(size + align)?;
+        let start_aligned = (start + align - 1) / align * align;
+        let addr = unsafe {
+            libc::mmap(
+                start_aligned as *mut libc::c_void,
+                size,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_FIXED,
+                fd,
+                0,
+            )
+        };
+        if addr == libc::MAP_FAILED {
+            let e = io::Error::last_os_error();
+            vm_deallocate(start, size + align)?;
+            unsafe { libc::close(fd) };
+            return Err(e)?;
+        }
+        let head = start_aligned - start;
+        if head > 0 {
+            vm_deallocate(start, head)?;
+        }
+        vm_deallocate(start_aligned + size, align - head)?;
+        Ok(MachVMBlock {
+            start: start_aligned,
+            size,
+            fd: Some(fd),
         })
     }
 
+    /// The file descriptor of the shared memory object backing the block, or
+    /// `None` if the block is private to this process.
+    pub fn fd(&self) -> Option<RawFd> {
+        self.fd
+    }
+
     pub fn write<T>(&mut self, val: T, offset: usize, index: usize) {
         debug_assert!((index + 1) * size_of::<T>() + offset <= self.size);
         let ptr = (self.start + offset + index * size_of::<T>()) as *mut T;
@@ -168,7 +268,10 @@ impl MachVMBlock {
 
 impl Drop for MachVMBlock {
     fn drop(&mut self) {
-        vm_deallocate(self.start, self.size).unwrap()
+        vm_deallocate(self.start, self.size).unwrap();
+        if let Some(fd) = self.fd {
+            unsafe { libc::close(fd) };
+        }
     }
 }
 
@@ -268,4 +371,33 @@ mod tests {
         assert_eq!(block[0], 4);
         assert_eq!(&block[0..2], [4, 0])
     }
+
+    #[test]
+    fn vm_block_shared_unaligned_test() {
+        let mut block = MachVMBlock::new_shared(3 * 4096).unwrap();
+        assert_eq!(block.start % crate::PAGE_SIZE, 0);
+        block[3 * 4096 - 1] = 6;
+        assert_eq!(block[3 * 4096 - 1], 6);
+    }
+
+    #[test]
+    fn vm_block_shared_test() {
+        let mut block = MachVMBlock::new_shared_aligned(4096, 2 * 4096).unwrap();
+        assert_eq!(block.start % (2 * 4096), 0);
+        block[0] = 5;
+        // another mapping of the shared memory object sees the same data
+        let addr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                4096,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                block.fd().unwrap(),
+                0,
+            )
+        };
+        assert_ne!(addr, libc::MAP_FAILED);
+        assert_eq!(unsafe { *(addr as *const u8) }, 5);
+        unsafe { libc::munmap(addr, 4096) };
+    }
 }
@@ -6,11 +6,13 @@ use bitfield::bitfield;
 use crossbeam_channel::Sender;
 use libc::{cfmakeraw, tcgetattr, tcsetattr, termios, CLOCAL, STDIN_FILENO, TCSANOW};
 use log::*;
-use std::collections::VecDeque;
-use std::io::Read;
+use std::cell::UnsafeCell;
 use std::io::Write;
 use std::mem::{size_of, transmute};
-use std::sync::{Arc, RwLock};
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::thread::JoinHandle;
+use std::time::Duration;
 
 // offset 0x1, Interrupt Enable Register (IER)
 bitfield! {
@@ -46,12 +48,14 @@ bitfield! {
     #[derive(Copy, Clone, Debug, Default)]
     struct Iir(u8);
     u8;
-    intr_id, _: 3,1; // Interrupt ID
-    pending, _: 0,0; // Interrupt Pending Bit
+    fifo, set_fifo: 7,6;         // FIFOs enabled
+    intr_id, set_intr_id: 3,1;   // Interrupt ID
+    pending, set_pending: 0,0;   // Interrupt Pending Bit, active low
 }
 
 const DATA_AVAILABLE: u8 = 0b010;
 const ROOM_AVAILABLE: u8 = 0b001;
+const CHAR_TIMEOUT: u8 = 0b110;
 
 // offset 0x3, Line Control Register (LCR)
 bitfield! {
@@ -109,20 +113,142 @@ impl Default for Lsr {
     }
 }
 
-// TO-DO: send interrupts
+/// Depth of the transmit and receive FIFOs of a 16550.
+const FIFO_SIZE: usize = 16;
+
+/// Receive FIFO trigger levels, selected by FCR bits 7:6.
+const RX_TRIGGER: [usize; 4] = [1, 4, 8, 14];
+
+/// Bytes buffered on the host side in each direction.
+const RING_SIZE: usize = 4096;
+
+/// How long a full transmit FIFO takes to drain at 115200 baud, 10 bits per
+/// character. The writer thread collects output for that long before it
+/// writes, so a burst costs one write instead of one per character.
+const TX_DRAIN: Duration = Duration::from_micros(1400);
+
+/// Receive character timeout in ms: input below the trigger level is
+/// signaled once no more arrives for about 4 character times.
+const RX_TIMEOUT: i32 = 1;
+
+/// A single producer, single consumer byte ring. Each direction of the UART
+/// has one: the vCPU produces output and consumes input under the `com1`
+/// lock, and the input and writer threads are the other ends.
+struct ByteRing {
+    buf: Box<[UnsafeCell<u8>]>,
+    /// bytes ever pushed, advanced by the producer
+    head: AtomicUsize,
+    /// bytes ever popped, advanced by the consumer
+    tail: AtomicUsize,
+}
+
+// the producer and the consumer never touch the same bytes at the same time:
+// `head` and `tail` hand bytes over with release/acquire ordering
+unsafe impl Sync for ByteRing {}
+
+impl ByteRing {
+    fn new(size: usize) -> Self {
+        ByteRing {
+            buf: (0..size).map(|_| UnsafeCell::new(0)).collect(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+        }
+    }
+
+    fn len(&self) -> usize {
+        let tail = self.tail.load(Ordering::Acquire);
+        self.head.load(Ordering::Acquire).wrapping_sub(tail)
+    }
+
+    fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    fn room(&self) -> usize {
+        self.buf.len() - self.len()
+    }
+
+    /// Appends as much of `data` as fits and returns how much that was.
+    /// Called by the producer only.
+    fn push(&self, data: &[u8]) -> usize {
+        let head = self.head.load(Ordering::Relaxed);
+        let tail = self.tail.load(Ordering::Acquire);
+        let n = std::cmp::min(data.len(), self.buf.len() - head.wrapping_sub(tail));
+        let base = self.buf.as_ptr() as *mut u8;
+        let start = head % self.buf.len();
+        let first = std::cmp::min(n, self.buf.len() - start);
+        unsafe {
+            std::ptr::copy_nonoverlapping(data.as_ptr(), base.add(start), first);
+            std::ptr::copy_nonoverlapping(data.as_ptr().add(first), base, n - first);
+        }
+        self.head.store(head.wrapping_add(n), Ordering::Release);
+        n
+    }
+
+    /// Moves up to `buf.len()` bytes to `buf` and returns how many.
+    /// Called by the consumer only.
+    fn pop_into(&self, buf: &mut [u8]) -> usize {
+        let tail = self.tail.load(Ordering::Relaxed);
+        let head = self.head.load(Ordering::Acquire);
+        let n = std::cmp::min(buf.len(), head.wrapping_sub(tail));
+        let base = self.buf.as_ptr() as *const u8;
+        let start = tail % self.buf.len();
+        let first = std::cmp::min(n, self.buf.len() - start);
+        unsafe {
+            std::ptr::copy_nonoverlapping(base.add(start), buf.as_mut_ptr(), first);
+            std::ptr::copy_nonoverlapping(base, buf.as_mut_ptr().add(first), n - first);
+        }
+        self.tail.store(tail.wrapping_add(n), Ordering::Release);
+        n
+    }
+
+    fn pop(&self) -> Option<u8> {
+        let mut b = [0u8];
+        if self.pop_into(&mut b) == 1 {
+            Some(b[0])
+        } else {
+            None
+        }
+    }
+
+    /// Drops everything in the ring. Called by the consumer only.
+    fn clear(&self) {
+        let head = self.head.load(Ordering::Acquire);
+        self.tail.store(head, Ordering::Release);
+    }
+}
+
+/// The receive side shared with the input thread.
+struct Input {
+    ring: ByteRing,
+    /// IER.ERBFI, so the input thread knows whether to interrupt
+    irq_enabled: AtomicBool,
+    /// receive trigger level from FCR
+    trigger: AtomicUsize,
+}
+
+/// The transmit side shared with the writer thread.
+struct Output {
+    ring: ByteRing,
+    closing: AtomicBool,
+}
 
 pub struct Serial {
     ier: Ier, // 0x1, Interrupt Enable Register (IER)
     fcr: Fcr, // 0x2, write, FIFO Control Register (FCR)
-    #[allow(dead_code)]
-    iir: Iir, // 0x2, read, Interrupt Identification Register
     lcr: Lcr, // 0x3, Line Control Register (LCR)
     mcr: Mcr, // 0x4, Modem Control Register (MCR)
     lsr: Lsr, // 0x5, Line Status Register (LSR)
     msr: u8,  // 0x6, Modem Status Register (MSR)
     scr: u8,  // 0x7, Scratch Register (SCR)
     divisor: u16,
-    in_data: Arc<RwLock<VecDeque<u8>>>,
+    input: Arc<Input>,
+    output: Arc<Output>,
+    writer: Option<JoinHandle<()>>,
+    /// bytes written to the transmit FIFO since it last drained
+    tx_fifo_len: usize,
+    /// a THR empty interrupt is pending until IIR reports it or THR is written
+    thre_pending: bool,
     irq: u32,
     irq_sender: Sender<u32>,
     termios_backup: termios,
@@ -130,7 +256,15 @@ pub struct Serial {
 
 impl Serial {
     pub fn new(irq: u32, irq_sender: Sender<u32>) -> Self {
-        let in_data = Arc::new(RwLock::new(VecDeque::new()));
+        let input = Arc::new(Input {
+            ring: ByteRing::new(RING_SIZE),
+            irq_enabled: AtomicBool::new(false),
+            trigger: AtomicUsize::new(1),
+        });
+        let output = Arc::new(Output {
+            ring: ByteRing::new(RING_SIZE),
+            closing: AtomicBool::new(false),
+        });
 
         let termios_backup = unsafe {
             let mut old: termios = transmute([0u8; size_of::<termios>()]);
@@ -143,45 +277,182 @@ impl Serial {
             }
             old
         };
+        let writer = {
+            let output = output.clone();
+            std::thread::Builder::new()
+                .name(format!("serial writer irq {}", irq))
+                .spawn(move || Self::output_loop(output))
+                .unwrap()
+        };
         let r = Serial {
             ier: Ier::default(),
             fcr: Fcr::default(),
-            iir: Iir::default(),
             lcr: Lcr::default(),
             mcr: Mcr::default(),
             lsr: Lsr::default(),
             msr: 0,
             scr: 0,
             divisor: 0,
-            in_data: in_data.clone(),
+            input: input.clone(),
+            output,
+            writer: Some(writer),
+            tx_fifo_len: 0,
+            thre_pending: false,
             irq,
             irq_sender: irq_sender.clone(),
             termios_backup,
         };
         std::thread::Builder::new()
             .name(format!("serial thread irq {}", irq))
-            .spawn(move || Self::input_loop(irq, irq_sender, in_data))
+            .spawn(move || Self::input_loop(irq, irq_sender, input))
             .unwrap();
         r
     }
 
-    fn input_loop(irq: u32, irq_sender: Sender<u32>, in_data: Arc<RwLock<VecDeque<u8>>>) {
+    /// Waits up to `timeout` ms, or forever if it is negative, for stdin to
+    /// become readable.
+    fn wait_stdin(timeout: i32) -> bool {
+        let mut pfd = libc::pollfd {
+            fd: STDIN_FILENO,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        unsafe { libc::poll(&mut pfd, 1, timeout) > 0 }
+    }
+
+    /// Reads stdin in bulk into the receive ring. Like the receive FIFO of a
+    /// 16550, it interrupts once the trigger level is reached, or when input
+    /// below that level has been sitting there for the character timeout.
+    fn input_loop(irq: u32, irq_sender: Sender<u32>, input: Arc<Input>) {
+        let mut buf = [0u8; 256];
+        let mut unsignaled = false;
+        let signal = || {
+            if input.irq_enabled.load(Ordering::Acquire) {
+                irq_sender.send(irq).unwrap();
+            }
+        };
         loop {
-            let stdin = std::io::stdin();
-            let mut handle = stdin.lock();
-            let mut buf = [0u8];
-            handle.read_exact(&mut buf).unwrap();
-            in_data.write().unwrap().push_back(buf[0]);
-            irq_sender.send(irq).unwrap();
+            let timeout = if unsignaled { RX_TIMEOUT } else { -1 };
+            if !Self::wait_stdin(timeout) {
+                unsignaled = false;
+                signal();
+                continue;
+            }
+            let room = std::cmp::min(buf.len(), input.ring.room());
+            if room == 0 {
+                // the guest is not reading; remind it and wait
+                signal();
+                std::thread::sleep(Duration::from_millis(10));
+                continue;
+            }
+            let n = unsafe { libc::read(STDIN_FILENO, buf.as_mut_ptr() as *mut _, room) };
+            if n < 0 && std::io::Error::last_os_error().kind() == std::io::ErrorKind::Interrupted {
+                continue;
+            }
+            if n <= 0 {
+                info!("serial input closed");
+                return;
+            }
+            input.ring.push(&buf[..n as usize]);
+            if input.ring.len() >= input.trigger.load(Ordering::Relaxed) {
+                unsignaled = false;
+                signal();
+            } else {
+                unsignaled = true;
+            }
+        }
+    }
+
+    /// Writes out what the guest transmits. Woken by the first byte of a
+    /// burst, it gives the guest the time a FIFO takes to drain to add more,
+    /// and then writes everything with one write and one flush.
+    fn output_loop(output: Arc<Output>) {
+        let mut buf = vec![0u8; RING_SIZE];
+        let stdout = std::io::stdout();
+        loop {
+            if output.ring.is_empty() {
+                if output.closing.load(Ordering::Acquire) {
+                    return;
+                }
+                std::thread::park();
+                continue;
+            }
+            if !output.closing.load(Ordering::Acquire) {
+                std::thread::park_timeout(TX_DRAIN);
+            }
+            let n = output.ring.pop_into(&mut buf);
+            let mut handle = stdout.lock();
+            if let Err(e) = handle.write_all(&buf[..n]).and_then(|_| handle.flush()) {
+                error!("serial output: {}", e);
+            }
+        }
+    }
+
+    fn fifo_depth(&self) -> usize {
+        if self.fcr.fifo() == 1 {
+            FIFO_SIZE
+        } else {
+            1
+        }
+    }
+
+    fn wake_writer(&self) {
+        if let Some(writer) = &self.writer {
+            writer.thread().unpark();
+        }
+    }
+
+    /// Queues a byte written to THR. The FIFO drains as soon as it is full,
+    /// and that is when THRE is signaled: once per FIFO, not per byte.
+    fn transmit(&mut self, value: u8) {
+        let was_empty = self.output.ring.is_empty();
+        while self.output.ring.push(&[value]) == 0 {
+            // the writer is behind: that is our back pressure
+            self.wake_writer();
+            std::thread::yield_now();
+        }
+        self.thre_pending = false;
+        self.tx_fifo_len += 1;
+        if was_empty || self.output.ring.len() % FIFO_SIZE == 0 {
+            self.wake_writer();
+        }
+        if self.tx_fifo_len >= self.fifo_depth() {
+            self.tx_fifo_len = 0;
+            if self.ier.etbei() == 1 {
+                self.thre_pending = true;
+                self.irq_sender.send(self.irq).unwrap();
+            }
+        }
+    }
+
+    /// The highest priority pending interrupt, as IIR reports it.
+    fn iir(&self) -> Iir {
+        let mut iir = Iir::default();
+        if self.fcr.fifo() == 1 {
+            iir.set_fifo(0b11);
         }
+        let rx_len = self.input.ring.len();
+        let id = if self.ier.erbfi() == 1 && rx_len > 0 {
+            if rx_len >= self.input.trigger.load(Ordering::Relaxed) {
+                DATA_AVAILABLE
+            } else {
+                CHAR_TIMEOUT
+            }
+        } else if self.ier.etbei() == 1 && self.thre_pending {
+            ROOM_AVAILABLE
+        } else {
+            iir.set_pending(1);
+            0
+        };
+        iir.set_intr_id(id);
+        iir
     }
 
     pub fn read(&mut self, offset: u16) -> u8 {
         let result = match offset {
             0 => {
                 if self.lcr.dlab() == 0 {
-                    let mut in_data = self.in_data.write().unwrap();
-                    in_data.pop_front().unwrap_or(0xff)
+                    self.input.ring.pop().unwrap_or(0xff)
                 } else {
                     (self.divisor & 0xff) as u8
                 }
@@ -194,17 +465,17 @@ impl Serial {
                 }
             }
             2 => {
-                if self.in_data.read().unwrap().len() > 0 {
-                    DATA_AVAILABLE << 1
-                } else {
-                    ROOM_AVAILABLE << 1
+                let iir = self.iir();
+                // reading IIR acknowledges a THR empty interrupt
+                if iir.intr_id() == ROOM_AVAILABLE {
+                    self.thre_pending = false;
                 }
+                iir.0
             }
             3 => self.lcr.0,
             4 => self.mcr.0,
             5 => {
-                let in_data_len = { self.in_data.read().unwrap().len() };
-                if in_data_len == 0 {
+                if self.input.ring.is_empty() {
                     self.lsr.set_ready(0);
                 } else {
                     self.lsr.set_ready(1);
@@ -216,22 +487,16 @@ impl Serial {
             7 => self.scr,
             _ => unreachable!("offset {}", offset),
         };
-        info!("read {:08b} from offset {}", result, offset);
+        trace!("read {:08b} from offset {}", result, offset);
         result
     }
 
     pub fn write(&mut self, offset: u16, value: u8) {
-        info!("write {:08b} to offset {}", value, offset);
+        trace!("write {:08b} to offset {}", value, offset);
         match offset {
             0 => {
                 if self.lcr.dlab() == 0 {
-                    let stdout = std::io::stdout();
-                    let mut handle = stdout.lock();
-                    let num_char = handle.write(&[value]).unwrap();
-                    debug_assert_eq!(num_char, 1);
-                    let flush_ret = handle.flush().unwrap();
-                    debug_assert_eq!(flush_ret, ());
-                    self.irq_sender.send(self.irq).unwrap();
+                    self.transmit(value);
                 } else {
                     self.divisor &= !0xff;
                     self.divisor |= value as u16;
@@ -239,13 +504,46 @@ impl Serial {
             }
             1 => {
                 if self.lcr.dlab() == 0 {
-                    self.ier.0 = value
+                    let old = self.ier;
+                    self.ier.0 = value;
+                    self.input
+                        .irq_enabled
+                        .store(self.ier.erbfi() == 1, Ordering::Release);
+                    // enabling an interrupt whose condition already holds
+                    // raises it right away
+                    let thre = old.etbei() == 0 && self.ier.etbei() == 1;
+                    if thre {
+                        self.thre_pending = true;
+                    }
+                    if thre
+                        || old.erbfi() == 0 && self.ier.erbfi() == 1 && !self.input.ring.is_empty()
+                    {
+                        self.irq_sender.send(self.irq).unwrap();
+                    }
                 } else {
                     self.divisor &= 0xff;
                     self.divisor |= (value as u16) << 8;
                 }
             }
-            2 => self.fcr.0 = value,
+            2 => {
+                let mut fcr = Fcr(value);
+                if fcr.rfr() == 1 {
+                    self.input.ring.clear();
+                }
+                if fcr.tfr() == 1 {
+                    self.tx_fifo_len = 0;
+                }
+                // the reset bits clear themselves
+                fcr.set_rfr(0);
+                fcr.set_tfr(0);
+                let trigger = if fcr.fifo() == 1 {
+                    RX_TRIGGER[fcr.rtb() as usize]
+                } else {
+                    1
+                };
+                self.input.trigger.store(trigger, Ordering::Relaxed);
+                self.fcr = fcr;
+            }
             3 => self.lcr.0 = value,
             4 => self.mcr.0 = value,
             5 => self.lsr.0 = value,
@@ -258,8 +556,39 @@ impl Serial {
 
 impl Drop for Serial {
     fn drop(&mut self) {
+        // let the writer get the last output out before the terminal is
+        // restored
+        self.output.closing.store(true, Ordering::Release);
+        if let Some(writer) = self.writer.take() {
+            writer.thread().unpark();
+            writer.join().ok();
+        }
         unsafe {
             tcsetattr(STDIN_FILENO, TCSANOW, &self.termios_backup);
         }
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn byte_ring_test() {
+        let ring = ByteRing::new(8);
+        assert_eq!(ring.push(b"abcde"), 5);
+        let mut buf = [0u8; 3];
+        assert_eq!(ring.pop_into(&mut buf), 3);
+        assert_eq!(&buf, b"abc");
+        // wraps around the end, and stops when full
+        assert_eq!(ring.push(b"fghijkl"), 6);
+        assert_eq!(ring.room(), 0);
+        let mut buf = [0u8; 16];
+        assert_eq!(ring.pop_into(&mut buf), 8);
+        assert_eq!(&buf[..8], b"defghijk");
+        assert_eq!(ring.pop(), None);
+        ring.push(b"xy");
+        ring.clear();
+        assert!(ring.is_empty());
+    }
+}
@@ -0,0 +1,569 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Implements a virtio memory balloon device, so that guest memory the guest
+does not use goes back to the host.
+
+The host sets a target size with [`Balloon::set_target`]. The guest inflates
+the balloon towards it by handing over page frame numbers on the inflate
+queue, and takes pages back on the deflate queue. With
+`VIRTIO_BALLOON_F_DEFLATE_ON_OOM`, the guest deflates on its own instead of
+running out of memory.
+
+With free page reporting (`VIRTIO_BALLOON_F_REPORTING`), the guest also
+reports large free blocks of its memory on the reporting queue, while
+keeping them: memory it touched once and freed again goes back to the host
+without any target being set.
+
+With `VIRTIO_BALLOON_F_STATS_VQ`, the guest tells how it uses its memory. The
+driver puts a buffer of statistics on the stats queue and the device keeps
+it; returning it with [`Balloon::request_stats`] asks the driver for fresh
+ones, which arrive in the next buffer.
+
+Pages the guest gives up are released with `madvise()` on the mapping that
+backs guest RAM; nothing is done when the guest takes them back, the pages
+are faulted in again when it touches them:
+
+* on Linux, anonymous memory is released with `MADV_DONTNEED` and shared
+  memory with `MADV_REMOVE`, which also frees the backing pages;
+* on macOS, memory is released with `MADV_FREE_REUSABLE`, and marked with
+  `MADV_FREE_REUSE` again on deflate so that it is accounted to xhype again.
+
+Page frame numbers are checked against the guest RAM regions of the VM:
+pages outside of guest RAM are ignored.
+*/
+
+use super::consts::*;
+use super::virtq::*;
+use super::TaskSender;
+use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
+use crate::{guest_ram_hva, GuestRamRegion, VirtualMachine};
+#[allow(unused_imports)]
+use log::*;
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::Instant;
+
+pub const VIRTIO_BALLOON_F_MUST_TELL_HOST: u64 = 0;
+pub const VIRTIO_BALLOON_F_STATS_VQ: u64 = 1;
+pub const VIRTIO_BALLOON_F_DEFLATE_ON_OOM: u64 = 2;
+pub const VIRTIO_BALLOON_F_FREE_PAGE_HINT: u64 = 3;
+pub const VIRTIO_BALLOON_F_PAGE_POISON: u64 = 4;
+pub const VIRTIO_BALLOON_F_REPORTING: u64 = 5;
+
+// virtio-v1.1 5.5.6.3: tags of the statistics
+pub const VIRTIO_BALLOON_S_SWAP_IN: u16 = 0;
+pub const VIRTIO_BALLOON_S_SWAP_OUT: u16 = 1;
+pub const VIRTIO_BALLOON_S_MAJFLT: u16 = 2;
+pub const VIRTIO_BALLOON_S_MINFLT: u16 = 3;
+pub const VIRTIO_BALLOON_S_MEMFREE: u16 = 4;
+pub const VIRTIO_BALLOON_S_MEMTOT: u16 = 5;
+pub const VIRTIO_BALLOON_S_AVAIL: u16 = 6;
+pub const VIRTIO_BALLOON_S_CACHES: u16 = 7;
+pub const VIRTIO_BALLOON_S_HTLB_PGALLOC: u16 = 8;
+pub const VIRTIO_BALLOON_S_HTLB_PGFAIL: u16 = 9;
+const VIRTIO_BALLOON_S_NR: usize = 10;
+
+/// Size of a statistic: le16 tag, le64 value, packed.
+const BALLOON_STAT_SIZE: usize = 10;
+
+/// Balloon page frame numbers are always in units of 4 KiB.
+const VIRTIO_BALLOON_PFN_SHIFT: u32 = 12;
+const BALLOON_PAGE_SIZE: u64 = 1 << VIRTIO_BALLOON_PFN_SHIFT;
+
+/// Releases `len` bytes of guest RAM at `hva`.
+fn release(hva: usize, len: usize, shared: bool) {
+    #[cfg(target_os = "linux")]
+    let advice = if shared {
+        libc::MADV_REMOVE
+    } else {
+        libc::MADV_DONTNEED
+    };
+    #[cfg(not(target_os = "linux"))]
+    let advice = {
+        let _ = shared;
+        libc::MADV_FREE_REUSABLE
+    };
+    if unsafe { libc::madvise(hva as *mut libc::c_void, len, advice) } != 0 {
+        warn!(
+            "virtio-balloon: madvise(0x{:x}, 0x{:x}): {}",
+            hva,
+            len,
+            std::io::Error::last_os_error()
+        );
+    }
+}
+
+/// Called when the guest takes back `len` bytes of guest RAM at `hva`.
+fn reuse(hva: usize, len: usize) {
+    #[cfg(target_os = "macos")]
+    unsafe {
+        libc::madvise(hva as *mut libc::c_void, len, libc::MADV_FREE_REUSE);
+    }
+    #[cfg(not(target_os = "macos"))]
+    let _ = (hva, len);
+}
+
+/// Sorts `pfns` and merges them into runs of contiguous pages, as
+/// (first pfn, number of pages).
+fn pfn_runs(pfns: &mut Vec<u32>) -> Vec<(u64, u64)> {
+    pfns.sort_unstable();
+    pfns.dedup();
+    let mut runs: Vec<(u64, u64)> = Vec::new();
+    for &pfn in pfns.iter() {
+        match runs.last_mut() {
+            Some((start, n)) if *start + *n == pfn as u64 => *n += 1,
+            _ => runs.push((pfn as u64, 1)),
+        }
+    }
+    runs
+}
+
+/// The memory statistics a guest reported last. Memory sizes are in bytes,
+/// the others are counts since the guest booted.
+#[derive(Debug, Clone, Default)]
+pub struct BalloonStats {
+    values: [Option<u64>; VIRTIO_BALLOON_S_NR],
+    /// when the guest sent them
+    pub updated: Option<Instant>,
+}
+
+impl BalloonStats {
+    /// The statistic with tag `tag`, if the guest reported it.
+    pub fn get(&self, tag: u16) -> Option<u64> {
+        self.values.get(tag as usize).cloned().flatten()
+    }
+
+    /// Parses a buffer of statistics; tags we don't know are skipped.
+    fn parse(buf: &[u8]) -> Self {
+        let mut stats = BalloonStats {
+            updated: Some(Instant::now()),
+            ..Default::default()
+        };
+        for s in buf.chunks_exact(BALLOON_STAT_SIZE) {
+            let tag = u16::from_le_bytes([s[0], s[1]]) as usize;
+            let mut val = [0u8; 8];
+            val.copy_from_slice(&s[2..]);
+            if tag < VIRTIO_BALLOON_S_NR {
+                stats.values[tag] = Some(u64::from_le_bytes(val));
+            }
+        }
+        stats
+    }
+}
+
+/// The host side of a balloon: sets its target and tells how much memory
+/// it holds.
+pub struct Balloon {
+    /// pages the host wants in the balloon, `num_pages` in config space
+    target: AtomicU32,
+    /// pages the driver says are in the balloon, `actual` in config space
+    actual: AtomicU32,
+    /// pages released because the balloon was inflated
+    inflated: AtomicU64,
+    /// pages released because the guest reported them free
+    reported: AtomicU64,
+    /// how to raise a configuration change interrupt, once there is a device
+    irq: Mutex<Option<(u32, Sender<u32>, Arc<RwLock<u32>>)>>,
+    /// the features the driver accepted
+    features: AtomicU64,
+    stats: Mutex<BalloonStats>,
+    /// return the stats buffer the next time the stats queue is served
+    stats_wanted: AtomicBool,
+    /// wakes up the stats queue
+    stats_queue: Mutex<Option<TaskSender>>,
+}
+
+impl Balloon {
+    pub fn new() -> Arc<Self> {
+        Arc::new(Balloon {
+            target: AtomicU32::new(0),
+            actual: AtomicU32::new(0),
+            inflated: AtomicU64::new(0),
+            reported: AtomicU64::new(0),
+            irq: Mutex::new(None),
+            features: AtomicU64::new(0),
+            stats: Mutex::new(BalloonStats::default()),
+            stats_wanted: AtomicBool::new(false),
+            stats_queue: Mutex::new(None),
+        })
+    }
+
+    /// Asks the guest to grow or shrink the balloon to `pages` pages of
+    /// 4 KiB.
+    pub fn set_target(&self, pages: u32) {
+        if self.target.swap(pages, Ordering::AcqRel) == pages {
+            return;
+        }
+        if let Some((irq, irq_sender, isr)) = &*self.irq.lock().unwrap() {
+            *isr.write().unwrap() |= VIRTIO_INT_CONFIG;
+            irq_sender.send(*irq).unwrap();
+        }
+    }
+
+    pub fn target(&self) -> u32 {
+        self.target.load(Ordering::Acquire)
+    }
+
+    /// The number of pages in the balloon, as the guest reports it.
+    pub fn actual(&self) -> u32 {
+        self.actual.load(Ordering::Acquire)
+    }
+
+    /// The number of pages given up by inflating the balloon.
+    pub fn inflated_pages(&self) -> u64 {
+        self.inflated.load(Ordering::Relaxed)
+    }
+
+    /// The number of pages released through free page reporting, in total.
+    pub fn reported_pages(&self) -> u64 {
+        self.reported.load(Ordering::Relaxed)
+    }
+
+    /// The statistics the guest sent last.
+    pub fn stats(&self) -> BalloonStats {
+        self.stats.lock().unwrap().clone()
+    }
+
+    /// Asks the guest for fresh statistics. They show up in `stats()` once
+    /// the guest has sent them.
+    pub fn request_stats(&self) {
+        if self.features.load(Ordering::Acquire) & 1 << VIRTIO_BALLOON_F_STATS_VQ == 0 {
+            return;
+        }
+        self.stats_wanted.store(true, Ordering::Release);
+        if let Some(queue) = &*self.stats_queue.lock().unwrap() {
+            queue.send(Some(())).unwrap();
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum BalloonQueue {
+    Inflate,
+    Deflate,
+    Stats,
+    Reporting,
+    /// the third queue: the stats queue if the driver accepted
+    /// `VIRTIO_BALLOON_F_STATS_VQ`, otherwise the reporting queue
+    StatsOrReporting,
+}
+
+struct BalloonDescHandler {
+    queue: BalloonQueue,
+    balloon: Arc<Balloon>,
+    ram: Arc<RwLock<Vec<GuestRamRegion>>>,
+    /// position in the available ring of the stats buffer we hold
+    held: Option<u16>,
+}
+
+impl BalloonDescHandler {
+    fn role(&self) -> BalloonQueue {
+        match self.queue {
+            BalloonQueue::StatsOrReporting => {
+                let features = self.balloon.features.load(Ordering::Acquire);
+                if features & 1 << VIRTIO_BALLOON_F_STATS_VQ != 0 {
+                    BalloonQueue::Stats
+                } else {
+                    BalloonQueue::Reporting
+                }
+            }
+            queue => queue,
+        }
+    }
+
+    /// Takes the statistics from the buffer at position `index` and keeps the
+    /// buffer until they are asked for again. The driver only ever has one
+    /// buffer on the queue.
+    fn handle_stats(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        if self.held != Some(index) {
+            let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+            let readable = &desc_chain[..desc_chain.len() - writable_count];
+            let mut buf = vec![0u8; total_len(readable)];
+            gather(readable, &mut buf);
+            *self.balloon.stats.lock().unwrap() = BalloonStats::parse(&buf);
+            self.held = Some(index);
+        }
+        if self.balloon.stats_wanted.swap(false, Ordering::AcqRel) {
+            self.held = None;
+            vec![0]
+        } else {
+            vec![]
+        }
+    }
+
+    /// Inflates or deflates the balloon by the pages listed in the chain,
+    /// an array of le32 page frame numbers.
+    fn handle_pfns(&self, readable: &[(usize, usize)]) {
+        let mut buf = vec![0u8; total_len(readable)];
+        gather(readable, &mut buf);
+        let mut pfns: Vec<u32> = buf
+            .chunks_exact(4)
+            .map(|b| u32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+            .collect();
+        let ram = self.ram.read().unwrap();
+        let mut pages = 0;
+        for (pfn, n) in pfn_runs(&mut pfns) {
+            let gpa = pfn << VIRTIO_BALLOON_PFN_SHIFT;
+            let len = n * BALLOON_PAGE_SIZE;
+            let (hva, shared) = match guest_ram_hva(&ram, gpa, len) {
+                Some(r) => r,
+                None => {
+                    warn!("virtio-balloon: pages 0x{:x}+0x{:x} are not RAM", gpa, len);
+                    continue;
+                }
+            };
+            if self.queue == BalloonQueue::Inflate {
+                release(hva, len as usize, shared);
+            } else {
+                reuse(hva, len as usize);
+            }
+            pages += n;
+        }
+        if self.queue == BalloonQueue::Inflate {
+            self.balloon.inflated.fetch_add(pages, Ordering::Relaxed);
+        } else {
+            // the guest may deflate pages it never inflated after a reset
+            let inflated = &self.balloon.inflated;
+            let old = inflated.load(Ordering::Relaxed);
+            inflated.store(old.saturating_sub(pages), Ordering::Relaxed);
+        }
+        debug!("virtio-balloon: {:?} {} pages", self.queue, pages);
+    }
+
+    /// Releases the free blocks the guest reports. Each buffer of the chain
+    /// is one block of free guest memory; the guest keeps it, and may use it
+    /// again as soon as the chain is returned.
+    fn handle_report(&self, virtq: &Virtq<usize>, index: u16) {
+        let (blocks, _) = virtq.get_desc_chain(index, |gpa| gpa as usize);
+        let ram = self.ram.read().unwrap();
+        for (gpa, len) in blocks {
+            let (gpa, len) = (gpa as u64, len as u64);
+            // only whole pages can be released
+            let start = (gpa + BALLOON_PAGE_SIZE - 1) & !(BALLOON_PAGE_SIZE - 1);
+            let end = (gpa + len) & !(BALLOON_PAGE_SIZE - 1);
+            if end <= start {
+                continue;
+            }
+            match guest_ram_hva(&ram, start, end - start) {
+                Some((hva, shared)) => {
+                    release(hva, (end - start) as usize, shared);
+                    let pages = (end - start) / BALLOON_PAGE_SIZE;
+                    self.balloon.reported.fetch_add(pages, Ordering::Relaxed);
+                }
+                None => warn!(
+                    "virtio-balloon: reported block 0x{:x}+0x{:x} is not RAM",
+                    gpa, len
+                ),
+            }
+        }
+    }
+}
+
+impl VirtqDescHandle for BalloonDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        match self.role() {
+            BalloonQueue::Inflate | BalloonQueue::Deflate => {
+                let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+                let readable = &desc_chain[..desc_chain.len() - writable_count];
+                self.handle_pfns(readable);
+            }
+            _ => self.handle_report(virtq, index),
+        }
+        0
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        if self.role() == BalloonQueue::Stats {
+            return self.handle_stats(virtq, index, gpa2hva);
+        }
+        (0..count)
+            .map(|i| self.handle_desc_chain(virtq, index.wrapping_add(i), gpa2hva))
+            .collect()
+    }
+}
+
+/// virtio-balloon device's config space: le32 num_pages, le32 actual,
+/// le32 free_page_hint_cmd_id, le32 poison_val
+struct VirtioBalloonCfg {
+    balloon: Arc<Balloon>,
+    gen: u32,
+}
+
+impl VirtioDevCfg for VirtioBalloonCfg {
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        match (size, offset) {
+            (4, 0) => Some(self.balloon.target()),
+            (4, 4) => Some(self.balloon.actual()),
+            (4, 8) | (4, 12) => Some(0),
+            _ => None,
+        }
+    }
+
+    fn write(&mut self, offset: usize, size: u8, value: u32) -> Option<()> {
+        match (size, offset) {
+            (4, 4) => {
+                self.balloon.actual.store(value, Ordering::Release);
+                Some(())
+            }
+            _ => None,
+        }
+    }
+
+    fn reset(&mut self) {
+        self.balloon.actual.store(0, Ordering::Release);
+        self.balloon.features.store(0, Ordering::Release);
+        self.gen += 1;
+    }
+
+    fn features_ok(&mut self, features: u64) {
+        self.balloon.features.store(features, Ordering::Release);
+    }
+
+    fn generation(&self) -> u32 {
+        self.gen
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a virtio-balloon device for the guest RAM of `vm`, controlled
+    /// through `balloon`. With `deflate_on_oom`, the guest may deflate the
+    /// balloon when it runs out of memory.
+    pub fn new_balloon(
+        name: String,
+        irq: u32,
+        vm: &VirtualMachine,
+        balloon: &Arc<Balloon>,
+        deflate_on_oom: bool,
+    ) -> Self {
+        let isr = Arc::new(RwLock::new(0));
+        *balloon.irq.lock().unwrap() = Some((irq, vm.irq_sender.clone(), isr.clone()));
+        let queue = |queue: BalloonQueue, suffix: &str| {
+            VirtqManager::new(
+                format!("{}_{}", name, suffix),
+                128,
+                irq,
+                vm.irq_sender.clone(),
+                isr.clone(),
+                vm.gpa2hva.clone(),
+                BalloonDescHandler {
+                    queue,
+                    balloon: balloon.clone(),
+                    ram: vm.ram_regions.clone(),
+                    held: None,
+                },
+            )
+        };
+        // virtio-v1.1 5.5.2: the queues of features the driver did not
+        // accept are left out, and the ones after them move up. Without
+        // FREE_PAGE_HINT, the reporting queue directly follows the stats
+        // queue, or the deflate queue without STATS_VQ.
+        let vqs = vec![
+            queue(BalloonQueue::Inflate, "inflate"),
+            queue(BalloonQueue::Deflate, "deflate"),
+            queue(BalloonQueue::StatsOrReporting, "stats"),
+            queue(BalloonQueue::Reporting, "reporting"),
+        ];
+        *balloon.stats_queue.lock().unwrap() = Some(vqs[2].task_sender.clone());
+        let mut dev_feat = 1 << VIRTIO_F_VERSION_1
+            | 1 << VIRTIO_BALLOON_F_MUST_TELL_HOST
+            | 1 << VIRTIO_BALLOON_F_STATS_VQ
+            | 1 << VIRTIO_BALLOON_F_REPORTING;
+        if deflate_on_oom {
+            dev_feat |= 1 << VIRTIO_BALLOON_F_DEFLATE_ON_OOM;
+        }
+        VirtioDevice {
+            name,
+            dev_id: VirtioId::BalloonTraditional,
+            dev_feat,
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            vqs,
+            cfg: Box::new(VirtioBalloonCfg {
+                balloon: balloon.clone(),
+                gen: 0,
+            }),
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn pfn_runs_test() {
+        let mut pfns = vec![7, 3, 4, 5, 9, 4, 8];
+        assert_eq!(pfn_runs(&mut pfns), vec![(3, 3), (7, 3)]);
+        assert_eq!(pfn_runs(&mut vec![]), vec![]);
+    }
+
+    #[test]
+    fn balloon_stats_test() {
+        let mut buf = vec![];
+        for &(tag, val) in &[
+            (VIRTIO_BALLOON_S_MAJFLT, 7u64),
+            (VIRTIO_BALLOON_S_AVAIL, 1 << 30),
+            (42, 1),
+        ] {
+            buf.extend_from_slice(&u16::to_le_bytes(tag));
+            buf.extend_from_slice(&u64::to_le_bytes(val));
+        }
+        let stats = BalloonStats::parse(&buf);
+        assert_eq!(stats.get(VIRTIO_BALLOON_S_MAJFLT), Some(7));
+        assert_eq!(stats.get(VIRTIO_BALLOON_S_AVAIL), Some(1 << 30));
+        assert_eq!(stats.get(VIRTIO_BALLOON_S_MEMFREE), None);
+        assert_eq!(stats.get(42), None);
+    }
+
+    #[test]
+    fn guest_ram_hva_test() {
+        let ram = [
+            GuestRamRegion {
+                gpa: 0,
+                size: 0x10000,
+                hva: 0x7000_0000,
+                shared: false,
+            },
+            GuestRamRegion {
+                gpa: 0x1_0000_0000,
+                size: 0x10000,
+                hva: 0x1_0000_0000,
+                shared: true,
+            },
+        ];
+        assert_eq!(
+            guest_ram_hva(&ram, 0x1000, 0x1000),
+            Some((0x7000_1000, false))
+        );
+        assert_eq!(
+            guest_ram_hva(&ram, 0x1_0000_f000, 0x1000),
+            Some((0x1_0000_f000, true))
+        );
+        // straddles the end of a region
+        assert_eq!(guest_ram_hva(&ram, 0xf000, 0x2000), None);
+        assert_eq!(guest_ram_hva(&ram, 0x20000, 0x1000), None);
+        assert_eq!(guest_ram_hva(&ram, u64::MAX - 0xfff, 0x1000), None);
+    }
+}
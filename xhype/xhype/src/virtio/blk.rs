@@ -0,0 +1,372 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Implements a virtio block device on top of a [`DiskImage`].
+
+Besides plain reads and writes, the device supports `VIRTIO_BLK_T_DISCARD` and
+`VIRTIO_BLK_T_WRITE_ZEROES`. Neither of them moves any data between the guest
+and the host: a discard punches a hole into the image and a write-zeroes is
+turned into a zero-range or hole-punch request, see [`DiskImage`].
+*/
+
+use super::consts::*;
+use super::disk::{DiskImage, SECTOR_SIZE};
+use super::qos::IoThrottle;
+use super::virtq::*;
+use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
+#[allow(unused_imports)]
+use log::*;
+use std::mem::size_of;
+use std::slice;
+use std::sync::{Arc, RwLock};
+
+/// Maximum size of any single segment is in size_max.
+pub const VIRTIO_BLK_F_SIZE_MAX: u64 = 1;
+/// Maximum number of segments in a request is in seg_max.
+pub const VIRTIO_BLK_F_SEG_MAX: u64 = 2;
+/// Disk-style geometry specified in geometry.
+pub const VIRTIO_BLK_F_GEOMETRY: u64 = 4;
+/// Device is read-only.
+pub const VIRTIO_BLK_F_RO: u64 = 5;
+/// Block size of disk is in blk_size.
+pub const VIRTIO_BLK_F_BLK_SIZE: u64 = 6;
+/// Cache flush command support.
+pub const VIRTIO_BLK_F_FLUSH: u64 = 9;
+/// Device exports information on optimal I/O alignment.
+pub const VIRTIO_BLK_F_TOPOLOGY: u64 = 10;
+/// Device can toggle its cache between writeback and writethrough modes.
+pub const VIRTIO_BLK_F_CONFIG_WCE: u64 = 11;
+/// Device can support discard command.
+pub const VIRTIO_BLK_F_DISCARD: u64 = 13;
+/// Device can support write zeroes command.
+pub const VIRTIO_BLK_F_WRITE_ZEROES: u64 = 14;
+
+pub const VIRTIO_BLK_T_IN: u32 = 0;
+pub const VIRTIO_BLK_T_OUT: u32 = 1;
+pub const VIRTIO_BLK_T_FLUSH: u32 = 4;
+pub const VIRTIO_BLK_T_GET_ID: u32 = 8;
+pub const VIRTIO_BLK_T_DISCARD: u32 = 11;
+pub const VIRTIO_BLK_T_WRITE_ZEROES: u32 = 13;
+
+pub const VIRTIO_BLK_S_OK: u8 = 0;
+pub const VIRTIO_BLK_S_IOERR: u8 = 1;
+pub const VIRTIO_BLK_S_UNSUPP: u8 = 2;
+
+/// Length of the device ID string returned by `VIRTIO_BLK_T_GET_ID`.
+pub const VIRTIO_BLK_ID_BYTES: usize = 20;
+
+/// Set in the flags of a write-zeroes segment if the device may deallocate
+/// the range.
+pub const VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP: u32 = 1;
+
+const QUEUE_SIZE: u32 = 128;
+const MAX_DISCARD_SECTORS: u32 = u32::MAX;
+const MAX_DISCARD_SEG: u32 = 32;
+
+/// Header of every request, see virtio 1.1, 5.2.6 Device Operation
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioBlkReqHeader {
+    req_type: u32,
+    reserved: u32,
+    sector: u64,
+}
+
+/// Payload of `VIRTIO_BLK_T_DISCARD` and `VIRTIO_BLK_T_WRITE_ZEROES`
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioBlkDiscardWriteZeroes {
+    sector: u64,
+    num_sectors: u32,
+    flags: u32,
+}
+
+struct BlkDescHandler {
+    disk: Arc<dyn DiskImage>,
+    id: [u8; VIRTIO_BLK_ID_BYTES],
+    throttle: Option<Arc<IoThrottle>>,
+}
+
+impl BlkDescHandler {
+    fn check_range(&self, sector: u64, len: u64) -> Result<u64, u8> {
+        let offset = sector.checked_mul(SECTOR_SIZE).ok_or(VIRTIO_BLK_S_IOERR)?;
+        match offset.checked_add(len) {
+            Some(end) if end <= self.disk.size() => Ok(offset),
+            _ => {
+                warn!(
+                    "virtio-blk: sector 0x{:x} + 0x{:x} bytes is beyond the disk",
+                    sector, len
+                );
+                Err(VIRTIO_BLK_S_IOERR)
+            }
+        }
+    }
+
+    /// Reads from the disk directly into the guest buffers.
+    fn read(&self, sector: u64, data: &[(usize, usize)]) -> Result<u32, u8> {
+        let mut offset = self.check_range(sector, total_len(data) as u64)?;
+        for &(addr, len) in data {
+            let buf = unsafe { slice::from_raw_parts_mut(addr as *mut u8, len) };
+            self.disk.read_at(buf, offset).map_err(|e| {
+                error!("virtio-blk: read at 0x{:x}: {}", offset, e);
+                VIRTIO_BLK_S_IOERR
+            })?;
+            offset += len as u64;
+        }
+        Ok(total_len(data) as u32)
+    }
+
+    /// Writes the guest buffers directly to the disk.
+    fn write(&self, sector: u64, data: &[(usize, usize)]) -> Result<u32, u8> {
+        if self.disk.read_only() {
+            return Err(VIRTIO_BLK_S_IOERR);
+        }
+        let mut offset = self.check_range(sector, total_len(data) as u64)?;
+        for &(addr, len) in data {
+            let buf = unsafe { slice::from_raw_parts(addr as *const u8, len) };
+            self.disk.write_at(buf, offset).map_err(|e| {
+                error!("virtio-blk: write at 0x{:x}: {}", offset, e);
+                VIRTIO_BLK_S_IOERR
+            })?;
+            offset += len as u64;
+        }
+        Ok(0)
+    }
+
+    fn get_id(&self, data: &[(usize, usize)]) -> Result<u32, u8> {
+        Ok(scatter(data, &self.id) as u32)
+    }
+
+    /// Handles `VIRTIO_BLK_T_DISCARD` and `VIRTIO_BLK_T_WRITE_ZEROES`, whose
+    /// payload is a list of ranges instead of data.
+    fn discard_or_zero(&self, req_type: u32, segs: &[(usize, usize)]) -> Result<u32, u8> {
+        if self.disk.read_only() {
+            return Err(VIRTIO_BLK_S_IOERR);
+        }
+        let seg_size = size_of::<VirtioBlkDiscardWriteZeroes>();
+        let num_segs = total_len(segs) / seg_size;
+        if num_segs == 0 || num_segs > MAX_DISCARD_SEG as usize {
+            return Err(VIRTIO_BLK_S_UNSUPP);
+        }
+        for i in 0..num_segs {
+            let seg: VirtioBlkDiscardWriteZeroes = read_pod(segs, i * seg_size).unwrap();
+            let (sector, num_sectors, flags) = (seg.sector, seg.num_sectors, seg.flags);
+            if flags & !VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP != 0 {
+                return Err(VIRTIO_BLK_S_UNSUPP);
+            }
+            let len = num_sectors as u64 * SECTOR_SIZE;
+            let offset = self.check_range(sector, len)?;
+            let result = if req_type == VIRTIO_BLK_T_DISCARD {
+                // virtio 1.1, 5.2.6.2: the unmap flag is reserved for discard
+                if flags != 0 {
+                    return Err(VIRTIO_BLK_S_UNSUPP);
+                }
+                self.disk.discard(offset, len)
+            } else {
+                let unmap = flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP != 0;
+                self.disk.write_zeroes(offset, len, unmap)
+            };
+            result.map_err(|e| {
+                error!(
+                    "virtio-blk: request {} at 0x{:x}, 0x{:x} bytes: {}",
+                    req_type, offset, len, e
+                );
+                VIRTIO_BLK_S_IOERR
+            })?;
+        }
+        Ok(0)
+    }
+}
+
+impl VirtqDescHandle for BlkDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+        let (readable, writable) = desc_chain.split_at(desc_chain.len() - writable_count);
+        // the last writable byte is the status, see virtio 1.1, 5.2.6
+        let writable_len = total_len(writable);
+        if writable_len == 0 {
+            error!("virtio-blk: request without a status byte");
+            return 0;
+        }
+        let status_addr = sub_regions(writable, writable_len - 1, 1)[0].0;
+        let header_size = size_of::<VirtioBlkReqHeader>();
+        let result = match read_pod::<VirtioBlkReqHeader>(readable, 0) {
+            None => Err(VIRTIO_BLK_S_IOERR),
+            Some(header) => {
+                let payload = sub_regions(readable, header_size, usize::MAX);
+                let data = sub_regions(writable, 0, writable_len - 1);
+                let sector = header.sector;
+                if let Some(throttle) = self.throttle.as_ref() {
+                    let bytes = match header.req_type {
+                        VIRTIO_BLK_T_IN => total_len(&data),
+                        VIRTIO_BLK_T_OUT => total_len(&payload),
+                        _ => 0,
+                    };
+                    throttle.admit(0, bytes as u64);
+                }
+                match header.req_type {
+                    VIRTIO_BLK_T_IN => self.read(sector, &data),
+                    VIRTIO_BLK_T_OUT => self.write(sector, &payload),
+                    VIRTIO_BLK_T_FLUSH => self.disk.flush().map(|_| 0).map_err(|e| {
+                        error!("virtio-blk: flush: {}", e);
+                        VIRTIO_BLK_S_IOERR
+                    }),
+                    VIRTIO_BLK_T_GET_ID => self.get_id(&data),
+                    t @ VIRTIO_BLK_T_DISCARD | t @ VIRTIO_BLK_T_WRITE_ZEROES => {
+                        self.discard_or_zero(t, &payload)
+                    }
+                    t => {
+                        warn!("virtio-blk: unsupported request type {}", t);
+                        Err(VIRTIO_BLK_S_UNSUPP)
+                    }
+                }
+            }
+        };
+        let (status, len) = match result {
+            Ok(len) => (VIRTIO_BLK_S_OK, len),
+            Err(status) => (status, 0),
+        };
+        unsafe { (status_addr as *mut u8).write(status) };
+        len + 1
+    }
+}
+
+/// virtio-blk device's config space, see virtio 1.1, 5.2.4 Device configuration layout
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioBlkCfgLayout {
+    capacity: u64,
+    size_max: u32,
+    seg_max: u32,
+    cylinders: u16,
+    heads: u8,
+    sectors: u8,
+    blk_size: u32,
+    physical_block_exp: u8,
+    alignment_offset: u8,
+    min_io_size: u16,
+    opt_io_size: u32,
+    writeback: u8,
+    unused0: [u8; 3],
+    max_discard_sectors: u32,
+    max_discard_seg: u32,
+    discard_sector_alignment: u32,
+    max_write_zeroes_sectors: u32,
+    max_write_zeroes_seg: u32,
+    write_zeroes_may_unmap: u8,
+    unused1: [u8; 3],
+}
+
+pub struct VirtioBlkCfg {
+    layout: VirtioBlkCfgLayout,
+    gen: u32,
+}
+
+impl VirtioDevCfg for VirtioBlkCfg {
+    fn write(&mut self, _offset: usize, _size: u8, _value: u32) -> Option<()> {
+        // writeback is only writable if VIRTIO_BLK_F_CONFIG_WCE is offered
+        None
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        let bytes = unsafe {
+            slice::from_raw_parts(
+                &self.layout as *const VirtioBlkCfgLayout as *const u8,
+                size_of::<VirtioBlkCfgLayout>(),
+            )
+        };
+        let field = bytes.get(offset..offset + size as usize)?;
+        match size {
+            1 => Some(field[0] as u32),
+            2 => Some(u16::from_le_bytes([field[0], field[1]]) as u32),
+            4 => Some(u32::from_le_bytes([field[0], field[1], field[2], field[3]])),
+            _ => None,
+        }
+    }
+
+    fn reset(&mut self) {
+        self.gen += 1;
+    }
+
+    fn generation(&self) -> u32 {
+        self.gen
+    }
+}
+
+impl VirtioDevice {
+    pub fn new_blk(
+        name: String,
+        irq: u32,
+        irq_sender: Sender<u32>,
+        gpa2hva: AddressConverter,
+        disk: Arc<dyn DiskImage>,
+        throttle: Option<Arc<IoThrottle>>,
+    ) -> Self {
+        let discard_alignment = (super::disk::DISCARD_ALIGNMENT / SECTOR_SIZE) as u32;
+        let layout = VirtioBlkCfgLayout {
+            capacity: disk.size() / SECTOR_SIZE,
+            seg_max: QUEUE_SIZE - 2,
+            blk_size: SECTOR_SIZE as u32,
+            max_discard_sectors: MAX_DISCARD_SECTORS,
+            max_discard_seg: MAX_DISCARD_SEG,
+            discard_sector_alignment: discard_alignment,
+            max_write_zeroes_sectors: MAX_DISCARD_SECTORS,
+            max_write_zeroes_seg: MAX_DISCARD_SEG,
+            write_zeroes_may_unmap: 1,
+            ..Default::default()
+        };
+        let mut dev_feat = (1 << VIRTIO_F_VERSION_1)
+            | (1 << VIRTIO_BLK_F_SEG_MAX)
+            | (1 << VIRTIO_BLK_F_BLK_SIZE)
+            | (1 << VIRTIO_BLK_F_FLUSH);
+        if disk.read_only() {
+            dev_feat |= 1 << VIRTIO_BLK_F_RO;
+        } else {
+            dev_feat |= (1 << VIRTIO_BLK_F_DISCARD) | (1 << VIRTIO_BLK_F_WRITE_ZEROES);
+        }
+        let mut id = [0u8; VIRTIO_BLK_ID_BYTES];
+        let id_len = std::cmp::min(name.len(), VIRTIO_BLK_ID_BYTES);
+        id[..id_len].copy_from_slice(&name.as_bytes()[..id_len]);
+        let isr = Arc::new(RwLock::new(0));
+        let req_q = VirtqManager::new(
+            format!("{}_req", name),
+            QUEUE_SIZE,
+            irq,
+            irq_sender,
+            isr.clone(),
+            gpa2hva.clone(),
+            BlkDescHandler { disk, id, throttle },
+        );
+        let vqs = vec![req_q];
+        VirtioDevice {
+            name,
+            dev_id: VirtioId::Block,
+            dev_feat,
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            vqs,
+            cfg: Box::new(VirtioBlkCfg { layout, gen: 0 }),
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    #[test]
+    fn blk_struct_size_test() {
+        assert_eq!(size_of::<VirtioBlkReqHeader>(), 16);
+        assert_eq!(size_of::<VirtioBlkDiscardWriteZeroes>(), 16);
+        assert_eq!(size_of::<VirtioBlkCfgLayout>(), 60);
+    }
+}
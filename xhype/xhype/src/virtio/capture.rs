@@ -0,0 +1,375 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Packet capture on the queues of virtio-net devices, written as pcapng.
+
+Each queue has a [`QueueTap`]. While a capture is on, the queue's service
+thread copies the first `snaplen` bytes of every frame into a ring of its
+own. That thread is the ring's only writer, so it needs no lock. A writer
+thread drains the rings into a pcapng file with one interface per queue. When
+a ring is full, records are dropped, never frames.
+
+While a capture is off, a tap costs one load of a flag and one branch, so the
+taps stay in production builds. Captures are started and stopped at any time
+with [`PacketCapture::start()`] and [`PacketCapture::stop()`].
+*/
+
+use super::virtq::sub_regions;
+use crate::err::Error;
+#[allow(unused_imports)]
+use log::*;
+use std::cell::UnsafeCell;
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread::JoinHandle;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+/// Bytes of the ring of each queue
+const TAP_RING_SIZE: usize = 1 << 20;
+/// timestamp (u64), original length (u32) and captured length (u32)
+const RECORD_HDR_SIZE: usize = 16;
+/// How long the writer thread sleeps when all rings are empty
+const WRITER_IDLE: Duration = Duration::from_millis(10);
+
+const PCAPNG_SHB: u32 = 0x0a0d0d0a;
+const PCAPNG_IDB: u32 = 0x00000001;
+const PCAPNG_EPB: u32 = 0x00000006;
+const PCAPNG_BYTE_ORDER_MAGIC: u32 = 0x1a2b3c4d;
+const PCAPNG_OPT_IF_NAME: u16 = 2;
+const PCAPNG_OPT_IF_TSRESOL: u16 = 9;
+const LINKTYPE_ETHERNET: u16 = 1;
+
+fn round_up(n: usize, align: usize) -> usize {
+    (n + align - 1) / align * align
+}
+
+/// A single-producer, single-consumer ring of variable-sized records.
+struct TapRing {
+    buf: Box<[UnsafeCell<u8>]>,
+    /// bytes ever written, advanced by the producer
+    head: AtomicUsize,
+    /// bytes ever consumed, advanced by the consumer
+    tail: AtomicUsize,
+    /// records dropped because the ring was full
+    dropped: AtomicU64,
+}
+
+// the producer and the consumer never touch the same bytes at the same time:
+// `head` and `tail` hand bytes over with release/acquire ordering
+unsafe impl Sync for TapRing {}
+
+impl TapRing {
+    fn new(size: usize) -> Self {
+        TapRing {
+            buf: (0..size).map(|_| UnsafeCell::new(0)).collect(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            dropped: AtomicU64::new(0),
+        }
+    }
+
+    /// Copies `len` bytes from `src` to byte `pos` of the ring, wrapping
+    /// around at its end.
+    unsafe fn write_at(&self, pos: usize, src: *const u8, len: usize) {
+        let base = self.buf.as_ptr() as *mut u8;
+        let start = pos % self.buf.len();
+        let first = std::cmp::min(len, self.buf.len() - start);
+        std::ptr::copy_nonoverlapping(src, base.add(start), first);
+        std::ptr::copy_nonoverlapping(src.add(first), base, len - first);
+    }
+
+    unsafe fn read_at(&self, pos: usize, dst: &mut [u8]) {
+        let base = self.buf.as_ptr() as *const u8;
+        let start = pos % self.buf.len();
+        let first = std::cmp::min(dst.len(), self.buf.len() - start);
+        std::ptr::copy_nonoverlapping(base.add(start), dst.as_mut_ptr(), first);
+        std::ptr::copy_nonoverlapping(base, dst.as_mut_ptr().add(first), dst.len() - first);
+    }
+
+    /// Appends a record of the first `snaplen` bytes of the frame of `len`
+    /// bytes in `regions`. Called by the producer only.
+    fn push(&self, timestamp: u64, regions: &[(usize, usize)], len: usize, snaplen: usize) {
+        let cap = std::cmp::min(len, snaplen);
+        let size = RECORD_HDR_SIZE + round_up(cap, 8);
+        let head = self.head.load(Ordering::Relaxed);
+        let tail = self.tail.load(Ordering::Acquire);
+        if size > self.buf.len() - head.wrapping_sub(tail) {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+        let mut hdr = [0u8; RECORD_HDR_SIZE];
+        hdr[..8].copy_from_slice(&timestamp.to_le_bytes());
+        hdr[8..12].copy_from_slice(&(len as u32).to_le_bytes());
+        hdr[12..].copy_from_slice(&(cap as u32).to_le_bytes());
+        let mut pos = head.wrapping_add(RECORD_HDR_SIZE);
+        unsafe {
+            self.write_at(head, hdr.as_ptr(), RECORD_HDR_SIZE);
+            for (addr, n) in sub_regions(regions, 0, cap) {
+                self.write_at(pos, addr as *const u8, n);
+                pos = pos.wrapping_add(n);
+            }
+        }
+        self.head.store(head.wrapping_add(size), Ordering::Release);
+    }
+
+    /// Takes the oldest record, puts its captured bytes into `data` and
+    /// returns its timestamp and original length. Called by the consumer only.
+    fn pop(&self, data: &mut Vec<u8>) -> Option<(u64, u32)> {
+        let tail = self.tail.load(Ordering::Relaxed);
+        if tail == self.head.load(Ordering::Acquire) {
+            return None;
+        }
+        let mut hdr = [0u8; RECORD_HDR_SIZE];
+        let mut word = [0u8; 4];
+        let mut timestamp = [0u8; 8];
+        unsafe { self.read_at(tail, &mut hdr) };
+        timestamp.copy_from_slice(&hdr[..8]);
+        word.copy_from_slice(&hdr[8..12]);
+        let len = u32::from_le_bytes(word);
+        word.copy_from_slice(&hdr[12..]);
+        let cap = u32::from_le_bytes(word) as usize;
+        data.resize(cap, 0);
+        unsafe { self.read_at(tail.wrapping_add(RECORD_HDR_SIZE), data) };
+        let size = RECORD_HDR_SIZE + round_up(cap, 8);
+        self.tail.store(tail.wrapping_add(size), Ordering::Release);
+        Some((u64::from_le_bytes(timestamp), len))
+    }
+
+    /// Discards all records. Only called while there is no consumer.
+    fn clear(&self) {
+        let head = self.head.load(Ordering::Acquire);
+        self.tail.store(head, Ordering::Release);
+        self.dropped.store(0, Ordering::Relaxed);
+    }
+}
+
+fn write_block(out: &mut impl Write, block_type: u32, body: &[u8]) -> io::Result<()> {
+    let padded = round_up(body.len(), 4);
+    let total = (12 + padded) as u32;
+    out.write_all(&block_type.to_le_bytes())?;
+    out.write_all(&total.to_le_bytes())?;
+    out.write_all(body)?;
+    out.write_all(&[0u8; 3][..padded - body.len()])?;
+    out.write_all(&total.to_le_bytes())
+}
+
+fn push_option(body: &mut Vec<u8>, code: u16, value: &[u8]) {
+    body.extend_from_slice(&code.to_le_bytes());
+    body.extend_from_slice(&(value.len() as u16).to_le_bytes());
+    body.extend_from_slice(value);
+    body.resize(round_up(body.len(), 4), 0);
+}
+
+fn write_header(out: &mut impl Write, names: &[String], snaplen: usize) -> io::Result<()> {
+    let mut shb = PCAPNG_BYTE_ORDER_MAGIC.to_le_bytes().to_vec();
+    // version 1.0, section length unknown
+    shb.extend_from_slice(&1u16.to_le_bytes());
+    shb.extend_from_slice(&0u16.to_le_bytes());
+    shb.extend_from_slice(&(-1i64).to_le_bytes());
+    write_block(out, PCAPNG_SHB, &shb)?;
+    for name in names {
+        let mut idb = LINKTYPE_ETHERNET.to_le_bytes().to_vec();
+        idb.extend_from_slice(&0u16.to_le_bytes());
+        idb.extend_from_slice(&(snaplen as u32).to_le_bytes());
+        push_option(&mut idb, PCAPNG_OPT_IF_NAME, name.as_bytes());
+        // timestamps in nanoseconds
+        push_option(&mut idb, PCAPNG_OPT_IF_TSRESOL, &[9]);
+        push_option(&mut idb, 0, &[]);
+        write_block(out, PCAPNG_IDB, &idb)?;
+    }
+    Ok(())
+}
+
+fn write_packet(
+    out: &mut impl Write,
+    interface: u32,
+    timestamp: u64,
+    len: u32,
+    data: &[u8],
+) -> io::Result<()> {
+    let mut epb = Vec::with_capacity(20 + data.len());
+    epb.extend_from_slice(&interface.to_le_bytes());
+    epb.extend_from_slice(&((timestamp >> 32) as u32).to_le_bytes());
+    epb.extend_from_slice(&(timestamp as u32).to_le_bytes());
+    epb.extend_from_slice(&(data.len() as u32).to_le_bytes());
+    epb.extend_from_slice(&len.to_le_bytes());
+    epb.extend_from_slice(data);
+    write_block(out, PCAPNG_EPB, &epb)
+}
+
+/// Drains `rings` into `out` until `stop` is set and the rings are empty.
+fn write_pcapng(mut out: BufWriter<File>, rings: Vec<Arc<TapRing>>, stop: Arc<AtomicBool>) {
+    let mut data = Vec::new();
+    loop {
+        let stopping = stop.load(Ordering::Acquire);
+        let mut idle = true;
+        for (interface, ring) in rings.iter().enumerate() {
+            while let Some((timestamp, len)) = ring.pop(&mut data) {
+                idle = false;
+                if let Err(e) = write_packet(&mut out, interface as u32, timestamp, len, &data) {
+                    error!("packet capture: {}", e);
+                    return;
+                }
+            }
+        }
+        if idle {
+            if let Err(e) = out.flush() {
+                error!("packet capture: {}", e);
+                return;
+            }
+            if stopping {
+                break;
+            }
+            std::thread::sleep(WRITER_IDLE);
+        }
+    }
+    let dropped: u64 = rings
+        .iter()
+        .map(|r| r.dropped.load(Ordering::Relaxed))
+        .sum();
+    if dropped > 0 {
+        warn!("packet capture: {} records dropped", dropped);
+    }
+}
+
+/// A packet capture on a set of queues
+pub struct PacketCapture {
+    enabled: AtomicBool,
+    snaplen: AtomicUsize,
+    /// the name and the ring of every tapped queue
+    rings: Mutex<Vec<(String, Arc<TapRing>)>>,
+    /// the stop flag and the writer thread of a running capture
+    writer: Mutex<Option<(Arc<AtomicBool>, JoinHandle<()>)>>,
+}
+
+impl PacketCapture {
+    pub fn new() -> Arc<Self> {
+        Arc::new(PacketCapture {
+            enabled: AtomicBool::new(false),
+            snaplen: AtomicUsize::new(0),
+            rings: Mutex::new(Vec::new()),
+            writer: Mutex::new(None),
+        })
+    }
+
+    /// Creates the tap of the queue `name`. Queues tapped while a capture is
+    /// running join the next one.
+    pub fn tap(self: &Arc<Self>, name: String) -> QueueTap {
+        let ring = Arc::new(TapRing::new(TAP_RING_SIZE));
+        self.rings.lock().unwrap().push((name, ring.clone()));
+        QueueTap {
+            capture: self.clone(),
+            ring,
+        }
+    }
+
+    /// Starts capturing the first `snaplen` bytes of every frame into the
+    /// pcapng file `path`, replacing a running capture.
+    pub fn start(&self, path: impl AsRef<Path>, snaplen: usize) -> Result<(), Error> {
+        self.stop();
+        let mut writer = self.writer.lock().unwrap();
+        let rings = self.rings.lock().unwrap();
+        let names: Vec<String> = rings.iter().map(|(name, _)| name.clone()).collect();
+        let mut out = BufWriter::new(File::create(path)?);
+        write_header(&mut out, &names, snaplen)?;
+        let rings: Vec<Arc<TapRing>> = rings.iter().map(|(_, ring)| ring.clone()).collect();
+        for ring in rings.iter() {
+            ring.clear();
+        }
+        let stop = Arc::new(AtomicBool::new(false));
+        let writer_stop = stop.clone();
+        let handle = std::thread::Builder::new()
+            .name("packet_capture".into())
+            .spawn(move || write_pcapng(out, rings, writer_stop))?;
+        *writer = Some((stop, handle));
+        self.snaplen.store(snaplen, Ordering::Relaxed);
+        self.enabled.store(true, Ordering::Release);
+        Ok(())
+    }
+
+    /// Stops a running capture and writes out the frames captured so far.
+    pub fn stop(&self) {
+        self.enabled.store(false, Ordering::Release);
+        if let Some((stop, handle)) = self.writer.lock().unwrap().take() {
+            stop.store(true, Ordering::Release);
+            let _ = handle.join();
+        }
+    }
+
+    pub fn is_on(&self) -> bool {
+        self.enabled.load(Ordering::Relaxed)
+    }
+}
+
+/// The tap of one queue, used by the queue's service thread only.
+pub struct QueueTap {
+    capture: Arc<PacketCapture>,
+    ring: Arc<TapRing>,
+}
+
+impl QueueTap {
+    #[inline(always)]
+    pub fn is_on(&self) -> bool {
+        self.capture.enabled.load(Ordering::Relaxed)
+    }
+
+    /// Records the frame of `len` bytes in the buffers `regions`. Callers
+    /// check [`is_on()`](#method.is_on) first.
+    #[cold]
+    pub fn record(&self, regions: &[(usize, usize)], len: usize) {
+        let timestamp = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map(|d| d.as_nanos() as u64)
+            .unwrap_or(0);
+        let snaplen = self.capture.snaplen.load(Ordering::Relaxed);
+        self.ring.push(timestamp, regions, len, snaplen);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn tap_ring_test() {
+        let ring = TapRing::new(64);
+        let frame: Vec<u8> = (0..40).collect();
+        let regions = [
+            (frame.as_ptr() as usize, 10),
+            (frame.as_ptr() as usize + 10, 30),
+        ];
+        let mut data = Vec::new();
+        // records of 16 + 24 bytes wrap around the ring of 64 bytes
+        for i in 0..5 {
+            ring.push(i, &regions, frame.len(), 20);
+            assert_eq!(ring.pop(&mut data), Some((i, 40)));
+            assert_eq!(data, &frame[..20]);
+        }
+        assert_eq!(ring.pop(&mut data), None);
+        ring.push(0, &regions, frame.len(), 40);
+        ring.push(1, &regions, frame.len(), 40);
+        assert_eq!(ring.dropped.load(Ordering::Relaxed), 1);
+        assert_eq!(ring.pop(&mut data), Some((0, 40)));
+        assert_eq!(data, frame);
+    }
+
+    #[test]
+    fn pcapng_block_test() {
+        let mut out = Vec::new();
+        write_packet(&mut out, 1, 0x1_0000_0002, 60, &[0xaa; 5]).unwrap();
+        // 12 bytes of framing, 20 bytes of fields, 5 bytes of data padded to 8
+        assert_eq!(out.len(), 40);
+        assert_eq!(out[4..8], 40u32.to_le_bytes());
+        assert_eq!(out[36..40], 40u32.to_le_bytes());
+        // interface, then the high and the low half of the timestamp
+        assert_eq!(out[8..12], 1u32.to_le_bytes());
+        assert_eq!(out[12..16], 1u32.to_le_bytes());
+        assert_eq!(out[16..20], 2u32.to_le_bytes());
+        let mut header = Vec::new();
+        write_header(&mut header, &["rx0".into()], 128).unwrap();
+        // SHB of 28 bytes, IDB of 20 + 8 (name) + 8 (tsresol) + 4 (end) bytes
+        assert_eq!(header.len(), 28 + 40);
+    }
+}
@@ -0,0 +1,358 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! A read-only disk image made of independently compressed chunks.
+
+The disk is cut into chunks of `chunk_size` bytes and every chunk is
+compressed with [LZ4](crate::lz4) on its own, so any sector can be read by
+decompressing a single chunk. The file layout is, all integers little-endian:
+
+```text
+offset  size            content
+0       8               magic, "XHZIMG01"
+8       4               version, 1
+12      4               chunk_size, a power of two in [4 KiB, 4 MiB]
+16      8               size of the disk in bytes
+24      8               number of chunks, n
+32      8 * (n + 1)     index: chunk i is stored at [index[i], index[i + 1])
+...                     chunk data
+```
+
+A chunk whose stored length is 0 is all zeros; a chunk whose stored length
+equals its decompressed length is stored uncompressed; any other chunk is an
+LZ4 block.
+
+Decompressed chunks are kept in a bounded LRU cache. Since a [`DiskImage`] is
+shared by all virtqueues of a device, so is the cache.
+*/
+
+use super::disk::{DiskImage, SECTOR_SIZE};
+use crate::lz4;
+#[allow(unused_imports)]
+use log::*;
+use std::collections::{BTreeMap, HashMap};
+use std::fs::File;
+use std::io::{self, Read, Seek, SeekFrom, Write};
+use std::os::unix::fs::FileExt;
+use std::sync::{Arc, Mutex};
+
+pub const COMPRESSED_IMAGE_MAGIC: &[u8; 8] = b"XHZIMG01";
+const VERSION: u32 = 1;
+const HEADER_SIZE: u64 = 32;
+pub const DEFAULT_CHUNK_SIZE: u32 = 64 * 1024;
+/// Default size of the decompressed-chunk cache in bytes.
+pub const DEFAULT_CACHE_SIZE: usize = 64 << 20;
+
+fn invalid(msg: String) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+/// An LRU cache of decompressed chunks.
+struct ChunkCache {
+    capacity: usize,
+    clock: u64,
+    /// chunk index -> (data, time of last use)
+    chunks: HashMap<u64, (Arc<Vec<u8>>, u64)>,
+    /// time of last use -> chunk index, the first entry is the LRU chunk
+    lru: BTreeMap<u64, u64>,
+}
+
+impl ChunkCache {
+    fn new(capacity: usize) -> Self {
+        ChunkCache {
+            capacity: std::cmp::max(capacity, 1),
+            clock: 0,
+            chunks: HashMap::with_capacity(capacity),
+            lru: BTreeMap::new(),
+        }
+    }
+
+    fn get(&mut self, index: u64) -> Option<Arc<Vec<u8>>> {
+        let clock = self.clock + 1;
+        let (data, last_use) = self.chunks.get_mut(&index)?;
+        self.lru.remove(last_use);
+        self.lru.insert(clock, index);
+        *last_use = clock;
+        self.clock = clock;
+        Some(data.clone())
+    }
+
+    fn insert(&mut self, index: u64, data: Arc<Vec<u8>>) {
+        if self.chunks.contains_key(&index) {
+            // another queue decompressed the same chunk in the meantime
+            return;
+        }
+        if self.chunks.len() >= self.capacity {
+            let (&oldest, &victim) = self.lru.iter().next().unwrap();
+            self.lru.remove(&oldest);
+            self.chunks.remove(&victim);
+        }
+        self.clock += 1;
+        self.lru.insert(self.clock, index);
+        self.chunks.insert(index, (data, self.clock));
+    }
+}
+
+pub struct CompressedImage {
+    file: File,
+    chunk_size: u64,
+    size: u64,
+    index: Vec<u64>,
+    cache: Mutex<ChunkCache>,
+}
+
+impl CompressedImage {
+    /// Opens a compressed image and caches up to `cache_size` bytes of
+    /// decompressed chunks.
+    pub fn open(path: &str, cache_size: usize) -> io::Result<Self> {
+        let file = File::open(path)?;
+        let file_len = file.metadata()?.len();
+        let mut header = [0u8; HEADER_SIZE as usize];
+        file.read_exact_at(&mut header, 0)?;
+        let u32_at =
+            |i: usize| u32::from_le_bytes([header[i], header[i + 1], header[i + 2], header[i + 3]]);
+        let u64_at = |i: usize| u32_at(i) as u64 | (u32_at(i + 4) as u64) << 32;
+        if &header[0..8] != COMPRESSED_IMAGE_MAGIC || u32_at(8) != VERSION {
+            return Err(invalid(format!("{} is not a compressed image", path)));
+        }
+        let chunk_size = u32_at(12) as u64;
+        let size = u64_at(16);
+        let num_chunks = u64_at(24);
+        if !chunk_size.is_power_of_two() || chunk_size < 4096 || chunk_size > 4 << 20 {
+            return Err(invalid(format!("bad chunk size 0x{:x}", chunk_size)));
+        }
+        let chunks_needed = size / chunk_size + (size % chunk_size != 0) as u64;
+        if size % SECTOR_SIZE != 0 || num_chunks != chunks_needed {
+            return Err(invalid(format!(
+                "{} chunks cannot hold 0x{:x} bytes",
+                num_chunks, size
+            )));
+        }
+        // the header is not trusted with the size of the index until the
+        // file is known to hold it
+        let index_end = num_chunks
+            .checked_add(1)
+            .and_then(|n| n.checked_mul(8))
+            .and_then(|n| n.checked_add(HEADER_SIZE));
+        match index_end {
+            Some(end) if end <= file_len => {}
+            _ => return Err(invalid(format!("truncated chunk index in {}", path))),
+        }
+        let mut raw_index = vec![0u8; 8 * (num_chunks as usize + 1)];
+        file.read_exact_at(&mut raw_index, HEADER_SIZE)?;
+        let index: Vec<u64> = raw_index
+            .chunks(8)
+            .map(|b| u64::from_le_bytes([b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]]))
+            .collect();
+        let data_start = HEADER_SIZE + raw_index.len() as u64;
+        if index[0] < data_start
+            || index.windows(2).any(|w| w[0] > w[1])
+            || index[num_chunks as usize] > file_len
+        {
+            return Err(invalid(format!("corrupted chunk index in {}", path)));
+        }
+        Ok(CompressedImage {
+            file,
+            chunk_size,
+            size,
+            index,
+            cache: Mutex::new(ChunkCache::new(cache_size / chunk_size as usize)),
+        })
+    }
+
+    /// Converts the raw disk image `src` to a compressed image `dst`.
+    pub fn create(src: &str, dst: &str, chunk_size: u32) -> io::Result<()> {
+        assert!(chunk_size.is_power_of_two() && chunk_size >= 4096 && chunk_size <= 4 << 20);
+        let mut input = File::open(src)?;
+        let size = input.metadata()?.len();
+        if size % SECTOR_SIZE != 0 {
+            return Err(invalid(format!(
+                "size of {} is not a multiple of {}",
+                src, SECTOR_SIZE
+            )));
+        }
+        let num_chunks = (size + chunk_size as u64 - 1) / chunk_size as u64;
+        let mut output = File::create(dst)?;
+        let mut header = Vec::with_capacity(HEADER_SIZE as usize);
+        header.extend_from_slice(COMPRESSED_IMAGE_MAGIC);
+        header.extend_from_slice(&VERSION.to_le_bytes());
+        header.extend_from_slice(&chunk_size.to_le_bytes());
+        header.extend_from_slice(&size.to_le_bytes());
+        header.extend_from_slice(&num_chunks.to_le_bytes());
+        output.write_all(&header)?;
+        let mut offset = HEADER_SIZE + 8 * (num_chunks + 1);
+        output.seek(SeekFrom::Start(offset))?;
+        let mut index = Vec::with_capacity(num_chunks as usize + 1);
+        let mut chunk = vec![0u8; chunk_size as usize];
+        let mut compressed = Vec::with_capacity(lz4::compress_bound(chunk.len()));
+        for i in 0..num_chunks {
+            let len = std::cmp::min(chunk_size as u64, size - i * chunk_size as u64) as usize;
+            input.read_exact(&mut chunk[..len])?;
+            index.push(offset);
+            if chunk[..len].iter().all(|&b| b == 0) {
+                continue;
+            }
+            compressed.clear();
+            lz4::compress(&chunk[..len], &mut compressed);
+            let stored = if compressed.len() < len {
+                &compressed[..]
+            } else {
+                &chunk[..len]
+            };
+            output.write_all(stored)?;
+            offset += stored.len() as u64;
+        }
+        index.push(offset);
+        let raw_index: Vec<u8> = index
+            .iter()
+            .flat_map(|o| o.to_le_bytes().to_vec())
+            .collect();
+        output.write_all_at(&raw_index, HEADER_SIZE)?;
+        output.sync_all()
+    }
+
+    /// Returns the decompressed content of chunk `i`, which is not all zeros.
+    fn chunk(&self, i: u64) -> io::Result<Arc<Vec<u8>>> {
+        if let Some(data) = self.cache.lock().unwrap().get(i) {
+            return Ok(data);
+        }
+        // decompress without holding the lock, so that other queues can keep
+        // hitting the cache in the meantime
+        let (start, end) = (self.index[i as usize], self.index[i as usize + 1]);
+        let len = std::cmp::min(self.chunk_size, self.size - i * self.chunk_size) as usize;
+        let mut stored = vec![0u8; (end - start) as usize];
+        self.file.read_exact_at(&mut stored, start)?;
+        let data = if stored.len() == len {
+            stored
+        } else {
+            let mut data = vec![0u8; len];
+            match lz4::decompress(&stored, &mut data) {
+                Ok(n) if n == len => data,
+                r => return Err(invalid(format!("chunk {} is corrupted: {:?}", i, r))),
+            }
+        };
+        let data = Arc::new(data);
+        self.cache.lock().unwrap().insert(i, data.clone());
+        Ok(data)
+    }
+}
+
+impl DiskImage for CompressedImage {
+    fn size(&self) -> u64 {
+        self.size
+    }
+
+    fn read_only(&self) -> bool {
+        true
+    }
+
+    fn read_at(&self, mut buf: &mut [u8], mut offset: u64) -> io::Result<()> {
+        if offset + buf.len() as u64 > self.size {
+            return Err(io::ErrorKind::UnexpectedEof.into());
+        }
+        while !buf.is_empty() {
+            let i = offset / self.chunk_size;
+            let in_chunk = (offset % self.chunk_size) as usize;
+            let n = std::cmp::min(buf.len(), self.chunk_size as usize - in_chunk);
+            let (head, tail) = buf.split_at_mut(n);
+            if self.index[i as usize] == self.index[i as usize + 1] {
+                for b in head.iter_mut() {
+                    *b = 0;
+                }
+            } else {
+                head.copy_from_slice(&self.chunk(i)?[in_chunk..in_chunk + n]);
+            }
+            buf = tail;
+            offset += n as u64;
+        }
+        Ok(())
+    }
+
+    fn write_at(&self, _buf: &[u8], _offset: u64) -> io::Result<()> {
+        Err(io::Error::from_raw_os_error(libc::EROFS))
+    }
+
+    fn flush(&self) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn discard(&self, _offset: u64, _len: u64) -> io::Result<()> {
+        Err(io::Error::from_raw_os_error(libc::EROFS))
+    }
+
+    fn write_zeroes(&self, _offset: u64, _len: u64, _unmap: bool) -> io::Result<()> {
+        Err(io::Error::from_raw_os_error(libc::EROFS))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn chunk_cache_test() {
+        let mut cache = ChunkCache::new(2);
+        cache.insert(1, Arc::new(vec![1]));
+        cache.insert(2, Arc::new(vec![2]));
+        assert!(cache.get(1).is_some());
+        cache.insert(3, Arc::new(vec![3]));
+        assert!(cache.get(2).is_none());
+        assert_eq!(*cache.get(1).unwrap(), vec![1]);
+        assert_eq!(*cache.get(3).unwrap(), vec![3]);
+    }
+
+    #[test]
+    fn compressed_image_test() {
+        let dir = std::env::temp_dir();
+        let raw_path = dir.join(format!("xhype-raw-{}", std::process::id()));
+        let img_path = dir.join(format!("xhype-zimg-{}", std::process::id()));
+        let (raw_path, img_path) = (raw_path.to_str().unwrap(), img_path.to_str().unwrap());
+        // a text chunk, a zero chunk, a random chunk, and a short tail
+        let mut raw: Vec<u8> = b"xhype compressed image "
+            .iter()
+            .cycle()
+            .take(4096)
+            .cloned()
+            .collect();
+        raw.extend_from_slice(&[0u8; 4096]);
+        let mut x = 0x9e3779b9u32;
+        raw.extend((0..4096 + 512).map(|_| {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            x as u8
+        }));
+        std::fs::write(raw_path, &raw).unwrap();
+        CompressedImage::create(raw_path, img_path, 4096).unwrap();
+        let image = CompressedImage::open(img_path, 4096).unwrap();
+        assert_eq!(image.size(), raw.len() as u64);
+        let mut buf = vec![0u8; raw.len()];
+        image.read_at(&mut buf, 0).unwrap();
+        assert_eq!(buf, raw);
+        let mut buf = vec![0u8; 5000];
+        image.read_at(&mut buf, 3000).unwrap();
+        assert_eq!(&buf[..], &raw[3000..8000]);
+        assert!(image.read_at(&mut buf, raw.len() as u64 - 100).is_err());
+        assert!(std::fs::metadata(img_path).unwrap().len() < raw.len() as u64 / 2);
+        std::fs::remove_file(raw_path).unwrap();
+        std::fs::remove_file(img_path).unwrap();
+    }
+
+    #[test]
+    fn compressed_image_bad_header_test() {
+        let path = std::env::temp_dir().join(format!("xhype-zbad-{}", std::process::id()));
+        let path = path.to_str().unwrap();
+        for &size in &[1u64 << 60, u64::MAX & !(SECTOR_SIZE - 1)] {
+            let chunk_size = 4096u64;
+            let mut header = COMPRESSED_IMAGE_MAGIC.to_vec();
+            header.extend_from_slice(&VERSION.to_le_bytes());
+            header.extend_from_slice(&(chunk_size as u32).to_le_bytes());
+            header.extend_from_slice(&size.to_le_bytes());
+            let num_chunks = size / chunk_size + (size % chunk_size != 0) as u64;
+            header.extend_from_slice(&num_chunks.to_le_bytes());
+            std::fs::write(path, &header).unwrap();
+            let err = CompressedImage::open(path, 4096).err().unwrap();
+            assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+        }
+        std::fs::remove_file(path).unwrap();
+    }
+}
@@ -0,0 +1,281 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Disk images that back virtio block devices.
+
+A virtio block device does not care about how its data is stored on the host,
+it only needs a [`DiskImage`]. [`RawImage`] is the simplest one: a plain host
+file whose byte `n` is byte `n` of the disk. [`CompressedImage`] is a read-only
+image stored as compressed chunks. [`open_image()`] tells them apart.
+*/
+
+pub use super::compressed::CompressedImage;
+use super::compressed::{COMPRESSED_IMAGE_MAGIC, DEFAULT_CACHE_SIZE};
+#[allow(unused_imports)]
+use log::*;
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
+use std::sync::Arc;
+
+/// Size of a virtio block sector, see virtio 1.1, 5.2.6.
+pub const SECTOR_SIZE: u64 = 512;
+
+/// The granularity in which space is returned to the host file system.
+pub const DISCARD_ALIGNMENT: u64 = 4096;
+
+/// A disk image that backs a virtio block device.
+///
+/// All methods take `&self` so that one image can be shared by several
+/// virtqueues, each of which is served by its own thread.
+pub trait DiskImage: Send + Sync {
+    /// Size of the disk in bytes.
+    fn size(&self) -> u64;
+
+    /// Whether writes, discards and write-zeroes are rejected.
+    fn read_only(&self) -> bool {
+        false
+    }
+
+    /// Fills `buf` with the content of the disk starting at `offset`.
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()>;
+
+    /// Writes `buf` to the disk starting at `offset`.
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()>;
+
+    /// Makes all previous writes durable.
+    fn flush(&self) -> io::Result<()>;
+
+    /// Tells the image that the range is no longer used. The image is free to
+    /// give the space back to the host. This is only a hint: afterwards the
+    /// range may read as zeros or keep its old content, in part or in whole.
+    /// Use `write_zeroes` to have it read as zeros.
+    fn discard(&self, offset: u64, len: u64) -> io::Result<()>;
+
+    /// Makes the range read as zeros without the caller supplying any data.
+    /// If `unmap` is true, the image may deallocate the range as well.
+    fn write_zeroes(&self, offset: u64, len: u64, unmap: bool) -> io::Result<()>;
+}
+
+/// Opens the disk image at `path`, either a compressed image, which is always
+/// read-only, or a raw image.
+pub fn open_image(path: &str, read_only: bool) -> io::Result<Arc<dyn DiskImage>> {
+    let mut magic = [0u8; 8];
+    let is_compressed = File::open(path)?
+        .read_exact_at(&mut magic, 0)
+        .map(|_| &magic == COMPRESSED_IMAGE_MAGIC)
+        .unwrap_or(false);
+    if is_compressed {
+        Ok(Arc::new(CompressedImage::open(path, DEFAULT_CACHE_SIZE)?))
+    } else {
+        Ok(Arc::new(RawImage::open(path, read_only)?))
+    }
+}
+
+/// A disk image stored as a plain host file.
+pub struct RawImage {
+    file: File,
+    size: u64,
+    read_only: bool,
+}
+
+impl RawImage {
+    pub fn open(path: &str, read_only: bool) -> io::Result<Self> {
+        let file = OpenOptions::new().read(true).write(!read_only).open(path)?;
+        let size = file.metadata()?.len();
+        if size % SECTOR_SIZE != 0 {
+            warn!(
+                "size of disk image {} is not a multiple of {}, the tail is ignored",
+                path, SECTOR_SIZE
+            );
+        }
+        Ok(RawImage {
+            file,
+            size: size - size % SECTOR_SIZE,
+            read_only,
+        })
+    }
+
+    /// Writes zeros to the range from a static buffer. No guest data is
+    /// involved, but the host file system still sees ordinary writes.
+    fn zero_fill(&self, mut offset: u64, len: u64) -> io::Result<()> {
+        static ZEROS: [u8; 64 * 1024] = [0; 64 * 1024];
+        let end = offset + len;
+        while offset < end {
+            let n = std::cmp::min(end - offset, ZEROS.len() as u64) as usize;
+            self.file.write_all_at(&ZEROS[..n], offset)?;
+            offset += n as u64;
+        }
+        Ok(())
+    }
+
+    /// Deallocates the blocks covered by the range. The unaligned head and
+    /// tail are not touched, callers must zero them themselves if needed.
+    /// Returns the aligned range that was deallocated.
+    fn punch_hole(&self, offset: u64, len: u64) -> io::Result<(u64, u64)> {
+        let start = (offset + DISCARD_ALIGNMENT - 1) / DISCARD_ALIGNMENT * DISCARD_ALIGNMENT;
+        let end = (offset + len) / DISCARD_ALIGNMENT * DISCARD_ALIGNMENT;
+        if start >= end {
+            return Ok((start, start));
+        }
+        punch_hole(&self.file, start, end - start)?;
+        Ok((start, end))
+    }
+}
+
+impl DiskImage for RawImage {
+    fn size(&self) -> u64 {
+        self.size
+    }
+
+    fn read_only(&self) -> bool {
+        self.read_only
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        self.file.read_exact_at(buf, offset)
+    }
+
+    fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        self.file.write_all_at(buf, offset)
+    }
+
+    fn flush(&self) -> io::Result<()> {
+        self.file.sync_data()
+    }
+
+    fn discard(&self, offset: u64, len: u64) -> io::Result<()> {
+        // Discard is only a hint, so partial blocks at both ends are kept.
+        self.punch_hole(offset, len).map(|_| ())
+    }
+
+    fn write_zeroes(&self, offset: u64, len: u64, unmap: bool) -> io::Result<()> {
+        // unmap is only a hint: where holes cannot be punched, zeros are
+        // written as without it
+        let hole = if unmap {
+            self.punch_hole(offset, len).ok()
+        } else {
+            None
+        };
+        match hole {
+            Some((start, end)) if start < end => {
+                self.zero_fill(offset, start - offset)?;
+                self.zero_fill(end, offset + len - end)
+            }
+            Some(_) => self.zero_fill(offset, len),
+            None => zero_range(&self.file, offset, len).or_else(|_| self.zero_fill(offset, len)),
+        }
+    }
+}
+
+// F_PUNCHHOLE and its argument, defined in <sys/fcntl.h> of macOS 10.12+
+#[cfg(target_os = "macos")]
+const F_PUNCHHOLE: libc::c_int = 99;
+
+#[cfg(target_os = "macos")]
+#[repr(C)]
+struct FPunchhole {
+    fp_flags: libc::c_uint,
+    reserved: libc::c_uint,
+    fp_offset: libc::off_t,
+    fp_length: libc::off_t,
+}
+
+#[cfg(target_os = "macos")]
+fn punch_hole(file: &File, offset: u64, len: u64) -> io::Result<()> {
+    let arg = FPunchhole {
+        fp_flags: 0,
+        reserved: 0,
+        fp_offset: offset as libc::off_t,
+        fp_length: len as libc::off_t,
+    };
+    match unsafe { libc::fcntl(file.as_raw_fd(), F_PUNCHHOLE, &arg) } {
+        -1 => Err(io::Error::last_os_error()),
+        _ => Ok(()),
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn punch_hole(file: &File, offset: u64, len: u64) -> io::Result<()> {
+    let mode = libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE;
+    match unsafe {
+        libc::fallocate(
+            file.as_raw_fd(),
+            mode,
+            offset as libc::off_t,
+            len as libc::off_t,
+        )
+    } {
+        -1 => Err(io::Error::last_os_error()),
+        _ => Ok(()),
+    }
+}
+
+// Zeroes a range while keeping it allocated.
+#[cfg(target_os = "linux")]
+fn zero_range(file: &File, offset: u64, len: u64) -> io::Result<()> {
+    let mode = libc::FALLOC_FL_ZERO_RANGE | libc::FALLOC_FL_KEEP_SIZE;
+    match unsafe {
+        libc::fallocate(
+            file.as_raw_fd(),
+            mode,
+            offset as libc::off_t,
+            len as libc::off_t,
+        )
+    } {
+        -1 => Err(io::Error::last_os_error()),
+        _ => Ok(()),
+    }
+}
+
+// macOS has no way to zero a range in place, callers fall back to zero_fill().
+#[cfg(not(target_os = "linux"))]
+fn zero_range(_file: &File, _offset: u64, _len: u64) -> io::Result<()> {
+    Err(io::Error::from_raw_os_error(libc::EOPNOTSUPP))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn raw_image(name: &str, data: &[u8]) -> (String, RawImage) {
+        let path = std::env::temp_dir().join(format!("xhype-{}-{}", name, std::process::id()));
+        let path = path.to_str().unwrap().to_string();
+        std::fs::write(&path, data).unwrap();
+        let image = RawImage::open(&path, false).unwrap();
+        (path, image)
+    }
+
+    #[test]
+    fn raw_discard_test() {
+        let data = vec![0xaau8; 4 * DISCARD_ALIGNMENT as usize];
+        let (path, image) = raw_image("discard", &data);
+        // only the two whole blocks inside the range may be given back
+        image.discard(512, 3 * DISCARD_ALIGNMENT - 1024).unwrap();
+        let mut buf = vec![0u8; data.len()];
+        image.read_at(&mut buf, 0).unwrap();
+        assert!(buf[..DISCARD_ALIGNMENT as usize].iter().all(|&b| b == 0xaa));
+        assert!(buf[3 * DISCARD_ALIGNMENT as usize..]
+            .iter()
+            .all(|&b| b == 0xaa));
+        std::fs::remove_file(path).unwrap();
+    }
+
+    #[test]
+    fn raw_write_zeroes_test() {
+        let data = vec![0xaau8; 4 * DISCARD_ALIGNMENT as usize];
+        let (path, image) = raw_image("write-zeroes", &data);
+        for &unmap in [false, true].iter() {
+            image.write_at(&data, 0).unwrap();
+            let (offset, len) = (512, 3 * DISCARD_ALIGNMENT - 1024);
+            image.write_zeroes(offset, len, unmap).unwrap();
+            let mut buf = vec![0u8; data.len()];
+            image.read_at(&mut buf, 0).unwrap();
+            let (start, end) = (offset as usize, (offset + len) as usize);
+            assert!(buf[..start].iter().all(|&b| b == 0xaa));
+            assert!(buf[start..end].iter().all(|&b| b == 0));
+            assert!(buf[end..].iter().all(|&b| b == 0xaa));
+        }
+        std::fs::remove_file(path).unwrap();
+    }
+}
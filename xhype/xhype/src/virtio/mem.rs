@@ -0,0 +1,482 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Implements a virtio-mem device: guest memory that is plugged and unplugged
+at runtime in blocks of a fixed size.
+
+The device owns a region of the guest physical address space above all other
+guest memory. The host asks for a size with
+[`HotplugMemory::set_requested_size`] and the guest driver plugs or unplugs
+blocks until it has that much; a guest can start small and grow later
+instead of being given memory for its peak load from the start.
+
+Like the guest's main memory, the region is identity mapped: its guest
+physical address equals its host virtual address. The whole region is
+reserved in the address space of xhype without any memory behind it. A block
+is mapped into the guest when it is plugged and only gets host memory when
+the guest touches it. Unplugging a block unmaps it from the guest and gives
+its memory back to the host right away.
+
+The Linux driver needs the region aligned to its memory block size, 128 MiB
+on x86_64, and hotplugged memory has to be onlined in the guest, e.g. with
+`memhp_default_state=online_movable` on the kernel command line. The memory
+is not shared with vhost-user backends.
+*/
+
+use super::consts::*;
+use super::virtq::*;
+use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
+use crate::consts::*;
+use crate::err::Error;
+use crate::hv::ffi::{HV_MEMORY_EXEC, HV_MEMORY_READ, HV_MEMORY_WRITE};
+use crate::hv::MemSpace;
+use crate::{GuestRamRegion, VirtualMachine, PAGE_SIZE};
+#[allow(unused_imports)]
+use log::*;
+use std::mem::size_of;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+
+/* Feature bits */
+/// The driver does not access unplugged memory. It is required: unplugged
+/// blocks are unmapped, and reading them would stop the VM.
+pub const VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE: u64 = 1;
+
+pub const VIRTIO_MEM_REQ_PLUG: u16 = 0;
+pub const VIRTIO_MEM_REQ_UNPLUG: u16 = 1;
+pub const VIRTIO_MEM_REQ_UNPLUG_ALL: u16 = 2;
+pub const VIRTIO_MEM_REQ_STATE: u16 = 3;
+
+pub const VIRTIO_MEM_RESP_ACK: u16 = 0;
+pub const VIRTIO_MEM_RESP_NACK: u16 = 1;
+pub const VIRTIO_MEM_RESP_BUSY: u16 = 2;
+pub const VIRTIO_MEM_RESP_ERROR: u16 = 3;
+
+pub const VIRTIO_MEM_STATE_PLUGGED: u16 = 0;
+pub const VIRTIO_MEM_STATE_UNPLUGGED: u16 = 1;
+pub const VIRTIO_MEM_STATE_MIXED: u16 = 2;
+
+/// Alignment of the region in the guest physical address space: a memory
+/// block of Linux on x86_64.
+const MEM_ALIGN: usize = 128 * MiB;
+
+/// A request, see virtio 1.2, 5.15.6 Device Operation
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioMemReq {
+    req_type: u16,
+    padding: [u16; 3],
+    addr: u64,
+    nb_blocks: u16,
+    padding_1: [u16; 3],
+}
+
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioMemResp {
+    resp_type: u16,
+    padding: [u16; 3],
+    state: u16,
+}
+
+/// virtio-mem device's config space, see virtio 1.2, 5.15.4
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioMemCfgLayout {
+    block_size: u64,
+    node_id: u16,
+    padding: [u8; 6],
+    addr: u64,
+    region_size: u64,
+    usable_region_size: u64,
+    plugged_size: u64,
+    requested_size: u64,
+}
+
+/// Returns the first block and the number of blocks of a request for
+/// `nb_blocks` blocks at `addr`, if they are all within the region.
+fn block_range(
+    start: u64,
+    block_size: u64,
+    num_blocks: usize,
+    addr: u64,
+    nb_blocks: u16,
+) -> Option<(usize, usize)> {
+    if addr < start || (addr - start) % block_size != 0 || nb_blocks == 0 {
+        return None;
+    }
+    let first = ((addr - start) / block_size) as usize;
+    let n = nb_blocks as usize;
+    if first + n > num_blocks {
+        return None;
+    }
+    Some((first, n))
+}
+
+/// Gives the memory of `len` bytes at `hva` back to the host and leaves the
+/// range reserved without access.
+fn discard(hva: usize, len: usize) -> std::io::Result<()> {
+    let addr = unsafe {
+        libc::mmap(
+            hva as *mut libc::c_void,
+            len,
+            libc::PROT_NONE,
+            libc::MAP_PRIVATE | libc::MAP_ANON | libc::MAP_NORESERVE | libc::MAP_FIXED,
+            -1,
+            0,
+        )
+    };
+    if addr == libc::MAP_FAILED {
+        return Err(std::io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// The host side of a virtio-mem device: a region of hot-pluggable memory.
+pub struct HotplugMemory {
+    /// start of the region, a guest physical and host virtual address
+    start: usize,
+    size: usize,
+    block_size: usize,
+    requested: AtomicU64,
+    plugged_size: AtomicU64,
+    /// whether each block is plugged
+    blocks: Mutex<Vec<bool>>,
+    mem_space: Arc<RwLock<MemSpace>>,
+    /// how to raise a configuration change interrupt, once there is a device
+    irq: Mutex<Option<(u32, Sender<u32>, Arc<RwLock<u32>>)>>,
+}
+
+impl HotplugMemory {
+    /// Reserves a region of `size` bytes of hot-pluggable memory for `vm`,
+    /// in blocks of `block_size` bytes. Nothing is plugged at first.
+    pub fn new(vm: &VirtualMachine, size: usize, block_size: usize) -> Result<Arc<Self>, Error> {
+        if block_size < PAGE_SIZE || !block_size.is_power_of_two() || block_size > MEM_ALIGN {
+            return Err(format!("virtio-mem: bad block size 0x{:x}", block_size))?;
+        }
+        let size = (size + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+        // reserve a range with enough room to align the start address, and
+        // give back the rest
+        let reserved = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                size + MEM_ALIGN,
+                libc::PROT_NONE,
+                libc::MAP_PRIVATE | libc::MAP_ANON | libc::MAP_NORESERVE,
+                -1,
+                0,
+            )
+        };
+        if reserved == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error())?;
+        }
+        let reserved = reserved as usize;
+        let start = (reserved + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+        unsafe {
+            if start > reserved {
+                libc::munmap(reserved as *mut libc::c_void, start - reserved);
+            }
+            let end = start + size;
+            let reserved_end = reserved + size + MEM_ALIGN;
+            if reserved_end > end {
+                libc::munmap(end as *mut libc::c_void, reserved_end - end);
+            }
+        }
+        vm.ram_regions.write().unwrap().push(GuestRamRegion {
+            gpa: start as u64,
+            size: size as u64,
+            hva: start,
+            shared: false,
+        });
+        info!(
+            "virtio-mem: 0x{:x} bytes at 0x{:x} in blocks of 0x{:x}",
+            size, start, block_size
+        );
+        Ok(Arc::new(HotplugMemory {
+            start,
+            size,
+            block_size,
+            requested: AtomicU64::new(0),
+            plugged_size: AtomicU64::new(0),
+            blocks: Mutex::new(vec![false; size / block_size]),
+            mem_space: vm.mem_space.clone(),
+            irq: Mutex::new(None),
+        }))
+    }
+
+    /// Asks the guest to plug or unplug blocks until it has `bytes` bytes,
+    /// rounded down to whole blocks.
+    pub fn set_requested_size(&self, bytes: u64) {
+        let bytes = std::cmp::min(bytes, self.size as u64);
+        let bytes = bytes - bytes % self.block_size as u64;
+        if self.requested.swap(bytes, Ordering::AcqRel) == bytes {
+            return;
+        }
+        if let Some((irq, irq_sender, isr)) = &*self.irq.lock().unwrap() {
+            *isr.write().unwrap() |= VIRTIO_INT_CONFIG;
+            irq_sender.send(*irq).unwrap();
+        }
+    }
+
+    pub fn requested_size(&self) -> u64 {
+        self.requested.load(Ordering::Acquire)
+    }
+
+    /// The number of bytes the guest has plugged.
+    pub fn plugged_size(&self) -> u64 {
+        self.plugged_size.load(Ordering::Acquire)
+    }
+
+    fn plug(&self, blocks: &mut [bool], first: usize, n: usize) -> u16 {
+        if blocks[first..first + n].iter().any(|&b| b) {
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+        let len = n * self.block_size;
+        if self.plugged_size() + len as u64 > self.requested_size() {
+            return VIRTIO_MEM_RESP_NACK;
+        }
+        let hva = self.start + first * self.block_size;
+        let ret = unsafe {
+            libc::mprotect(
+                hva as *mut libc::c_void,
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+            )
+        };
+        if ret != 0 {
+            error!(
+                "virtio-mem: mprotect(0x{:x}, 0x{:x}): {}",
+                hva,
+                len,
+                std::io::Error::last_os_error()
+            );
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+        let flags = HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC;
+        if let Err(e) = self.mem_space.write().unwrap().map(hva, hva, len, flags) {
+            error!("virtio-mem: map 0x{:x}, 0x{:x}: {:?}", hva, len, e);
+            let _ = discard(hva, len);
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+        blocks[first..first + n].iter_mut().for_each(|b| *b = true);
+        self.plugged_size.fetch_add(len as u64, Ordering::AcqRel);
+        VIRTIO_MEM_RESP_ACK
+    }
+
+    fn unplug(&self, blocks: &mut [bool], first: usize, n: usize) -> u16 {
+        if !blocks[first..first + n].iter().all(|&b| b) {
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+        let (hva, len) = (self.start + first * self.block_size, n * self.block_size);
+        if let Err(e) = self.mem_space.write().unwrap().unmap(hva, len) {
+            error!("virtio-mem: unmap 0x{:x}, 0x{:x}: {:?}", hva, len, e);
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+        // the guest no longer sees the blocks, so they stay unplugged even if
+        // their memory cannot be released
+        if let Err(e) = discard(hva, len) {
+            warn!("virtio-mem: release 0x{:x}, 0x{:x}: {}", hva, len, e);
+        }
+        blocks[first..first + n].iter_mut().for_each(|b| *b = false);
+        self.plugged_size.fetch_sub(len as u64, Ordering::AcqRel);
+        VIRTIO_MEM_RESP_ACK
+    }
+
+    fn unplug_all(&self, blocks: &mut [bool]) -> u16 {
+        let mut first = 0;
+        while first < blocks.len() {
+            if !blocks[first] {
+                first += 1;
+                continue;
+            }
+            let n = blocks[first..].iter().take_while(|&&b| b).count();
+            let resp = self.unplug(blocks, first, n);
+            if resp != VIRTIO_MEM_RESP_ACK {
+                return resp;
+            }
+            first += n;
+        }
+        VIRTIO_MEM_RESP_ACK
+    }
+
+    fn state(blocks: &[bool]) -> u16 {
+        if blocks.iter().all(|&b| b) {
+            VIRTIO_MEM_STATE_PLUGGED
+        } else if blocks.iter().all(|&b| !b) {
+            VIRTIO_MEM_STATE_UNPLUGGED
+        } else {
+            VIRTIO_MEM_STATE_MIXED
+        }
+    }
+
+    fn handle(&self, req: &VirtioMemReq) -> VirtioMemResp {
+        let mut resp = VirtioMemResp::default();
+        let mut blocks = self.blocks.lock().unwrap();
+        let (req_type, addr, nb_blocks) = (req.req_type, req.addr, req.nb_blocks);
+        let range = block_range(
+            self.start as u64,
+            self.block_size as u64,
+            blocks.len(),
+            addr,
+            nb_blocks,
+        );
+        resp.resp_type = match (req_type, range) {
+            (VIRTIO_MEM_REQ_UNPLUG_ALL, _) => self.unplug_all(&mut blocks),
+            (VIRTIO_MEM_REQ_PLUG, Some((first, n))) => self.plug(&mut blocks, first, n),
+            (VIRTIO_MEM_REQ_UNPLUG, Some((first, n))) => self.unplug(&mut blocks, first, n),
+            (VIRTIO_MEM_REQ_STATE, Some((first, n))) => {
+                resp.state = Self::state(&blocks[first..first + n]);
+                VIRTIO_MEM_RESP_ACK
+            }
+            (t, _) => {
+                warn!(
+                    "virtio-mem: bad request {} at 0x{:x}, {} blocks",
+                    t, addr, nb_blocks
+                );
+                VIRTIO_MEM_RESP_ERROR
+            }
+        };
+        resp
+    }
+}
+
+impl Drop for HotplugMemory {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.start as *mut libc::c_void, self.size) };
+    }
+}
+
+struct MemDescHandler {
+    mem: Arc<HotplugMemory>,
+}
+
+impl VirtqDescHandle for MemDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+        let (readable, writable) = desc_chain.split_at(desc_chain.len() - writable_count);
+        let resp = match read_pod::<VirtioMemReq>(readable, 0) {
+            Some(req) => self.mem.handle(&req),
+            None => {
+                warn!("virtio-mem: short request");
+                VirtioMemResp {
+                    resp_type: VIRTIO_MEM_RESP_ERROR,
+                    ..Default::default()
+                }
+            }
+        };
+        let bytes = unsafe {
+            std::slice::from_raw_parts(
+                &resp as *const VirtioMemResp as *const u8,
+                size_of::<VirtioMemResp>(),
+            )
+        };
+        scatter(writable, bytes) as u32
+    }
+}
+
+pub struct VirtioMemCfg {
+    mem: Arc<HotplugMemory>,
+    gen: u32,
+}
+
+impl VirtioDevCfg for VirtioMemCfg {
+    fn write(&mut self, _offset: usize, _size: u8, _value: u32) -> Option<()> {
+        None
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        let layout = VirtioMemCfgLayout {
+            block_size: self.mem.block_size as u64,
+            addr: self.mem.start as u64,
+            region_size: self.mem.size as u64,
+            usable_region_size: self.mem.size as u64,
+            plugged_size: self.mem.plugged_size(),
+            requested_size: self.mem.requested_size(),
+            ..Default::default()
+        };
+        let bytes = unsafe {
+            std::slice::from_raw_parts(
+                &layout as *const VirtioMemCfgLayout as *const u8,
+                size_of::<VirtioMemCfgLayout>(),
+            )
+        };
+        let field = bytes.get(offset..offset + size as usize)?;
+        let mut value = [0u8; 4];
+        value[..field.len()].copy_from_slice(field);
+        Some(u32::from_le_bytes(value))
+    }
+
+    fn reset(&mut self) {
+        self.gen += 1;
+    }
+
+    fn generation(&self) -> u32 {
+        self.gen
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a virtio-mem device for the hot-pluggable memory `mem` of
+    /// `vm`.
+    pub fn new_mem(name: String, irq: u32, vm: &VirtualMachine, mem: &Arc<HotplugMemory>) -> Self {
+        let isr = Arc::new(RwLock::new(0));
+        *mem.irq.lock().unwrap() = Some((irq, vm.irq_sender.clone(), isr.clone()));
+        let req_q = VirtqManager::new(
+            format!("{}_guestreq", name),
+            64,
+            irq,
+            vm.irq_sender.clone(),
+            isr.clone(),
+            vm.gpa2hva.clone(),
+            MemDescHandler { mem: mem.clone() },
+        );
+        VirtioDevice {
+            name,
+            dev_id: VirtioId::Mem,
+            dev_feat: 1 << VIRTIO_F_VERSION_1 | 1 << VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE,
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            vqs: vec![req_q],
+            cfg: Box::new(VirtioMemCfg {
+                mem: mem.clone(),
+                gen: 0,
+            }),
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn mem_struct_size_test() {
+        assert_eq!(size_of::<VirtioMemReq>(), 24);
+        assert_eq!(size_of::<VirtioMemResp>(), 10);
+        assert_eq!(size_of::<VirtioMemCfgLayout>(), 56);
+    }
+
+    #[test]
+    fn block_range_test() {
+        let (start, bs) = (0x1_0000_0000, 2 * MiB as u64);
+        assert_eq!(block_range(start, bs, 64, start + 2 * bs, 3), Some((2, 3)));
+        assert_eq!(
+            block_range(start, bs, 64, start + 60 * bs, 4),
+            Some((60, 4))
+        );
+        assert_eq!(block_range(start, bs, 64, start + 60 * bs, 5), None);
+        assert_eq!(block_range(start, bs, 64, start + 4096, 1), None);
+        assert_eq!(block_range(start, bs, 64, start - bs, 1), None);
+        assert_eq!(block_range(start, bs, 64, start, 0), None);
+    }
+}
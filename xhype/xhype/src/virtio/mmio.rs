@@ -111,6 +111,10 @@ impl VirtioMmioDev {
         self.dev.status = 0;
         *self.dev.isr.write().unwrap() = 0;
         for vq in self.dev.vqs.iter_mut() {
+            if vq.qready != 0 {
+                // stop serving the virtq, like clearing QueueReady does
+                vq.task_sender.send(None).unwrap();
+            }
             vq.qready = 0;
         }
         self.dev.cfg.reset();
@@ -370,6 +374,10 @@ fn virtio_mmio_write(mmio_dev: &mut VirtioMmioDev, gpa: usize, size: u8, value:
                     );
                 }
             }
+            if value & !mmio_dev.dev.status & VIRTIO_CONFIG_S_FEATURES_OK != 0 {
+                let features = mmio_dev.dev.dri_feat;
+                mmio_dev.dev.cfg.features_ok(features);
+            }
             mmio_dev.dev.status = value;
             info!("dev {} status = {:b}", mmio_dev.dev.name, value);
         }
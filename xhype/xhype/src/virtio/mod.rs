@@ -1,9 +1,26 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 
+pub mod balloon;
+pub mod blk;
+pub mod capture;
+pub mod compressed;
+pub mod disk;
+pub mod mem;
 pub mod mmio;
 pub mod net;
+pub mod net_backend;
+pub mod offload;
+pub mod overcommit;
+pub mod p9;
+pub mod pmem;
+pub mod qos;
 pub mod rng;
+pub mod rss;
+pub mod scsi;
+pub mod switch;
+pub mod vhost_user;
 pub mod virtq;
+pub mod vsock;
 
 use crate::AddressConverter;
 use crossbeam_channel::unbounded as channel;
@@ -57,6 +74,9 @@ pub enum VirtioId {
     GPU = 16,
     Timer = 17,
     Input = 18,
+    Vsock = 19,
+    Mem = 24,
+    Pmem = 27,
 }
 
 pub trait VirtioDevCfg {
@@ -64,6 +84,9 @@ pub trait VirtioDevCfg {
     fn generation(&self) -> u32;
     fn read(&self, offset: usize, size: u8) -> Option<u32>;
     fn write(&mut self, offset: usize, size: u8, value: u32) -> Option<()>;
+    /// Called when the driver sets FEATURES_OK and the device accepts the
+    /// `features` it negotiated.
+    fn features_ok(&mut self, _features: u64) {}
 }
 
 pub struct VirtioDevice {
@@ -90,6 +113,14 @@ impl VirtioDevice {
         if self.dri_feat & !self.dev_feat != 0 {
             return Err("driver activated features that are not supported by the device");
         }
+        let inaccessible = 1 << mem::VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE;
+        if let VirtioId::Mem = self.dev_id {
+            if self.dev_feat & inaccessible != 0 && self.dri_feat & inaccessible == 0 {
+                return Err(
+                    "unplugged virtio-mem blocks are unmapped, the driver must not read them",
+                );
+            }
+        }
         Ok(())
     }
 }
@@ -1,19 +1,33 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 
-/*! Implements a virtio-net device based on [vmnet](https://developer.apple.com/documentation/vmnet?language=objc).
+/*! Implements a virtio-net device on one of the backends of [`net_backend`](../net_backend/index.html).
 */
 
+use super::capture::{PacketCapture, QueueTap};
 use super::consts::*;
+use super::net_backend::{NetBackend, Vmnet};
+use super::offload::*;
+use super::rss::steer;
 use super::virtq::*;
 use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
+use crate::err::Error;
+use crossbeam_channel::{bounded, Receiver, Sender as CbSender};
 #[allow(unused_imports)]
 use log::*;
-use std::io::IoSliceMut;
-use std::slice;
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
 use std::sync::{Arc, RwLock};
 
 pub const VIRTIO_HEADER_SIZE: usize = 12;
 
+/// frames the steering thread queues for a receive queue
+const RX_STEER_BACKLOG: usize = 1024;
+
+/// Ethernet header
+const ETH_HLEN: usize = 14;
+/// 802.1Q VLAN tag
+const VLAN_HLEN: usize = 4;
+
 /// Host handles pkts w/ partial csum
 pub const VIRTIO_NET_F_CSUM: u64 = 0;
 /// Guest handles pkts w/ partial csum
@@ -55,24 +69,248 @@ pub const VIRTIO_NET_F_CTRL_RX_EXTRA: u64 = 20;
 /// Guest can announce device on the network
 pub const VIRTIO_NET_F_GUEST_ANNOUNCE: u64 = 21;
 
-pub const VMNET_SUCCESS: u32 = 1000;
+/// Device supports multiqueue with automatic receive steering
+pub const VIRTIO_NET_F_MQ: u64 = 22;
+
+pub const VIRTIO_NET_OK: u8 = 0;
+pub const VIRTIO_NET_ERR: u8 = 1;
+
+pub const VIRTIO_NET_CTRL_RX: u8 = 0;
+pub const VIRTIO_NET_CTRL_RX_PROMISC: u8 = 0;
+pub const VIRTIO_NET_CTRL_RX_ALLMULTI: u8 = 1;
+pub const VIRTIO_NET_CTRL_RX_ALLUNI: u8 = 2;
+pub const VIRTIO_NET_CTRL_RX_NOMULTI: u8 = 3;
+pub const VIRTIO_NET_CTRL_RX_NOUNI: u8 = 4;
+pub const VIRTIO_NET_CTRL_RX_NOBCAST: u8 = 5;
+
+pub const VIRTIO_NET_CTRL_MAC: u8 = 1;
+pub const VIRTIO_NET_CTRL_MAC_TABLE_SET: u8 = 0;
+
+pub const VIRTIO_NET_CTRL_MQ: u8 = 4;
+pub const VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET: u8 = 0;
 
-#[repr(C)]
-struct VmPktDesc<'a> {
-    vm_pkt_size: usize,
-    vm_pkt_iov: *mut IoSliceMut<'a>,
-    vm_pkt_iovcnt: u32,
-    vm_flags: u32,
+/// Returns the buffers of a descriptor chain that hold the packet, i.e.,
+/// everything after the virtio-net header.
+pub(super) fn packet_regions(chain: &[(usize, usize)]) -> Vec<(usize, usize)> {
+    sub_regions(chain, VIRTIO_HEADER_SIZE, usize::MAX)
 }
 
-extern "C" {
-    fn vmnet_read_blocking(interface: usize, packets: *mut VmPktDesc, pktcnt: *mut u32) -> u32;
-    fn vmnet_write(interface: usize, packets: *const VmPktDesc, pktcnt: *mut u32) -> u32;
-    fn create_interface(interface: *mut usize, mac: *mut u8, mtu: *mut u16) -> u32;
+/// Reads up to `count` frames from `queue` of `backend` into host buffers,
+/// taken from `spare` if there are any, and appends them to `frames`. Each
+/// buffer has room for `frame_max` bytes.
+fn read_frames(
+    backend: &dyn NetBackend,
+    queue: usize,
+    frame_max: usize,
+    count: usize,
+    spare: &mut Vec<Vec<u8>>,
+    frames: &mut VecDeque<Vec<u8>>,
+) -> Result<(), Error> {
+    let mut bufs: Vec<Vec<u8>> = (0..count)
+        .map(|_| {
+            let mut buf = spare.pop().unwrap_or_default();
+            buf.resize(frame_max, 0);
+            buf
+        })
+        .collect();
+    let packets: Vec<_> = bufs
+        .iter_mut()
+        .map(|buf| vec![(buf.as_mut_ptr() as usize, buf.len())])
+        .collect();
+    let result = backend.recv(queue, &packets);
+    let sizes = result.as_ref().map(|s| s.as_slice()).unwrap_or(&[]);
+    for (i, mut buf) in bufs.into_iter().enumerate() {
+        if i < sizes.len() {
+            buf.truncate(sizes[i]);
+            frames.push_back(buf);
+        } else {
+            spare.push(buf);
+        }
+    }
+    result.map(|_| ())
 }
-/// Transmits the guest's output network packets
+
+/// Where a receive queue gets its frames from
+enum RxSource {
+    /// The queue reads from a queue of the backend itself.
+    Backend(usize),
+    /// A steering thread reads from the backend and passes the queue its
+    /// frames.
+    Steered(Receiver<Vec<u8>>),
+}
+
+/// delivers incoming network packets to the guest
+///
+/// If the backend has a queue for each receive queue, the service thread of a
+/// receive queue is the dedicated reader of its backend queue: every
+/// `recv()` fills as many of the buffers posted by the guest as there are
+/// packets available, up to the backend's limit. Otherwise a steering thread
+/// reads the frames, see [`steer_rx()`].
+///
+/// If the backend passes virtio-net headers, they come with the frames and
+/// go to the guest as they are.
+///
+/// With `VIRTIO_NET_F_MRG_RXBUF`, the guest may post buffers smaller than a
+/// frame. As long as its buffers hold a whole frame, vmnet still writes into
+/// them directly. Otherwise frames are read into host buffers and then spread
+/// over as many guest buffers as they need, see virtio 1.1, 5.1.6.4.
 struct NetRxDescHandler {
-    interface: usize,
+    backend: Arc<dyn NetBackend>,
+    max_packets: u16,
+    state: Arc<NetState>,
+    source: RxSource,
+    /// the largest frame the backend delivers
+    frame_max: usize,
+    /// size of the virtio-net header the backend puts before each frame
+    hdr_len: usize,
+    /// frames read into host buffers that wait for guest buffers
+    pending: VecDeque<Vec<u8>>,
+    /// host buffers for reuse
+    spare: Vec<Vec<u8>>,
+    tap: QueueTap,
+}
+
+impl NetRxDescHandler {
+    fn new(
+        backend: Arc<dyn NetBackend>,
+        state: Arc<NetState>,
+        source: RxSource,
+        frame_max: usize,
+        tap: QueueTap,
+    ) -> Self {
+        let max_packets = backend.max_packets();
+        let hdr_len = if backend.vnet_hdr() {
+            VIRTIO_HEADER_SIZE
+        } else {
+            0
+        };
+        NetRxDescHandler {
+            backend,
+            max_packets,
+            state,
+            source,
+            frame_max,
+            hdr_len,
+            pending: VecDeque::new(),
+            spare: Vec::new(),
+            tap,
+        }
+    }
+
+    /// Gets up to `count` frames into `self.pending`, at least one.
+    fn fill_pending(&mut self, count: usize) -> Result<(), Error> {
+        match &self.source {
+            RxSource::Backend(queue) => read_frames(
+                &*self.backend,
+                *queue,
+                self.hdr_len + self.frame_max,
+                count,
+                &mut self.spare,
+                &mut self.pending,
+            ),
+            RxSource::Steered(frames) => {
+                // the steering thread never goes away
+                self.pending.push_back(frames.recv().unwrap());
+                self.pending.extend(frames.try_iter().take(count - 1));
+                Ok(())
+            }
+        }
+    }
+
+    /// Delivers the pending frames to the guest buffers starting at `index`.
+    /// With mergeable buffers every frame goes to as many buffers as it needs,
+    /// otherwise to one buffer. Returns the number of bytes written to each
+    /// buffer used.
+    fn receive_pending(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+        features: u64,
+    ) -> Vec<u32> {
+        if self.pending.is_empty() {
+            let n = std::cmp::min(count, self.max_packets) as usize;
+            if let Err(e) = self.fill_pending(n) {
+                error!("virtio-net: receive: {:?}", e);
+                return vec![0];
+            }
+        }
+        let guest_csum = features & (1 << VIRTIO_NET_F_GUEST_CSUM) != 0;
+        let per_frame = if features & (1 << VIRTIO_NET_F_MRG_RXBUF) != 0 {
+            count as usize
+        } else {
+            1
+        };
+        let mut lengths = Vec::new();
+        let mut next = 0u16;
+        while let Some(buf) = self.pending.front() {
+            let frame = &buf[self.hdr_len..];
+            let needed = VIRTIO_HEADER_SIZE + frame.len();
+            let mut chains = Vec::new();
+            let mut room = 0;
+            while room < needed && chains.len() < per_frame && next + (chains.len() as u16) < count
+            {
+                let i = index.wrapping_add(next + chains.len() as u16);
+                let (writable, _) = virtq.get_desc_chain(i, |gpa| gpa2hva(gpa));
+                room += total_len(&writable);
+                chains.push(writable);
+            }
+            if room < needed {
+                // Frames are never truncated. Without mergeable buffers a
+                // frame goes to one buffer, so one that is too small is never
+                // going to do; with them, neither is the whole ring.
+                let hopeless = !chains.is_empty()
+                    && (per_frame == 1 || (next == 0 && count as u32 == virtq.num));
+                if !hopeless {
+                    // wait for the guest to post more buffers
+                    break;
+                }
+                let dropped = self.state.rx_dropped.fetch_add(1, Ordering::Relaxed) + 1;
+                warn!(
+                    "virtio-net: drop a frame of {} bytes, guest buffers hold {}, {} dropped",
+                    frame.len(),
+                    room,
+                    dropped
+                );
+                let buf = self.pending.pop_front().unwrap();
+                self.spare.push(buf);
+                continue;
+            }
+            let mut header = VirtioNetHdr::default();
+            if self.hdr_len > 0 {
+                let regions = [(buf.as_ptr() as usize, buf.len())];
+                header = read_pod(&regions, 0).unwrap_or_default();
+            } else if guest_csum
+                && validate_rx(&[(frame.as_ptr() as usize, frame.len())], frame.len())
+            {
+                header.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+            }
+            header.num_buffers = chains.len() as u16;
+            // the header goes to the first buffer, the frame follows it
+            scatter(&chains[0], header.as_bytes());
+            let mut offset = 0;
+            for (j, chain) in chains.iter().enumerate() {
+                let (regions, prefix) = if j == 0 {
+                    (packet_regions(chain), VIRTIO_HEADER_SIZE)
+                } else {
+                    (chain.clone(), 0)
+                };
+                let n = scatter(&regions, &frame[offset..]);
+                offset += n;
+                lengths.push((prefix + n) as u32);
+            }
+            if self.tap.is_on() {
+                self.tap
+                    .record(&[(frame.as_ptr() as usize, frame.len())], frame.len());
+            }
+            next += chains.len() as u16;
+            let buf = self.pending.pop_front().unwrap();
+            self.spare.push(buf);
+        }
+        debug!("net_rx_srv, received frames into {} buffers", lengths.len());
+        lengths
+    }
 }
 
 impl VirtqDescHandle for NetRxDescHandler {
@@ -82,55 +320,280 @@ impl VirtqDescHandle for NetRxDescHandler {
         index: u16,
         gpa2hva: &AddressConverter,
     ) -> u32 {
-        let (writable, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
-        debug_assert_eq!(writable.len(), writable_count);
-        let mut trim_length = VIRTIO_HEADER_SIZE;
-        let mut iov = Vec::with_capacity(writable.len());
-        let mut total_size = 0;
-        for (mut addr, mut len) in writable.iter() {
-            if trim_length > 0 {
-                if len > trim_length {
-                    len -= trim_length;
-                    addr += trim_length;
-                    trim_length = 0;
+        self.handle_desc_chains(virtq, index, 1, gpa2hva)
+            .first()
+            .cloned()
+            .unwrap_or(0)
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        let features = self.state.features.load(Ordering::Relaxed);
+        let guest_csum = features & (1 << VIRTIO_NET_F_GUEST_CSUM) != 0;
+        let mergeable = features & (1 << VIRTIO_NET_F_MRG_RXBUF) != 0;
+        let count = std::cmp::min(count, self.max_packets);
+        if let RxSource::Steered(_) = self.source {
+            return self.receive_pending(virtq, index, count, gpa2hva, features);
+        }
+        // without mergeable buffers, the guest buffers are large enough for
+        // any frame
+        let frame_room = VIRTIO_HEADER_SIZE + self.frame_max;
+        let chains: Vec<_> = (0..count)
+            .map(|i| {
+                let (writable, writable_count) =
+                    virtq.get_desc_chain(index.wrapping_add(i), |gpa| gpa2hva(gpa));
+                debug_assert_eq!(writable.len(), writable_count);
+                writable
+            })
+            .take_while(|chain| !mergeable || total_len(chain) >= frame_room)
+            .collect();
+        if mergeable && (chains.is_empty() || !self.pending.is_empty()) {
+            return self.receive_pending(virtq, index, count, gpa2hva, features);
+        }
+        // the backend writes its header to the start of the buffers too
+        let packets: Vec<_> = chains
+            .iter()
+            .map(|chain| sub_regions(chain, VIRTIO_HEADER_SIZE - self.hdr_len, usize::MAX))
+            .collect();
+        let queue = match self.source {
+            RxSource::Backend(queue) => queue,
+            RxSource::Steered(_) => unreachable!(),
+        };
+        let sizes = match self.backend.recv(queue, &packets) {
+            Ok(sizes) => sizes,
+            Err(e) => {
+                // return the first buffer empty, as if the packet was dropped
+                error!("virtio-net: receive: {:?}", e);
+                return vec![0];
+            }
+        };
+        // without a header from the backend, frames are complete, so there is
+        // never a partial checksum or a GSO frame
+        let lengths: Vec<u32> = sizes
+            .iter()
+            .zip(chains.iter())
+            .map(|(&size, chain)| {
+                let size = size.saturating_sub(self.hdr_len);
+                if self.hdr_len > 0 {
+                    // the backend leaves num_buffers alone
+                    scatter(&sub_regions(chain, 10, 2), &1u16.to_le_bytes());
                 } else {
-                    trim_length -= len;
-                    continue;
+                    let mut header = VirtioNetHdr {
+                        num_buffers: 1,
+                        ..Default::default()
+                    };
+                    if guest_csum && validate_rx(&packet_regions(chain), size) {
+                        header.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+                    }
+                    scatter(chain, header.as_bytes());
+                }
+                if self.tap.is_on() {
+                    self.tap.record(&packet_regions(chain), size);
                 }
+                (size + VIRTIO_HEADER_SIZE) as u32
+            })
+            .collect();
+        debug!(
+            "net_rx_srv, get {} packets, {} bytes",
+            sizes.len(),
+            lengths.iter().sum::<u32>()
+        );
+        lengths
+    }
+}
+
+/// Reads frames from queue 0 of the backend and passes each of them to the
+/// receive queue its flow hashes to, among the queue pairs the driver enabled.
+/// A queue that falls behind loses frames, like the ring of a NIC that is
+/// full.
+fn steer_rx(
+    backend: Arc<dyn NetBackend>,
+    frame_max: usize,
+    state: Arc<NetState>,
+    queues: Vec<CbSender<Vec<u8>>>,
+) {
+    let mut frames = VecDeque::new();
+    let mut spare = Vec::new();
+    let hdr_len = if backend.vnet_hdr() {
+        VIRTIO_HEADER_SIZE
+    } else {
+        0
+    };
+    loop {
+        let read = read_frames(
+            &*backend,
+            0,
+            hdr_len + frame_max,
+            backend.max_packets() as usize,
+            &mut spare,
+            &mut frames,
+        );
+        if let Err(e) = read {
+            error!("virtio-net: receive: {:?}", e);
+            continue;
+        }
+        let queue_pairs = state.queue_pairs.load(Ordering::Relaxed);
+        for frame in frames.drain(..) {
+            let q = steer(&frame[hdr_len..], std::cmp::min(queue_pairs, queues.len()));
+            if queues[q].try_send(frame).is_err() {
+                debug!("rx queue {} is full, drop a frame", q);
             }
-            total_size += len;
-            let io_slice = unsafe { slice::from_raw_parts_mut(addr as *mut u8, len) };
-            iov.push(IoSliceMut::new(io_slice));
         }
-        let mut vmpktdesc = VmPktDesc {
-            vm_flags: 0,
-            vm_pkt_iovcnt: iov.len() as u32,
-            vm_pkt_size: total_size,
-            vm_pkt_iov: iov.as_mut_ptr(),
+    }
+}
+
+/// Handles the commands on the control queue, virtio 1.1, 5.1.6.5
+pub(super) struct NetCtrlDescHandler {
+    state: Arc<NetState>,
+    max_queue_pairs: u16,
+}
+
+/// Reads a `struct virtio_net_ctrl_mac`, a le32 count followed by that many
+/// MAC addresses, at `offset` of `regions`. Returns the addresses and the
+/// offset after them.
+fn read_mac_list(regions: &[(usize, usize)], offset: usize) -> Option<(Vec<[u8; 6]>, usize)> {
+    let entries = read_pod::<u32>(regions, offset)? as usize;
+    let macs = (0..entries)
+        .map(|i| read_pod::<[u8; 6]>(regions, offset + 4 + 6 * i))
+        .collect::<Option<Vec<_>>>()?;
+    Some((macs, offset + 4 + 6 * entries))
+}
+
+impl NetCtrlDescHandler {
+    pub(super) fn new(state: Arc<NetState>, max_queue_pairs: u16) -> Self {
+        NetCtrlDescHandler {
+            state,
+            max_queue_pairs,
+        }
+    }
+
+    fn rx_mode(&self, cmd: u8, on: bool) -> bool {
+        let mut filter = self.state.rx_filter.write().unwrap();
+        let flag = match cmd {
+            VIRTIO_NET_CTRL_RX_PROMISC => &mut filter.promisc,
+            VIRTIO_NET_CTRL_RX_ALLMULTI => &mut filter.allmulti,
+            VIRTIO_NET_CTRL_RX_ALLUNI => &mut filter.alluni,
+            VIRTIO_NET_CTRL_RX_NOMULTI => &mut filter.nomulti,
+            VIRTIO_NET_CTRL_RX_NOUNI => &mut filter.nouni,
+            VIRTIO_NET_CTRL_RX_NOBCAST => &mut filter.nobcast,
+            _ => return false,
+        };
+        *flag = on;
+        true
+    }
+
+    fn mac_table_set(&self, readable: &[(usize, usize)]) -> bool {
+        let (unicast, offset) = match read_mac_list(readable, 2) {
+            Some(list) => list,
+            None => return false,
+        };
+        let (multicast, _) = match read_mac_list(readable, offset) {
+            Some(list) => list,
+            None => return false,
         };
-        let mut pkt_count = 1;
-        let ret = unsafe { vmnet_read_blocking(self.interface, &mut vmpktdesc, &mut pkt_count) };
-        if ret == VMNET_SUCCESS && pkt_count == 1 {
-            info!("net_rx_srv, get {} bytes", vmpktdesc.vm_pkt_size);
-            let (addr, _) = writable[0];
-            let first_buffer = unsafe { slice::from_raw_parts_mut(addr as *mut u16, 8) };
-            for i in 0..5 {
-                first_buffer[i] = 0;
+        let mut filter = self.state.rx_filter.write().unwrap();
+        filter.unicast = unicast;
+        filter.multicast = multicast;
+        true
+    }
+}
+
+impl VirtqDescHandle for NetCtrlDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+        let (readable, writable) = desc_chain.split_at(desc_chain.len() - writable_count);
+        let class = read_pod::<u8>(readable, 0);
+        let cmd = read_pod::<u8>(readable, 1);
+        let ok = |b: bool| if b { VIRTIO_NET_OK } else { VIRTIO_NET_ERR };
+        let ack = match (class, cmd) {
+            (Some(VIRTIO_NET_CTRL_RX), Some(cmd)) => match read_pod::<u8>(readable, 2) {
+                Some(on) => ok(self.rx_mode(cmd, on != 0)),
+                None => VIRTIO_NET_ERR,
+            },
+            (Some(VIRTIO_NET_CTRL_MAC), Some(VIRTIO_NET_CTRL_MAC_TABLE_SET)) => {
+                ok(self.mac_table_set(readable))
             }
-            first_buffer[5] = 1;
-            let content = format!("{:04x?}", first_buffer);
-            error!("rx header {}", content);
-            (vmpktdesc.vm_pkt_size + VIRTIO_HEADER_SIZE) as u32
+            (Some(VIRTIO_NET_CTRL_MQ), Some(VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET)) => {
+                match read_pod::<u16>(readable, 2) {
+                    Some(n) if n >= 1 && n <= self.max_queue_pairs => {
+                        info!("virtio-net: {} queue pairs enabled", n);
+                        self.state.queue_pairs.store(n as usize, Ordering::Relaxed);
+                        VIRTIO_NET_OK
+                    }
+                    n => {
+                        warn!("virtio-net: invalid number of queue pairs {:?}", n);
+                        VIRTIO_NET_ERR
+                    }
+                }
+            }
+            _ => {
+                warn!("virtio-net: unsupported command {:?}/{:?}", class, cmd);
+                VIRTIO_NET_ERR
+            }
+        };
+        scatter(writable, &[ack]) as u32
+    }
+}
+
+/// Queue 2 is the control queue, unless the driver negotiates
+/// `VIRTIO_NET_F_MQ`, which makes it the second receive queue and moves the
+/// control queue to the end, see virtio 1.1, 5.1.2.
+struct NetQueue2Handler {
+    rx: NetRxDescHandler,
+    ctrl: NetCtrlDescHandler,
+}
+
+impl VirtqDescHandle for NetQueue2Handler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        self.handle_desc_chains(virtq, index, 1, gpa2hva)
+            .first()
+            .cloned()
+            .unwrap_or(0)
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        if self.ctrl.state.features.load(Ordering::Relaxed) & (1 << VIRTIO_NET_F_MQ) != 0 {
+            self.rx.handle_desc_chains(virtq, index, count, gpa2hva)
         } else {
-            error!("vmnet_read() returns {}", ret);
-            0
+            self.ctrl.handle_desc_chains(virtq, index, count, gpa2hva)
         }
     }
 }
 
-/// delivers incoming network packets to the guest
+/// Transmits the guest's output network packets
+///
+/// All the packets the guest has queued are handed to the backend in one
+/// `send()` call. If the backend takes virtio-net headers, the guest's
+/// buffers go to it as they are. Otherwise it takes plain Ethernet frames, so
+/// frames with a partial checksum or GSO frames are copied, completed and
+/// segmented first.
 struct NetTxDescHandler {
-    interface: usize,
+    backend: Arc<dyn NetBackend>,
+    /// the backend queue the frames go to
+    queue: usize,
+    max_packets: u16,
+    tap: QueueTap,
 }
 
 impl VirtqDescHandle for NetTxDescHandler {
@@ -140,43 +603,130 @@ impl VirtqDescHandle for NetTxDescHandler {
         index: u16,
         gpa2hva: &AddressConverter,
     ) -> u32 {
-        let (readable, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
-        debug_assert_eq!(writable_count, 0);
-        let mut trim_length = VIRTIO_HEADER_SIZE;
-        let mut iov = Vec::with_capacity(readable.len());
-        let mut total_size = 0;
-        for (mut addr, mut len) in readable.into_iter() {
-            if trim_length > 0 {
-                if len > trim_length {
-                    len -= trim_length;
-                    addr += trim_length;
-                    trim_length = 0;
-                } else {
-                    trim_length -= len;
-                    continue;
+        self.handle_desc_chains(virtq, index, 1, gpa2hva);
+        0
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        let count = std::cmp::min(count, self.max_packets);
+        // frames that needed offload work; the packets refer to their buffers
+        let mut frames: Vec<Vec<u8>> = Vec::new();
+        let mut packets = Vec::with_capacity(count as usize);
+        for i in 0..count {
+            let (readable, writable_count) =
+                virtq.get_desc_chain(index.wrapping_add(i), |gpa| gpa2hva(gpa));
+            debug_assert_eq!(writable_count, 0);
+            if self.backend.vnet_hdr() {
+                packets.push(readable);
+                continue;
+            }
+            let hdr = read_pod::<VirtioNetHdr>(&readable, 0).unwrap_or_default();
+            let payload = packet_regions(&readable);
+            if hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM == 0
+                && hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE
+            {
+                packets.push(payload);
+                continue;
+            }
+            let mut frame = vec![0u8; total_len(&payload)];
+            gather(&payload, &mut frame);
+            let first = frames.len();
+            if let Err(e) = prepare_tx(&hdr, frame, &mut frames) {
+                warn!("virtio-net: drop a frame: {}", e);
+            }
+            packets.extend(
+                frames[first..]
+                    .iter()
+                    .map(|f| vec![(f.as_ptr() as usize, f.len())]),
+            );
+        }
+        // segmentation may produce more packets than the backend takes at once
+        for batch in packets.chunks(self.max_packets as usize) {
+            if self.tap.is_on() {
+                for packet in batch {
+                    let frame = if self.backend.vnet_hdr() {
+                        packet_regions(packet)
+                    } else {
+                        packet.clone()
+                    };
+                    self.tap.record(&frame, total_len(&frame));
                 }
             }
-            total_size += len;
-            let io_slice = unsafe { slice::from_raw_parts_mut(addr as *mut u8, len) };
+            match self.backend.send(self.queue, batch) {
+                Ok(n) if n == batch.len() => debug!("net_tx_srv, write {} packets", n),
+                Ok(n) => error!("virtio-net: {} of {} packets sent", n, batch.len()),
+                Err(e) => error!("virtio-net: send: {:?}", e),
+            }
+        }
+        vec![0; count as usize]
+    }
+}
+/// State shared by the queues of a device and its config space
+pub struct NetState {
+    /// features negotiated by the driver
+    pub(super) features: AtomicU64,
+    /// queue pairs enabled by the driver
+    pub(super) queue_pairs: AtomicUsize,
+    /// receive filter set through the control queue
+    pub(super) rx_filter: RwLock<RxFilter>,
+    /// frames dropped because no guest buffers could ever hold them
+    pub(super) rx_dropped: AtomicU64,
+}
 
-            iov.push(IoSliceMut::new(io_slice));
+impl NetState {
+    pub(super) fn new() -> Self {
+        NetState {
+            features: AtomicU64::new(0),
+            queue_pairs: AtomicUsize::new(1),
+            rx_filter: RwLock::new(RxFilter::default()),
+            rx_dropped: AtomicU64::new(0),
         }
-        let vmpktdesc = VmPktDesc {
-            vm_flags: 0,
-            vm_pkt_iovcnt: iov.len() as u32,
-            vm_pkt_size: total_size,
-            vm_pkt_iov: iov.as_mut_ptr(),
-        };
-        let mut pkt_count = 1;
-        let ret = unsafe { vmnet_write(self.interface, &vmpktdesc, &mut pkt_count) };
-        if ret == VMNET_SUCCESS && pkt_count == 1 {
-            info!("net_tx_srv, write {} bytes", vmpktdesc.vm_pkt_size);
+    }
+
+    pub(super) fn features(&self) -> u64 {
+        self.features.load(Ordering::Relaxed)
+    }
+
+    /// Returns true if a device with the MAC address `mac` receives a frame
+    /// sent to `dst`. Without `VIRTIO_NET_F_CTRL_RX`, the driver cannot set up
+    /// filters, so the device receives all broadcast and multicast frames.
+    pub(super) fn accepts(&self, mac: &[u8; 6], dst: &[u8; 6]) -> bool {
+        if self.features() & (1 << VIRTIO_NET_F_CTRL_RX) == 0 {
+            return dst == mac || dst[0] & 1 != 0;
+        }
+        let filter = self.rx_filter.read().unwrap();
+        if filter.promisc {
+            true
+        } else if dst == &[0xff; 6] {
+            !filter.nobcast
+        } else if dst[0] & 1 != 0 {
+            !filter.nomulti && (filter.allmulti || filter.multicast.contains(dst))
         } else {
-            error!("vmnet_write returns {}", ret);
+            !filter.nouni && (dst == mac || filter.alluni || filter.unicast.contains(dst))
         }
-        0
     }
 }
+
+/// The receive modes and MAC address tables of virtio 1.1, 5.1.6.5.1 and
+/// 5.1.6.5.2
+#[derive(Debug, Default)]
+pub struct RxFilter {
+    pub promisc: bool,
+    pub allmulti: bool,
+    pub alluni: bool,
+    pub nomulti: bool,
+    pub nouni: bool,
+    pub nobcast: bool,
+    pub unicast: Vec<[u8; 6]>,
+    pub multicast: Vec<[u8; 6]>,
+}
+
 /// virtio-net device's config space, see virtio 1.1, 5.1.4 Device configuration layout
 pub struct VirtioNetCfg {
     pub mac: [u8; 6],
@@ -184,6 +734,9 @@ pub struct VirtioNetCfg {
     pub max_virtqueue_pairs: u16,
     pub mtu: u16,
     pub gen: u32,
+    pub state: Arc<NetState>,
+    /// the backend that is told the negotiated features
+    pub backend: Option<Arc<dyn NetBackend>>,
 }
 
 impl VirtioDevCfg for VirtioNetCfg {
@@ -204,68 +757,177 @@ impl VirtioDevCfg for VirtioNetCfg {
 
     fn reset(&mut self) {
         self.status = 0;
+        self.state.features.store(0, Ordering::Relaxed);
+        self.state.queue_pairs.store(1, Ordering::Relaxed);
+        *self.state.rx_filter.write().unwrap() = RxFilter::default();
         self.gen += 1;
     }
 
+    fn features_ok(&mut self, features: u64) {
+        self.state.features.store(features, Ordering::Relaxed);
+        if let Some(backend) = &self.backend {
+            backend.set_features(features);
+        }
+    }
+
     fn generation(&self) -> u32 {
         self.gen
     }
 }
 
 impl VirtioDevice {
+    /// Creates a virtio-net device on a new vmnet interface, see
+    /// [`new_net()`](#method.new_net).
     pub fn new_vmnet(
         name: String,
         irq: u32,
         irq_sender: Sender<u32>,
         gpa2hva: AddressConverter,
+        queue_pairs: u16,
+        capture: &Arc<PacketCapture>,
     ) -> Self {
-        let mut interface = 0;
-        let mut mac_str = vec![0u8; 17];
-        let mut mtu = 0u16;
-        let ret = unsafe { create_interface(&mut interface, mac_str.as_mut_ptr(), &mut mtu) };
-        if ret != 0 {
-            panic!("cannot create vmnet interface. root privilege is required.");
-        }
-        let mac_vec: Vec<u8> = String::from_utf8(mac_str)
-            .unwrap()
-            .split(':')
-            .map(|c| u8::from_str_radix(c, 16).unwrap())
-            .collect();
-        let mut mac = [0u8; 6];
-        mac.copy_from_slice(&mac_vec);
+        let backend =
+            Vmnet::new().expect("cannot create vmnet interface. root privilege is required.");
+        Self::new_net(
+            name,
+            irq,
+            irq_sender,
+            gpa2hva,
+            Arc::new(backend),
+            queue_pairs,
+            capture,
+        )
+    }
+
+    /// Creates a virtio-net device on `backend` with `queue_pairs` pairs of
+    /// receive and transmit queues, each queue served by its own thread. A
+    /// guest with several vCPUs can process one queue pair on each. Every
+    /// queue gets a tap of `capture`.
+    pub fn new_net(
+        name: String,
+        irq: u32,
+        irq_sender: Sender<u32>,
+        gpa2hva: AddressConverter,
+        backend: Arc<dyn NetBackend>,
+        queue_pairs: u16,
+        capture: &Arc<PacketCapture>,
+    ) -> Self {
+        let queue_pairs = std::cmp::max(1, queue_pairs);
+        let mtu = backend.mtu();
+        let state = Arc::new(NetState::new());
         let net_cfg = VirtioNetCfg {
-            mac,
+            mac: backend.mac(),
             status: 0,
-            max_virtqueue_pairs: 1,
+            max_virtqueue_pairs: queue_pairs,
             mtu,
             gen: 0,
+            state: state.clone(),
+            backend: Some(backend.clone()),
         };
+        let frame_max = mtu as usize + ETH_HLEN + VLAN_HLEN;
+        let mut sources = Vec::new();
+        if backend.queues() >= queue_pairs as usize {
+            sources.extend((0..queue_pairs as usize).map(RxSource::Backend));
+        } else {
+            let mut senders = Vec::new();
+            for _ in 0..queue_pairs {
+                let (tx, rx) = bounded(RX_STEER_BACKLOG);
+                senders.push(tx);
+                sources.push(RxSource::Steered(rx));
+            }
+            let steer_state = state.clone();
+            let steer_backend = backend.clone();
+            std::thread::Builder::new()
+                .name(format!("{}_rx_steer", name))
+                .spawn(move || steer_rx(steer_backend, frame_max, steer_state, senders))
+                .expect("cannot create the rx steering thread");
+        }
         let isr = Arc::new(RwLock::new(0));
-        let rx = VirtqManager::new(
-            format!("{}_rx", name),
-            64,
-            irq,
-            irq_sender.clone(),
-            isr.clone(),
-            gpa2hva.clone(),
-            NetRxDescHandler { interface },
-        );
-        let tx = VirtqManager::new(
-            format!("{}_tx", name),
+        let mut vqs = Vec::new();
+        for (i, source) in sources.into_iter().enumerate() {
+            let rx_name = format!("{}_rx{}", name, i);
+            let rx = NetRxDescHandler::new(
+                backend.clone(),
+                state.clone(),
+                source,
+                frame_max,
+                capture.tap(rx_name.clone()),
+            );
+            vqs.push(if i == 1 {
+                let ctrl = NetCtrlDescHandler {
+                    state: state.clone(),
+                    max_queue_pairs: queue_pairs,
+                };
+                let handler = NetQueue2Handler { rx, ctrl };
+                VirtqManager::new(
+                    rx_name,
+                    64,
+                    irq,
+                    irq_sender.clone(),
+                    isr.clone(),
+                    gpa2hva.clone(),
+                    handler,
+                )
+            } else {
+                VirtqManager::new(
+                    rx_name,
+                    64,
+                    irq,
+                    irq_sender.clone(),
+                    isr.clone(),
+                    gpa2hva.clone(),
+                    rx,
+                )
+            });
+            // a TSO frame of 64 KiB may take up to 19 descriptors
+            let tx_name = format!("{}_tx{}", name, i);
+            let tap = capture.tap(tx_name.clone());
+            vqs.push(VirtqManager::new(
+                tx_name,
+                256,
+                irq,
+                irq_sender.clone(),
+                isr.clone(),
+                gpa2hva.clone(),
+                NetTxDescHandler {
+                    backend: backend.clone(),
+                    queue: i % backend.queues(),
+                    max_packets: backend.max_packets(),
+                    tap,
+                },
+            ));
+        }
+        vqs.push(VirtqManager::new(
+            format!("{}_ctrl", name),
             64,
             irq,
             irq_sender.clone(),
             isr.clone(),
             gpa2hva.clone(),
-            NetTxDescHandler { interface },
-        );
+            NetCtrlDescHandler {
+                state: state.clone(),
+                max_queue_pairs: queue_pairs,
+            },
+        ));
 
-        let vqs = vec![rx, tx];
+        let mut dev_feat = (1 << VIRTIO_F_VERSION_1)
+            | (1 << VIRTIO_NET_F_MAC)
+            | (1 << VIRTIO_NET_F_MTU)
+            | (1 << VIRTIO_NET_F_CSUM)
+            | (1 << VIRTIO_NET_F_GUEST_CSUM)
+            | (1 << VIRTIO_NET_F_HOST_TSO4)
+            | (1 << VIRTIO_NET_F_HOST_TSO6)
+            | (1 << VIRTIO_NET_F_HOST_ECN)
+            | (1 << VIRTIO_NET_F_MRG_RXBUF)
+            | (1 << VIRTIO_NET_F_CTRL_VQ);
+        if queue_pairs > 1 {
+            dev_feat |= 1 << VIRTIO_NET_F_MQ;
+        }
 
         VirtioDevice {
             name,
             dev_id: VirtioId::Net,
-            dev_feat: (1 << VIRTIO_F_VERSION_1) | (1 << VIRTIO_NET_F_MAC) | (1 << VIRTIO_NET_F_MTU),
+            dev_feat,
             dri_feat: 0,
             dev_feat_sel: 0,
             dri_feat_sel: 0,
@@ -0,0 +1,831 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Backends of the virtio-net device
+
+A backend carries the frames of a virtio-net device to and from the host:
+
+- [`Vmnet`]: an interface of macOS's
+  [vmnet](https://developer.apple.com/documentation/vmnet?language=objc)
+  framework;
+- [`Tap`]: a Linux TAP interface with one file descriptor per queue. Frames
+  carry virtio-net headers, so the kernel completes the checksums and
+  segments the TSO frames of the guest;
+- [`Packet`]: an `AF_PACKET` socket on an existing Linux interface. The kernel
+  fills a `TPACKET_V3` ring shared with the device in blocks of frames, and
+  the device reads a block's frames without a system call per frame;
+- [`UnixDgram`]: a unix datagram socket carrying one frame per datagram. It
+  needs no privilege, which suits tests and userspace switches.
+*/
+
+use super::net::{VIRTIO_HEADER_SIZE, VIRTIO_NET_F_GUEST_CSUM};
+use super::virtq::scatter;
+use crate::err::Error;
+#[allow(unused_imports)]
+use log::*;
+use std::io::{self, IoSliceMut};
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::net::UnixDatagram;
+use std::path::Path;
+use std::slice;
+
+pub trait NetBackend: Send + Sync {
+    /// The MAC address of the guest
+    fn mac(&self) -> [u8; 6];
+    fn mtu(&self) -> u16;
+    /// The most frames a call of `recv()` or `send()` takes
+    fn max_packets(&self) -> u16;
+    /// Number of queues that are read and written independently. The backend
+    /// steers incoming frames among them.
+    fn queues(&self) -> usize {
+        1
+    }
+    /// True if every frame is preceded by a virtio-net header of
+    /// `VIRTIO_HEADER_SIZE` bytes, in both directions.
+    fn vnet_hdr(&self) -> bool {
+        false
+    }
+    /// Tells the backend the features the driver negotiated.
+    fn set_features(&self, _features: u64) {}
+    /// Waits for frames on `queue` and reads them into `packets`, one frame
+    /// into the buffers of each packet. Returns the size of every frame read,
+    /// at least one.
+    fn recv(&self, queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<Vec<usize>, Error>;
+    /// Sends the frame in the buffers of each packet on `queue`. Returns the
+    /// number of frames sent.
+    fn send(&self, queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<usize, Error>;
+}
+
+/// Returns a random, locally administered unicast MAC address.
+pub fn random_mac() -> [u8; 6] {
+    use std::collections::hash_map::RandomState;
+    use std::hash::{BuildHasher, Hasher};
+    let bits = RandomState::new().build_hasher().finish();
+    let mut mac = [0u8; 6];
+    mac.copy_from_slice(&bits.to_le_bytes()[..6]);
+    mac[0] = (mac[0] & 0xfe) | 0x02;
+    mac
+}
+
+pub const VMNET_SUCCESS: u32 = 1000;
+
+#[repr(C)]
+struct VmPktDesc<'a> {
+    vm_pkt_size: usize,
+    vm_pkt_iov: *mut IoSliceMut<'a>,
+    vm_pkt_iovcnt: u32,
+    vm_flags: u32,
+}
+
+extern "C" {
+    fn vmnet_read_blocking(interface: usize, packets: *mut VmPktDesc, pktcnt: *mut u32) -> u32;
+    fn vmnet_write(interface: usize, packets: *const VmPktDesc, pktcnt: *mut u32) -> u32;
+    fn create_interface(
+        interface: *mut usize,
+        mac: *mut u8,
+        mtu: *mut u16,
+        max_pkts: *mut u32,
+    ) -> u32;
+}
+
+fn regions_iov(regions: &[(usize, usize)]) -> Vec<IoSliceMut<'static>> {
+    regions
+        .iter()
+        .map(|&(addr, len)| {
+            IoSliceMut::new(unsafe { slice::from_raw_parts_mut(addr as *mut u8, len) })
+        })
+        .collect()
+}
+
+/// Builds the vmnet packet descriptors for `iovs`. The descriptors point into
+/// `iovs`, which must outlive them.
+fn packet_descs<'a>(iovs: &mut [Vec<IoSliceMut<'a>>]) -> Vec<VmPktDesc<'a>> {
+    iovs.iter_mut()
+        .map(|iov| VmPktDesc {
+            vm_pkt_size: iov.iter().map(|s| s.len()).sum(),
+            vm_pkt_iov: iov.as_mut_ptr(),
+            vm_pkt_iovcnt: iov.len() as u32,
+            vm_flags: 0,
+        })
+        .collect()
+}
+
+/// An interface of vmnet in shared mode
+pub struct Vmnet {
+    interface: usize,
+    mac: [u8; 6],
+    mtu: u16,
+    max_packets: u16,
+}
+
+impl Vmnet {
+    /// Creates a vmnet interface. Root privilege is required.
+    pub fn new() -> Result<Self, Error> {
+        let mut interface = 0;
+        let mut mac_str = vec![0u8; 17];
+        let mut mtu = 0u16;
+        let mut max_pkts = 0u32;
+        let ret = unsafe {
+            create_interface(
+                &mut interface,
+                mac_str.as_mut_ptr(),
+                &mut mtu,
+                &mut max_pkts,
+            )
+        };
+        if ret != 0 {
+            return Err((ret, "create_interface").into());
+        }
+        let mac_vec: Vec<u8> = String::from_utf8(mac_str)
+            .unwrap()
+            .split(':')
+            .map(|c| u8::from_str_radix(c, 16).unwrap())
+            .collect();
+        let mut mac = [0u8; 6];
+        mac.copy_from_slice(&mac_vec);
+        // vmnet_read() and vmnet_write() take at most max_pkts packets per call
+        let max_packets = std::cmp::max(1, std::cmp::min(max_pkts, u16::MAX as u32)) as u16;
+        Ok(Vmnet {
+            interface,
+            mac,
+            mtu,
+            max_packets,
+        })
+    }
+}
+
+impl NetBackend for Vmnet {
+    fn mac(&self) -> [u8; 6] {
+        self.mac
+    }
+
+    fn mtu(&self) -> u16 {
+        self.mtu
+    }
+
+    fn max_packets(&self) -> u16 {
+        self.max_packets
+    }
+
+    fn recv(&self, _queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<Vec<usize>, Error> {
+        let mut iovs: Vec<_> = packets.iter().map(|p| regions_iov(p)).collect();
+        let mut descs = packet_descs(&mut iovs);
+        loop {
+            let mut pkt_count = descs.len() as u32;
+            let ret =
+                unsafe { vmnet_read_blocking(self.interface, descs.as_mut_ptr(), &mut pkt_count) };
+            if ret != VMNET_SUCCESS {
+                return Err((ret, "vmnet_read").into());
+            }
+            if pkt_count > 0 {
+                let sizes = descs[..pkt_count as usize]
+                    .iter()
+                    .map(|d| d.vm_pkt_size)
+                    .collect();
+                return Ok(sizes);
+            }
+        }
+    }
+
+    fn send(&self, _queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<usize, Error> {
+        let mut iovs: Vec<_> = packets.iter().map(|p| regions_iov(p)).collect();
+        let descs = packet_descs(&mut iovs);
+        let mut pkt_count = descs.len() as u32;
+        let ret = unsafe { vmnet_write(self.interface, descs.as_ptr(), &mut pkt_count) };
+        if ret != VMNET_SUCCESS {
+            return Err((ret, "vmnet_write").into());
+        }
+        Ok(pkt_count as usize)
+    }
+}
+
+/// frames a file-descriptor backend reads or writes per call
+const FD_MAX_PACKETS: u16 = 64;
+
+fn iovecs(regions: &[(usize, usize)]) -> Vec<libc::iovec> {
+    regions
+        .iter()
+        .map(|&(addr, len)| libc::iovec {
+            iov_base: addr as *mut libc::c_void,
+            iov_len: len,
+        })
+        .collect()
+}
+
+/// Waits until `fd` has one of `events`.
+fn wait_fd(fd: RawFd, events: libc::c_short) -> Result<(), Error> {
+    let mut pfd = libc::pollfd {
+        fd,
+        events,
+        revents: 0,
+    };
+    loop {
+        if unsafe { libc::poll(&mut pfd, 1, -1) } >= 0 {
+            return Ok(());
+        }
+        let e = io::Error::last_os_error();
+        if e.kind() != io::ErrorKind::Interrupted {
+            return Err(e.into());
+        }
+    }
+}
+
+/// Reads one frame per `readv()` from the non-blocking `fd` into `packets`
+/// until `fd` has no more, waiting for the first one.
+fn read_fd_frames(fd: RawFd, packets: &[Vec<(usize, usize)>]) -> Result<Vec<usize>, Error> {
+    let mut sizes = Vec::with_capacity(packets.len());
+    while sizes.len() < packets.len() {
+        let iov = iovecs(&packets[sizes.len()]);
+        let n = unsafe { libc::readv(fd, iov.as_ptr(), iov.len() as libc::c_int) };
+        if n >= 0 {
+            sizes.push(n as usize);
+            continue;
+        }
+        let e = io::Error::last_os_error();
+        match e.kind() {
+            io::ErrorKind::Interrupted => {}
+            io::ErrorKind::WouldBlock if sizes.is_empty() => wait_fd(fd, libc::POLLIN)?,
+            io::ErrorKind::WouldBlock => break,
+            _ if sizes.is_empty() => return Err(e.into()),
+            _ => break,
+        }
+    }
+    Ok(sizes)
+}
+
+/// Writes the frame of each packet with one `writev()` to the non-blocking
+/// `fd`, waiting while `fd` is not writable.
+fn write_fd_frames(fd: RawFd, packets: &[Vec<(usize, usize)>]) -> Result<usize, Error> {
+    for (i, packet) in packets.iter().enumerate() {
+        let iov = iovecs(packet);
+        loop {
+            if unsafe { libc::writev(fd, iov.as_ptr(), iov.len() as libc::c_int) } >= 0 {
+                break;
+            }
+            let e = io::Error::last_os_error();
+            match e.kind() {
+                io::ErrorKind::Interrupted => {}
+                io::ErrorKind::WouldBlock => wait_fd(fd, libc::POLLOUT)?,
+                _ if i == 0 => return Err(e.into()),
+                _ => return Ok(i),
+            }
+        }
+    }
+    Ok(packets.len())
+}
+
+/// A unix datagram socket with one frame per datagram
+pub struct UnixDgram {
+    socket: UnixDatagram,
+    mac: [u8; 6],
+    mtu: u16,
+}
+
+impl UnixDgram {
+    fn from_socket(socket: UnixDatagram, mac: Option<[u8; 6]>) -> Result<Self, Error> {
+        socket.set_nonblocking(true)?;
+        Ok(UnixDgram {
+            socket,
+            mac: mac.unwrap_or_else(random_mac),
+            mtu: 1500,
+        })
+    }
+
+    /// Binds a socket to `path`, replacing a stale socket there, and sends
+    /// frames to the socket at `peer`.
+    pub fn connect(
+        path: impl AsRef<Path>,
+        peer: impl AsRef<Path>,
+        mac: Option<[u8; 6]>,
+    ) -> Result<Self, Error> {
+        let _ = std::fs::remove_file(&path);
+        let socket = UnixDatagram::bind(path)?;
+        socket.connect(peer)?;
+        Self::from_socket(socket, mac)
+    }
+
+    /// Creates a backend and the socket at the other end of its link.
+    pub fn pair(mac: Option<[u8; 6]>) -> Result<(Self, UnixDatagram), Error> {
+        let (socket, peer) = UnixDatagram::pair()?;
+        Ok((Self::from_socket(socket, mac)?, peer))
+    }
+}
+
+impl NetBackend for UnixDgram {
+    fn mac(&self) -> [u8; 6] {
+        self.mac
+    }
+
+    fn mtu(&self) -> u16 {
+        self.mtu
+    }
+
+    fn max_packets(&self) -> u16 {
+        FD_MAX_PACKETS
+    }
+
+    fn recv(&self, _queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<Vec<usize>, Error> {
+        read_fd_frames(self.socket.as_raw_fd(), packets)
+    }
+
+    fn send(&self, _queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<usize, Error> {
+        write_fd_frames(self.socket.as_raw_fd(), packets)
+    }
+}
+
+#[cfg(target_os = "linux")]
+pub use self::linux::{Packet, Tap};
+
+#[cfg(target_os = "linux")]
+mod linux {
+    use super::*;
+    use std::fs::{File, OpenOptions};
+    use std::os::unix::fs::OpenOptionsExt;
+    use std::sync::atomic::{AtomicU32, Ordering};
+    use std::sync::Mutex;
+
+    const IFNAMSIZ: usize = 16;
+    const SIOCGIFMTU: libc::c_ulong = 0x8921;
+    const SIOCGIFINDEX: libc::c_ulong = 0x8933;
+
+    const TUNSETIFF: libc::c_ulong = 0x400454ca;
+    const TUNSETOFFLOAD: libc::c_ulong = 0x400454d0;
+    const TUNSETVNETHDRSZ: libc::c_ulong = 0x400454d8;
+    const IFF_TAP: u16 = 0x0002;
+    const IFF_MULTI_QUEUE: u16 = 0x0100;
+    const IFF_NO_PI: u16 = 0x1000;
+    const IFF_VNET_HDR: u16 = 0x4000;
+    const TUN_F_CSUM: libc::c_uint = 0x01;
+
+    const ETH_P_ALL: u16 = 0x0003;
+    const SOL_PACKET: libc::c_int = 263;
+    const PACKET_ADD_MEMBERSHIP: libc::c_int = 1;
+    const PACKET_RX_RING: libc::c_int = 5;
+    const PACKET_VERSION: libc::c_int = 10;
+    const PACKET_FANOUT: libc::c_int = 18;
+    const PACKET_IGNORE_OUTGOING: libc::c_int = 23;
+    const PACKET_MR_PROMISC: u16 = 1;
+    const PACKET_FANOUT_HASH: u32 = 0;
+    const PACKET_FANOUT_FLAG_DEFRAG: u32 = 0x8000;
+    const TPACKET_V3: libc::c_int = 2;
+    const TP_STATUS_KERNEL: u32 = 0;
+    const TP_STATUS_USER: u32 = 1;
+
+    /// Each block of the receive ring of a queue of [`Packet`] holds many
+    /// frames; the kernel hands over a block when it is full or after
+    /// `PACKET_BLOCK_TIMEOUT` milliseconds.
+    const PACKET_BLOCK_SIZE: u32 = 1 << 18;
+    const PACKET_BLOCK_NR: u32 = 32;
+    const PACKET_FRAME_SIZE: u32 = 2048;
+    const PACKET_BLOCK_TIMEOUT: u32 = 1;
+
+    /// `struct ifreq` with the union as bytes
+    #[repr(C)]
+    #[derive(Default)]
+    struct IfReq {
+        name: [u8; IFNAMSIZ],
+        data: [u8; 24],
+    }
+
+    impl IfReq {
+        fn new(name: &str) -> Result<Self, Error> {
+            let mut req = IfReq::default();
+            if name.len() >= IFNAMSIZ {
+                return Err(format!("interface name {} is too long", name).into());
+            }
+            req.name[..name.len()].copy_from_slice(name.as_bytes());
+            Ok(req)
+        }
+
+        fn int(&self) -> i32 {
+            let mut bytes = [0u8; 4];
+            bytes.copy_from_slice(&self.data[..4]);
+            i32::from_ne_bytes(bytes)
+        }
+    }
+
+    fn ioctl(fd: RawFd, request: libc::c_ulong, arg: *mut libc::c_void) -> Result<(), Error> {
+        if unsafe { libc::ioctl(fd, request as _, arg) } < 0 {
+            Err(io::Error::last_os_error().into())
+        } else {
+            Ok(())
+        }
+    }
+
+    fn setsockopt<T>(
+        fd: RawFd,
+        level: libc::c_int,
+        name: libc::c_int,
+        value: &T,
+    ) -> io::Result<()> {
+        let ret = unsafe {
+            libc::setsockopt(
+                fd,
+                level,
+                name,
+                value as *const T as *const libc::c_void,
+                std::mem::size_of::<T>() as libc::socklen_t,
+            )
+        };
+        if ret < 0 {
+            Err(io::Error::last_os_error())
+        } else {
+            Ok(())
+        }
+    }
+
+    /// Queries the interface `name` with `request`, `SIOCGIFMTU` or
+    /// `SIOCGIFINDEX`, which both return an int.
+    fn query_interface(name: &str, request: libc::c_ulong) -> Result<i32, Error> {
+        let socket = UnixDatagram::unbound()?;
+        let mut req = IfReq::new(name)?;
+        ioctl(
+            socket.as_raw_fd(),
+            request,
+            &mut req as *mut IfReq as *mut libc::c_void,
+        )?;
+        Ok(req.int())
+    }
+
+    /// A TAP interface of Linux, with virtio-net headers and one file
+    /// descriptor per queue
+    pub struct Tap {
+        queues: Vec<File>,
+        mac: [u8; 6],
+        mtu: u16,
+    }
+
+    impl Tap {
+        /// Attaches `queues` queues to the TAP interface `name`, creating it if
+        /// it does not exist yet. This needs `CAP_NET_ADMIN`, unless the
+        /// interface was created for the user beforehand, e.g., with
+        /// `ip tuntap add <name> mode tap multi_queue user <user>`.
+        pub fn open(name: &str, queues: usize, mac: Option<[u8; 6]>) -> Result<Self, Error> {
+            let mut flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+            if queues > 1 {
+                flags |= IFF_MULTI_QUEUE;
+            }
+            let mut files = Vec::new();
+            for _ in 0..std::cmp::max(1, queues) {
+                let file = OpenOptions::new()
+                    .read(true)
+                    .write(true)
+                    .custom_flags(libc::O_NONBLOCK | libc::O_CLOEXEC)
+                    .open("/dev/net/tun")?;
+                let mut req = IfReq::new(name)?;
+                req.data[..2].copy_from_slice(&flags.to_ne_bytes());
+                let fd = file.as_raw_fd();
+                ioctl(fd, TUNSETIFF, &mut req as *mut IfReq as *mut libc::c_void)?;
+                let mut hdr_size = VIRTIO_HEADER_SIZE as libc::c_int;
+                ioctl(
+                    fd,
+                    TUNSETVNETHDRSZ,
+                    &mut hdr_size as *mut libc::c_int as *mut libc::c_void,
+                )?;
+                files.push(file);
+            }
+            let mtu = query_interface(name, SIOCGIFMTU).unwrap_or(1500) as u16;
+            info!("tap {}: {} queues, mtu {}", name, files.len(), mtu);
+            Ok(Tap {
+                queues: files,
+                mac: mac.unwrap_or_else(random_mac),
+                mtu,
+            })
+        }
+    }
+
+    impl NetBackend for Tap {
+        fn mac(&self) -> [u8; 6] {
+            self.mac
+        }
+
+        fn mtu(&self) -> u16 {
+            self.mtu
+        }
+
+        fn max_packets(&self) -> u16 {
+            FD_MAX_PACKETS
+        }
+
+        fn queues(&self) -> usize {
+            self.queues.len()
+        }
+
+        fn vnet_hdr(&self) -> bool {
+            true
+        }
+
+        /// Frames to the guest may have a partial checksum if the guest
+        /// completes them. They are never larger than the MTU, so the device
+        /// keeps its receive buffer layout.
+        fn set_features(&self, features: u64) {
+            let mut offload = if features & (1 << VIRTIO_NET_F_GUEST_CSUM) != 0 {
+                TUN_F_CSUM
+            } else {
+                0
+            };
+            for file in self.queues.iter() {
+                let arg = &mut offload as *mut libc::c_uint as *mut libc::c_void;
+                if let Err(e) = ioctl(file.as_raw_fd(), TUNSETOFFLOAD, arg) {
+                    warn!("tap: TUNSETOFFLOAD {:x}: {:?}", offload, e);
+                }
+            }
+        }
+
+        fn recv(&self, queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<Vec<usize>, Error> {
+            read_fd_frames(self.queues[queue].as_raw_fd(), packets)
+        }
+
+        fn send(&self, queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<usize, Error> {
+            write_fd_frames(self.queues[queue].as_raw_fd(), packets)
+        }
+    }
+
+    #[repr(C)]
+    struct TpacketReq3 {
+        tp_block_size: u32,
+        tp_block_nr: u32,
+        tp_frame_size: u32,
+        tp_frame_nr: u32,
+        tp_retire_blk_tov: u32,
+        tp_sizeof_priv: u32,
+        tp_feature_req_word: u32,
+    }
+
+    #[repr(C)]
+    struct PacketMreq {
+        mr_ifindex: libc::c_int,
+        mr_type: u16,
+        mr_alen: u16,
+        mr_address: [u8; 8],
+    }
+
+    /// A socket of [`Packet`] and its receive ring
+    struct PacketQueue {
+        fd: RawFd,
+        ring: *mut u8,
+        /// the block the queue reads from
+        block: usize,
+        /// frames of `block` already read
+        read: u32,
+        /// offset of the next frame in `block`
+        offset: usize,
+    }
+
+    // the ring is only touched under the queue's lock
+    unsafe impl Send for PacketQueue {}
+
+    impl PacketQueue {
+        fn ring_size() -> usize {
+            (PACKET_BLOCK_SIZE * PACKET_BLOCK_NR) as usize
+        }
+
+        fn block_u32(&self, offset: usize) -> &AtomicU32 {
+            let block = self.block * PACKET_BLOCK_SIZE as usize;
+            unsafe { &*(self.ring.add(block + offset) as *const AtomicU32) }
+        }
+
+        /// `struct tpacket_block_desc`: version, offset_to_priv and then
+        /// `struct tpacket_hdr_v1` with block_status, num_pkts and
+        /// offset_to_first_pkt
+        fn block_status(&self) -> &AtomicU32 {
+            self.block_u32(8)
+        }
+
+        fn num_pkts(&self) -> u32 {
+            self.block_u32(12).load(Ordering::Relaxed)
+        }
+
+        fn first_pkt(&self) -> usize {
+            self.block_u32(16).load(Ordering::Relaxed) as usize
+        }
+
+        /// Copies the next frame of the current block, a `struct
+        /// tpacket3_hdr` followed by the frame at `tp_mac`, to `regions`.
+        fn read_frame(&mut self, regions: &[(usize, usize)]) -> usize {
+            let hdr = self.block * PACKET_BLOCK_SIZE as usize + self.offset;
+            let field = |offset: usize| -> u32 {
+                let mut bytes = [0u8; 4];
+                let src = unsafe { slice::from_raw_parts(self.ring.add(hdr + offset), 4) };
+                bytes.copy_from_slice(src);
+                u32::from_ne_bytes(bytes)
+            };
+            let next_offset = field(0) as usize;
+            let snaplen = field(12) as usize;
+            let mac = (field(24) & 0xffff) as usize;
+            let frame = unsafe { slice::from_raw_parts(self.ring.add(hdr + mac), snaplen) };
+            let n = scatter(regions, frame);
+            self.read += 1;
+            self.offset += next_offset;
+            n
+        }
+
+        fn recv(&mut self, packets: &[Vec<(usize, usize)>]) -> Result<Vec<usize>, Error> {
+            let mut sizes = Vec::with_capacity(packets.len());
+            while sizes.len() < packets.len() {
+                if self.block_status().load(Ordering::Acquire) & TP_STATUS_USER == 0 {
+                    if !sizes.is_empty() {
+                        break;
+                    }
+                    wait_fd(self.fd, libc::POLLIN | libc::POLLERR)?;
+                    continue;
+                }
+                if self.read == 0 {
+                    self.offset = self.first_pkt();
+                }
+                if self.read < self.num_pkts() {
+                    sizes.push(self.read_frame(&packets[sizes.len()]));
+                    continue;
+                }
+                // all frames of the block are read, return it to the kernel
+                self.block_status()
+                    .store(TP_STATUS_KERNEL, Ordering::Release);
+                self.block = (self.block + 1) % PACKET_BLOCK_NR as usize;
+                self.read = 0;
+            }
+            Ok(sizes)
+        }
+    }
+
+    impl Drop for PacketQueue {
+        fn drop(&mut self) {
+            unsafe {
+                if !self.ring.is_null() {
+                    libc::munmap(self.ring as *mut libc::c_void, Self::ring_size());
+                }
+                libc::close(self.fd);
+            }
+        }
+    }
+
+    /// `AF_PACKET` sockets on an existing interface, which is put into
+    /// promiscuous mode. With several queues, the sockets form a fanout group
+    /// and the kernel steers each flow to one of them.
+    pub struct Packet {
+        queues: Vec<Mutex<PacketQueue>>,
+        /// the sockets of `queues`, for sending without waiting for a
+        /// receiver blocked under a queue's lock
+        fds: Vec<RawFd>,
+        mac: [u8; 6],
+        mtu: u16,
+    }
+
+    impl Packet {
+        fn open_queue(ifindex: i32, fanout: Option<u32>) -> Result<PacketQueue, Error> {
+            let fd = unsafe {
+                libc::socket(
+                    libc::AF_PACKET,
+                    libc::SOCK_RAW | libc::SOCK_NONBLOCK | libc::SOCK_CLOEXEC,
+                    ETH_P_ALL.to_be() as libc::c_int,
+                )
+            };
+            if fd < 0 {
+                return Err(io::Error::last_os_error().into());
+            }
+            let mut queue = PacketQueue {
+                fd,
+                ring: std::ptr::null_mut(),
+                block: 0,
+                read: 0,
+                offset: 0,
+            };
+            setsockopt(fd, SOL_PACKET, PACKET_VERSION, &TPACKET_V3)?;
+            let req = TpacketReq3 {
+                tp_block_size: PACKET_BLOCK_SIZE,
+                tp_block_nr: PACKET_BLOCK_NR,
+                tp_frame_size: PACKET_FRAME_SIZE,
+                tp_frame_nr: PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE * PACKET_BLOCK_NR,
+                tp_retire_blk_tov: PACKET_BLOCK_TIMEOUT,
+                tp_sizeof_priv: 0,
+                tp_feature_req_word: 0,
+            };
+            setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req)?;
+            let ring = unsafe {
+                libc::mmap(
+                    std::ptr::null_mut(),
+                    PacketQueue::ring_size(),
+                    libc::PROT_READ | libc::PROT_WRITE,
+                    libc::MAP_SHARED,
+                    fd,
+                    0,
+                )
+            };
+            if ring == libc::MAP_FAILED {
+                return Err(io::Error::last_os_error().into());
+            }
+            queue.ring = ring as *mut u8;
+            let mut addr: libc::sockaddr_ll = unsafe { std::mem::zeroed() };
+            addr.sll_family = libc::AF_PACKET as u16;
+            addr.sll_protocol = ETH_P_ALL.to_be();
+            addr.sll_ifindex = ifindex;
+            let ret = unsafe {
+                libc::bind(
+                    fd,
+                    &addr as *const libc::sockaddr_ll as *const libc::sockaddr,
+                    std::mem::size_of::<libc::sockaddr_ll>() as libc::socklen_t,
+                )
+            };
+            if ret < 0 {
+                return Err(io::Error::last_os_error().into());
+            }
+            // frames the guest sends must not come back to it
+            if let Err(e) = setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &1i32) {
+                warn!("packet: PACKET_IGNORE_OUTGOING: {:?}", e);
+            }
+            let mreq = PacketMreq {
+                mr_ifindex: ifindex,
+                mr_type: PACKET_MR_PROMISC,
+                mr_alen: 0,
+                mr_address: [0; 8],
+            };
+            setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq)?;
+            if let Some(group) = fanout {
+                let arg = group | (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16;
+                setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg)?;
+            }
+            Ok(queue)
+        }
+
+        /// Opens `queues` queues on the interface `name`. This needs
+        /// `CAP_NET_RAW`.
+        pub fn open(name: &str, queues: usize, mac: Option<[u8; 6]>) -> Result<Self, Error> {
+            let ifindex = query_interface(name, SIOCGIFINDEX)?;
+            let mtu = query_interface(name, SIOCGIFMTU)? as u16;
+            let queues = std::cmp::max(1, queues);
+            let fanout = if queues > 1 {
+                Some(std::process::id() & 0xffff)
+            } else {
+                None
+            };
+            let queues = (0..queues)
+                .map(|_| Self::open_queue(ifindex, fanout).map(Mutex::new))
+                .collect::<Result<Vec<_>, _>>()?;
+            info!("packet {}: {} queues, mtu {}", name, queues.len(), mtu);
+            let fds = queues.iter().map(|q| q.lock().unwrap().fd).collect();
+            Ok(Packet {
+                queues,
+                fds,
+                mac: mac.unwrap_or_else(random_mac),
+                mtu,
+            })
+        }
+    }
+
+    impl NetBackend for Packet {
+        fn mac(&self) -> [u8; 6] {
+            self.mac
+        }
+
+        fn mtu(&self) -> u16 {
+            self.mtu
+        }
+
+        fn max_packets(&self) -> u16 {
+            FD_MAX_PACKETS
+        }
+
+        fn queues(&self) -> usize {
+            self.queues.len()
+        }
+
+        fn recv(&self, queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<Vec<usize>, Error> {
+            self.queues[queue].lock().unwrap().recv(packets)
+        }
+
+        fn send(&self, queue: usize, packets: &[Vec<(usize, usize)>]) -> Result<usize, Error> {
+            write_fd_frames(self.fds[queue], packets)
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn unix_dgram_test() {
+        let (backend, peer) = UnixDgram::pair(None).unwrap();
+        assert_eq!(backend.mac()[0] & 3, 2);
+        // a frame from two buffers is one datagram
+        let frame: Vec<u8> = (0..60).collect();
+        let base = frame.as_ptr() as usize;
+        let sent = backend
+            .send(0, &[vec![(base, 20), (base + 20, 40)], vec![(base, 10)]])
+            .unwrap();
+        assert_eq!(sent, 2);
+        let mut buf = [0u8; 100];
+        assert_eq!(peer.recv(&mut buf).unwrap(), 60);
+        assert_eq!(&buf[..60], &frame[..]);
+        assert_eq!(peer.recv(&mut buf).unwrap(), 10);
+
+        // the datagrams waiting are read in one call
+        peer.send(&frame[..30]).unwrap();
+        peer.send(&frame[..50]).unwrap();
+        let mut bufs = vec![[0u8; 64]; 4];
+        let packets: Vec<_> = bufs
+            .iter_mut()
+            .map(|b| vec![(b.as_mut_ptr() as usize, b.len())])
+            .collect();
+        assert_eq!(backend.recv(0, &packets).unwrap(), vec![30, 50]);
+        assert_eq!(&bufs[1][..50], &frame[..50]);
+    }
+}
@@ -0,0 +1,344 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Memory overcommit: sets balloon targets from guest statistics and host
+memory pressure.
+
+An [`OvercommitController`] watches every guest added to it through the
+statistics of its [`Balloon`] (available memory and major faults) and the
+host through its memory pressure: the `some avg10` value of
+`/proc/pressure/memory` on Linux, or the memorystatus pressure level on macOS,
+mapped to a similar percentage. Guests whose balloon reports no available
+memory fall back on a [`WorkingSetSampler`], if one tracks them: what is
+neither in their working set nor in the balloon counts as available.
+
+Once the pressure reaches `pressure_high`, the controller takes memory from
+guests that have more available than they need (`reserve` of their memory),
+and keeps doing so until the pressure falls to `pressure_low`. Below that,
+balloons are slowly deflated again. In between, targets are held. Targets
+move a fraction of the way to their goal every interval and at most
+`max_step` at once, except when a guest is short of memory: then the balloon
+gives back what it misses at once. A guest with a storm of major faults gets
+its whole balloon back and is left alone for `cooldown`.
+*/
+
+use super::balloon::{Balloon, VIRTIO_BALLOON_S_AVAIL, VIRTIO_BALLOON_S_MAJFLT};
+use crate::consts::*;
+use crate::wss::WorkingSetSampler;
+#[allow(unused_imports)]
+use log::*;
+use std::sync::{Arc, Mutex};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+/// Balloon targets are in pages of 4 KiB.
+const PAGE: u64 = 4096;
+
+#[derive(Debug, Clone)]
+pub struct OvercommitPolicy {
+    /// how often targets are updated
+    pub interval: Duration,
+    /// host pressure, in percent of time stalled, that starts reclaiming
+    pub pressure_high: f64,
+    /// host pressure that stops reclaiming
+    pub pressure_low: f64,
+    /// share of its memory a guest keeps available
+    pub reserve: f64,
+    /// share of the distance to its goal a target moves every interval
+    pub smoothing: f64,
+    /// largest change of a target in one interval, in bytes
+    pub max_step: u64,
+    /// memory a guest always keeps, in bytes
+    pub min_guest: u64,
+    /// major faults per second that make a fault storm
+    pub storm_faults: u64,
+    /// how long a guest's balloon stays deflated after a fault storm
+    pub cooldown: Duration,
+}
+
+impl Default for OvercommitPolicy {
+    fn default() -> Self {
+        OvercommitPolicy {
+            interval: Duration::from_secs(1),
+            pressure_high: 10.0,
+            pressure_low: 1.0,
+            reserve: 0.1,
+            smoothing: 0.25,
+            max_step: 64 * MiB as u64,
+            min_guest: 128 * MiB as u64,
+            storm_faults: 500,
+            cooldown: Duration::from_secs(30),
+        }
+    }
+}
+
+/// The memory pressure of the host, in percent of time some task was
+/// stalled waiting for memory in the last 10 seconds.
+#[cfg(target_os = "linux")]
+pub fn host_pressure() -> Option<f64> {
+    let psi = std::fs::read_to_string("/proc/pressure/memory").ok()?;
+    let some = psi.lines().find(|line| line.starts_with("some "))?;
+    let avg10 = some.split_whitespace().find(|f| f.starts_with("avg10="))?;
+    avg10["avg10=".len()..].parse().ok()
+}
+
+/// The memory pressure of the host. macOS only has levels (normal, warning,
+/// critical), which are mapped to percentages below, between and above the
+/// default thresholds.
+#[cfg(target_os = "macos")]
+pub fn host_pressure() -> Option<f64> {
+    let mut level: libc::c_int = 0;
+    let mut size = std::mem::size_of::<libc::c_int>();
+    let ret = unsafe {
+        libc::sysctlbyname(
+            "kern.memorystatus_vm_pressure_level\0".as_ptr() as *const libc::c_char,
+            &mut level as *mut libc::c_int as *mut libc::c_void,
+            &mut size,
+            std::ptr::null_mut(),
+            0,
+        )
+    };
+    match (ret, level) {
+        (0, 1) => Some(0.0),
+        (0, 2) => Some(5.0),
+        (0, 4) => Some(60.0),
+        _ => None,
+    }
+}
+
+/// What the controller knows about a guest when it sets its target, in pages.
+#[derive(Debug, Clone, Copy, Default)]
+struct GuestView {
+    mem: u64,
+    target: u64,
+    available: Option<u64>,
+    storm: bool,
+    cooling: bool,
+}
+
+/// Updates whether the host is being reclaimed from: the state only changes
+/// when the pressure crosses the threshold on the other side.
+fn reclaiming(policy: &OvercommitPolicy, pressure: f64, was: bool) -> bool {
+    if pressure >= policy.pressure_high {
+        true
+    } else if pressure <= policy.pressure_low {
+        false
+    } else {
+        was
+    }
+}
+
+/// The next balloon target of a guest, in pages.
+fn next_target(policy: &OvercommitPolicy, pressure: f64, reclaiming: bool, g: &GuestView) -> u64 {
+    let most = g.mem.saturating_sub(policy.min_guest / PAGE);
+    if g.storm {
+        return 0;
+    }
+    let current = g.target as i64;
+    // memory the guest can spare (or misses, if negative)
+    let spare = g
+        .available
+        .map(|avail| avail as i64 - (g.mem as f64 * policy.reserve) as i64);
+    if let Some(spare) = spare.filter(|&spare| spare < 0) {
+        return (current + spare).max(0) as u64;
+    }
+    let goal = if reclaiming {
+        current + spare.unwrap_or(0)
+    } else if pressure <= policy.pressure_low {
+        0
+    } else {
+        current
+    };
+    let max_step = (policy.max_step / PAGE) as i64;
+    let mut step = ((goal - current) as f64 * policy.smoothing) as i64;
+    if step == 0 {
+        step = goal - current;
+    }
+    step = step.max(-max_step).min(max_step);
+    if g.cooling {
+        step = step.min(0);
+    }
+    ((current + step).max(0) as u64).min(most)
+}
+
+struct Guest {
+    name: String,
+    balloon: Arc<Balloon>,
+    /// in pages
+    mem: u64,
+    /// major faults of the last statistics, and when they were taken
+    faults: Option<(u64, Instant)>,
+    calm_after: Option<Instant>,
+    wss: Option<Arc<WorkingSetSampler>>,
+}
+
+impl Guest {
+    fn view(&mut self, policy: &OvercommitPolicy, now: Instant) -> GuestView {
+        let stats = self.balloon.stats();
+        let mut storm = false;
+        if let (Some(faults), Some(updated)) = (stats.get(VIRTIO_BALLOON_S_MAJFLT), stats.updated) {
+            if let Some((last, last_updated)) = self.faults.filter(|&(_, t)| t < updated) {
+                let secs = (updated - last_updated).as_secs_f64();
+                let rate = faults.saturating_sub(last) as f64 / secs;
+                storm = rate >= policy.storm_faults as f64;
+            }
+            self.faults = Some((faults, updated));
+        }
+        if storm {
+            warn!("{}: major fault storm, deflating its balloon", self.name);
+            self.calm_after = Some(now + policy.cooldown);
+        }
+        let target = self.balloon.target() as u64;
+        let wss_available = || {
+            let ws = self.wss.as_ref()?.working_set();
+            ws.updated?;
+            Some((self.mem.saturating_sub(target)).saturating_sub(ws.wss_bytes / PAGE))
+        };
+        GuestView {
+            mem: self.mem,
+            target,
+            available: stats
+                .get(VIRTIO_BALLOON_S_AVAIL)
+                .map(|avail| avail / PAGE)
+                .or_else(wss_available),
+            storm,
+            cooling: self.calm_after.map_or(false, |t| now < t),
+        }
+    }
+}
+
+/// Moves memory between the host and the guests by setting the targets of
+/// their balloons.
+pub struct OvercommitController {
+    policy: OvercommitPolicy,
+    guests: Mutex<Vec<Guest>>,
+}
+
+impl OvercommitController {
+    pub fn new(policy: OvercommitPolicy) -> Arc<Self> {
+        Arc::new(OvercommitController {
+            policy,
+            guests: Mutex::new(Vec::new()),
+        })
+    }
+
+    /// Puts the balloon of a guest with `mem` bytes of memory under the
+    /// control of the controller.
+    pub fn add_guest(&self, name: String, balloon: Arc<Balloon>, mem: u64) {
+        self.guests.lock().unwrap().push(Guest {
+            name,
+            balloon,
+            mem: mem / PAGE,
+            faults: None,
+            calm_after: None,
+            wss: None,
+        });
+    }
+
+    /// Estimates the available memory of guest `name` from `sampler` when its
+    /// balloon does not report it.
+    pub fn track_working_set(&self, name: &str, sampler: Arc<WorkingSetSampler>) {
+        let mut guests = self.guests.lock().unwrap();
+        if let Some(guest) = guests.iter_mut().find(|g| g.name == name) {
+            guest.wss = Some(sampler);
+        }
+    }
+
+    fn update(&self, pressure: f64, reclaiming: bool) {
+        let now = Instant::now();
+        for guest in self.guests.lock().unwrap().iter_mut() {
+            let view = guest.view(&self.policy, now);
+            let target = next_target(&self.policy, pressure, reclaiming, &view);
+            if target != view.target {
+                debug!(
+                    "{}: balloon target {} -> {} pages, pressure {:.2}",
+                    guest.name, view.target, target, pressure
+                );
+                guest.balloon.set_target(target as u32);
+            }
+            // the statistics are in when we look again
+            guest.balloon.request_stats();
+        }
+    }
+
+    /// Starts updating balloon targets every `policy.interval`.
+    pub fn start(self: &Arc<Self>) -> JoinHandle<()> {
+        let controller = self.clone();
+        std::thread::Builder::new()
+            .name("overcommit".into())
+            .spawn(move || {
+                let mut was_reclaiming = false;
+                if host_pressure().is_none() {
+                    warn!("host memory pressure unavailable, balloons are only deflated");
+                }
+                loop {
+                    let pressure = host_pressure().unwrap_or(0.0);
+                    let policy = &controller.policy;
+                    let now_reclaiming = reclaiming(policy, pressure, was_reclaiming);
+                    if now_reclaiming != was_reclaiming {
+                        info!(
+                            "host memory pressure {:.2}, reclaiming: {}",
+                            pressure, now_reclaiming
+                        );
+                    }
+                    was_reclaiming = now_reclaiming;
+                    controller.update(pressure, now_reclaiming);
+                    std::thread::sleep(policy.interval);
+                }
+            })
+            .unwrap()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn next_target_test() {
+        let policy = OvercommitPolicy::default();
+        // 1 GiB guest, 512 MiB available, reserve of ~102 MiB
+        let guest = GuestView {
+            mem: 262144,
+            target: 0,
+            available: Some(131072),
+            ..Default::default()
+        };
+        assert!(reclaiming(&policy, 20.0, false));
+        assert!(reclaiming(&policy, 5.0, true));
+        assert!(!reclaiming(&policy, 5.0, false));
+        // reclaiming moves by at most max_step
+        assert_eq!(next_target(&policy, 20.0, true, &guest), 16384);
+        // holds between the thresholds
+        assert_eq!(next_target(&policy, 5.0, false, &guest), 0);
+        let inflated = GuestView {
+            target: 100000,
+            ..guest
+        };
+        // relaxed host: deflates slowly
+        assert_eq!(next_target(&policy, 0.0, false, &inflated), 83616);
+        // short guest: deflates at once
+        let short = GuestView {
+            available: Some(6214),
+            ..inflated
+        };
+        assert_eq!(next_target(&policy, 20.0, true, &short), 80000);
+        let storm = GuestView {
+            storm: true,
+            ..inflated
+        };
+        assert_eq!(next_target(&policy, 20.0, true, &storm), 0);
+        let cooling = GuestView {
+            cooling: true,
+            ..inflated
+        };
+        assert_eq!(next_target(&policy, 20.0, true, &cooling), 100000);
+        // never below min_guest
+        let small = GuestView {
+            mem: 40000,
+            target: 0,
+            available: Some(40000),
+            ..Default::default()
+        };
+        assert_eq!(next_target(&policy, 20.0, true, &small), 7232);
+    }
+}
@@ -0,0 +1,1444 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! A virtio-9p device that exports a host directory with 9P2000.L.
+
+The guest mounts it with
+`mount -t 9p -o trans=virtio,version=9p2000.L,msize=524288 <tag> <dir>`.
+
+Every fid keeps the file descriptor it was opened with, so a Tread or Twrite
+is a single preadv(2) or pwritev(2) between the file and the guest's buffers,
+without copying through the host. Requests are served by a pool of threads
+and complete in any order, so a slow request does not hold up the others.
+
+The guest sees files with the owners and permissions they have on the host,
+and the files it creates belong to the user running xhype. The guest never
+reaches outside the exported directory: paths are resolved one component at
+a time from a descriptor of the directory with `O_NOFOLLOW`, and the last
+component is handled with the `*at()` calls without following it either.
+Symbolic links are resolved by the guest. Locks always succeed and extended
+attributes are not supported.
+*/
+
+use super::consts::*;
+use super::virtq::*;
+use super::{
+    channel, AddressConverter, Receiver, Sender, TaskReceiver, VirtioDevCfg, VirtioDevice,
+    VirtioId, VirtqReceiver,
+};
+use crate::err::Error;
+#[allow(unused_imports)]
+use log::*;
+use std::collections::HashMap;
+use std::ffi::{CStr, CString, OsStr};
+use std::fs::File;
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::{AsRawFd, FromRawFd, IntoRawFd};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+
+/// The mount tag is in the configuration space.
+pub const VIRTIO_9P_MOUNT_TAG: u64 = 0;
+
+const QUEUE_SIZE: u32 = 128;
+
+/// Largest message size we agree to. The Linux driver never uses more than
+/// fits in a ring of 128 pages.
+const P9_MAX_MSIZE: u32 = 512 << 10;
+
+/// size[4] type[1] tag[2]
+const P9_HDR_SIZE: usize = 7;
+/// The header of Rread and Rreaddir, which is followed by count[4]
+const P9_IOHDR_SIZE: usize = P9_HDR_SIZE + 4;
+/// The header of Twrite: fid[4] offset[8] count[4]
+const P9_TWRITE_SIZE: usize = P9_HDR_SIZE + 16;
+/// Most names a single Twalk walks
+const P9_MAXWELEM: u16 = 16;
+
+const P9_RLERROR: u8 = 7;
+const P9_TSTATFS: u8 = 8;
+const P9_TLOPEN: u8 = 12;
+const P9_TLCREATE: u8 = 14;
+const P9_TSYMLINK: u8 = 16;
+const P9_TMKNOD: u8 = 18;
+const P9_TRENAME: u8 = 20;
+const P9_TREADLINK: u8 = 22;
+const P9_TGETATTR: u8 = 24;
+const P9_TSETATTR: u8 = 26;
+const P9_TREADDIR: u8 = 40;
+const P9_TFSYNC: u8 = 50;
+const P9_TLOCK: u8 = 52;
+const P9_TGETLOCK: u8 = 54;
+const P9_TLINK: u8 = 70;
+const P9_TMKDIR: u8 = 72;
+const P9_TRENAMEAT: u8 = 74;
+const P9_TUNLINKAT: u8 = 76;
+const P9_TVERSION: u8 = 100;
+const P9_TATTACH: u8 = 104;
+const P9_TFLUSH: u8 = 108;
+const P9_TWALK: u8 = 110;
+const P9_TREAD: u8 = 116;
+const P9_TWRITE: u8 = 118;
+const P9_TCLUNK: u8 = 120;
+const P9_TREMOVE: u8 = 122;
+
+const P9_QTDIR: u8 = 0x80;
+const P9_QTSYMLINK: u8 = 0x02;
+const P9_QTFILE: u8 = 0;
+
+/// The fields of Rgetattr up to data_version, which are all we fill in
+const P9_GETATTR_BASIC: u64 = 0x7ff;
+
+const P9_ATTR_MODE: u32 = 1 << 0;
+const P9_ATTR_UID: u32 = 1 << 1;
+const P9_ATTR_GID: u32 = 1 << 2;
+const P9_ATTR_SIZE: u32 = 1 << 3;
+const P9_ATTR_ATIME: u32 = 1 << 4;
+const P9_ATTR_MTIME: u32 = 1 << 5;
+const P9_ATTR_ATIME_SET: u32 = 1 << 7;
+const P9_ATTR_MTIME_SET: u32 = 1 << 8;
+
+const P9_LOCK_SUCCESS: u8 = 0;
+const P9_LOCK_TYPE_UNLCK: u8 = 2;
+
+/// f_type of a 9p file system in Linux
+const V9FS_MAGIC: u32 = 0x01021997;
+
+// The guest sends Linux open flags and expects Linux error numbers.
+const L_O_ACCMODE: u32 = 0o3;
+const L_O_CREAT: u32 = 0o100;
+const L_O_EXCL: u32 = 0o200;
+const L_O_TRUNC: u32 = 0o1000;
+const L_O_APPEND: u32 = 0o2000;
+const L_O_NONBLOCK: u32 = 0o4000;
+const L_O_DSYNC: u32 = 0o10000;
+const L_O_DIRECTORY: u32 = 0o200000;
+const L_O_SYNC: u32 = 0o4000000;
+const L_AT_REMOVEDIR: u32 = 0x200;
+
+const L_EPERM: u32 = 1;
+const L_EIO: u32 = 5;
+const L_EBADF: u32 = 9;
+const L_EINVAL: u32 = 22;
+const L_EOPNOTSUPP: u32 = 95;
+
+/// Converts a host error to a Linux error number. Numbers up to ERANGE are
+/// the same on Linux and macOS.
+fn linux_errno(e: &io::Error) -> u32 {
+    let errno = match e.raw_os_error() {
+        Some(errno) => errno,
+        None => return L_EIO,
+    };
+    #[cfg(target_os = "macos")]
+    let errno = match errno {
+        libc::EAGAIN => 11,
+        libc::ENAMETOOLONG => 36,
+        libc::ENOSYS => 38,
+        libc::ENOTEMPTY => 39,
+        libc::ELOOP => 40,
+        libc::ENOATTR => 61,
+        libc::EOPNOTSUPP | libc::ENOTSUP => 95,
+        libc::ESTALE => 116,
+        libc::EDQUOT => 122,
+        errno if errno <= libc::ERANGE => errno,
+        _ => L_EIO as i32,
+    };
+    errno as u32
+}
+
+/// A reply without its header, or a Linux error number for Rlerror.
+type P9Result = Result<Vec<u8>, u32>;
+
+fn io_err(e: io::Error) -> u32 {
+    linux_errno(&e)
+}
+
+fn cvt(ret: libc::c_int) -> Result<(), u32> {
+    if ret < 0 {
+        Err(linux_errno(&io::Error::last_os_error()))
+    } else {
+        Ok(())
+    }
+}
+
+fn c_name(name: &OsStr) -> Result<CString, u32> {
+    CString::new(name.as_bytes()).map_err(|_| L_EINVAL)
+}
+
+fn is_dir(st: &libc::stat) -> bool {
+    st.st_mode & libc::S_IFMT == libc::S_IFDIR
+}
+
+fn fstat(file: &File) -> Result<libc::stat, u32> {
+    let mut st: libc::stat = unsafe { std::mem::zeroed() };
+    cvt(unsafe { libc::fstat(file.as_raw_fd(), &mut st) })?;
+    Ok(st)
+}
+
+/// Parses the little-endian fields of a request.
+struct Reader<'a> {
+    buf: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn bytes(&mut self, n: usize) -> Result<&'a [u8], u32> {
+        if self.buf.len() < n {
+            return Err(L_EINVAL);
+        }
+        let (head, rest) = self.buf.split_at(n);
+        self.buf = rest;
+        Ok(head)
+    }
+
+    fn u8(&mut self) -> Result<u8, u32> {
+        Ok(self.bytes(1)?[0])
+    }
+
+    fn u16(&mut self) -> Result<u16, u32> {
+        let b = self.bytes(2)?;
+        Ok(u16::from_le_bytes([b[0], b[1]]))
+    }
+
+    fn u32(&mut self) -> Result<u32, u32> {
+        let mut b = [0u8; 4];
+        b.copy_from_slice(self.bytes(4)?);
+        Ok(u32::from_le_bytes(b))
+    }
+
+    fn u64(&mut self) -> Result<u64, u32> {
+        let mut b = [0u8; 8];
+        b.copy_from_slice(self.bytes(8)?);
+        Ok(u64::from_le_bytes(b))
+    }
+
+    fn str(&mut self) -> Result<&'a [u8], u32> {
+        let len = self.u16()? as usize;
+        self.bytes(len)
+    }
+}
+
+/// Appends the little-endian fields of a reply.
+trait Put {
+    fn put_u8(&mut self, v: u8);
+    fn put_u16(&mut self, v: u16);
+    fn put_u32(&mut self, v: u32);
+    fn put_u64(&mut self, v: u64);
+    fn put_str(&mut self, s: &[u8]);
+    fn put_qid(&mut self, qid: &Qid);
+}
+
+impl Put for Vec<u8> {
+    fn put_u8(&mut self, v: u8) {
+        self.push(v);
+    }
+
+    fn put_u16(&mut self, v: u16) {
+        self.extend_from_slice(&v.to_le_bytes());
+    }
+
+    fn put_u32(&mut self, v: u32) {
+        self.extend_from_slice(&v.to_le_bytes());
+    }
+
+    fn put_u64(&mut self, v: u64) {
+        self.extend_from_slice(&v.to_le_bytes());
+    }
+
+    fn put_str(&mut self, s: &[u8]) {
+        self.put_u16(s.len() as u16);
+        self.extend_from_slice(s);
+    }
+
+    fn put_qid(&mut self, qid: &Qid) {
+        self.put_u8(qid.kind);
+        self.put_u32(0);
+        self.put_u64(qid.path);
+    }
+}
+
+/// The server's identification of a file: its type and inode number.
+#[derive(Debug, Clone, Copy)]
+struct Qid {
+    kind: u8,
+    path: u64,
+}
+
+impl Qid {
+    fn new(st: &libc::stat) -> Self {
+        let kind = match st.st_mode & libc::S_IFMT {
+            libc::S_IFDIR => P9_QTDIR,
+            libc::S_IFLNK => P9_QTSYMLINK,
+            _ => P9_QTFILE,
+        };
+        Qid {
+            kind,
+            path: st.st_ino as u64,
+        }
+    }
+}
+
+/// Translates Linux open flags to the host's. Symbolic links are never
+/// followed.
+fn open_flags(flags: u32) -> libc::c_int {
+    let map = [
+        (L_O_CREAT, libc::O_CREAT),
+        (L_O_EXCL, libc::O_EXCL),
+        (L_O_TRUNC, libc::O_TRUNC),
+        (L_O_APPEND, libc::O_APPEND),
+        (L_O_NONBLOCK, libc::O_NONBLOCK),
+        (L_O_DSYNC, libc::O_DSYNC),
+        (L_O_SYNC, libc::O_SYNC),
+        (L_O_DIRECTORY, libc::O_DIRECTORY),
+    ];
+    map.iter()
+        .filter(|(l, _)| flags & l != 0)
+        .fold(libc::O_NOFOLLOW | libc::O_CLOEXEC, |f, (_, h)| f | h)
+}
+
+/// Opens `name` in `dir` with Linux open flags.
+fn open(dir: &File, name: &CStr, flags: u32, mode: u32) -> Result<File, u32> {
+    let access = match flags & L_O_ACCMODE {
+        0 => libc::O_RDONLY,
+        1 => libc::O_WRONLY,
+        _ => libc::O_RDWR,
+    };
+    openat(dir, name, access | open_flags(flags), mode & 0o7777)
+}
+
+fn openat(dir: &File, name: &CStr, flags: libc::c_int, mode: u32) -> Result<File, u32> {
+    let fd = unsafe {
+        libc::openat(
+            dir.as_raw_fd(),
+            name.as_ptr(),
+            flags | libc::O_CLOEXEC,
+            mode as libc::c_uint,
+        )
+    };
+    cvt(fd)?;
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+/// The entries of the directory `dir`, but for `.` and `..`.
+fn list_dir(dir: File) -> Result<Vec<DirEntry9p>, u32> {
+    let fd = dir.into_raw_fd();
+    let dirp = unsafe { libc::fdopendir(fd) };
+    if dirp.is_null() {
+        let ecode = linux_errno(&io::Error::last_os_error());
+        unsafe { libc::close(fd) };
+        return Err(ecode);
+    }
+    let mut entries = vec![];
+    loop {
+        let entry = unsafe { libc::readdir(dirp) };
+        if entry.is_null() {
+            break;
+        }
+        let entry = unsafe { &*entry };
+        let name = unsafe { CStr::from_ptr(entry.d_name.as_ptr()) }.to_bytes();
+        if name == b"." || name == b".." {
+            continue;
+        }
+        let kind = match entry.d_type {
+            libc::DT_DIR => P9_QTDIR,
+            libc::DT_LNK => P9_QTSYMLINK,
+            _ => P9_QTFILE,
+        };
+        entries.push(DirEntry9p {
+            qid: Qid {
+                kind,
+                path: entry.d_ino as u64,
+            },
+            kind: entry.d_type,
+            name: name.to_vec(),
+        });
+    }
+    unsafe { libc::closedir(dirp) };
+    Ok(entries)
+}
+
+fn to_iovecs(regions: &[(usize, usize)]) -> Vec<libc::iovec> {
+    regions
+        .iter()
+        .map(|&(addr, len)| libc::iovec {
+            iov_base: addr as *mut libc::c_void,
+            iov_len: len,
+        })
+        .collect()
+}
+
+/// Reads from `file` at `offset` directly into the guest buffers.
+fn preadv(file: &File, regions: &[(usize, usize)], offset: u64) -> io::Result<usize> {
+    let iov = to_iovecs(regions);
+    loop {
+        let ret = unsafe {
+            libc::preadv(
+                file.as_raw_fd(),
+                iov.as_ptr(),
+                iov.len() as libc::c_int,
+                offset as libc::off_t,
+            )
+        };
+        if ret >= 0 {
+            return Ok(ret as usize);
+        }
+        let e = io::Error::last_os_error();
+        if e.kind() != io::ErrorKind::Interrupted {
+            return Err(e);
+        }
+    }
+}
+
+/// Writes the guest buffers directly to `file` at `offset`.
+fn pwritev(file: &File, regions: &[(usize, usize)], offset: u64) -> io::Result<usize> {
+    let iov = to_iovecs(regions);
+    loop {
+        let ret = unsafe {
+            libc::pwritev(
+                file.as_raw_fd(),
+                iov.as_ptr(),
+                iov.len() as libc::c_int,
+                offset as libc::off_t,
+            )
+        };
+        if ret >= 0 {
+            return Ok(ret as usize);
+        }
+        let e = io::Error::last_os_error();
+        if e.kind() != io::ErrorKind::Interrupted {
+            return Err(e);
+        }
+    }
+}
+
+struct DirEntry9p {
+    qid: Qid,
+    kind: u8,
+    name: Vec<u8>,
+}
+
+struct Fid {
+    /// path relative to the exported directory, empty for the directory
+    /// itself; changes when the file or one of its parents is renamed
+    path: RwLock<PathBuf>,
+    /// the file descriptor of an opened fid
+    file: Option<File>,
+    /// the entries of a directory, read at its first Treaddir
+    entries: Mutex<Option<Vec<DirEntry9p>>>,
+}
+
+impl Fid {
+    fn new(path: PathBuf, file: Option<File>) -> Arc<Self> {
+        Arc::new(Fid {
+            path: RwLock::new(path),
+            file,
+            entries: Mutex::new(None),
+        })
+    }
+
+    fn path(&self) -> PathBuf {
+        self.path.read().unwrap().clone()
+    }
+
+    fn file(&self) -> Result<&File, u32> {
+        self.file.as_ref().ok_or(L_EBADF)
+    }
+}
+
+/// The path of `name` in the directory `dir`, if `name` is a single
+/// component.
+fn child(dir: &Path, name: &[u8]) -> Result<PathBuf, u32> {
+    if name.is_empty() || name == b"." || name == b".." || name.contains(&b'/') {
+        return Err(L_EINVAL);
+    }
+    Ok(dir.join(OsStr::from_bytes(name)))
+}
+
+struct P9Server {
+    /// the exported directory
+    root: File,
+    msize: AtomicU32,
+    fids: RwLock<HashMap<u32, Arc<Fid>>>,
+}
+
+impl P9Server {
+    fn new(root: &Path) -> io::Result<Self> {
+        let root = c_name(root.as_os_str()).map_err(|_| io::ErrorKind::InvalidInput)?;
+        let fd = unsafe {
+            libc::open(
+                root.as_ptr(),
+                libc::O_RDONLY | libc::O_DIRECTORY | libc::O_CLOEXEC,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(P9Server {
+            root: unsafe { File::from_raw_fd(fd) },
+            msize: AtomicU32::new(P9_MAX_MSIZE),
+            fids: RwLock::new(HashMap::new()),
+        })
+    }
+
+    /// Opens the directory at `path`. No component may be a symbolic link,
+    /// so a path that was a directory when a fid walked it, and has since
+    /// been replaced by a link, fails instead of leading out of the export.
+    fn open_dir(&self, path: &Path) -> Result<File, u32> {
+        let mut dir = self.root.try_clone().map_err(io_err)?;
+        for name in path.iter() {
+            let flags = libc::O_RDONLY | libc::O_DIRECTORY | libc::O_NOFOLLOW;
+            dir = openat(&dir, &c_name(name)?, flags, 0)?;
+        }
+        Ok(dir)
+    }
+
+    /// The directory holding `path` and the name of `path` in it, for the
+    /// `*at()` calls; `.` in the exported directory for the directory itself.
+    fn locate(&self, path: &Path) -> Result<(File, CString), u32> {
+        match (path.parent(), path.file_name()) {
+            (Some(parent), Some(name)) => Ok((self.open_dir(parent)?, c_name(name)?)),
+            _ => Ok((
+                self.root.try_clone().map_err(io_err)?,
+                c_name(OsStr::new("."))?,
+            )),
+        }
+    }
+
+    fn lstat(&self, path: &Path) -> Result<libc::stat, u32> {
+        let (dir, name) = self.locate(path)?;
+        let mut st: libc::stat = unsafe { std::mem::zeroed() };
+        cvt(unsafe {
+            libc::fstatat(
+                dir.as_raw_fd(),
+                name.as_ptr(),
+                &mut st,
+                libc::AT_SYMLINK_NOFOLLOW,
+            )
+        })?;
+        Ok(st)
+    }
+
+    fn fid(&self, fid: u32) -> Result<Arc<Fid>, u32> {
+        self.fids.read().unwrap().get(&fid).cloned().ok_or(L_EBADF)
+    }
+
+    fn set_fid(&self, fid: u32, new: Arc<Fid>) {
+        self.fids.write().unwrap().insert(fid, new);
+    }
+
+    /// Largest payload of a Rread, Rreaddir or Twrite.
+    fn iounit(&self) -> u32 {
+        self.msize.load(Ordering::Relaxed) - P9_IOHDR_SIZE as u32
+    }
+
+    /// Handles the request in `readable` and puts the reply in `writable`.
+    /// Returns the length of the reply.
+    fn handle(&self, readable: &[(usize, usize)], writable: &[(usize, usize)]) -> u32 {
+        let mut hdr = [0u8; P9_HDR_SIZE];
+        if gather(readable, &mut hdr) < P9_HDR_SIZE {
+            warn!("virtio-9p: request without a header");
+            return 0;
+        }
+        let size = u32::from_le_bytes([hdr[0], hdr[1], hdr[2], hdr[3]]) as usize;
+        let (kind, tag) = (hdr[4], u16::from_le_bytes([hdr[5], hdr[6]]));
+        let result = match kind {
+            P9_TREAD => return self.read(tag, readable, writable),
+            P9_TWRITE => self.write(readable),
+            _ => {
+                let len = std::cmp::min(size, total_len(readable));
+                let mut msg = vec![0u8; len];
+                gather(readable, &mut msg);
+                let mut r = Reader {
+                    buf: msg.get(P9_HDR_SIZE..).unwrap_or(&[]),
+                };
+                self.dispatch(kind, &mut r)
+            }
+        };
+        let (kind, body) = match result {
+            Ok(body) => (kind + 1, body),
+            Err(ecode) => (P9_RLERROR, ecode.to_le_bytes().to_vec()),
+        };
+        reply(writable, kind, tag, &body)
+    }
+
+    fn dispatch(&self, kind: u8, r: &mut Reader) -> P9Result {
+        match kind {
+            P9_TVERSION => self.version(r),
+            P9_TATTACH => self.attach(r),
+            P9_TWALK => self.walk(r),
+            P9_TCLUNK => {
+                self.fids.write().unwrap().remove(&r.u32()?);
+                Ok(vec![])
+            }
+            P9_TFLUSH => Ok(vec![]),
+            P9_TGETATTR => self.getattr(r),
+            P9_TSETATTR => self.setattr(r),
+            P9_TLOPEN => self.lopen(r),
+            P9_TLCREATE => self.lcreate(r),
+            P9_TREADDIR => self.readdir(r),
+            P9_TSTATFS => self.statfs(r),
+            P9_TFSYNC => self.fsync(r),
+            P9_TMKDIR => self.mkdir(r),
+            P9_TSYMLINK => self.symlink(r),
+            P9_TMKNOD => self.mknod(r),
+            P9_TREADLINK => self.readlink(r),
+            P9_TLINK => self.link(r),
+            P9_TRENAME => self.rename(r),
+            P9_TRENAMEAT => self.renameat(r),
+            P9_TUNLINKAT => self.unlinkat(r),
+            P9_TREMOVE => self.remove(r),
+            P9_TLOCK => Ok(vec![P9_LOCK_SUCCESS]),
+            P9_TGETLOCK => self.getlock(r),
+            kind => {
+                debug!("virtio-9p: unsupported request {}", kind);
+                Err(L_EOPNOTSUPP)
+            }
+        }
+    }
+
+    fn version(&self, r: &mut Reader) -> P9Result {
+        let msize = std::cmp::min(r.u32()?, P9_MAX_MSIZE);
+        if (msize as usize) < P9_TWRITE_SIZE + 1 {
+            return Err(L_EINVAL);
+        }
+        let version = r.str()?;
+        // a new session: all fids are gone
+        self.fids.write().unwrap().clear();
+        self.msize.store(msize, Ordering::Relaxed);
+        let mut body = vec![];
+        body.put_u32(msize);
+        if version == b"9P2000.L" {
+            body.put_str(version);
+        } else {
+            body.put_str(b"unknown");
+        }
+        Ok(body)
+    }
+
+    fn attach(&self, r: &mut Reader) -> P9Result {
+        let fid = r.u32()?;
+        let m = self.lstat(Path::new(""))?;
+        self.set_fid(fid, Fid::new(PathBuf::new(), None));
+        let mut body = vec![];
+        body.put_qid(&Qid::new(&m));
+        Ok(body)
+    }
+
+    fn walk(&self, r: &mut Reader) -> P9Result {
+        let (fid, newfid, nwname) = (r.u32()?, r.u32()?, r.u16()?);
+        if nwname > P9_MAXWELEM {
+            return Err(L_EINVAL);
+        }
+        let mut path = self.fid(fid)?.path();
+        let mut qids = Vec::with_capacity(nwname as usize);
+        for i in 0..nwname {
+            let name = r.str()?;
+            let next = if name == b".." {
+                let mut parent = path.clone();
+                parent.pop();
+                parent
+            } else {
+                child(&path, name)?
+            };
+            match self.lstat(&next) {
+                Ok(m) => {
+                    qids.push(Qid::new(&m));
+                    path = next;
+                    // symbolic links are resolved by the guest
+                    if !is_dir(&m) && i + 1 < nwname {
+                        break;
+                    }
+                }
+                Err(ecode) if i == 0 => return Err(ecode),
+                Err(_) => break,
+            }
+        }
+        if qids.len() == nwname as usize {
+            self.set_fid(newfid, Fid::new(path, None));
+        }
+        let mut body = vec![];
+        body.put_u16(qids.len() as u16);
+        for qid in qids.iter() {
+            body.put_qid(qid);
+        }
+        Ok(body)
+    }
+
+    fn getattr(&self, r: &mut Reader) -> P9Result {
+        let fid = self.fid(r.u32()?)?;
+        // an open fid answers from its file descriptor
+        let st = match &fid.file {
+            Some(file) => fstat(file)?,
+            None => self.lstat(&fid.path())?,
+        };
+        let mut body = vec![];
+        body.put_u64(P9_GETATTR_BASIC);
+        body.put_qid(&Qid::new(&st));
+        body.put_u32(st.st_mode as u32);
+        body.put_u32(st.st_uid);
+        body.put_u32(st.st_gid);
+        body.put_u64(st.st_nlink as u64);
+        body.put_u64(st.st_rdev as u64);
+        body.put_u64(st.st_size as u64);
+        body.put_u64(st.st_blksize as u64);
+        body.put_u64(st.st_blocks as u64);
+        for &(sec, nsec) in &[
+            (st.st_atime as i64, st.st_atime_nsec as i64),
+            (st.st_mtime as i64, st.st_mtime_nsec as i64),
+            (st.st_ctime as i64, st.st_ctime_nsec as i64),
+        ] {
+            body.put_u64(sec as u64);
+            body.put_u64(nsec as u64);
+        }
+        // btime, gen and data_version
+        body.extend_from_slice(&[0u8; 32]);
+        Ok(body)
+    }
+
+    fn setattr(&self, r: &mut Reader) -> P9Result {
+        let fid = self.fid(r.u32()?)?;
+        let (valid, mode, uid, gid, size) = (r.u32()?, r.u32()?, r.u32()?, r.u32()?, r.u64()?);
+        let (atime_sec, atime_nsec, mtime_sec, mtime_nsec) =
+            (r.u64()?, r.u64()?, r.u64()?, r.u64()?);
+        // an open fid is changed through its file descriptor, anything else
+        // without following a symbolic link: the guest may have made one
+        // that points out of the export
+        let (dir, name) = self.locate(&fid.path())?;
+        let (dirfd, name) = (dir.as_raw_fd(), name.as_ptr());
+        if valid & P9_ATTR_MODE != 0 {
+            let mode = (mode & 0o7777) as libc::mode_t;
+            cvt(unsafe {
+                match &fid.file {
+                    Some(file) => libc::fchmod(file.as_raw_fd(), mode),
+                    None => libc::fchmodat(dirfd, name, mode, libc::AT_SYMLINK_NOFOLLOW),
+                }
+            })?;
+        }
+        if valid & (P9_ATTR_UID | P9_ATTR_GID) != 0 {
+            let uid = if valid & P9_ATTR_UID != 0 {
+                uid
+            } else {
+                u32::MAX
+            };
+            let gid = if valid & P9_ATTR_GID != 0 {
+                gid
+            } else {
+                u32::MAX
+            };
+            cvt(unsafe { libc::fchownat(dirfd, name, uid, gid, libc::AT_SYMLINK_NOFOLLOW) })?;
+        }
+        if valid & P9_ATTR_SIZE != 0 {
+            match &fid.file {
+                Some(file) => file.set_len(size).map_err(io_err)?,
+                None => {
+                    let flags = libc::O_WRONLY | libc::O_NOFOLLOW | libc::O_NONBLOCK;
+                    let file = openat(&dir, unsafe { CStr::from_ptr(name) }, flags, 0)?;
+                    file.set_len(size).map_err(io_err)?
+                }
+            }
+        }
+        if valid & (P9_ATTR_ATIME | P9_ATTR_MTIME) != 0 {
+            let time = |set: u32, time_set: u32, sec: u64, nsec: u64| {
+                let (tv_sec, tv_nsec) = if valid & set == 0 {
+                    (0, libc::UTIME_OMIT)
+                } else if valid & time_set == 0 {
+                    (0, libc::UTIME_NOW)
+                } else {
+                    (sec as libc::time_t, nsec as libc::c_long)
+                };
+                libc::timespec { tv_sec, tv_nsec }
+            };
+            let times = [
+                time(P9_ATTR_ATIME, P9_ATTR_ATIME_SET, atime_sec, atime_nsec),
+                time(P9_ATTR_MTIME, P9_ATTR_MTIME_SET, mtime_sec, mtime_nsec),
+            ];
+            cvt(unsafe {
+                libc::utimensat(dirfd, name, times.as_ptr(), libc::AT_SYMLINK_NOFOLLOW)
+            })?;
+        }
+        Ok(vec![])
+    }
+
+    /// Opens `fid` with the file at `path` and replies with its qid and the
+    /// iounit.
+    fn opened(&self, fid: u32, path: PathBuf, file: File) -> P9Result {
+        let st = fstat(&file)?;
+        self.set_fid(fid, Fid::new(path, Some(file)));
+        let mut body = vec![];
+        body.put_qid(&Qid::new(&st));
+        body.put_u32(self.iounit());
+        Ok(body)
+    }
+
+    fn lopen(&self, r: &mut Reader) -> P9Result {
+        let (fid, flags) = (r.u32()?, r.u32()?);
+        let path = self.fid(fid)?.path();
+        let flags = flags & !(L_O_CREAT | L_O_EXCL);
+        let (dir, name) = self.locate(&path)?;
+        let file = open(&dir, &name, flags, 0)?;
+        self.opened(fid, path, file)
+    }
+
+    fn lcreate(&self, r: &mut Reader) -> P9Result {
+        let (fid, name, flags, mode) = (r.u32()?, r.str()?, r.u32()?, r.u32()?);
+        let path = child(&self.fid(fid)?.path(), name)?;
+        let (dir, name) = self.locate(&path)?;
+        let file = open(&dir, &name, flags | L_O_CREAT, mode)?;
+        self.opened(fid, path, file)
+    }
+
+    /// Serves a Tread with one preadv(2) into the guest buffers behind the
+    /// reply header.
+    fn read(&self, tag: u16, readable: &[(usize, usize)], writable: &[(usize, usize)]) -> u32 {
+        let mut req = [0u8; P9_IOHDR_SIZE + 12];
+        let result = if gather(readable, &mut req) < req.len() {
+            Err(L_EINVAL)
+        } else {
+            let mut r = Reader {
+                buf: &req[P9_HDR_SIZE..],
+            };
+            let (fid, offset, count) = (r.u32().unwrap(), r.u64().unwrap(), r.u32().unwrap());
+            let count = std::cmp::min(count, self.iounit()) as usize;
+            let data = sub_regions(writable, P9_IOHDR_SIZE, count);
+            self.fid(fid).and_then(|fid| {
+                let file = fid.file()?;
+                preadv(file, &data, offset).map_err(io_err)
+            })
+        };
+        match result {
+            Ok(n) => {
+                let mut hdr = vec![];
+                hdr.put_u32((P9_IOHDR_SIZE + n) as u32);
+                hdr.put_u8(P9_TREAD + 1);
+                hdr.put_u16(tag);
+                hdr.put_u32(n as u32);
+                scatter(writable, &hdr) as u32 + n as u32
+            }
+            Err(ecode) => reply(writable, P9_RLERROR, tag, &ecode.to_le_bytes()),
+        }
+    }
+
+    /// Serves a Twrite with one pwritev(2) from the guest buffers behind the
+    /// request header.
+    fn write(&self, readable: &[(usize, usize)]) -> P9Result {
+        let mut req = [0u8; P9_TWRITE_SIZE];
+        if gather(readable, &mut req) < req.len() {
+            return Err(L_EINVAL);
+        }
+        let mut r = Reader {
+            buf: &req[P9_HDR_SIZE..],
+        };
+        let (fid, offset, count) = (r.u32()?, r.u64()?, r.u32()?);
+        let data = sub_regions(readable, P9_TWRITE_SIZE, count as usize);
+        let fid = self.fid(fid)?;
+        let n = pwritev(fid.file()?, &data, offset).map_err(io_err)?;
+        let mut body = vec![];
+        body.put_u32(n as u32);
+        Ok(body)
+    }
+
+    fn read_entries(&self, path: &Path) -> Result<Vec<DirEntry9p>, u32> {
+        let mut entries = vec![];
+        let parent = path.parent().unwrap_or(path);
+        for (name, path) in &[(".", path), ("..", parent)] {
+            entries.push(DirEntry9p {
+                qid: Qid::new(&self.lstat(path)?),
+                kind: libc::DT_DIR,
+                name: name.as_bytes().to_vec(),
+            });
+        }
+        entries.extend(list_dir(self.open_dir(path)?)?);
+        Ok(entries)
+    }
+
+    /// Directory offsets are positions in the list of entries read at the
+    /// first Treaddir, so a directory changing meanwhile does not make the
+    /// guest miss or repeat entries.
+    fn readdir(&self, r: &mut Reader) -> P9Result {
+        let (fid, offset, count) = (r.u32()?, r.u64()?, r.u32()?);
+        let fid = self.fid(fid)?;
+        let count = std::cmp::min(count, self.iounit()) as usize;
+        let mut cached = fid.entries.lock().unwrap();
+        if offset == 0 || cached.is_none() {
+            *cached = Some(self.read_entries(&fid.path())?);
+        }
+        let mut data = vec![];
+        let entries = cached.as_ref().unwrap();
+        for (i, entry) in entries.iter().enumerate().skip(offset as usize) {
+            // qid[13] offset[8] type[1] name[s]
+            if data.len() + 24 + entry.name.len() > count {
+                break;
+            }
+            data.put_qid(&entry.qid);
+            data.put_u64(i as u64 + 1);
+            data.put_u8(entry.kind);
+            data.put_str(&entry.name);
+        }
+        let mut body = vec![];
+        body.put_u32(data.len() as u32);
+        body.extend_from_slice(&data);
+        Ok(body)
+    }
+
+    fn statfs(&self, r: &mut Reader) -> P9Result {
+        let path = self.fid(r.u32()?)?.path();
+        // the file system of a file is that of its directory
+        let dir = match self.open_dir(&path) {
+            Ok(dir) => dir,
+            Err(_) => self.locate(&path)?.0,
+        };
+        let mut st: libc::statvfs = unsafe { std::mem::zeroed() };
+        cvt(unsafe { libc::fstatvfs(dir.as_raw_fd(), &mut st) })?;
+        let mut body = vec![];
+        body.put_u32(V9FS_MAGIC);
+        body.put_u32(st.f_frsize as u32);
+        body.put_u64(st.f_blocks as u64);
+        body.put_u64(st.f_bfree as u64);
+        body.put_u64(st.f_bavail as u64);
+        body.put_u64(st.f_files as u64);
+        body.put_u64(st.f_ffree as u64);
+        body.put_u64(st.f_fsid as u64);
+        body.put_u32(st.f_namemax as u32);
+        Ok(body)
+    }
+
+    fn fsync(&self, r: &mut Reader) -> P9Result {
+        let fid = self.fid(r.u32()?)?;
+        let datasync = r.u32().unwrap_or(0) != 0;
+        let file = fid.file()?;
+        if datasync {
+            file.sync_data().map_err(io_err)?;
+        } else {
+            file.sync_all().map_err(io_err)?;
+        }
+        Ok(vec![])
+    }
+
+    /// Replies with the qid of the file just created at `path`.
+    fn created(&self, path: &Path) -> P9Result {
+        let mut body = vec![];
+        body.put_qid(&Qid::new(&self.lstat(path)?));
+        Ok(body)
+    }
+
+    fn mkdir(&self, r: &mut Reader) -> P9Result {
+        let (dfid, name, mode) = (r.u32()?, r.str()?, r.u32()?);
+        let path = child(&self.fid(dfid)?.path(), name)?;
+        let (dir, name) = self.locate(&path)?;
+        let mode = (mode & 0o7777) as libc::mode_t;
+        cvt(unsafe { libc::mkdirat(dir.as_raw_fd(), name.as_ptr(), mode) })?;
+        self.created(&path)
+    }
+
+    fn symlink(&self, r: &mut Reader) -> P9Result {
+        let (dfid, name, target) = (r.u32()?, r.str()?, r.str()?);
+        let path = child(&self.fid(dfid)?.path(), name)?;
+        let target = c_name(OsStr::from_bytes(target))?;
+        let (dir, name) = self.locate(&path)?;
+        cvt(unsafe { libc::symlinkat(target.as_ptr(), dir.as_raw_fd(), name.as_ptr()) })?;
+        self.created(&path)
+    }
+
+    /// Only FIFOs: device nodes would give the guest access to host devices.
+    fn mknod(&self, r: &mut Reader) -> P9Result {
+        let (dfid, name, mode) = (r.u32()?, r.str()?, r.u32()?);
+        let path = child(&self.fid(dfid)?.path(), name)?;
+        if mode & libc::S_IFMT as u32 != libc::S_IFIFO as u32 {
+            return Err(L_EPERM);
+        }
+        let (dir, name) = self.locate(&path)?;
+        let mode = (mode & 0o7777) as libc::mode_t;
+        cvt(unsafe { libc::mkfifoat(dir.as_raw_fd(), name.as_ptr(), mode) })?;
+        self.created(&path)
+    }
+
+    fn readlink(&self, r: &mut Reader) -> P9Result {
+        let path = self.fid(r.u32()?)?.path();
+        let (dir, name) = self.locate(&path)?;
+        let mut buf = vec![0u8; libc::PATH_MAX as usize];
+        let len = unsafe {
+            libc::readlinkat(
+                dir.as_raw_fd(),
+                name.as_ptr(),
+                buf.as_mut_ptr() as *mut libc::c_char,
+                buf.len(),
+            )
+        };
+        cvt(len as libc::c_int)?;
+        let mut body = vec![];
+        body.put_str(&buf[..len as usize]);
+        Ok(body)
+    }
+
+    /// A link to a symbolic link is a link to the symbolic link itself:
+    /// linkat(2) without AT_SYMLINK_FOLLOW, unlike link(2) on macOS.
+    fn link(&self, r: &mut Reader) -> P9Result {
+        let (dfid, fid, name) = (r.u32()?, r.u32()?, r.str()?);
+        let path = child(&self.fid(dfid)?.path(), name)?;
+        let target = self.fid(fid)?.path();
+        let (old_dir, old_name) = self.locate(&target)?;
+        let (new_dir, new_name) = self.locate(&path)?;
+        cvt(unsafe {
+            libc::linkat(
+                old_dir.as_raw_fd(),
+                old_name.as_ptr(),
+                new_dir.as_raw_fd(),
+                new_name.as_ptr(),
+                0,
+            )
+        })?;
+        Ok(vec![])
+    }
+
+    /// Renames `old` to `new` and moves the fids of it and everything below.
+    fn move_path(&self, old: &Path, new: &Path) -> Result<(), u32> {
+        if old.as_os_str().is_empty() {
+            return Err(L_EINVAL);
+        }
+        let (old_dir, old_name) = self.locate(old)?;
+        let (new_dir, new_name) = self.locate(new)?;
+        cvt(unsafe {
+            libc::renameat(
+                old_dir.as_raw_fd(),
+                old_name.as_ptr(),
+                new_dir.as_raw_fd(),
+                new_name.as_ptr(),
+            )
+        })?;
+        for fid in self.fids.read().unwrap().values() {
+            let mut path = fid.path.write().unwrap();
+            if let Ok(rest) = path.strip_prefix(old) {
+                *path = new.join(rest);
+            }
+        }
+        Ok(())
+    }
+
+    fn rename(&self, r: &mut Reader) -> P9Result {
+        let (fid, dfid, name) = (r.u32()?, r.u32()?, r.str()?);
+        let old = self.fid(fid)?.path();
+        let new = child(&self.fid(dfid)?.path(), name)?;
+        self.move_path(&old, &new)?;
+        Ok(vec![])
+    }
+
+    fn renameat(&self, r: &mut Reader) -> P9Result {
+        let (olddir, oldname) = (r.u32()?, r.str()?);
+        let (newdir, newname) = (r.u32()?, r.str()?);
+        let old = child(&self.fid(olddir)?.path(), oldname)?;
+        let new = child(&self.fid(newdir)?.path(), newname)?;
+        self.move_path(&old, &new)?;
+        Ok(vec![])
+    }
+
+    fn unlink(&self, path: &Path, flags: libc::c_int) -> Result<(), u32> {
+        let (dir, name) = self.locate(path)?;
+        cvt(unsafe { libc::unlinkat(dir.as_raw_fd(), name.as_ptr(), flags) })
+    }
+
+    fn unlinkat(&self, r: &mut Reader) -> P9Result {
+        let (dfid, name, flags) = (r.u32()?, r.str()?, r.u32()?);
+        let path = child(&self.fid(dfid)?.path(), name)?;
+        if flags & L_AT_REMOVEDIR != 0 {
+            self.unlink(&path, libc::AT_REMOVEDIR)?;
+        } else {
+            self.unlink(&path, 0)?;
+        }
+        Ok(vec![])
+    }
+
+    /// Removes the file of a fid, and clunks the fid even if that fails.
+    fn remove(&self, r: &mut Reader) -> P9Result {
+        let fid = self
+            .fids
+            .write()
+            .unwrap()
+            .remove(&r.u32()?)
+            .ok_or(L_EBADF)?;
+        let path = fid.path();
+        if path.as_os_str().is_empty() {
+            return Err(L_EINVAL);
+        }
+        if is_dir(&self.lstat(&path)?) {
+            self.unlink(&path, libc::AT_REMOVEDIR)?;
+        } else {
+            self.unlink(&path, 0)?;
+        }
+        Ok(vec![])
+    }
+
+    /// No one else holds locks on the guest's files, so every range is free.
+    fn getlock(&self, r: &mut Reader) -> P9Result {
+        let (_fid, _kind, start, length) = (r.u32()?, r.u8()?, r.u64()?, r.u64()?);
+        let (proc_id, client_id) = (r.u32()?, r.str()?);
+        let mut body = vec![P9_LOCK_TYPE_UNLCK];
+        body.put_u64(start);
+        body.put_u64(length);
+        body.put_u32(proc_id);
+        body.put_str(client_id);
+        Ok(body)
+    }
+}
+
+/// Writes a reply into the guest buffers and returns its length.
+fn reply(writable: &[(usize, usize)], kind: u8, tag: u16, body: &[u8]) -> u32 {
+    let mut msg = Vec::with_capacity(P9_HDR_SIZE + body.len());
+    msg.put_u32((P9_HDR_SIZE + body.len()) as u32);
+    msg.put_u8(kind);
+    msg.put_u16(tag);
+    msg.extend_from_slice(body);
+    if total_len(writable) < msg.len() {
+        warn!(
+            "virtio-9p: reply {} of {} bytes does not fit",
+            kind,
+            msg.len()
+        );
+        if kind != P9_RLERROR {
+            return reply(writable, P9_RLERROR, tag, &L_EIO.to_le_bytes());
+        }
+    }
+    scatter(writable, &msg) as u32
+}
+
+/// A request handed to a worker: the head of its descriptor chain.
+struct P9Request {
+    generation: u64,
+    virtq: Virtq<usize>,
+    head: u16,
+}
+
+/// Where the workers put the replies.
+struct P9Ring {
+    /// the current virtq, and how many times the driver has set it up
+    ring: Mutex<(u64, Option<Virtq<usize>>)>,
+    irq: u32,
+    irq_sender: Sender<u32>,
+    isr: Arc<RwLock<u32>>,
+}
+
+impl P9Ring {
+    fn complete(&self, req: &P9Request, len: u32) {
+        let ring = self.ring.lock().unwrap();
+        let virtq = match &*ring {
+            (generation, Some(virtq)) if *generation == req.generation => virtq,
+            // the queue was reset while the request was served
+            _ => return,
+        };
+        virtq.push_used(req.head, len);
+        if virtq.avail_flags() & VIRTQ_AVAIL_F_NO_INTERRUPT == 0 {
+            *self.isr.write().unwrap() |= VIRTIO_INT_VRING;
+            self.irq_sender.send(self.irq).unwrap();
+        }
+    }
+}
+
+fn work(
+    server: Arc<P9Server>,
+    ring: Arc<P9Ring>,
+    gpa2hva: AddressConverter,
+    rx: Receiver<P9Request>,
+) {
+    for req in rx.iter() {
+        let (chain, writable_count) = req.virtq.desc_chain(req.head, |gpa| gpa2hva(gpa));
+        let (readable, writable) = chain.split_at(chain.len() - writable_count);
+        let len = server.handle(readable, writable);
+        ring.complete(&req, len);
+    }
+}
+
+/// Hands every request the guest makes available to the workers.
+fn serve(
+    ring: Arc<P9Ring>,
+    gpa2hva: AddressConverter,
+    jobs: Sender<P9Request>,
+    task_rx: TaskReceiver,
+    virtq_rx: VirtqReceiver,
+) {
+    let mut generation = 0;
+    for virtq in virtq_rx.iter() {
+        let virtq = virtq.to_hva(|gpa| gpa2hva(gpa));
+        generation += 1;
+        *ring.ring.lock().unwrap() = (generation, Some(virtq.clone()));
+        let mut current_index: u16 = 0;
+        for t in task_rx.iter() {
+            if t.is_none() {
+                break;
+            }
+            while current_index != virtq.avail_index() {
+                let head = virtq.read_avail(current_index);
+                let req = P9Request {
+                    generation,
+                    virtq: virtq.clone(),
+                    head,
+                };
+                jobs.send(req).unwrap();
+                current_index = current_index.wrapping_add(1);
+            }
+        }
+        ring.ring.lock().unwrap().1 = None;
+    }
+}
+
+/// Configuration space: le16 tag_len, followed by the tag
+struct Virtio9pCfg {
+    layout: Vec<u8>,
+}
+
+impl VirtioDevCfg for Virtio9pCfg {
+    fn reset(&mut self) {}
+
+    fn generation(&self) -> u32 {
+        0
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        let bytes = self.layout.get(offset..offset + size as usize)?;
+        let mut value = [0u8; 4];
+        value[..bytes.len()].copy_from_slice(bytes);
+        Some(u32::from_le_bytes(value))
+    }
+
+    fn write(&mut self, _offset: usize, _size: u8, _value: u32) -> Option<()> {
+        None
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a virtio-9p device exporting the host directory `root` under
+    /// the mount tag `tag`. Requests are served by `threads` threads.
+    pub fn new_9p(
+        name: String,
+        irq: u32,
+        irq_sender: Sender<u32>,
+        gpa2hva: AddressConverter,
+        tag: &str,
+        root: impl AsRef<Path>,
+        threads: usize,
+    ) -> Result<Self, Error> {
+        let root = root.as_ref().canonicalize()?;
+        if !root.is_dir() {
+            return Err(format!("{}: {} is not a directory", name, root.display()).into());
+        }
+        let server = Arc::new(P9Server::new(&root)?);
+        let isr = Arc::new(RwLock::new(0));
+        let ring = Arc::new(P9Ring {
+            ring: Mutex::new((0, None)),
+            irq,
+            irq_sender,
+            isr: isr.clone(),
+        });
+        let (jobs, rx) = channel();
+        for i in 0..std::cmp::max(threads, 1) {
+            let (server, ring, gpa2hva, rx) =
+                (server.clone(), ring.clone(), gpa2hva.clone(), rx.clone());
+            std::thread::Builder::new()
+                .name(format!("{}_worker{}", name, i))
+                .spawn(move || work(server, ring, gpa2hva, rx))?;
+        }
+        let requests = VirtqManager::with_thread(
+            format!("{}_requests", name),
+            QUEUE_SIZE,
+            move |task_rx, virtq_rx| serve(ring, gpa2hva, jobs, task_rx, virtq_rx),
+        );
+        let mut layout = vec![];
+        layout.put_str(tag.as_bytes());
+        Ok(VirtioDevice {
+            name,
+            dev_id: VirtioId::Transport9P,
+            dev_feat: 1 << VIRTIO_F_VERSION_1 | 1 << VIRTIO_9P_MOUNT_TAG,
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            vqs: vec![requests],
+            cfg: Box::new(Virtio9pCfg { layout }),
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::fs;
+
+    /// Sends a request to the server and returns the reply, or the error.
+    fn try_call(server: &P9Server, kind: u8, body: &[u8]) -> Result<Vec<u8>, u32> {
+        let mut req = vec![];
+        req.put_u32((P9_HDR_SIZE + body.len()) as u32);
+        req.put_u8(kind);
+        req.put_u16(1);
+        req.extend_from_slice(body);
+        let mut buf = vec![0u8; 4096];
+        let len = server.handle(
+            &[(req.as_ptr() as usize, req.len())],
+            &[(buf.as_mut_ptr() as usize, buf.len())],
+        );
+        buf.truncate(len as usize);
+        if buf[4] == P9_RLERROR {
+            return Err(u32::from_le_bytes([buf[7], buf[8], buf[9], buf[10]]));
+        }
+        assert_eq!(buf[4], kind + 1, "reply {:?}", buf);
+        Ok(buf.split_off(P9_HDR_SIZE))
+    }
+
+    fn call(server: &P9Server, kind: u8, body: &[u8]) -> Vec<u8> {
+        try_call(server, kind, body).unwrap()
+    }
+
+    fn attach(server: &P9Server) {
+        let mut body = vec![];
+        body.put_u32(8192);
+        body.put_str(b"9P2000.L");
+        call(server, P9_TVERSION, &body);
+        let mut body = vec![];
+        body.put_u32(0);
+        body.put_u32(!0);
+        body.put_str(b"");
+        body.put_str(b"");
+        body.put_u32(0);
+        call(server, P9_TATTACH, &body);
+    }
+
+    fn walk(server: &P9Server, fid: u32, newfid: u32, name: &[u8]) {
+        let mut body = vec![];
+        body.put_u32(fid);
+        body.put_u32(newfid);
+        body.put_u16(1);
+        body.put_str(name);
+        assert_eq!(call(server, P9_TWALK, &body)[..2], 1u16.to_le_bytes());
+    }
+
+    fn symlink(server: &P9Server, dfid: u32, name: &[u8], target: &Path) {
+        let mut body = vec![];
+        body.put_u32(dfid);
+        body.put_str(name);
+        body.put_str(target.as_os_str().as_bytes());
+        body.put_u32(0);
+        call(server, P9_TSYMLINK, &body);
+    }
+
+    #[test]
+    fn p9_server_test() {
+        let root = std::env::temp_dir().join(format!("xhype-9p-{}", std::process::id()));
+        fs::create_dir_all(root.join("dir")).unwrap();
+        fs::write(root.join("dir/file"), b"hello 9p").unwrap();
+        let server = P9Server::new(&root).unwrap();
+        let mut body = vec![];
+        body.put_u32(8192);
+        body.put_str(b"9P2000.L");
+        assert_eq!(
+            &call(&server, P9_TVERSION, &body)[..4],
+            &8192u32.to_le_bytes()
+        );
+        let mut body = vec![];
+        body.put_u32(0);
+        body.put_u32(!0);
+        body.put_str(b"");
+        body.put_str(b"");
+        body.put_u32(0);
+        call(&server, P9_TATTACH, &body);
+        let mut body = vec![];
+        body.put_u32(0);
+        body.put_u32(1);
+        body.put_u16(3);
+        for name in &[&b"dir"[..], b"..", b"dir"] {
+            body.put_str(name);
+        }
+        assert_eq!(call(&server, P9_TWALK, &body)[..2], 3u16.to_le_bytes());
+        let mut body = vec![];
+        body.put_u32(1);
+        body.put_u32(2);
+        body.put_u16(2);
+        body.put_str(b"file");
+        body.put_str(b"x");
+        // a walk stops at a file
+        assert_eq!(call(&server, P9_TWALK, &body)[..2], 1u16.to_le_bytes());
+        let mut body = vec![];
+        body.put_u32(1);
+        body.put_u32(2);
+        body.put_u16(1);
+        body.put_str(b"file");
+        call(&server, P9_TWALK, &body);
+        let mut body = vec![];
+        body.put_u32(2);
+        body.put_u32(0);
+        call(&server, P9_TLOPEN, &body);
+        let mut body = vec![];
+        body.put_u32(2);
+        body.put_u64(6);
+        body.put_u32(100);
+        let reply = call(&server, P9_TREAD, &body);
+        assert_eq!(&reply[..4], &2u32.to_le_bytes());
+        assert_eq!(&reply[4..], b"9p");
+        fs::remove_dir_all(root).unwrap();
+    }
+
+    #[test]
+    fn p9_no_follow_test() {
+        use std::os::unix::fs::PermissionsExt;
+        let tmp = std::env::temp_dir().join(format!("xhype-9p-nofollow-{}", std::process::id()));
+        let (root, outside) = (tmp.join("export"), tmp.join("outside"));
+        fs::create_dir_all(&root).unwrap();
+        fs::create_dir_all(&outside).unwrap();
+        let secret = outside.join("secret");
+        fs::write(&secret, b"secret").unwrap();
+        fs::set_permissions(&secret, fs::Permissions::from_mode(0o600)).unwrap();
+        let server = P9Server::new(&root).unwrap();
+        attach(&server);
+
+        // Tsetattr on a link changes the link, never what it points to
+        symlink(&server, 0, b"link", &secret);
+        walk(&server, 0, 1, b"link");
+        for &(valid, mode) in &[(P9_ATTR_MODE, 0o777), (P9_ATTR_SIZE, 0)] {
+            let mut body = vec![];
+            body.put_u32(1);
+            body.put_u32(valid);
+            body.put_u32(mode);
+            body.put_u32(0);
+            body.put_u32(0);
+            body.put_u64(0);
+            body.extend_from_slice(&[0; 32]);
+            let _ = try_call(&server, P9_TSETATTR, &body);
+        }
+        assert_eq!(fs::read(&secret).unwrap(), b"secret");
+        let mode = fs::metadata(&secret).unwrap().permissions().mode();
+        assert_eq!(mode & 0o777, 0o600);
+
+        // Tlink of a link makes a hard link to the link
+        let mut body = vec![];
+        body.put_u32(0);
+        body.put_u32(1);
+        body.put_str(b"hard");
+        call(&server, P9_TLINK, &body);
+        let hard = fs::symlink_metadata(root.join("hard")).unwrap();
+        assert!(hard.file_type().is_symlink());
+
+        // a fid of a directory replaced by a link does not follow it
+        let mut body = vec![];
+        body.put_u32(0);
+        body.put_str(b"d");
+        body.put_u32(0o755);
+        body.put_u32(0);
+        call(&server, P9_TMKDIR, &body);
+        walk(&server, 0, 2, b"d");
+        let mut body = vec![];
+        body.put_u32(0);
+        body.put_str(b"d");
+        body.put_u32(L_AT_REMOVEDIR);
+        call(&server, P9_TUNLINKAT, &body);
+        symlink(&server, 0, b"d", &outside);
+        let mut body = vec![];
+        body.put_u32(2);
+        body.put_str(b"escape");
+        body.put_u32(2);
+        body.put_u32(0o644);
+        body.put_u32(0);
+        assert!(try_call(&server, P9_TLCREATE, &body).is_err());
+        assert!(!outside.join("escape").exists());
+        fs::remove_dir_all(tmp).unwrap();
+    }
+}
@@ -0,0 +1,245 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Implements a virtio persistent memory device.
+
+A host file is mapped into the address space of xhype with `MAP_SHARED` and the
+same range is mapped into the guest physical address space, so a guest DAX
+file system accesses the file with plain loads and stores: no VM exits, no
+virtqueue round-trips and no copies. Since the pages live in the host page
+cache, VMs mapping the same file share them.
+
+Like the guest's main memory, the region is identity mapped: its guest physical
+address equals its host virtual address.
+
+The only request on the virtqueue is a flush, which is turned into
+`msync(MS_SYNC)` plus `fdatasync()` on the file.
+*/
+
+use super::consts::*;
+use super::virtq::*;
+use super::{AddressConverter, VirtioDevCfg, VirtioDevice, VirtioId};
+use crate::consts::x86::*;
+use crate::consts::*;
+use crate::err::Error;
+use crate::hv::ffi::{HV_MEMORY_EXEC, HV_MEMORY_READ, HV_MEMORY_WRITE};
+use crate::VirtualMachine;
+#[allow(unused_imports)]
+use log::*;
+use std::fs::{File, OpenOptions};
+use std::os::unix::io::AsRawFd;
+use std::sync::{Arc, RwLock};
+
+pub const VIRTIO_PMEM_REQ_TYPE_FLUSH: u32 = 0;
+
+/// Alignment of the region in the guest physical address space. Linux maps
+/// persistent memory in units of memory sections, which are 128 MiB on x86_64.
+const PMEM_ALIGN: usize = 128 * MiB;
+
+/// A host file mapped at an aligned address.
+struct PmemRegion {
+    file: File,
+    start: usize,
+    size: usize,
+}
+
+impl PmemRegion {
+    fn new(path: &str, read_only: bool) -> Result<Self, Error> {
+        let file = OpenOptions::new().read(true).write(!read_only).open(path)?;
+        let size = file.metadata()?.len() as usize;
+        if size == 0 || size % PAGE_SIZE != 0 {
+            return Err(format!(
+                "size of {} (0x{:x}) is not a non-zero multiple of the page size",
+                path, size
+            ))?;
+        }
+        // reserve a range with enough room to align the start address, map
+        // the file at the aligned address, and give back the rest
+        let reserved = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                size + PMEM_ALIGN,
+                libc::PROT_NONE,
+                libc::MAP_PRIVATE | libc::MAP_ANON,
+                -1,
+                0,
+            )
+        };
+        if reserved == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error())?;
+        }
+        let reserved = reserved as usize;
+        let start = (reserved + PMEM_ALIGN - 1) / PMEM_ALIGN * PMEM_ALIGN;
+        let prot = if read_only {
+            libc::PROT_READ
+        } else {
+            libc::PROT_READ | libc::PROT_WRITE
+        };
+        let addr = unsafe {
+            libc::mmap(
+                start as *mut libc::c_void,
+                size,
+                prot,
+                libc::MAP_SHARED | libc::MAP_FIXED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        let mmap_result = if addr == libc::MAP_FAILED {
+            Err(std::io::Error::last_os_error())
+        } else {
+            Ok(())
+        };
+        unsafe {
+            if start > reserved {
+                libc::munmap(reserved as *mut libc::c_void, start - reserved);
+            }
+            let end = start + size;
+            let reserved_end = reserved + size + PMEM_ALIGN;
+            if reserved_end > end {
+                libc::munmap(end as *mut libc::c_void, reserved_end - end);
+            }
+        }
+        if let Err(e) = mmap_result {
+            unsafe { libc::munmap(start as *mut libc::c_void, size) };
+            return Err(e)?;
+        }
+        Ok(PmemRegion { file, start, size })
+    }
+
+    fn flush(&self) -> std::io::Result<()> {
+        let ret = unsafe { libc::msync(self.start as *mut libc::c_void, self.size, libc::MS_SYNC) };
+        if ret != 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+        self.file.sync_data()
+    }
+}
+
+impl Drop for PmemRegion {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.start as *mut libc::c_void, self.size) };
+    }
+}
+
+struct PmemDescHandler {
+    region: Arc<PmemRegion>,
+}
+
+impl VirtqDescHandle for PmemDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+        let (readable, writable) = desc_chain.split_at(desc_chain.len() - writable_count);
+        // virtio 1.1 (draft), 5.19.6: a request is a le32 type, the response
+        // is a le32 return value, 0 on success
+        let ret: u32 = match read_pod::<u32>(readable, 0) {
+            Some(VIRTIO_PMEM_REQ_TYPE_FLUSH) => match self.region.flush() {
+                Ok(_) => 0,
+                Err(e) => {
+                    error!("virtio-pmem: flush: {}", e);
+                    1
+                }
+            },
+            t => {
+                warn!("virtio-pmem: unknown request {:?}", t);
+                1
+            }
+        };
+        scatter(writable, &ret.to_le_bytes()) as u32
+    }
+}
+
+/// virtio-pmem device's config space: le64 start, le64 size
+pub struct VirtioPmemCfg {
+    start: u64,
+    size: u64,
+    gen: u32,
+}
+
+impl VirtioDevCfg for VirtioPmemCfg {
+    fn write(&mut self, _offset: usize, _size: u8, _value: u32) -> Option<()> {
+        None
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        match (size, offset) {
+            (4, 0) => Some(self.start as u32),
+            (4, 4) => Some((self.start >> 32) as u32),
+            (4, 8) => Some(self.size as u32),
+            (4, 12) => Some((self.size >> 32) as u32),
+            _ => None,
+        }
+    }
+
+    fn reset(&mut self) {
+        self.gen += 1;
+    }
+
+    fn generation(&self) -> u32 {
+        self.gen
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a virtio-pmem device backed by the file at `path` and maps the
+    /// file into the guest physical address space of `vm`.
+    pub fn new_pmem(
+        name: String,
+        irq: u32,
+        vm: &VirtualMachine,
+        path: &str,
+        read_only: bool,
+    ) -> Result<Self, Error> {
+        let region = PmemRegion::new(path, read_only)?;
+        let flags = if read_only {
+            HV_MEMORY_READ | HV_MEMORY_EXEC
+        } else {
+            HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC
+        };
+        vm.mem_space
+            .write()
+            .unwrap()
+            .map(region.start, region.start, region.size, flags)?;
+        info!(
+            "virtio-pmem: {} mapped at 0x{:x}, size 0x{:x}",
+            path, region.start, region.size
+        );
+        let pmem_cfg = VirtioPmemCfg {
+            start: region.start as u64,
+            size: region.size as u64,
+            gen: 0,
+        };
+        let isr = Arc::new(RwLock::new(0));
+        let req_q = VirtqManager::new(
+            format!("{}_req", name),
+            64,
+            irq,
+            vm.irq_sender.clone(),
+            isr.clone(),
+            vm.gpa2hva.clone(),
+            PmemDescHandler {
+                region: Arc::new(region),
+            },
+        );
+        let vqs = vec![req_q];
+        Ok(VirtioDevice {
+            name,
+            dev_id: VirtioId::Pmem,
+            dev_feat: 1 << VIRTIO_F_VERSION_1,
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            vqs,
+            cfg: Box::new(pmem_cfg),
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        })
+    }
+}
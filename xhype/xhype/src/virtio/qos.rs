@@ -0,0 +1,364 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! I/O rate limiting and weighted fair sharing between virtqueues.
+
+An [`IoThrottle`] is shared by all queues of a device (or by several devices
+to give them a common budget). It limits the IOPS and bytes per second of the
+device as a whole and of every single queue with token buckets. Every bucket
+holds up to `burst` tokens (one second worth of tokens if `burst` is 0), so an
+idle device can briefly run faster than its rate.
+
+When the device-wide budget is exhausted, queues are served in the order of
+the virtual start tags of their requests (start-time fair queueing): a queue with weight `w`
+gets `w` times the share of a queue with weight 1.
+
+All limits and weights can be changed at runtime through the `set_*` methods
+of the `Arc<IoThrottle>` the device was created with.
+*/
+
+#[allow(unused_imports)]
+use log::*;
+use std::str::FromStr;
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+/// Rate limits, 0 means unlimited.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct QosLimits {
+    /// I/O operations per second
+    pub iops: u64,
+    /// Largest burst of I/O operations, `iops` if 0
+    pub iops_burst: u64,
+    /// Bytes per second
+    pub bps: u64,
+    /// Largest burst of bytes, `bps` if 0
+    pub bps_burst: u64,
+}
+
+impl QosLimits {
+    fn is_unlimited(&self) -> bool {
+        self.iops == 0 && self.bps == 0
+    }
+}
+
+/// Parses a comma-separated list of `key=value`, where key is one of `iops`,
+/// `iops_burst`, `bps`, `bps_burst`, and value may have a `K`, `M` or `G`
+/// suffix, e.g. `iops=2000,bps=100M,bps_burst=200M`.
+impl FromStr for QosLimits {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        let mut limits = QosLimits::default();
+        for item in s.split(',').filter(|item| !item.is_empty()) {
+            let mut kv = item.splitn(2, '=');
+            let key = kv.next().unwrap().trim();
+            let value = kv
+                .next()
+                .ok_or(format!("missing value for {}", key))?
+                .trim();
+            let (digits, unit) = match value.chars().last() {
+                Some('K') | Some('k') => (&value[..value.len() - 1], 1 << 10),
+                Some('M') | Some('m') => (&value[..value.len() - 1], 1 << 20),
+                Some('G') | Some('g') => (&value[..value.len() - 1], 1 << 30),
+                _ => (value, 1),
+            };
+            let n = digits
+                .parse::<u64>()
+                .map_err(|e| format!("{}: {}", item, e))?
+                * unit;
+            match key {
+                "iops" => limits.iops = n,
+                "iops_burst" => limits.iops_burst = n,
+                "bps" => limits.bps = n,
+                "bps_burst" => limits.bps_burst = n,
+                _ => return Err(format!("unknown QoS key {}", key)),
+            }
+        }
+        Ok(limits)
+    }
+}
+
+struct TokenBucket {
+    rate: u64,
+    capacity: f64,
+    tokens: f64,
+    last: Instant,
+}
+
+impl TokenBucket {
+    fn new(rate: u64, burst: u64, now: Instant) -> Self {
+        let mut bucket = TokenBucket {
+            rate: 0,
+            capacity: 0.0,
+            tokens: 0.0,
+            last: now,
+        };
+        bucket.set(rate, burst);
+        bucket.tokens = bucket.capacity;
+        bucket
+    }
+
+    fn set(&mut self, rate: u64, burst: u64) {
+        self.rate = rate;
+        self.capacity = if burst > 0 { burst } else { rate } as f64;
+        self.tokens = self.tokens.min(self.capacity);
+    }
+
+    fn refill(&mut self, now: Instant) {
+        let elapsed = now.saturating_duration_since(self.last).as_secs_f64();
+        self.tokens = (self.tokens + elapsed * self.rate as f64).min(self.capacity);
+        self.last = now;
+    }
+
+    /// Returns how long it takes until `cost` tokens can be taken. A request
+    /// larger than the bucket only needs a full bucket and leaves a debt.
+    fn wait_time(&self, cost: u64) -> Duration {
+        if self.rate == 0 {
+            return Duration::from_secs(0);
+        }
+        let needed = (cost as f64).min(self.capacity);
+        if self.tokens >= needed {
+            Duration::from_secs(0)
+        } else {
+            Duration::from_secs_f64((needed - self.tokens) / self.rate as f64)
+        }
+    }
+
+    fn take(&mut self, cost: u64) {
+        if self.rate > 0 {
+            self.tokens -= cost as f64;
+        }
+    }
+}
+
+/// Rate limits of a device or a queue: an IOPS bucket and a bytes/s bucket.
+struct Limiter {
+    limits: QosLimits,
+    iops: TokenBucket,
+    bps: TokenBucket,
+}
+
+impl Limiter {
+    fn new(limits: QosLimits, now: Instant) -> Self {
+        Limiter {
+            limits,
+            iops: TokenBucket::new(limits.iops, limits.iops_burst, now),
+            bps: TokenBucket::new(limits.bps, limits.bps_burst, now),
+        }
+    }
+
+    fn set(&mut self, limits: QosLimits) {
+        self.limits = limits;
+        self.iops.set(limits.iops, limits.iops_burst);
+        self.bps.set(limits.bps, limits.bps_burst);
+    }
+
+    fn refill(&mut self, now: Instant) {
+        self.iops.refill(now);
+        self.bps.refill(now);
+    }
+
+    fn wait_time(&self, bytes: u64) -> Duration {
+        std::cmp::max(self.iops.wait_time(1), self.bps.wait_time(bytes))
+    }
+
+    fn take(&mut self, bytes: u64) {
+        self.iops.take(1);
+        self.bps.take(bytes);
+    }
+}
+
+struct QueueState {
+    weight: u32,
+    /// virtual finish tag of the last admitted request
+    finish: f64,
+    /// virtual start tag and size of the request waiting for admission
+    waiting: Option<(f64, u64)>,
+    limiter: Limiter,
+}
+
+struct ThrottleState {
+    /// virtual time, the start tag of the last admitted request
+    vtime: f64,
+    device: Limiter,
+    queues: Vec<QueueState>,
+}
+
+impl ThrottleState {
+    fn queue(&mut self, index: usize) -> &mut QueueState {
+        while self.queues.len() <= index {
+            self.queues.push(QueueState {
+                weight: 1,
+                finish: 0.0,
+                waiting: None,
+                limiter: Limiter::new(QosLimits::default(), Instant::now()),
+            });
+        }
+        &mut self.queues[index]
+    }
+}
+
+/// Cost of a request in virtual time. Every request counts as at least one
+/// page, so that small requests are not free.
+fn virtual_cost(bytes: u64, weight: u32) -> f64 {
+    (bytes + 4096) as f64 / weight as f64
+}
+
+pub struct IoThrottle {
+    state: Mutex<ThrottleState>,
+    cond: Condvar,
+}
+
+impl IoThrottle {
+    pub fn new(device_limits: QosLimits) -> Arc<Self> {
+        Arc::new(IoThrottle {
+            state: Mutex::new(ThrottleState {
+                vtime: 0.0,
+                device: Limiter::new(device_limits, Instant::now()),
+                queues: Vec::new(),
+            }),
+            cond: Condvar::new(),
+        })
+    }
+
+    pub fn limits(&self) -> QosLimits {
+        self.state.lock().unwrap().device.limits
+    }
+
+    pub fn set_limits(&self, limits: QosLimits) {
+        let mut state = self.state.lock().unwrap();
+        state.device.refill(Instant::now());
+        state.device.set(limits);
+        self.cond.notify_all();
+    }
+
+    pub fn set_queue_limits(&self, queue: usize, limits: QosLimits) {
+        let mut state = self.state.lock().unwrap();
+        let q = state.queue(queue);
+        q.limiter.refill(Instant::now());
+        q.limiter.set(limits);
+        self.cond.notify_all();
+    }
+
+    pub fn set_queue_weight(&self, queue: usize, weight: u32) {
+        assert!(weight > 0);
+        self.state.lock().unwrap().queue(queue).weight = weight;
+        self.cond.notify_all();
+    }
+
+    /// Blocks the calling queue until it may issue a request of `bytes` bytes.
+    pub fn admit(&self, queue: usize, bytes: u64) {
+        let mut state = self.state.lock().unwrap();
+        let q = state.queue(queue);
+        let (weight, finish) = (q.weight, q.finish);
+        let queue_unlimited = q.limiter.limits.is_unlimited();
+        if queue_unlimited && state.device.limits.is_unlimited() {
+            return;
+        }
+        let start = state.vtime.max(finish);
+        state.queues[queue].waiting = Some((start, bytes));
+        loop {
+            let now = Instant::now();
+            state.device.refill(now);
+            for q in state.queues.iter_mut() {
+                q.limiter.refill(now);
+            }
+            let queue_wait = state.queues[queue].limiter.wait_time(bytes);
+            if queue_wait > Duration::from_secs(0) {
+                // this queue is over its own limit
+                state = self.cond.wait_timeout(state, queue_wait).unwrap().0;
+                continue;
+            }
+            // among the queues whose waiting request is within their own
+            // limits, the one with the smallest start tag gets the device
+            // budget first
+            let first = state
+                .queues
+                .iter()
+                .enumerate()
+                .filter_map(|(i, q)| q.waiting.map(|w| (w, q, i)))
+                .filter(|((_, bytes), q, _)| q.limiter.wait_time(*bytes) == Duration::from_secs(0))
+                .map(|((tag, _), _, i)| (tag, i))
+                .min_by(|a, b| a.partial_cmp(b).unwrap());
+            if first.map(|(_, i)| i) != Some(queue) {
+                state = self.cond.wait(state).unwrap();
+                continue;
+            }
+            let device_wait = state.device.wait_time(bytes);
+            if device_wait > Duration::from_secs(0) {
+                state = self.cond.wait_timeout(state, device_wait).unwrap().0;
+                continue;
+            }
+            state.device.take(bytes);
+            state.vtime = start;
+            let q = &mut state.queues[queue];
+            q.limiter.take(bytes);
+            q.finish = start + virtual_cost(bytes, weight);
+            q.waiting = None;
+            self.cond.notify_all();
+            return;
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn qos_limits_parse_test() {
+        let limits: QosLimits = "iops=2000,bps=100M,bps_burst=1G".parse().unwrap();
+        assert_eq!(
+            limits,
+            QosLimits {
+                iops: 2000,
+                iops_burst: 0,
+                bps: 100 << 20,
+                bps_burst: 1 << 30,
+            }
+        );
+        assert!("iops".parse::<QosLimits>().is_err());
+        assert!("foo=1".parse::<QosLimits>().is_err());
+    }
+
+    #[test]
+    fn token_bucket_test() {
+        let now = Instant::now();
+        let mut bucket = TokenBucket::new(1000, 100, now);
+        assert_eq!(bucket.wait_time(100), Duration::from_secs(0));
+        bucket.take(100);
+        assert_eq!(bucket.wait_time(50), Duration::from_millis(50));
+        bucket.refill(now + Duration::from_millis(20));
+        assert_eq!(bucket.wait_time(20), Duration::from_secs(0));
+        // requests larger than the bucket only wait for a full bucket
+        bucket.refill(now + Duration::from_secs(1));
+        assert_eq!(bucket.wait_time(1000), Duration::from_secs(0));
+    }
+
+    #[test]
+    fn throttled_queue_does_not_block_test() {
+        let throttle = IoThrottle::new(QosLimits {
+            iops: 1_000_000,
+            ..Default::default()
+        });
+        throttle.set_queue_limits(
+            0,
+            QosLimits {
+                bps: 4096,
+                bps_burst: 4096,
+                ..Default::default()
+            },
+        );
+        // queue 1 has had far more service, so its start tags are later
+        throttle.admit(1, 1 << 20);
+        throttle.admit(0, 4096);
+        let t = throttle.clone();
+        // waits about a second for its own bucket, holding the smallest tag
+        let blocked = std::thread::spawn(move || t.admit(0, 4096));
+        std::thread::sleep(Duration::from_millis(100));
+        let begin = Instant::now();
+        throttle.admit(1, 4096);
+        assert!(begin.elapsed() < Duration::from_millis(500));
+        blocked.join().unwrap();
+    }
+}
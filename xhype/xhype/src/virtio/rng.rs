@@ -1,15 +1,263 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 
+/*! A virtio entropy device
+
+Every device has its own ChaCha20 generator, keyed from the OS and rekeyed
+after [`RESEED_BYTES`] bytes. Four blocks are generated at once, 256 bytes
+that go straight into the guest's buffers, so a guest draining the device at
+boot gets its entropy at memory speed.
+*/
+
 use super::consts::*;
 use super::virtq::*;
 use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
 #[allow(unused_imports)]
 use log::*;
-use rand::random;
+use std::io;
 use std::slice;
 use std::sync::{Arc, RwLock};
 
-struct RngDescHandler {}
+const CHACHA_CONSTANTS: [u32; 4] = [0x6170_7865, 0x3320_646e, 0x7962_2d32, 0x6b20_6574];
+const CHACHA_BLOCK: usize = 64;
+/// bytes of the four blocks generated at once
+const CHACHA_BATCH: usize = 4 * CHACHA_BLOCK;
+/// The generator takes a new key from the OS after this many bytes.
+pub const RESEED_BYTES: usize = 1 << 20;
+
+/// Fills `buf` with random bytes from the OS.
+#[cfg(target_os = "linux")]
+fn os_random(buf: &mut [u8]) -> io::Result<()> {
+    let mut filled = 0;
+    while filled < buf.len() {
+        let ret = unsafe {
+            libc::getrandom(
+                buf[filled..].as_mut_ptr() as *mut libc::c_void,
+                buf.len() - filled,
+                0,
+            )
+        };
+        if ret >= 0 {
+            filled += ret as usize;
+            continue;
+        }
+        let e = io::Error::last_os_error();
+        if e.kind() != io::ErrorKind::Interrupted {
+            return Err(e);
+        }
+    }
+    Ok(())
+}
+
+/// Fills `buf`, at most 256 bytes, with random bytes from the OS.
+#[cfg(not(target_os = "linux"))]
+fn os_random(buf: &mut [u8]) -> io::Result<()> {
+    if unsafe { libc::getentropy(buf.as_mut_ptr() as *mut libc::c_void, buf.len()) } < 0 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(())
+    }
+}
+
+/// The input of the ChaCha20 block function with a 64-bit block counter and
+/// a 64-bit nonce
+fn chacha_state(key: &[u32; 8], counter: u64, nonce: &[u32; 2]) -> [u32; 16] {
+    let mut state = [0u32; 16];
+    state[..4].copy_from_slice(&CHACHA_CONSTANTS);
+    state[4..12].copy_from_slice(key);
+    state[12] = counter as u32;
+    state[13] = (counter >> 32) as u32;
+    state[14..].copy_from_slice(nonce);
+    state
+}
+
+/// Writes the block of `state` to the first 64 bytes of `out`.
+#[allow(dead_code)]
+fn chacha20_block(state: &[u32; 16], out: &mut [u8]) {
+    fn quarter_round(x: &mut [u32; 16], a: usize, b: usize, c: usize, d: usize) {
+        x[a] = x[a].wrapping_add(x[b]);
+        x[d] = (x[d] ^ x[a]).rotate_left(16);
+        x[c] = x[c].wrapping_add(x[d]);
+        x[b] = (x[b] ^ x[c]).rotate_left(12);
+        x[a] = x[a].wrapping_add(x[b]);
+        x[d] = (x[d] ^ x[a]).rotate_left(8);
+        x[c] = x[c].wrapping_add(x[d]);
+        x[b] = (x[b] ^ x[c]).rotate_left(7);
+    }
+    let mut x = *state;
+    for _ in 0..10 {
+        quarter_round(&mut x, 0, 4, 8, 12);
+        quarter_round(&mut x, 1, 5, 9, 13);
+        quarter_round(&mut x, 2, 6, 10, 14);
+        quarter_round(&mut x, 3, 7, 11, 15);
+        quarter_round(&mut x, 0, 5, 10, 15);
+        quarter_round(&mut x, 1, 6, 11, 12);
+        quarter_round(&mut x, 2, 7, 8, 13);
+        quarter_round(&mut x, 3, 4, 9, 14);
+    }
+    for (i, word) in x.iter().enumerate() {
+        let bytes = word.wrapping_add(state[i]).to_le_bytes();
+        out[4 * i..4 * i + 4].copy_from_slice(&bytes);
+    }
+}
+
+/// Writes the blocks `counter` to `counter + 3` to the first 256 bytes of
+/// `out`. Each SSE2 register holds the same word of the four blocks.
+#[cfg(target_arch = "x86_64")]
+fn chacha20_blocks4(key: &[u32; 8], counter: u64, nonce: &[u32; 2], out: &mut [u8]) {
+    use std::arch::x86_64::*;
+
+    macro_rules! rotl {
+        ($v:expr, $l:literal, $r:literal) => {
+            _mm_or_si128(_mm_slli_epi32($v, $l), _mm_srli_epi32($v, $r))
+        };
+    }
+
+    #[inline(always)]
+    unsafe fn quarter_round(x: &mut [__m128i; 16], a: usize, b: usize, c: usize, d: usize) {
+        x[a] = _mm_add_epi32(x[a], x[b]);
+        x[d] = rotl!(_mm_xor_si128(x[d], x[a]), 16, 16);
+        x[c] = _mm_add_epi32(x[c], x[d]);
+        x[b] = rotl!(_mm_xor_si128(x[b], x[c]), 12, 20);
+        x[a] = _mm_add_epi32(x[a], x[b]);
+        x[d] = rotl!(_mm_xor_si128(x[d], x[a]), 8, 24);
+        x[c] = _mm_add_epi32(x[c], x[d]);
+        x[b] = rotl!(_mm_xor_si128(x[b], x[c]), 7, 25);
+    }
+
+    assert!(out.len() >= CHACHA_BATCH);
+    let state = chacha_state(key, counter, nonce);
+    let counters = [
+        counter,
+        counter.wrapping_add(1),
+        counter.wrapping_add(2),
+        counter.wrapping_add(3),
+    ];
+    // SSE2 is part of x86_64, and `out` has room for the four blocks
+    unsafe {
+        let mut input = [_mm_setzero_si128(); 16];
+        for (i, word) in input.iter_mut().enumerate() {
+            *word = _mm_set1_epi32(state[i] as i32);
+        }
+        input[12] = _mm_setr_epi32(
+            counters[0] as i32,
+            counters[1] as i32,
+            counters[2] as i32,
+            counters[3] as i32,
+        );
+        input[13] = _mm_setr_epi32(
+            (counters[0] >> 32) as i32,
+            (counters[1] >> 32) as i32,
+            (counters[2] >> 32) as i32,
+            (counters[3] >> 32) as i32,
+        );
+        let mut x = input;
+        for _ in 0..10 {
+            quarter_round(&mut x, 0, 4, 8, 12);
+            quarter_round(&mut x, 1, 5, 9, 13);
+            quarter_round(&mut x, 2, 6, 10, 14);
+            quarter_round(&mut x, 3, 7, 11, 15);
+            quarter_round(&mut x, 0, 5, 10, 15);
+            quarter_round(&mut x, 1, 6, 11, 12);
+            quarter_round(&mut x, 2, 7, 8, 13);
+            quarter_round(&mut x, 3, 4, 9, 14);
+        }
+        for i in 0..16 {
+            x[i] = _mm_add_epi32(x[i], input[i]);
+        }
+        // transpose each group of four words so that every register holds
+        // four consecutive words of one block
+        let base = out.as_mut_ptr();
+        for k in 0..4 {
+            let (a, b, c, d) = (x[4 * k], x[4 * k + 1], x[4 * k + 2], x[4 * k + 3]);
+            let ab_lo = _mm_unpacklo_epi32(a, b);
+            let ab_hi = _mm_unpackhi_epi32(a, b);
+            let cd_lo = _mm_unpacklo_epi32(c, d);
+            let cd_hi = _mm_unpackhi_epi32(c, d);
+            let blocks = [
+                _mm_unpacklo_epi64(ab_lo, cd_lo),
+                _mm_unpackhi_epi64(ab_lo, cd_lo),
+                _mm_unpacklo_epi64(ab_hi, cd_hi),
+                _mm_unpackhi_epi64(ab_hi, cd_hi),
+            ];
+            for (j, words) in blocks.iter().enumerate() {
+                let dst = base.add(CHACHA_BLOCK * j + 16 * k) as *mut __m128i;
+                _mm_storeu_si128(dst, *words);
+            }
+        }
+    }
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+fn chacha20_blocks4(key: &[u32; 8], counter: u64, nonce: &[u32; 2], out: &mut [u8]) {
+    for j in 0..4 {
+        let state = chacha_state(key, counter.wrapping_add(j as u64), nonce);
+        chacha20_block(&state, &mut out[CHACHA_BLOCK * j..]);
+    }
+}
+
+/// A ChaCha20 keystream used as a random number generator
+pub struct ChaCha20Rng {
+    key: [u32; 8],
+    counter: u64,
+    /// bytes generated with the current key
+    generated: usize,
+}
+
+impl ChaCha20Rng {
+    pub fn new() -> io::Result<Self> {
+        let mut rng = ChaCha20Rng {
+            key: [0; 8],
+            counter: 0,
+            generated: 0,
+        };
+        rng.reseed()?;
+        Ok(rng)
+    }
+
+    fn reseed(&mut self) -> io::Result<()> {
+        let mut seed = [0u8; 32];
+        os_random(&mut seed)?;
+        for (word, bytes) in self.key.iter_mut().zip(seed.chunks_exact(4)) {
+            let mut b = [0u8; 4];
+            b.copy_from_slice(bytes);
+            *word = u32::from_le_bytes(b);
+        }
+        self.counter = 0;
+        self.generated = 0;
+        Ok(())
+    }
+
+    fn next_batch(&mut self, out: &mut [u8]) {
+        if self.generated >= RESEED_BYTES {
+            if let Err(e) = self.reseed() {
+                // the keystream is still good, try again later
+                warn!("virtio-rng: cannot reseed: {}", e);
+                self.generated = 0;
+            }
+        }
+        chacha20_blocks4(&self.key, self.counter, &[0, 0], out);
+        self.counter = self.counter.wrapping_add(4);
+        self.generated += CHACHA_BATCH;
+    }
+
+    /// Fills `buf` with random bytes.
+    pub fn fill(&mut self, buf: &mut [u8]) {
+        let mut batches = buf.chunks_exact_mut(CHACHA_BATCH);
+        for batch in &mut batches {
+            self.next_batch(batch);
+        }
+        let rest = batches.into_remainder();
+        if !rest.is_empty() {
+            let mut batch = [0u8; CHACHA_BATCH];
+            self.next_batch(&mut batch);
+            rest.copy_from_slice(&batch[..rest.len()]);
+        }
+    }
+}
+
+struct RngDescHandler {
+    rng: ChaCha20Rng,
+}
 
 impl VirtqDescHandle for RngDescHandler {
     fn handle_desc_chain(
@@ -23,12 +271,10 @@ impl VirtqDescHandle for RngDescHandler {
         let mut total_size = 0;
         for (addr, len) in desc_chain.into_iter() {
             let buf = unsafe { slice::from_raw_parts_mut(addr as *mut u8, len) };
-            for byte in buf.iter_mut() {
-                *byte = random();
-            }
-            trace!("virtio-rng writes random bytes to guest: {:02x?}", buf);
+            self.rng.fill(buf);
             total_size += len;
         }
+        trace!("virtio-rng writes {} random bytes to guest", total_size);
         total_size as u32
     }
 }
@@ -64,7 +310,9 @@ impl VirtioDevice {
     ) -> Self {
         let rng_cfg = VirtioRngCfg { gen: 0 };
         let isr = Arc::new(RwLock::new(0));
-        let handler = RngDescHandler {};
+        let handler = RngDescHandler {
+            rng: ChaCha20Rng::new().expect("cannot seed virtio-rng"),
+        };
         let req_q = VirtqManager::new(
             format!("{}_req", name),
             64,
@@ -92,3 +340,49 @@ impl VirtioDevice {
         }
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn chacha20_block_test() {
+        // RFC 7539, 2.3.2: its 32-bit counter and 96-bit nonce map to our
+        // 64-bit counter and 64-bit nonce
+        let mut key = [0u32; 8];
+        for (i, word) in key.iter_mut().enumerate() {
+            let b = 4 * i as u8;
+            *word = u32::from_le_bytes([b, b + 1, b + 2, b + 3]);
+        }
+        let state = chacha_state(&key, 1 | 0x0900_0000 << 32, &[0x4a00_0000, 0]);
+        let mut block = [0u8; CHACHA_BLOCK];
+        chacha20_block(&state, &mut block);
+        assert_eq!(
+            block[..16],
+            [
+                0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20,
+                0x71, 0xc4
+            ]
+        );
+        assert_eq!(block[60..], [0xa2, 0x50, 0x3c, 0x4e]);
+    }
+
+    #[test]
+    fn chacha20_blocks4_test() {
+        let key = [1, 2, 3, 4, 5, 6, 7, 8];
+        // the four blocks cross a carry of the low counter word
+        let counter = 0xffff_fffe;
+        let mut batch = [0u8; CHACHA_BATCH];
+        chacha20_blocks4(&key, counter, &[9, 10], &mut batch);
+        for j in 0..4 {
+            let mut block = [0u8; CHACHA_BLOCK];
+            chacha20_block(&chacha_state(&key, counter + j, &[9, 10]), &mut block);
+            let start = CHACHA_BLOCK * j as usize;
+            assert_eq!(batch[start..start + CHACHA_BLOCK], block[..]);
+        }
+        let mut rng = ChaCha20Rng::new().unwrap();
+        let mut buf = vec![0u8; 1000];
+        rng.fill(&mut buf);
+        assert!(buf.iter().any(|&b| b != 0));
+    }
+}
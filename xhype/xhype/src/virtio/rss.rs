@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Receive side scaling: steers incoming frames to receive queues.
+
+Frames are hashed with the Toeplitz hash of the Microsoft RSS specification
+over their IP addresses and, for TCP and UDP, their ports. All frames of a
+flow thus go to the same queue, and the guest processes them on the same
+vCPU. Frames that are not IP go to the first queue.
+*/
+
+use super::offload::{be16, parse, IPPROTO_TCP, IPPROTO_UDP};
+
+/// The default key of the Microsoft RSS specification, also used by most NICs.
+pub const RSS_DEFAULT_KEY: [u8; 40] = [
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+];
+
+/// The Toeplitz hash of `input`. `key` must be at least 4 bytes longer than
+/// `input`.
+pub fn toeplitz(key: &[u8], input: &[u8]) -> u32 {
+    let mut hash = 0;
+    // the 32 bits of the key starting at the current bit of the input
+    let mut window = u32::from_be_bytes([key[0], key[1], key[2], key[3]]);
+    for (i, byte) in input.iter().enumerate() {
+        let next = key.get(i + 4).cloned().unwrap_or(0);
+        for bit in 0..8 {
+            if byte & (0x80 >> bit) != 0 {
+                hash ^= window;
+            }
+            window = window << 1 | ((next >> (7 - bit)) & 1) as u32;
+        }
+    }
+    hash
+}
+
+/// The RSS hash of an Ethernet frame, or `None` if it is not an IP frame.
+pub fn flow_hash(frame: &[u8]) -> Option<u32> {
+    let layout = parse(frame)?;
+    let addrs = if layout.ipv6 {
+        &frame[layout.l3 + 8..layout.l3 + 40]
+    } else {
+        &frame[layout.l3 + 12..layout.l3 + 20]
+    };
+    let mut input = [0u8; 36];
+    input[..addrs.len()].copy_from_slice(addrs);
+    let mut len = addrs.len();
+    // fragments other than the first one do not carry the ports, so all
+    // fragments of a datagram are hashed by the addresses only
+    let fragmented = !layout.ipv6 && be16(frame, layout.l3 + 6) & 0x3fff != 0;
+    let has_ports = layout.proto == IPPROTO_TCP || layout.proto == IPPROTO_UDP;
+    if has_ports && !fragmented && frame.len() >= layout.l4 + 4 {
+        input[len..len + 4].copy_from_slice(&frame[layout.l4..layout.l4 + 4]);
+        len += 4;
+    }
+    Some(toeplitz(&RSS_DEFAULT_KEY, &input[..len]))
+}
+
+/// The receive queue pair a frame is steered to, out of `queue_pairs`.
+pub fn steer(frame: &[u8], queue_pairs: usize) -> usize {
+    match flow_hash(frame) {
+        Some(hash) if queue_pairs > 1 => hash as usize % queue_pairs,
+        _ => 0,
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn toeplitz_test() {
+        // the verification suite of the Microsoft RSS specification:
+        // 66.9.149.187:2794 -> 161.142.100.80:1766
+        let ips = [66, 9, 149, 187, 161, 142, 100, 80];
+        assert_eq!(toeplitz(&RSS_DEFAULT_KEY, &ips), 0x323e8fc2);
+        let mut input = ips.to_vec();
+        input.extend_from_slice(&2794u16.to_be_bytes());
+        input.extend_from_slice(&1766u16.to_be_bytes());
+        assert_eq!(toeplitz(&RSS_DEFAULT_KEY, &input), 0x51ccc178);
+    }
+
+    #[test]
+    fn flow_hash_test() {
+        let mut frame = vec![0u8; 14 + 20 + 20];
+        frame[12..14].copy_from_slice(&0x0800u16.to_be_bytes());
+        frame[14] = 0x45;
+        frame[23] = IPPROTO_TCP;
+        frame[26..34].copy_from_slice(&[66, 9, 149, 187, 161, 142, 100, 80]);
+        frame[34..36].copy_from_slice(&2794u16.to_be_bytes());
+        frame[36..38].copy_from_slice(&1766u16.to_be_bytes());
+        assert_eq!(flow_hash(&frame), Some(0x51ccc178));
+        assert_eq!(steer(&frame, 4), 0x51ccc178 % 4);
+        frame[12] = 0x08;
+        frame[13] = 0x06;
+        assert_eq!(flow_hash(&frame), None);
+        assert_eq!(steer(&frame, 4), 0);
+    }
+}
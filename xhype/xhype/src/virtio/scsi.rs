@@ -0,0 +1,846 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Implements a virtio SCSI host controller with file-backed LUNs.
+
+The controller exposes a single target whose logical units are backed by
+[`DiskImage`]s. Besides the control queue and the event queue, it has
+`num_queues` request queues, each of which is served by its own thread, so that
+a multi-queue guest driver can submit commands from every vCPU in parallel.
+
+Only the subset of SPC/SBC commands that Linux and other common guests need to
+use a disk is implemented, plus UNMAP, which is mapped to
+[`DiskImage::discard`].
+
+Definitions are ported from [virtio_scsi.h](../../../../include/virtio_scsi.h).
+*/
+
+use super::consts::*;
+use super::disk::{DiskImage, DISCARD_ALIGNMENT, SECTOR_SIZE};
+use super::qos::IoThrottle;
+use super::virtq::*;
+use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
+#[allow(unused_imports)]
+use log::*;
+use std::mem::size_of;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::{Arc, RwLock};
+
+pub const VIRTIO_SCSI_CDB_DEFAULT_SIZE: u32 = 32;
+pub const VIRTIO_SCSI_SENSE_DEFAULT_SIZE: u32 = 96;
+/// Largest sizes the driver may set: a CDB is at most 260 bytes, and fixed
+/// format sense data at most 252. They also bound what a request allocates.
+pub const VIRTIO_SCSI_CDB_MAX_SIZE: u32 = 256;
+pub const VIRTIO_SCSI_SENSE_MAX_SIZE: u32 = 252;
+
+/* Feature Bits */
+pub const VIRTIO_SCSI_F_INOUT: u64 = 0;
+pub const VIRTIO_SCSI_F_HOTPLUG: u64 = 1;
+pub const VIRTIO_SCSI_F_CHANGE: u64 = 2;
+pub const VIRTIO_SCSI_F_T10_PI: u64 = 3;
+
+/* Response codes */
+pub const VIRTIO_SCSI_S_OK: u8 = 0;
+pub const VIRTIO_SCSI_S_OVERRUN: u8 = 1;
+pub const VIRTIO_SCSI_S_ABORTED: u8 = 2;
+pub const VIRTIO_SCSI_S_BAD_TARGET: u8 = 3;
+pub const VIRTIO_SCSI_S_RESET: u8 = 4;
+pub const VIRTIO_SCSI_S_BUSY: u8 = 5;
+pub const VIRTIO_SCSI_S_TRANSPORT_FAILURE: u8 = 6;
+pub const VIRTIO_SCSI_S_TARGET_FAILURE: u8 = 7;
+pub const VIRTIO_SCSI_S_NEXUS_FAILURE: u8 = 8;
+pub const VIRTIO_SCSI_S_FAILURE: u8 = 9;
+pub const VIRTIO_SCSI_S_FUNCTION_SUCCEEDED: u8 = 10;
+pub const VIRTIO_SCSI_S_FUNCTION_REJECTED: u8 = 11;
+pub const VIRTIO_SCSI_S_INCORRECT_LUN: u8 = 12;
+
+/* Controlq type codes.  */
+pub const VIRTIO_SCSI_T_TMF: u32 = 0;
+pub const VIRTIO_SCSI_T_AN_QUERY: u32 = 1;
+pub const VIRTIO_SCSI_T_AN_SUBSCRIBE: u32 = 2;
+
+/* Events.  */
+pub const VIRTIO_SCSI_T_EVENTS_MISSED: u32 = 0x80000000;
+pub const VIRTIO_SCSI_T_NO_EVENT: u32 = 0;
+
+/* SCSI status codes and sense keys, see SAM-5 and SPC-4 */
+const GOOD: u8 = 0x00;
+const CHECK_CONDITION: u8 = 0x02;
+
+const NO_SENSE: u8 = 0x00;
+const NOT_READY: u8 = 0x02;
+const MEDIUM_ERROR: u8 = 0x03;
+const ILLEGAL_REQUEST: u8 = 0x05;
+const DATA_PROTECT: u8 = 0x07;
+
+/* Operation codes, see SPC-4 and SBC-3 */
+const TEST_UNIT_READY: u8 = 0x00;
+const REQUEST_SENSE: u8 = 0x03;
+const READ_6: u8 = 0x08;
+const WRITE_6: u8 = 0x0a;
+const INQUIRY: u8 = 0x12;
+const MODE_SENSE_6: u8 = 0x1a;
+const START_STOP_UNIT: u8 = 0x1b;
+const PREVENT_ALLOW_MEDIUM_REMOVAL: u8 = 0x1e;
+const READ_CAPACITY_10: u8 = 0x25;
+const READ_10: u8 = 0x28;
+const WRITE_10: u8 = 0x2a;
+const VERIFY_10: u8 = 0x2f;
+const SYNCHRONIZE_CACHE_10: u8 = 0x35;
+const UNMAP: u8 = 0x42;
+const MODE_SENSE_10: u8 = 0x5a;
+const READ_16: u8 = 0x88;
+const WRITE_16: u8 = 0x8a;
+const SYNCHRONIZE_CACHE_16: u8 = 0x91;
+const SERVICE_ACTION_IN_16: u8 = 0x9e;
+const SAI_READ_CAPACITY_16: u8 = 0x10;
+const REPORT_LUNS: u8 = 0xa0;
+
+const QUEUE_SIZE: u32 = 128;
+const MAX_UNMAP_DESCRIPTORS: u32 = 32;
+
+/// The fixed part of a command request, followed by the CDB and data-out,
+/// see virtio 1.1, 5.6.6.1 Device Operation: Request Queues
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioScsiCmdReqHeader {
+    lun: [u8; 8],
+    tag: u64,
+    task_attr: u8,
+    prio: u8,
+    crn: u8,
+}
+
+/// The fixed part of a command response, followed by sense data and data-in
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioScsiCmdRespHeader {
+    sense_len: u32,
+    resid: u32,
+    status_qualifier: u16,
+    status: u8,
+    response: u8,
+}
+
+/// Task management function request on the control queue
+#[repr(C, packed)]
+#[derive(Default)]
+struct VirtioScsiCtrlTmfReq {
+    req_type: u32,
+    subtype: u32,
+    lun: [u8; 8],
+    tag: u64,
+}
+
+/// Result of a SCSI command: the status, the sense data if the status is
+/// CHECK CONDITION, and the number of data-in bytes written to the guest.
+struct CmdResult {
+    status: u8,
+    sense: [u8; 18],
+    data_in: usize,
+}
+
+impl CmdResult {
+    fn good(data_in: usize) -> Self {
+        CmdResult {
+            status: GOOD,
+            sense: [0; 18],
+            data_in,
+        }
+    }
+
+    /// Builds fixed format sense data, see SPC-4, 4.5.3.
+    fn check_condition(key: u8, asc: u8, ascq: u8) -> Self {
+        let mut sense = [0u8; 18];
+        sense[0] = 0x70;
+        sense[2] = key;
+        sense[7] = 10;
+        sense[12] = asc;
+        sense[13] = ascq;
+        CmdResult {
+            status: CHECK_CONDITION,
+            sense,
+            data_in: 0,
+        }
+    }
+
+    fn invalid_opcode() -> Self {
+        Self::check_condition(ILLEGAL_REQUEST, 0x20, 0x00)
+    }
+
+    fn invalid_field() -> Self {
+        Self::check_condition(ILLEGAL_REQUEST, 0x24, 0x00)
+    }
+
+    fn lba_out_of_range() -> Self {
+        Self::check_condition(ILLEGAL_REQUEST, 0x21, 0x00)
+    }
+
+    fn write_protected() -> Self {
+        Self::check_condition(DATA_PROTECT, 0x27, 0x00)
+    }
+
+    fn medium_not_present() -> Self {
+        Self::check_condition(NOT_READY, 0x3a, 0x00)
+    }
+}
+
+fn be16(b: &[u8]) -> u16 {
+    u16::from_be_bytes([b[0], b[1]])
+}
+
+fn be32(b: &[u8]) -> u32 {
+    u32::from_be_bytes([b[0], b[1], b[2], b[3]])
+}
+
+fn be64(b: &[u8]) -> u64 {
+    let mut bytes = [0u8; 8];
+    bytes.copy_from_slice(&b[..8]);
+    u64::from_be_bytes(bytes)
+}
+
+/// Converts a block range to a byte range, if it is inside the disk.
+fn byte_range(disk: &dyn DiskImage, lba: u64, blocks: u64) -> Option<(u64, u64)> {
+    let offset = lba.checked_mul(SECTOR_SIZE)?;
+    let len = blocks * SECTOR_SIZE;
+    match offset.checked_add(len) {
+        Some(end) if end <= disk.size() => Some((offset, len)),
+        _ => None,
+    }
+}
+
+/// Decodes the single level LUN structure used by virtio-scsi: byte 0 is 1,
+/// byte 1 is the target, bytes 2-3 are the LUN in flat space addressing.
+fn decode_lun(lun: &[u8; 8]) -> Option<(u8, usize)> {
+    if lun[0] != 1 {
+        return None;
+    }
+    Some((lun[1], (((lun[2] & 0x3f) as usize) << 8) | lun[3] as usize))
+}
+
+/// Sizes of the CDB and the sense data, which the driver may change through
+/// the config space.
+struct ScsiSizes {
+    cdb_size: AtomicU32,
+    sense_size: AtomicU32,
+}
+
+struct ScsiReqDescHandler {
+    luns: Arc<Vec<Arc<dyn DiskImage>>>,
+    sizes: Arc<ScsiSizes>,
+    /// the throttle and the index of this request queue in it
+    throttle: Option<(Arc<IoThrottle>, usize)>,
+}
+
+impl ScsiReqDescHandler {
+    /// Reads or writes `blocks` sectors starting at `lba` directly between the
+    /// disk and the guest buffers.
+    fn read_write(
+        &self,
+        disk: &dyn DiskImage,
+        lba: u64,
+        blocks: u64,
+        write: bool,
+        data: &[(usize, usize)],
+    ) -> CmdResult {
+        if write && disk.read_only() {
+            return CmdResult::write_protected();
+        }
+        let (offset, len) = match byte_range(disk, lba, blocks) {
+            Some(range) => range,
+            None => return CmdResult::lba_out_of_range(),
+        };
+        if total_len(data) < len as usize {
+            return CmdResult::invalid_field();
+        }
+        let mut pos = offset;
+        for (addr, n) in sub_regions(data, 0, len as usize) {
+            let result = if write {
+                let buf = unsafe { std::slice::from_raw_parts(addr as *const u8, n) };
+                disk.write_at(buf, pos)
+            } else {
+                let buf = unsafe { std::slice::from_raw_parts_mut(addr as *mut u8, n) };
+                disk.read_at(buf, pos)
+            };
+            if let Err(e) = result {
+                error!("virtio-scsi: io at 0x{:x}: {}", pos, e);
+                return match write {
+                    true => CmdResult::check_condition(MEDIUM_ERROR, 0x0c, 0x00),
+                    false => CmdResult::check_condition(MEDIUM_ERROR, 0x11, 0x00),
+                };
+            }
+            pos += n as u64;
+        }
+        CmdResult::good(if write { 0 } else { (pos - offset) as usize })
+    }
+
+    fn inquiry(&self, cdb: &[u8], lun: usize, data: &[(usize, usize)]) -> CmdResult {
+        let alloc_len = be16(&cdb[3..]) as usize;
+        let mut resp: Vec<u8> = if cdb[1] & 1 == 0 {
+            if cdb[2] != 0 {
+                return CmdResult::invalid_field();
+            }
+            // standard inquiry data, SPC-4 6.4.2. We claim SPC-3 conformance
+            // so that Linux uses READ CAPACITY(16) and the VPD pages.
+            let mut resp = vec![0u8, 0, 5, 2, 31, 0, 0, 0x02];
+            resp.extend_from_slice(b"xhype   ");
+            resp.extend_from_slice(b"VIRTUAL DISK    ");
+            resp.extend_from_slice(b"0001");
+            resp
+        } else {
+            self.vpd_page(cdb[2], lun).unwrap_or_else(|| Vec::new())
+        };
+        if resp.is_empty() {
+            return CmdResult::invalid_field();
+        }
+        resp.truncate(alloc_len);
+        CmdResult::good(scatter(data, &resp))
+    }
+
+    /// Vital product data pages, SPC-4 7.8 and SBC-3 6.5.
+    fn vpd_page(&self, page: u8, lun: usize) -> Option<Vec<u8>> {
+        let disk = &self.luns[lun];
+        let mut resp = vec![0u8, page, 0, 0];
+        match page {
+            // supported VPD pages
+            0x00 => resp.extend_from_slice(&[0x00, 0x80, 0xb0, 0xb2]),
+            // unit serial number
+            0x80 => resp.extend_from_slice(format!("xhype-lun{:04}", lun).as_bytes()),
+            // block limits
+            0xb0 => {
+                resp.resize(0x40, 0);
+                if !disk.read_only() {
+                    let granularity = (DISCARD_ALIGNMENT / SECTOR_SIZE) as u32;
+                    resp[20..24].copy_from_slice(&u32::MAX.to_be_bytes());
+                    resp[24..28].copy_from_slice(&MAX_UNMAP_DESCRIPTORS.to_be_bytes());
+                    resp[28..32].copy_from_slice(&granularity.to_be_bytes());
+                }
+            }
+            // logical block provisioning: UNMAP is supported (LBPU)
+            0xb2 => {
+                resp.resize(8, 0);
+                if !disk.read_only() {
+                    resp[5] = 0x80;
+                    resp[6] = 0x02;
+                }
+            }
+            _ => return None,
+        }
+        let page_len = (resp.len() - 4) as u16;
+        resp[2..4].copy_from_slice(&page_len.to_be_bytes());
+        Some(resp)
+    }
+
+    /// Returns the caching mode page and the mode parameter header, with the
+    /// write cache enabled so that the guest sends SYNCHRONIZE CACHE.
+    fn mode_sense(&self, cdb: &[u8], disk: &dyn DiskImage, data: &[(usize, usize)]) -> CmdResult {
+        let ten = cdb[0] == MODE_SENSE_10;
+        let page = cdb[2] & 0x3f;
+        let alloc_len = if ten {
+            be16(&cdb[7..]) as usize
+        } else {
+            cdb[4] as usize
+        };
+        let mut pages = Vec::new();
+        if page == 0x08 || page == 0x3f {
+            let mut caching = [0u8; 20];
+            caching[0] = 0x08;
+            caching[1] = 0x12;
+            caching[2] = 0x04; // WCE
+            pages.extend_from_slice(&caching);
+        } else {
+            return CmdResult::invalid_field();
+        }
+        let wp = if disk.read_only() { 0x80 } else { 0 };
+        let mut resp = if ten {
+            let len = (pages.len() + 6) as u16;
+            let mut header = vec![0u8; 8];
+            header[0..2].copy_from_slice(&len.to_be_bytes());
+            header[3] = wp;
+            header
+        } else {
+            vec![(pages.len() + 3) as u8, 0, wp, 0]
+        };
+        resp.extend_from_slice(&pages);
+        resp.truncate(alloc_len);
+        CmdResult::good(scatter(data, &resp))
+    }
+
+    fn report_luns(&self, cdb: &[u8], data: &[(usize, usize)]) -> CmdResult {
+        let alloc_len = be32(&cdb[6..]) as usize;
+        let list_len = (self.luns.len() * 8) as u32;
+        let mut resp = vec![0u8; 8];
+        resp[0..4].copy_from_slice(&list_len.to_be_bytes());
+        for lun in 0..self.luns.len() {
+            let mut entry = [0u8; 8];
+            if lun < 256 {
+                entry[1] = lun as u8;
+            } else {
+                entry[0] = 0x40 | (lun >> 8) as u8;
+                entry[1] = lun as u8;
+            }
+            resp.extend_from_slice(&entry);
+        }
+        resp.truncate(alloc_len);
+        CmdResult::good(scatter(data, &resp))
+    }
+
+    fn read_capacity(
+        &self,
+        cdb: &[u8],
+        disk: &dyn DiskImage,
+        data: &[(usize, usize)],
+    ) -> CmdResult {
+        // an image smaller than a block has no last block to report
+        let last_lba = match (disk.size() / SECTOR_SIZE).checked_sub(1) {
+            Some(lba) => lba,
+            None => return CmdResult::medium_not_present(),
+        };
+        let mut resp;
+        if cdb[0] == READ_CAPACITY_10 {
+            resp = vec![0u8; 8];
+            let lba = std::cmp::min(last_lba, u32::MAX as u64) as u32;
+            resp[0..4].copy_from_slice(&lba.to_be_bytes());
+            resp[4..8].copy_from_slice(&(SECTOR_SIZE as u32).to_be_bytes());
+        } else {
+            resp = vec![0u8; 32];
+            resp[0..8].copy_from_slice(&last_lba.to_be_bytes());
+            resp[8..12].copy_from_slice(&(SECTOR_SIZE as u32).to_be_bytes());
+            if !disk.read_only() {
+                resp[14] = 0x80; // LBPME: logical block provisioning is enabled
+            }
+            resp.truncate(be32(&cdb[10..]) as usize);
+        }
+        CmdResult::good(scatter(data, &resp))
+    }
+
+    /// Parses the UNMAP parameter list, SBC-3 5.28, and discards every range.
+    fn unmap(&self, disk: &dyn DiskImage, data_out: &[(usize, usize)]) -> CmdResult {
+        if disk.read_only() {
+            return CmdResult::write_protected();
+        }
+        let mut header = [0u8; 8];
+        if gather(data_out, &mut header) < header.len() {
+            return CmdResult::good(0);
+        }
+        let desc_len = be16(&header[2..]) as usize;
+        let num_desc = desc_len / 16;
+        if num_desc > MAX_UNMAP_DESCRIPTORS as usize {
+            return CmdResult::invalid_field();
+        }
+        let descs = sub_regions(data_out, header.len(), num_desc * 16);
+        let mut buf = vec![0u8; num_desc * 16];
+        if gather(&descs, &mut buf) < buf.len() {
+            return CmdResult::invalid_field();
+        }
+        for desc in buf.chunks(16) {
+            let lba = be64(&desc[0..]);
+            let blocks = be32(&desc[8..]) as u64;
+            let (offset, len) = match byte_range(disk, lba, blocks) {
+                Some(range) => range,
+                None => return CmdResult::lba_out_of_range(),
+            };
+            if let Err(e) = disk.discard(offset, len) {
+                error!("virtio-scsi: unmap 0x{:x} + 0x{:x}: {}", offset, len, e);
+                return CmdResult::check_condition(MEDIUM_ERROR, 0x0c, 0x00);
+            }
+        }
+        CmdResult::good(0)
+    }
+
+    fn execute(
+        &self,
+        cdb: &[u8],
+        lun: usize,
+        data_out: &[(usize, usize)],
+        data_in: &[(usize, usize)],
+    ) -> CmdResult {
+        let disk = self.luns[lun].as_ref();
+        match cdb[0] {
+            TEST_UNIT_READY | START_STOP_UNIT | PREVENT_ALLOW_MEDIUM_REMOVAL | VERIFY_10 => {
+                CmdResult::good(0)
+            }
+            REQUEST_SENSE => {
+                // sense data is always returned with the response, so there
+                // is never a pending condition here
+                let sense = CmdResult::check_condition(NO_SENSE, 0, 0).sense;
+                let len = std::cmp::min(cdb[4] as usize, sense.len());
+                CmdResult::good(scatter(data_in, &sense[..len]))
+            }
+            INQUIRY => self.inquiry(cdb, lun, data_in),
+            MODE_SENSE_6 | MODE_SENSE_10 => self.mode_sense(cdb, disk, data_in),
+            REPORT_LUNS => self.report_luns(cdb, data_in),
+            READ_CAPACITY_10 => self.read_capacity(cdb, disk, data_in),
+            SERVICE_ACTION_IN_16 if cdb[1] & 0x1f == SAI_READ_CAPACITY_16 => {
+                self.read_capacity(cdb, disk, data_in)
+            }
+            READ_6 | WRITE_6 => {
+                let lba = (((cdb[1] & 0x1f) as u64) << 16) | be16(&cdb[2..]) as u64;
+                let blocks = if cdb[4] == 0 { 256 } else { cdb[4] as u64 };
+                match cdb[0] {
+                    READ_6 => self.read_write(disk, lba, blocks, false, data_in),
+                    _ => self.read_write(disk, lba, blocks, true, data_out),
+                }
+            }
+            READ_10 => self.read_write(
+                disk,
+                be32(&cdb[2..]) as u64,
+                be16(&cdb[7..]) as u64,
+                false,
+                data_in,
+            ),
+            WRITE_10 => self.read_write(
+                disk,
+                be32(&cdb[2..]) as u64,
+                be16(&cdb[7..]) as u64,
+                true,
+                data_out,
+            ),
+            READ_16 => self.read_write(
+                disk,
+                be64(&cdb[2..]),
+                be32(&cdb[10..]) as u64,
+                false,
+                data_in,
+            ),
+            WRITE_16 => self.read_write(
+                disk,
+                be64(&cdb[2..]),
+                be32(&cdb[10..]) as u64,
+                true,
+                data_out,
+            ),
+            SYNCHRONIZE_CACHE_10 | SYNCHRONIZE_CACHE_16 => match disk.flush() {
+                Ok(_) => CmdResult::good(0),
+                Err(e) => {
+                    error!("virtio-scsi: flush: {}", e);
+                    CmdResult::check_condition(MEDIUM_ERROR, 0x0c, 0x00)
+                }
+            },
+            UNMAP => self.unmap(disk, data_out),
+            op => {
+                debug!("virtio-scsi: unsupported operation 0x{:02x}", op);
+                CmdResult::invalid_opcode()
+            }
+        }
+    }
+}
+
+impl VirtqDescHandle for ScsiReqDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+        let (readable, writable) = desc_chain.split_at(desc_chain.len() - writable_count);
+        let cdb_size = self.sizes.cdb_size.load(Ordering::Relaxed) as usize;
+        let sense_size = self.sizes.sense_size.load(Ordering::Relaxed) as usize;
+        let req_size = size_of::<VirtioScsiCmdReqHeader>() + cdb_size;
+        let resp_size = size_of::<VirtioScsiCmdRespHeader>() + sense_size;
+        if total_len(writable) < resp_size {
+            error!("virtio-scsi: no room for the response");
+            return 0;
+        }
+        let mut resp = VirtioScsiCmdRespHeader::default();
+        let mut sense_data = Vec::new();
+        let data_in = sub_regions(writable, resp_size, usize::MAX);
+        let data_out = sub_regions(readable, req_size, usize::MAX);
+        let mut cdb = vec![0u8; std::cmp::max(cdb_size, 16)];
+        let header = read_pod::<VirtioScsiCmdReqHeader>(readable, 0);
+        let cdb_len = gather(
+            &sub_regions(readable, size_of::<VirtioScsiCmdReqHeader>(), cdb_size),
+            &mut cdb,
+        );
+        match header.as_ref().and_then(|h| decode_lun(&h.lun)) {
+            _ if cdb_len < cdb_size => resp.response = VIRTIO_SCSI_S_FAILURE,
+            Some((0, lun)) if lun < self.luns.len() => {
+                if let Some((throttle, queue)) = self.throttle.as_ref() {
+                    let bytes = std::cmp::max(total_len(&data_in), total_len(&data_out));
+                    throttle.admit(*queue, bytes as u64);
+                }
+                let result = self.execute(&cdb, lun, &data_out, &data_in);
+                resp.response = VIRTIO_SCSI_S_OK;
+                resp.status = result.status;
+                if result.status == CHECK_CONDITION {
+                    let len = std::cmp::min(result.sense.len(), sense_size);
+                    sense_data.extend_from_slice(&result.sense[..len]);
+                    resp.sense_len = len as u32;
+                }
+                resp.resid = (total_len(&data_in) - result.data_in) as u32;
+            }
+            Some((0, _)) => resp.response = VIRTIO_SCSI_S_INCORRECT_LUN,
+            _ => resp.response = VIRTIO_SCSI_S_BAD_TARGET,
+        }
+        let resp_bytes = unsafe {
+            std::slice::from_raw_parts(
+                &resp as *const VirtioScsiCmdRespHeader as *const u8,
+                size_of::<VirtioScsiCmdRespHeader>(),
+            )
+        };
+        scatter(writable, resp_bytes);
+        scatter(
+            &sub_regions(writable, resp_bytes.len(), sense_size),
+            &sense_data,
+        );
+        (resp_size + total_len(&data_in) - resp.resid as usize) as u32
+    }
+}
+
+/// Handles task management functions and asynchronous notification requests.
+/// Every command completes before its request is put in the used ring, so
+/// there is never anything to abort or reset.
+struct ScsiCtrlDescHandler {}
+
+impl VirtqDescHandle for ScsiCtrlDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        let (desc_chain, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+        let (readable, writable) = desc_chain.split_at(desc_chain.len() - writable_count);
+        let req_type = read_pod::<u32>(readable, 0);
+        match req_type {
+            Some(VIRTIO_SCSI_T_TMF) => {
+                let tmf: Option<VirtioScsiCtrlTmfReq> = read_pod(readable, 0);
+                debug!(
+                    "virtio-scsi: task management function {:?}",
+                    tmf.map(|t| t.subtype)
+                );
+                scatter(writable, &[VIRTIO_SCSI_S_FUNCTION_SUCCEEDED]) as u32
+            }
+            Some(VIRTIO_SCSI_T_AN_QUERY) | Some(VIRTIO_SCSI_T_AN_SUBSCRIBE) => {
+                // event_actual = 0: no asynchronous notification is supported
+                let mut resp = [0u8; 5];
+                resp[4] = VIRTIO_SCSI_S_OK;
+                scatter(writable, &resp) as u32
+            }
+            t => {
+                warn!("virtio-scsi: unknown control request {:?}", t);
+                scatter(writable, &[VIRTIO_SCSI_S_FAILURE]) as u32
+            }
+        }
+    }
+}
+
+/// The device never offers VIRTIO_SCSI_F_HOTPLUG or VIRTIO_SCSI_F_CHANGE, so
+/// there are no events to report. Buffers on the event queue are held: the
+/// driver posts a new one for every one returned, so returning them, even with
+/// VIRTIO_SCSI_T_NO_EVENT, would keep the queue spinning.
+struct ScsiEventDescHandler {}
+
+impl VirtqDescHandle for ScsiEventDescHandler {
+    fn handle_desc_chain(&mut self, _: &Virtq<usize>, _: u16, _: &AddressConverter) -> u32 {
+        0
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        _virtq: &Virtq<usize>,
+        _index: u16,
+        _count: u16,
+        _gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        vec![]
+    }
+}
+
+/// virtio-scsi device's config space, see virtio 1.1, 5.6.4 Device configuration layout
+pub struct VirtioScsiCfg {
+    num_queues: u32,
+    max_lun: u32,
+    sizes: Arc<ScsiSizes>,
+    gen: u32,
+}
+
+impl VirtioDevCfg for VirtioScsiCfg {
+    fn write(&mut self, offset: usize, size: u8, value: u32) -> Option<()> {
+        // only sense_size and cdb_size are writable by the driver
+        match (size, offset) {
+            (4, 20) => self.sizes.sense_size.store(
+                std::cmp::min(value, VIRTIO_SCSI_SENSE_MAX_SIZE),
+                Ordering::Relaxed,
+            ),
+            (4, 24) => self.sizes.cdb_size.store(
+                std::cmp::min(value, VIRTIO_SCSI_CDB_MAX_SIZE),
+                Ordering::Relaxed,
+            ),
+            _ => return None,
+        }
+        Some(())
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        match (size, offset) {
+            (4, 0) => Some(self.num_queues),
+            (4, 4) => Some(QUEUE_SIZE - 2), // seg_max
+            (4, 8) => Some(0xffff),         // max_sectors
+            (4, 12) => Some(QUEUE_SIZE),    // cmd_per_lun
+            (4, 16) => Some(16),            // event_info_size
+            (4, 20) => Some(self.sizes.sense_size.load(Ordering::Relaxed)),
+            (4, 24) => Some(self.sizes.cdb_size.load(Ordering::Relaxed)),
+            (2, 28) => Some(0), // max_channel
+            (2, 30) => Some(0), // max_target
+            (4, 32) => Some(self.max_lun),
+            _ => None,
+        }
+    }
+
+    fn reset(&mut self) {
+        let sizes = &self.sizes;
+        sizes
+            .sense_size
+            .store(VIRTIO_SCSI_SENSE_DEFAULT_SIZE, Ordering::Relaxed);
+        sizes
+            .cdb_size
+            .store(VIRTIO_SCSI_CDB_DEFAULT_SIZE, Ordering::Relaxed);
+        self.gen += 1;
+    }
+
+    fn generation(&self) -> u32 {
+        self.gen
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a virtio-scsi controller with one target. LUN `n` is backed by
+    /// `luns[n]`. The controller has `num_queues` request queues, which are
+    /// queues `0..num_queues` of `throttle`.
+    pub fn new_scsi(
+        name: String,
+        irq: u32,
+        irq_sender: Sender<u32>,
+        gpa2hva: AddressConverter,
+        luns: Vec<Arc<dyn DiskImage>>,
+        num_queues: u32,
+        throttle: Option<Arc<IoThrottle>>,
+    ) -> Self {
+        assert!(!luns.is_empty(), "virtio-scsi needs at least one LUN");
+        assert!(
+            num_queues > 0,
+            "virtio-scsi needs at least one request queue"
+        );
+        let sizes = Arc::new(ScsiSizes {
+            cdb_size: AtomicU32::new(VIRTIO_SCSI_CDB_DEFAULT_SIZE),
+            sense_size: AtomicU32::new(VIRTIO_SCSI_SENSE_DEFAULT_SIZE),
+        });
+        let scsi_cfg = VirtioScsiCfg {
+            num_queues,
+            max_lun: luns.len() as u32 - 1,
+            sizes: sizes.clone(),
+            gen: 0,
+        };
+        let luns = Arc::new(luns);
+        let isr = Arc::new(RwLock::new(0));
+        let ctrl_q = VirtqManager::new(
+            format!("{}_ctrl", name),
+            64,
+            irq,
+            irq_sender.clone(),
+            isr.clone(),
+            gpa2hva.clone(),
+            ScsiCtrlDescHandler {},
+        );
+        let event_q = VirtqManager::new(
+            format!("{}_event", name),
+            64,
+            irq,
+            irq_sender.clone(),
+            isr.clone(),
+            gpa2hva.clone(),
+            ScsiEventDescHandler {},
+        );
+        let mut vqs = vec![ctrl_q, event_q];
+        for i in 0..num_queues {
+            vqs.push(VirtqManager::new(
+                format!("{}_req{}", name, i),
+                QUEUE_SIZE,
+                irq,
+                irq_sender.clone(),
+                isr.clone(),
+                gpa2hva.clone(),
+                ScsiReqDescHandler {
+                    luns: luns.clone(),
+                    sizes: sizes.clone(),
+                    throttle: throttle.clone().map(|t| (t, i as usize)),
+                },
+            ));
+        }
+        VirtioDevice {
+            name,
+            dev_id: VirtioId::ScsiHost,
+            dev_feat: 1 << VIRTIO_F_VERSION_1,
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            vqs,
+            cfg: Box::new(scsi_cfg),
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    #[test]
+    fn scsi_struct_size_test() {
+        assert_eq!(size_of::<VirtioScsiCmdReqHeader>(), 19);
+        assert_eq!(size_of::<VirtioScsiCmdRespHeader>(), 12);
+        assert_eq!(size_of::<VirtioScsiCtrlTmfReq>(), 24);
+    }
+
+    #[test]
+    fn decode_lun_test() {
+        assert_eq!(decode_lun(&[1, 0, 0x40, 3, 0, 0, 0, 0]), Some((0, 3)));
+        assert_eq!(decode_lun(&[1, 2, 0x41, 0, 0, 0, 0, 0]), Some((2, 256)));
+        assert_eq!(decode_lun(&[0, 0, 0, 0, 0, 0, 0, 0]), None);
+    }
+
+    #[test]
+    fn scsi_cfg_sizes_test() {
+        let mut cfg = VirtioScsiCfg {
+            num_queues: 1,
+            max_lun: 0,
+            sizes: Arc::new(ScsiSizes {
+                cdb_size: AtomicU32::new(VIRTIO_SCSI_CDB_DEFAULT_SIZE),
+                sense_size: AtomicU32::new(VIRTIO_SCSI_SENSE_DEFAULT_SIZE),
+            }),
+            gen: 0,
+        };
+        cfg.write(24, 4, u32::MAX).unwrap();
+        cfg.write(20, 4, 1 << 30).unwrap();
+        assert_eq!(cfg.read(24, 4), Some(VIRTIO_SCSI_CDB_MAX_SIZE));
+        assert_eq!(cfg.read(20, 4), Some(VIRTIO_SCSI_SENSE_MAX_SIZE));
+        cfg.write(24, 4, 16).unwrap();
+        assert_eq!(cfg.read(24, 4), Some(16));
+    }
+
+    #[test]
+    fn scsi_read_capacity_empty_test() {
+        use crate::virtio::disk::RawImage;
+        let path = std::env::temp_dir().join(format!("xhype-scsi-{}", std::process::id()));
+        std::fs::write(&path, b"").unwrap();
+        let disk = RawImage::open(path.to_str().unwrap(), true).unwrap();
+        std::fs::remove_file(&path).unwrap();
+        let handler = ScsiReqDescHandler {
+            luns: Arc::new(vec![Arc::new(disk)]),
+            sizes: Arc::new(ScsiSizes {
+                cdb_size: AtomicU32::new(VIRTIO_SCSI_CDB_DEFAULT_SIZE),
+                sense_size: AtomicU32::new(VIRTIO_SCSI_SENSE_DEFAULT_SIZE),
+            }),
+            throttle: None,
+        };
+        let mut cdb = [0u8; 16];
+        cdb[0] = READ_CAPACITY_10;
+        let result = handler.execute(&cdb, 0, &[], &[]);
+        assert_eq!(result.status, CHECK_CONDITION);
+        assert_eq!(result.sense[2], NOT_READY);
+    }
+}
@@ -0,0 +1,409 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! An L2 switch between the virtio-net devices of the VMs in one process.
+
+Every device created by [`VirtioDevice::new_switch_port()`] is a port of a
+[`VirtualSwitch`]. The switch learns which port a MAC address is behind from
+the source addresses of the frames it forwards. Frames to unknown unicast
+addresses, and all broadcast and multicast frames, are flooded to all other
+ports. Every port applies the receive filter its driver set up through the
+control queue (`VIRTIO_NET_F_CTRL_RX`).
+
+The service thread of the sender's transmit queue copies a frame straight from
+the sender's transmit buffers into the receive buffers the receiving guest has
+posted, so a frame is copied exactly once per receiver and never goes through
+the host's network stack. Offloads are passed along. A TSO frame, or a frame
+with a partial checksum, reaches a guest that negotiated the corresponding
+`VIRTIO_NET_F_GUEST_*` features as it is. The host only completes checksums and
+cuts segments for guests that did not negotiate them.
+
+Like a NIC whose ring is full, a port without posted receive buffers drops
+frames.
+*/
+
+use super::consts::*;
+use super::net::*;
+use super::offload::*;
+use super::virtq::*;
+use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
+#[allow(unused_imports)]
+use log::*;
+use std::collections::{HashMap, VecDeque};
+use std::sync::{Arc, Condvar, Mutex, RwLock};
+
+/// The receive buffers a guest has posted to a port
+struct RxRing {
+    /// descriptor chains in the order of the available ring
+    posted: VecDeque<Vec<(usize, usize)>>,
+    /// position of the first chain of `posted` in the available ring
+    posted_start: u16,
+    /// bytes written to the first chains of `posted`, which are not yet put
+    /// into the used ring
+    filled: Vec<u32>,
+    /// incremented by a device reset, which invalidates the posted chains
+    generation: u64,
+}
+
+struct SwitchPort {
+    mac: [u8; 6],
+    state: Arc<NetState>,
+    rx: Mutex<RxRing>,
+    rx_cond: Condvar,
+}
+
+impl SwitchPort {
+    fn reset(&self) {
+        let mut ring = self.rx.lock().unwrap();
+        ring.posted.clear();
+        ring.filled.clear();
+        ring.generation += 1;
+        self.rx_cond.notify_all();
+    }
+
+    /// Copies the frame of `len` bytes in the guest buffers `frame` into the
+    /// next posted receive buffers, as many as it needs with mergeable
+    /// buffers. Returns false if there are not enough buffers.
+    fn receive(&self, hdr: &VirtioNetHdr, frame: &[(usize, usize)], len: usize) -> bool {
+        let mergeable = self.state.features() & (1 << VIRTIO_NET_F_MRG_RXBUF) != 0;
+        let needed = VIRTIO_HEADER_SIZE + len;
+        let mut ring = self.rx.lock().unwrap();
+        let first = ring.filled.len();
+        let (mut room, mut n) = (0, 0);
+        for chain in ring.posted.iter().skip(first) {
+            room += total_len(chain);
+            n += 1;
+            if room >= needed || !mergeable {
+                break;
+            }
+        }
+        if room < needed {
+            return false;
+        }
+        let mut header = *hdr;
+        header.num_buffers = n as u16;
+        let mut lengths = Vec::with_capacity(n);
+        let mut offset = 0;
+        for (j, chain) in ring.posted.iter().skip(first).take(n).enumerate() {
+            let (dst, prefix) = if j == 0 {
+                scatter(chain, header.as_bytes());
+                (packet_regions(chain), VIRTIO_HEADER_SIZE)
+            } else {
+                (chain.clone(), 0)
+            };
+            let copied = copy_regions(&dst, &sub_regions(frame, offset, usize::MAX));
+            offset += copied;
+            lengths.push((prefix + copied) as u32);
+        }
+        ring.filled.extend(lengths);
+        self.rx_cond.notify_one();
+        true
+    }
+}
+
+/// Returns the header a guest with `features` receives a frame sent with `hdr`
+/// with, or `None` if it cannot take the offloads of the frame.
+fn rx_header(hdr: &VirtioNetHdr, features: u64) -> Option<VirtioNetHdr> {
+    let has = |f: u64| features & (1 << f) != 0;
+    let gso_ok = match hdr.gso_type & !VIRTIO_NET_HDR_GSO_ECN {
+        VIRTIO_NET_HDR_GSO_NONE => true,
+        VIRTIO_NET_HDR_GSO_TCPV4 => has(VIRTIO_NET_F_GUEST_TSO4),
+        VIRTIO_NET_HDR_GSO_TCPV6 => has(VIRTIO_NET_F_GUEST_TSO6),
+        _ => false,
+    } && (hdr.gso_type & VIRTIO_NET_HDR_GSO_ECN == 0 || has(VIRTIO_NET_F_GUEST_ECN));
+    let csum_ok = hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM == 0 || has(VIRTIO_NET_F_GUEST_CSUM);
+    if gso_ok && csum_ok {
+        Some(VirtioNetHdr {
+            flags: hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM,
+            num_buffers: 0,
+            ..*hdr
+        })
+    } else {
+        None
+    }
+}
+
+/// Copies a frame out of the guest buffers and completes its offloads.
+fn complete_offloads(hdr: &VirtioNetHdr, frame: &[(usize, usize)], len: usize) -> Vec<Vec<u8>> {
+    let mut buf = vec![0u8; len];
+    gather(frame, &mut buf);
+    let mut frames = Vec::new();
+    if let Err(e) = prepare_tx(hdr, buf, &mut frames) {
+        warn!("virtual switch: drop a frame: {}", e);
+    }
+    frames
+}
+
+pub struct VirtualSwitch {
+    ports: RwLock<Vec<Arc<SwitchPort>>>,
+    /// the port behind each learned MAC address
+    fdb: RwLock<HashMap<[u8; 6], usize>>,
+}
+
+impl VirtualSwitch {
+    pub fn new() -> Arc<Self> {
+        Arc::new(VirtualSwitch {
+            ports: RwLock::new(Vec::new()),
+            fdb: RwLock::new(HashMap::new()),
+        })
+    }
+
+    fn add_port(&self, port: Arc<SwitchPort>) -> usize {
+        let mut ports = self.ports.write().unwrap();
+        ports.push(port);
+        ports.len() - 1
+    }
+
+    fn learn(&self, mac: [u8; 6], port: usize) {
+        if mac[0] & 1 != 0 {
+            return;
+        }
+        if self.fdb.read().unwrap().get(&mac) != Some(&port) {
+            self.fdb.write().unwrap().insert(mac, port);
+        }
+    }
+
+    /// Forwards the frame in the guest buffers `frame` that was sent with
+    /// header `hdr` on port `from`.
+    fn forward(&self, from: usize, hdr: &VirtioNetHdr, frame: &[(usize, usize)]) {
+        let len = total_len(frame);
+        let mut addrs = [0u8; 12];
+        if gather(frame, &mut addrs) < addrs.len() {
+            return;
+        }
+        let mut dst = [0u8; 6];
+        let mut src = [0u8; 6];
+        dst.copy_from_slice(&addrs[..6]);
+        src.copy_from_slice(&addrs[6..]);
+        self.learn(src, from);
+        let target = if dst[0] & 1 == 0 {
+            self.fdb.read().unwrap().get(&dst).cloned()
+        } else {
+            None
+        };
+        // the frame with its offloads completed, made for the first port that
+        // needs it
+        let mut plain: Option<Vec<Vec<u8>>> = None;
+        for (i, port) in self.ports.read().unwrap().iter().enumerate() {
+            if i == from || target.map_or(false, |t| t != i) || !port.state.accepts(&port.mac, &dst)
+            {
+                continue;
+            }
+            let delivered = match rx_header(hdr, port.state.features()) {
+                Some(rx_hdr) => port.receive(&rx_hdr, frame, len),
+                None => plain
+                    .get_or_insert_with(|| complete_offloads(hdr, frame, len))
+                    .iter()
+                    .all(|f| {
+                        let region = [(f.as_ptr() as usize, f.len())];
+                        port.receive(&VirtioNetHdr::default(), &region, f.len())
+                    }),
+            };
+            if !delivered {
+                debug!("switch port {} has no receive buffers, drop a frame", i);
+            }
+        }
+    }
+}
+
+/// Returns the receive buffers the sending ports have filled. Newly posted
+/// buffers are made available to the senders first.
+struct SwitchRxDescHandler {
+    port: Arc<SwitchPort>,
+}
+
+impl VirtqDescHandle for SwitchRxDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        self.handle_desc_chains(virtq, index, 1, gpa2hva)
+            .first()
+            .cloned()
+            .unwrap_or(0)
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        let mut ring = self.port.rx.lock().unwrap();
+        if ring.posted.is_empty() {
+            ring.posted_start = index;
+        }
+        let end = index.wrapping_add(count);
+        let mut next = ring.posted_start.wrapping_add(ring.posted.len() as u16);
+        while next != end {
+            let (writable, _) = virtq.get_desc_chain(next, |gpa| gpa2hva(gpa));
+            ring.posted.push_back(writable);
+            next = next.wrapping_add(1);
+        }
+        let generation = ring.generation;
+        while ring.filled.is_empty() && ring.generation == generation {
+            ring = self.port.rx_cond.wait(ring).unwrap();
+        }
+        if ring.generation != generation {
+            return vec![];
+        }
+        let filled = std::mem::replace(&mut ring.filled, Vec::new());
+        ring.posted.drain(..filled.len());
+        ring.posted_start = ring.posted_start.wrapping_add(filled.len() as u16);
+        filled
+    }
+}
+
+/// Passes the frames the guest transmits to the switch.
+struct SwitchTxDescHandler {
+    switch: Arc<VirtualSwitch>,
+    port: usize,
+}
+
+impl VirtqDescHandle for SwitchTxDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        let (readable, writable_count) = virtq.get_desc_chain(index, |gpa| gpa2hva(gpa));
+        debug_assert_eq!(writable_count, 0);
+        let hdr = read_pod::<VirtioNetHdr>(&readable, 0).unwrap_or_default();
+        self.switch
+            .forward(self.port, &hdr, &packet_regions(&readable));
+        0
+    }
+}
+
+/// The config space of a switch port, which also drops the posted receive
+/// buffers on a reset.
+struct SwitchPortCfg {
+    net: VirtioNetCfg,
+    port: Arc<SwitchPort>,
+}
+
+impl VirtioDevCfg for SwitchPortCfg {
+    fn write(&mut self, offset: usize, size: u8, value: u32) -> Option<()> {
+        self.net.write(offset, size, value)
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        self.net.read(offset, size)
+    }
+
+    fn reset(&mut self) {
+        self.net.reset();
+        self.port.reset();
+    }
+
+    fn features_ok(&mut self, features: u64) {
+        self.net.features_ok(features);
+    }
+
+    fn generation(&self) -> u32 {
+        self.net.generation()
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a virtio-net device with the MAC address `mac` and connects it
+    /// to a new port of `switch`.
+    pub fn new_switch_port(
+        name: String,
+        irq: u32,
+        irq_sender: Sender<u32>,
+        gpa2hva: AddressConverter,
+        switch: &Arc<VirtualSwitch>,
+        mac: [u8; 6],
+    ) -> Self {
+        let state = Arc::new(NetState::new());
+        let port = Arc::new(SwitchPort {
+            mac,
+            state: state.clone(),
+            rx: Mutex::new(RxRing {
+                posted: VecDeque::new(),
+                posted_start: 0,
+                filled: Vec::new(),
+                generation: 0,
+            }),
+            rx_cond: Condvar::new(),
+        });
+        let id = switch.add_port(port.clone());
+        let cfg = SwitchPortCfg {
+            net: VirtioNetCfg {
+                mac,
+                status: 0,
+                max_virtqueue_pairs: 1,
+                mtu: 0,
+                gen: 0,
+                state: state.clone(),
+                backend: None,
+            },
+            port: port.clone(),
+        };
+        let isr = Arc::new(RwLock::new(0));
+        let rx = VirtqManager::new(
+            format!("{}_rx", name),
+            256,
+            irq,
+            irq_sender.clone(),
+            isr.clone(),
+            gpa2hva.clone(),
+            SwitchRxDescHandler { port },
+        );
+        let tx = VirtqManager::new(
+            format!("{}_tx", name),
+            256,
+            irq,
+            irq_sender.clone(),
+            isr.clone(),
+            gpa2hva.clone(),
+            SwitchTxDescHandler {
+                switch: switch.clone(),
+                port: id,
+            },
+        );
+        let ctrl = VirtqManager::new(
+            format!("{}_ctrl", name),
+            64,
+            irq,
+            irq_sender.clone(),
+            isr.clone(),
+            gpa2hva.clone(),
+            NetCtrlDescHandler::new(state, 1),
+        );
+        let vqs = vec![rx, tx, ctrl];
+
+        VirtioDevice {
+            name,
+            dev_id: VirtioId::Net,
+            dev_feat: (1 << VIRTIO_F_VERSION_1)
+                | (1 << VIRTIO_NET_F_MAC)
+                | (1 << VIRTIO_NET_F_CSUM)
+                | (1 << VIRTIO_NET_F_GUEST_CSUM)
+                | (1 << VIRTIO_NET_F_HOST_TSO4)
+                | (1 << VIRTIO_NET_F_HOST_TSO6)
+                | (1 << VIRTIO_NET_F_HOST_ECN)
+                | (1 << VIRTIO_NET_F_GUEST_TSO4)
+                | (1 << VIRTIO_NET_F_GUEST_TSO6)
+                | (1 << VIRTIO_NET_F_GUEST_ECN)
+                | (1 << VIRTIO_NET_F_MRG_RXBUF)
+                | (1 << VIRTIO_NET_F_CTRL_VQ)
+                | (1 << VIRTIO_NET_F_CTRL_RX)
+                | (1 << VIRTIO_NET_F_CTRL_RX_EXTRA),
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            cfg: Box::new(cfg),
+            vqs,
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        }
+    }
+}
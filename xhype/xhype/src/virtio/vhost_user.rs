@@ -0,0 +1,578 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! The master side of the vhost-user protocol: the virtqueues of a device are
+served by a separate backend process, e.g., a poll-mode storage or network
+daemon running on dedicated cores.
+
+xhype connects to the unix socket the backend listens on. When the driver
+negotiates features, xhype sends the backend the file descriptors of the
+shared memory objects backing guest memory (`VHOST_USER_SET_MEM_TABLE`), so
+the VM must be created by [`VMManager::create_shared_vm()`]. When the driver
+sets QueueReady, the addresses of the rings and two notifiers are handed to
+the backend, which owns the queue from then on:
+
+* kick: xhype signals it when the guest notifies the queue;
+* call: the backend signals it to interrupt the guest.
+
+The notifiers are eventfds on Linux. macOS has no eventfd, so there they are
+pipes: a backend reads 8 bytes per notification from either.
+
+If the backend supports `VHOST_USER_PROTOCOL_F_CONFIG`, config space accesses
+are forwarded to it. Otherwise the device has no config space.
+
+[`VMManager::create_shared_vm()`]: ../../struct.VMManager.html#method.create_shared_vm
+*/
+
+use super::consts::*;
+use super::virtq::*;
+use super::{AddressConverter, IrqSender, TaskReceiver, VirtqReceiver};
+use super::{VirtioDevCfg, VirtioDevice, VirtioId};
+use crate::err::Error;
+use crate::{GuestMemRegion, VirtualMachine};
+#[allow(unused_imports)]
+use log::*;
+use std::io::{self, Read};
+use std::mem::size_of;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::path::Path;
+use std::sync::{Arc, Mutex, RwLock};
+
+const VHOST_USER_GET_FEATURES: u32 = 1;
+const VHOST_USER_SET_FEATURES: u32 = 2;
+const VHOST_USER_SET_OWNER: u32 = 3;
+const VHOST_USER_SET_MEM_TABLE: u32 = 5;
+const VHOST_USER_SET_VRING_NUM: u32 = 8;
+const VHOST_USER_SET_VRING_ADDR: u32 = 9;
+const VHOST_USER_SET_VRING_BASE: u32 = 10;
+const VHOST_USER_GET_VRING_BASE: u32 = 11;
+const VHOST_USER_SET_VRING_KICK: u32 = 12;
+const VHOST_USER_SET_VRING_CALL: u32 = 13;
+const VHOST_USER_GET_PROTOCOL_FEATURES: u32 = 15;
+const VHOST_USER_SET_PROTOCOL_FEATURES: u32 = 16;
+const VHOST_USER_GET_QUEUE_NUM: u32 = 17;
+const VHOST_USER_SET_VRING_ENABLE: u32 = 18;
+const VHOST_USER_GET_CONFIG: u32 = 24;
+const VHOST_USER_SET_CONFIG: u32 = 25;
+
+const VHOST_USER_VERSION: u32 = 0x1;
+const VHOST_USER_REPLY_MASK: u32 = 0x4;
+const VHOST_USER_NEED_REPLY_MASK: u32 = 0x8;
+
+/// request, flags and size, each a u32
+const VHOST_USER_HDR_SIZE: usize = 12;
+const VHOST_USER_MAX_MEM_REGIONS: usize = 8;
+
+const VHOST_USER_F_PROTOCOL_FEATURES: u64 = 30;
+
+const VHOST_USER_PROTOCOL_F_MQ: u64 = 0;
+const VHOST_USER_PROTOCOL_F_REPLY_ACK: u64 = 3;
+const VHOST_USER_PROTOCOL_F_CONFIG: u64 = 9;
+
+const VHOST_USER_PROTOCOL_FEATURES: u64 = (1 << VHOST_USER_PROTOCOL_F_MQ)
+    | (1 << VHOST_USER_PROTOCOL_F_REPLY_ACK)
+    | (1 << VHOST_USER_PROTOCOL_F_CONFIG);
+
+const VHOST_USER_QUEUE_SIZE: u32 = 256;
+
+/// A notifier shared with the backend: an eventfd on Linux and a pipe
+/// elsewhere.
+pub(super) struct EventFd {
+    pub(super) rx: RawFd,
+    tx: RawFd,
+}
+
+impl EventFd {
+    #[cfg(target_os = "linux")]
+    pub(super) fn new() -> io::Result<Self> {
+        match unsafe { libc::eventfd(0, libc::EFD_CLOEXEC) } {
+            fd if fd >= 0 => Ok(EventFd { rx: fd, tx: fd }),
+            _ => Err(io::Error::last_os_error()),
+        }
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    pub(super) fn new() -> io::Result<Self> {
+        let mut fds = [0; 2];
+        if unsafe { libc::pipe(fds.as_mut_ptr()) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        // a full pipe already has notifications pending, so signaling never
+        // blocks
+        unsafe { libc::fcntl(fds[1], libc::F_SETFL, libc::O_NONBLOCK) };
+        Ok(EventFd {
+            rx: fds[0],
+            tx: fds[1],
+        })
+    }
+
+    pub(super) fn signal(&self) {
+        let one = 1u64;
+        unsafe { libc::write(self.tx, &one as *const u64 as *const libc::c_void, 8) };
+    }
+
+    pub(super) fn wait(&self) -> io::Result<()> {
+        let mut value = 0u64;
+        loop {
+            let n = unsafe { libc::read(self.rx, &mut value as *mut u64 as *mut libc::c_void, 8) };
+            if n == 8 {
+                return Ok(());
+            }
+            let e = io::Error::last_os_error();
+            if n >= 0 || e.kind() != io::ErrorKind::Interrupted {
+                return Err(e);
+            }
+        }
+    }
+}
+
+impl Drop for EventFd {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.rx) };
+        if self.tx != self.rx {
+            unsafe { libc::close(self.tx) };
+        }
+    }
+}
+
+/// Sends `buf` with `fds` attached as `SCM_RIGHTS`.
+fn send_with_fds(sock: &UnixStream, buf: &[u8], fds: &[RawFd]) -> io::Result<()> {
+    let mut iov = libc::iovec {
+        iov_base: buf.as_ptr() as *mut libc::c_void,
+        iov_len: buf.len(),
+    };
+    let mut control = [0u64; 8];
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    if !fds.is_empty() {
+        let fds_len = (fds.len() * size_of::<RawFd>()) as u32;
+        msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+        msg.msg_controllen = unsafe { libc::CMSG_SPACE(fds_len) } as _;
+        unsafe {
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN(fds_len) as _;
+            std::ptr::copy_nonoverlapping(
+                fds.as_ptr(),
+                libc::CMSG_DATA(cmsg) as *mut RawFd,
+                fds.len(),
+            );
+        }
+    }
+    loop {
+        match unsafe { libc::sendmsg(sock.as_raw_fd(), &msg, 0) } {
+            n if n as usize == buf.len() => return Ok(()),
+            n if n >= 0 => {
+                return Err(io::Error::new(
+                    io::ErrorKind::WriteZero,
+                    "short vhost-user message",
+                ))
+            }
+            _ => {
+                let e = io::Error::last_os_error();
+                if e.kind() != io::ErrorKind::Interrupted {
+                    return Err(e);
+                }
+            }
+        }
+    }
+}
+
+fn vring_state(index: usize, num: u32) -> Vec<u8> {
+    let mut payload = (index as u32).to_le_bytes().to_vec();
+    payload.extend_from_slice(&num.to_le_bytes());
+    payload
+}
+
+/// The connection to a backend.
+struct VhostUserMaster {
+    name: String,
+    sock: Mutex<UnixStream>,
+    /// the features of the backend
+    features: u64,
+    /// the protocol features both sides support
+    protocol_features: u64,
+    mem_regions: Arc<RwLock<Vec<GuestMemRegion>>>,
+    gpa2hva: AddressConverter,
+}
+
+impl VhostUserMaster {
+    fn connect(name: String, path: &Path, vm: &VirtualMachine) -> Result<Self, Error> {
+        let mut master = VhostUserMaster {
+            name,
+            sock: Mutex::new(UnixStream::connect(path)?),
+            features: 0,
+            protocol_features: 0,
+            mem_regions: vm.mem_regions.clone(),
+            gpa2hva: vm.gpa2hva.clone(),
+        };
+        master.request(VHOST_USER_SET_OWNER, &[], &[], false)?;
+        master.features = master.get_u64(VHOST_USER_GET_FEATURES)?;
+        if master.features & (1 << VHOST_USER_F_PROTOCOL_FEATURES) != 0 {
+            let features = master.get_u64(VHOST_USER_GET_PROTOCOL_FEATURES)?;
+            master.protocol_features = features & VHOST_USER_PROTOCOL_FEATURES;
+            master.set_u64(VHOST_USER_SET_PROTOCOL_FEATURES, master.protocol_features)?;
+        }
+        Ok(master)
+    }
+
+    fn has_protocol_feature(&self, feature: u64) -> bool {
+        self.protocol_features & (1 << feature) != 0
+    }
+
+    /// Sends a message and returns the payload of the reply if `reply` is
+    /// set. With `VHOST_USER_PROTOCOL_F_REPLY_ACK`, messages with `ack` set
+    /// are also waited for and fail if the backend reports an error.
+    fn message(
+        &self,
+        request: u32,
+        payload: &[u8],
+        fds: &[RawFd],
+        reply: bool,
+        ack: bool,
+    ) -> Result<Vec<u8>, Error> {
+        let ack = ack && !reply && self.has_protocol_feature(VHOST_USER_PROTOCOL_F_REPLY_ACK);
+        let flags = if ack {
+            VHOST_USER_VERSION | VHOST_USER_NEED_REPLY_MASK
+        } else {
+            VHOST_USER_VERSION
+        };
+        let mut buf = Vec::with_capacity(VHOST_USER_HDR_SIZE + payload.len());
+        buf.extend_from_slice(&request.to_le_bytes());
+        buf.extend_from_slice(&flags.to_le_bytes());
+        buf.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+        buf.extend_from_slice(payload);
+        let mut sock = self.sock.lock().unwrap();
+        send_with_fds(&sock, &buf, fds)?;
+        if !reply && !ack {
+            return Ok(vec![]);
+        }
+        let mut hdr = [0u8; VHOST_USER_HDR_SIZE];
+        sock.read_exact(&mut hdr)?;
+        let word = |i: usize| u32::from_le_bytes([hdr[i], hdr[i + 1], hdr[i + 2], hdr[i + 3]]);
+        let mut reply_payload = vec![0u8; word(8) as usize];
+        sock.read_exact(&mut reply_payload)?;
+        if word(0) != request || word(4) & VHOST_USER_REPLY_MASK == 0 {
+            return Err(format!(
+                "{}: unexpected reply {} to vhost-user request {}",
+                self.name,
+                word(0),
+                request
+            ))?;
+        }
+        if ack && reply_payload.iter().any(|&b| b != 0) {
+            return Err(format!(
+                "{}: vhost-user backend failed request {}",
+                self.name, request
+            ))?;
+        }
+        Ok(reply_payload)
+    }
+
+    fn request(&self, request: u32, payload: &[u8], fds: &[RawFd], ack: bool) -> Result<(), Error> {
+        self.message(request, payload, fds, false, ack)?;
+        Ok(())
+    }
+
+    fn get_u64(&self, request: u32) -> Result<u64, Error> {
+        let reply = self.message(request, &[], &[], true, false)?;
+        if reply.len() < 8 {
+            return Err(format!("{}: short reply to request {}", self.name, request))?;
+        }
+        let mut value = [0u8; 8];
+        value.copy_from_slice(&reply[..8]);
+        Ok(u64::from_le_bytes(value))
+    }
+
+    fn set_u64(&self, request: u32, value: u64) -> Result<(), Error> {
+        self.request(request, &value.to_le_bytes(), &[], false)
+    }
+
+    fn set_features(&self, features: u64) -> Result<(), Error> {
+        let protocol = self.features & (1 << VHOST_USER_F_PROTOCOL_FEATURES);
+        self.set_u64(VHOST_USER_SET_FEATURES, features | protocol)
+    }
+
+    fn set_mem_table(&self) -> Result<(), Error> {
+        let regions = self.mem_regions.read().unwrap();
+        if regions.is_empty() {
+            return Err(format!(
+                "{}: vhost-user requires a VM created by create_shared_vm()",
+                self.name
+            ))?;
+        }
+        if regions.len() > VHOST_USER_MAX_MEM_REGIONS {
+            return Err(format!("{}: too many guest memory regions", self.name))?;
+        }
+        let mut payload = (regions.len() as u32).to_le_bytes().to_vec();
+        payload.extend_from_slice(&[0u8; 4]);
+        for region in regions.iter() {
+            payload.extend_from_slice(&region.gpa.to_le_bytes());
+            payload.extend_from_slice(&region.size.to_le_bytes());
+            payload.extend_from_slice(&(region.hva as u64).to_le_bytes());
+            // mmap_offset
+            payload.extend_from_slice(&0u64.to_le_bytes());
+        }
+        let fds: Vec<RawFd> = regions.iter().map(|r| r.fd).collect();
+        self.request(VHOST_USER_SET_MEM_TABLE, &payload, &fds, true)
+    }
+
+    /// Hands the rings of queue `index` and its notifiers to the backend.
+    fn start_ring(
+        &self,
+        index: usize,
+        virtq: &Virtq<u64>,
+        kick: &EventFd,
+        call: &EventFd,
+    ) -> Result<(), Error> {
+        self.request(
+            VHOST_USER_SET_VRING_NUM,
+            &vring_state(index, virtq.num),
+            &[],
+            false,
+        )?;
+        let mut addr = vring_state(index, 0);
+        // ring addresses are in the master's address space, which the backend
+        // translates through the memory table
+        for gpa in [virtq.desc, virtq.used, virtq.avail].iter() {
+            addr.extend_from_slice(&((self.gpa2hva)(*gpa) as u64).to_le_bytes());
+        }
+        // log_guest_addr
+        addr.extend_from_slice(&0u64.to_le_bytes());
+        self.request(VHOST_USER_SET_VRING_ADDR, &addr, &[], false)?;
+        self.request(
+            VHOST_USER_SET_VRING_BASE,
+            &vring_state(index, 0),
+            &[],
+            false,
+        )?;
+        let index_u64 = (index as u64).to_le_bytes();
+        self.request(VHOST_USER_SET_VRING_KICK, &index_u64, &[kick.rx], false)?;
+        self.request(VHOST_USER_SET_VRING_CALL, &index_u64, &[call.tx], false)?;
+        if self.features & (1 << VHOST_USER_F_PROTOCOL_FEATURES) != 0 {
+            // with protocol features, rings start disabled
+            self.request(
+                VHOST_USER_SET_VRING_ENABLE,
+                &vring_state(index, 1),
+                &[],
+                true,
+            )?;
+        }
+        Ok(())
+    }
+
+    /// Stops queue `index`: the backend no longer touches its rings once it
+    /// replies.
+    fn stop_ring(&self, index: usize) -> Result<(), Error> {
+        self.message(
+            VHOST_USER_GET_VRING_BASE,
+            &vring_state(index, 0),
+            &[],
+            true,
+            false,
+        )?;
+        Ok(())
+    }
+
+    /// Forwards the notifications from the guest to the backend while the
+    /// queue is ready.
+    fn serve(
+        &self,
+        index: usize,
+        kick: EventFd,
+        call: Arc<EventFd>,
+        task_rx: TaskReceiver,
+        virtq_rx: VirtqReceiver,
+    ) {
+        for virtq in virtq_rx.iter() {
+            if let Err(e) = self.start_ring(index, &virtq, &kick, &call) {
+                error!("{}: cannot start queue {}: {:?}", self.name, index, e);
+            }
+            for t in task_rx.iter() {
+                if t.is_none() {
+                    break;
+                }
+                kick.signal();
+            }
+            if let Err(e) = self.stop_ring(index) {
+                error!("{}: cannot stop queue {}: {:?}", self.name, index, e);
+            }
+        }
+    }
+}
+
+/// Raises the interrupt of the device each time the backend signals `call`.
+fn forward_calls(call: Arc<EventFd>, irq: u32, irq_sender: IrqSender, isr: Arc<RwLock<u32>>) {
+    while call.wait().is_ok() {
+        *isr.write().unwrap() |= VIRTIO_INT_VRING;
+        irq_sender.send(irq).unwrap();
+    }
+}
+
+struct VhostUserCfg {
+    master: Arc<VhostUserMaster>,
+}
+
+impl VhostUserCfg {
+    fn config_msg(offset: usize, size: u8, value: u32) -> Vec<u8> {
+        let mut payload = (offset as u32).to_le_bytes().to_vec();
+        payload.extend_from_slice(&(size as u32).to_le_bytes());
+        // flags
+        payload.extend_from_slice(&0u32.to_le_bytes());
+        payload.extend_from_slice(&value.to_le_bytes()[..size as usize]);
+        payload
+    }
+}
+
+impl VirtioDevCfg for VhostUserCfg {
+    fn reset(&mut self) {}
+
+    fn generation(&self) -> u32 {
+        0
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        if size > 4
+            || !self
+                .master
+                .has_protocol_feature(VHOST_USER_PROTOCOL_F_CONFIG)
+        {
+            return None;
+        }
+        let payload = Self::config_msg(offset, size, 0);
+        let reply = self
+            .master
+            .message(VHOST_USER_GET_CONFIG, &payload, &[], true, false)
+            .ok()?;
+        let data = reply.get(payload.len() - size as usize..payload.len())?;
+        let mut value = [0u8; 4];
+        value[..data.len()].copy_from_slice(data);
+        Some(u32::from_le_bytes(value))
+    }
+
+    fn write(&mut self, offset: usize, size: u8, value: u32) -> Option<()> {
+        if size > 4
+            || !self
+                .master
+                .has_protocol_feature(VHOST_USER_PROTOCOL_F_CONFIG)
+        {
+            return None;
+        }
+        let payload = Self::config_msg(offset, size, value);
+        self.master
+            .request(VHOST_USER_SET_CONFIG, &payload, &[], true)
+            .ok()
+    }
+
+    fn features_ok(&mut self, features: u64) {
+        // guest memory is complete by now, so it is handed over before any
+        // ring is started
+        if let Err(e) = self
+            .master
+            .set_features(features)
+            .and_then(|_| self.master.set_mem_table())
+        {
+            error!("{}: {:?}", self.master.name, e);
+        }
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a device of type `dev_id` with up to `queues` virtqueues, which
+    /// are served by the vhost-user backend listening on `path`.
+    pub fn new_vhost_user(
+        name: String,
+        dev_id: VirtioId,
+        irq: u32,
+        vm: &VirtualMachine,
+        path: impl AsRef<Path>,
+        queues: usize,
+    ) -> Result<Self, Error> {
+        let master = Arc::new(VhostUserMaster::connect(name.clone(), path.as_ref(), vm)?);
+        let queues = if master.has_protocol_feature(VHOST_USER_PROTOCOL_F_MQ) {
+            std::cmp::min(queues, master.get_u64(VHOST_USER_GET_QUEUE_NUM)? as usize)
+        } else {
+            queues
+        };
+        let isr = Arc::new(RwLock::new(0));
+        let mut vqs = Vec::with_capacity(queues);
+        for index in 0..queues {
+            let kick = EventFd::new()?;
+            let call = Arc::new(EventFd::new()?);
+            let (irq_sender, isr_clone, call_clone) =
+                (vm.irq_sender.clone(), isr.clone(), call.clone());
+            std::thread::Builder::new()
+                .name(format!("{}_call{}", name, index))
+                .spawn(move || forward_calls(call_clone, irq, irq_sender, isr_clone))?;
+            let master = master.clone();
+            vqs.push(VirtqManager::with_thread(
+                format!("{}_q{}", name, index),
+                VHOST_USER_QUEUE_SIZE,
+                move |task_rx, virtq_rx| master.serve(index, kick, call, task_rx, virtq_rx),
+            ));
+        }
+        info!(
+            "{}: vhost-user backend with features 0x{:x}, {} queues",
+            name, master.features, queues
+        );
+        Ok(VirtioDevice {
+            name,
+            dev_id,
+            dev_feat: master.features & !(1 << VHOST_USER_F_PROTOCOL_FEATURES),
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            cfg: Box::new(VhostUserCfg { master }),
+            vqs,
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn eventfd_test() {
+        let fd = EventFd::new().unwrap();
+        fd.signal();
+        fd.wait().unwrap();
+    }
+
+    #[test]
+    fn message_test() {
+        let (sock, mut backend) = UnixStream::pair().unwrap();
+        let master = VhostUserMaster {
+            name: "test".into(),
+            sock: Mutex::new(sock),
+            features: 0,
+            protocol_features: 0,
+            mem_regions: Arc::new(RwLock::new(vec![])),
+            gpa2hva: Arc::new(|gpa| gpa as usize),
+        };
+        let replier = std::thread::spawn(move || {
+            let mut hdr = [0u8; VHOST_USER_HDR_SIZE];
+            backend.read_exact(&mut hdr).unwrap();
+            assert_eq!(hdr[..4], VHOST_USER_GET_FEATURES.to_le_bytes());
+            assert_eq!(hdr[4..8], VHOST_USER_VERSION.to_le_bytes());
+            assert_eq!(hdr[8..], 0u32.to_le_bytes());
+            let mut reply = VHOST_USER_GET_FEATURES.to_le_bytes().to_vec();
+            reply.extend_from_slice(&(VHOST_USER_VERSION | VHOST_USER_REPLY_MASK).to_le_bytes());
+            reply.extend_from_slice(&8u32.to_le_bytes());
+            reply.extend_from_slice(&0x1_2345_6789u64.to_le_bytes());
+            std::io::Write::write_all(&mut backend, &reply).unwrap();
+        });
+        assert_eq!(
+            master.get_u64(VHOST_USER_GET_FEATURES).unwrap(),
+            0x1_2345_6789
+        );
+        replier.join().unwrap();
+    }
+}
@@ -12,6 +12,7 @@ use super::{
 #[allow(unused_imports)]
 use log::*;
 use std::mem::size_of;
+use std::slice;
 use std::sync::{Arc, RwLock};
 
 /// This marks a buffer as continuing via the next field.
@@ -166,7 +167,16 @@ impl Virtq<usize> {
     where
         C: Fn(u64) -> usize,
     {
-        let desc_head = self.read_avail(index);
+        self.desc_chain(self.read_avail(index), converter)
+    }
+
+    /// Like `get_desc_chain()`, but starts at descriptor `desc_head` instead
+    /// of a position in the available ring, for devices that complete
+    /// requests out of order.
+    pub fn desc_chain<C>(&self, desc_head: u16, converter: C) -> (Vec<(usize, usize)>, usize)
+    where
+        C: Fn(u64) -> usize,
+    {
         let mut desc_index = desc_head;
         let mut desc_chain = Vec::new();
         let mut writable_count = 0;
@@ -195,6 +205,108 @@ impl Virtq<usize> {
     }
 }
 
+/*
+Helpers to treat the buffers of a descriptor chain, a list of
+(host virtual address, length) pairs returned by `get_desc_chain()`, as one
+contiguous byte stream.
+*/
+
+/// Returns the sub-regions of `regions` that start `skip` bytes into it and
+/// cover at most `take` bytes.
+pub fn sub_regions(
+    regions: &[(usize, usize)],
+    mut skip: usize,
+    mut take: usize,
+) -> Vec<(usize, usize)> {
+    let mut result = Vec::with_capacity(regions.len());
+    for &(addr, len) in regions {
+        if take == 0 {
+            break;
+        }
+        if skip >= len {
+            skip -= len;
+            continue;
+        }
+        let n = std::cmp::min(len - skip, take);
+        result.push((addr + skip, n));
+        take -= n;
+        skip = 0;
+    }
+    result
+}
+
+/// Copies the guest buffers described by `regions` into `buf`. Returns the
+/// number of bytes copied.
+pub fn gather(regions: &[(usize, usize)], buf: &mut [u8]) -> usize {
+    let mut copied = 0;
+    for (addr, len) in sub_regions(regions, 0, buf.len()) {
+        let src = unsafe { slice::from_raw_parts(addr as *const u8, len) };
+        buf[copied..copied + len].copy_from_slice(src);
+        copied += len;
+    }
+    copied
+}
+
+/// Reads a plain-old-data struct from the guest buffers described by `regions`.
+pub fn read_pod<T: Default>(regions: &[(usize, usize)], skip: usize) -> Option<T> {
+    let mut value = T::default();
+    let buf = unsafe { slice::from_raw_parts_mut(&mut value as *mut T as *mut u8, size_of::<T>()) };
+    if gather(&sub_regions(regions, skip, size_of::<T>()), buf) == size_of::<T>() {
+        Some(value)
+    } else {
+        None
+    }
+}
+
+/// Copies `buf` into the guest buffers described by `regions`. Returns the
+/// number of bytes copied.
+pub fn scatter(regions: &[(usize, usize)], buf: &[u8]) -> usize {
+    let mut copied = 0;
+    for (addr, len) in sub_regions(regions, 0, buf.len()) {
+        let dst = unsafe { slice::from_raw_parts_mut(addr as *mut u8, len) };
+        dst.copy_from_slice(&buf[copied..copied + len]);
+        copied += len;
+    }
+    copied
+}
+
+/// Copies the guest buffers described by `src` to the guest buffers described
+/// by `dst`. Returns the number of bytes copied.
+pub fn copy_regions(dst: &[(usize, usize)], src: &[(usize, usize)]) -> usize {
+    let mut copied = 0;
+    let (mut di, mut doff) = (0, 0);
+    for &(saddr, slen) in src {
+        let mut soff = 0;
+        while soff < slen {
+            let (daddr, dlen) = match dst.get(di) {
+                Some(&region) => region,
+                None => return copied,
+            };
+            let n = std::cmp::min(slen - soff, dlen - doff);
+            unsafe {
+                std::ptr::copy_nonoverlapping(
+                    (saddr + soff) as *const u8,
+                    (daddr + doff) as *mut u8,
+                    n,
+                )
+            };
+            soff += n;
+            doff += n;
+            copied += n;
+            if doff == dlen {
+                di += 1;
+                doff = 0;
+            }
+        }
+    }
+    copied
+}
+
+/// Total number of bytes of the guest buffers described by `regions`.
+pub fn total_len(regions: &[(usize, usize)]) -> usize {
+    regions.iter().map(|(_, len)| len).sum()
+}
+
 /// Spawns a thread to collect notifications from the guest to handle IO requests.
 ///
 /// For different types of devices, what the manager
@@ -233,6 +345,27 @@ pub trait VirtqDescHandle {
         index: u16,
         gpa2hva: &AddressConverter,
     ) -> u32;
+
+    /// Handles up to `count` descriptor chains starting at position `index` of
+    /// the available ring and returns the number of bytes written to each
+    /// chain it handled, in order. A handler may handle fewer chains than
+    /// `count`; the remaining ones are passed to it again in the next call.
+    /// Returning no chain at all makes the manager wait for the next
+    /// notification from the guest.
+    ///
+    /// The default implementation handles the chains one by one. Devices that
+    /// can submit several requests to the host at once override it.
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        (0..count)
+            .map(|i| self.handle_desc_chain(virtq, index.wrapping_add(i), gpa2hva))
+            .collect()
+    }
 }
 
 impl VirtqManager {
@@ -252,12 +385,24 @@ impl VirtqManager {
                 if t.is_none() {
                     break;
                 }
-                let avail_index = virtq.avail_index();
-                while current_index < avail_index {
-                    let length_write = handler.handle_desc_chain(&virtq, current_index, &convert);
-                    debug!("handle write 0x{:x} bytes", length_write);
-                    virtq.push_used(virtq.read_avail(current_index), length_write);
-                    current_index += 1;
+                // the avail index is re-read after every batch, so buffers
+                // the guest adds meanwhile are handled without another
+                // notification
+                loop {
+                    let pending = virtq.avail_index().wrapping_sub(current_index);
+                    if pending == 0 {
+                        break;
+                    }
+                    let lengths =
+                        handler.handle_desc_chains(&virtq, current_index, pending, &convert);
+                    if lengths.is_empty() {
+                        break;
+                    }
+                    for length_write in lengths {
+                        debug!("handle write 0x{:x} bytes", length_write);
+                        virtq.push_used(virtq.read_avail(current_index), length_write);
+                        current_index = current_index.wrapping_add(1);
+                    }
                     let avail_flag = virtq.avail_flags();
                     if avail_flag & VIRTQ_AVAIL_F_NO_INTERRUPT == 0 {
                         *isr.write().unwrap() |= VIRTIO_INT_VRING;
@@ -277,12 +422,26 @@ impl VirtqManager {
         isr: Arc<RwLock<u32>>,
         converter: AddressConverter,
         handler: impl VirtqDescHandle + Send + 'static,
+    ) -> Self {
+        Self::with_thread(name, qnum_max, move |task_rx, virtq_rx| {
+            Self::serve(task_rx, virtq_rx, irq, irq_sender, isr, converter, handler)
+        })
+    }
+
+    /// Creates a virtq served by `serve` in a thread of its own. `serve`
+    /// receives the virtq each time the driver sets QueueReady, followed by
+    /// `Some(())` for each notification and `None` when the queue is
+    /// disabled or the device is reset.
+    pub(super) fn with_thread(
+        name: String,
+        qnum_max: u32,
+        serve: impl FnOnce(TaskReceiver, VirtqReceiver) + Send + 'static,
     ) -> Self {
         let (task_tx, task_rx) = channel();
         let (virtq_tx, virtq_rx) = channel();
         std::thread::Builder::new()
             .name(name.clone())
-            .spawn(move || Self::serve(task_rx, virtq_rx, irq, irq_sender, isr, converter, handler))
+            .spawn(move || serve(task_rx, virtq_rx))
             .expect(&format!("cannot create thread for virtq {}", &name));
         VirtqManager {
             name,
@@ -303,4 +462,30 @@ mod test {
         assert_eq!(size_of::<VirtqUsedElem>(), 8);
         assert_eq!(size_of::<VirtqDesc>(), 16);
     }
+
+    #[test]
+    fn sub_regions_test() {
+        let regions = [(0x1000, 16), (0x2000, 8), (0x3000, 1)];
+        assert_eq!(
+            sub_regions(&regions, 16, usize::MAX),
+            vec![(0x2000, 8), (0x3000, 1)]
+        );
+        assert_eq!(
+            sub_regions(&regions, 10, 10),
+            vec![(0x100a, 6), (0x2000, 4)]
+        );
+        assert_eq!(sub_regions(&regions, 24, 1), vec![(0x3000, 1)]);
+    }
+
+    #[test]
+    fn copy_regions_test() {
+        let src = b"0123456789";
+        let mut dst = [0u8; 12];
+        let base = dst.as_mut_ptr() as usize;
+        let src_regions = [(src.as_ptr() as usize, 3), (src.as_ptr() as usize + 3, 7)];
+        let dst_regions = [(base, 4), (base + 4, 0), (base + 6, 6)];
+        assert_eq!(copy_regions(&dst_regions, &src_regions), 10);
+        assert_eq!(&dst, b"0123\0\0456789");
+        assert_eq!(copy_regions(&dst_regions[..1], &src_regions), 4);
+    }
 }
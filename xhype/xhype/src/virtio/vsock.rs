@@ -0,0 +1,859 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Implements a virtio socket device: stream sockets between the guest and
+the host, without a network.
+
+Guest sockets are mapped to unix domain sockets on the host, with the
+convention of Firecracker:
+
+* a guest connecting to port P of the host (CID 2) is connected to the unix
+  socket `<uds_path>_P`, where a host service listens;
+* a host process connects to the unix socket `<uds_path>`, which xhype listens
+  on, and writes `CONNECT P\n`. xhype connects it to port P of the guest and
+  answers `OK <host port>\n`, after which the socket carries the stream.
+
+Flow control is credit based (virtio-v1.1 5.10.6.3). Each side tells the
+other how much buffer space it has (`buf_alloc`) and how many bytes it has
+consumed (`fwd_cnt`), and never sends more than the other can buffer. Data
+from the guest is written straight from the TX descriptors to the host
+socket. What the socket does not take right away is buffered, at most
+`VSOCK_BUF_ALLOC` bytes per connection. Data for the guest is read from the
+host socket straight into the RX descriptors. One pass over the available
+ring fills as many chains as there is data for.
+
+A thread polls the host sockets for data and for buffer space, and another
+one accepts connections from host processes.
+*/
+
+use super::consts::*;
+use super::vhost_user::EventFd;
+use super::virtq::*;
+use super::{AddressConverter, Sender, VirtioDevCfg, VirtioDevice, VirtioId};
+use crate::err::Error;
+#[allow(unused_imports)]
+use log::*;
+use std::collections::{HashMap, VecDeque};
+use std::io::{self, IoSlice, IoSliceMut, Read, Write};
+use std::mem::size_of;
+use std::net::Shutdown;
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::io::AsRawFd;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+use std::slice;
+use std::sync::{Arc, Condvar, Mutex, RwLock};
+
+const VMADDR_CID_HOST: u64 = 2;
+
+const VIRTIO_VSOCK_TYPE_STREAM: u16 = 1;
+
+const VIRTIO_VSOCK_OP_REQUEST: u16 = 1;
+const VIRTIO_VSOCK_OP_RESPONSE: u16 = 2;
+const VIRTIO_VSOCK_OP_RST: u16 = 3;
+const VIRTIO_VSOCK_OP_SHUTDOWN: u16 = 4;
+const VIRTIO_VSOCK_OP_RW: u16 = 5;
+const VIRTIO_VSOCK_OP_CREDIT_UPDATE: u16 = 6;
+const VIRTIO_VSOCK_OP_CREDIT_REQUEST: u16 = 7;
+
+const VIRTIO_VSOCK_SHUTDOWN_RCV: u32 = 1;
+const VIRTIO_VSOCK_SHUTDOWN_SEND: u32 = 2;
+
+/// Bytes of guest data buffered per connection
+const VSOCK_BUF_ALLOC: u32 = 256 * 1024;
+
+/// The first port of connections initiated by host processes
+const VSOCK_HOST_PORT_BASE: u32 = 1 << 30;
+
+#[repr(C, packed)]
+#[derive(Debug, Default, Clone, Copy)]
+struct VsockHdr {
+    src_cid: u64,
+    dst_cid: u64,
+    src_port: u32,
+    dst_port: u32,
+    len: u32,
+    type_: u16,
+    op: u16,
+    flags: u32,
+    buf_alloc: u32,
+    fwd_cnt: u32,
+}
+
+const VSOCK_HDR_SIZE: usize = size_of::<VsockHdr>();
+
+impl VsockHdr {
+    fn as_bytes(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self as *const Self as *const u8, VSOCK_HDR_SIZE) }
+    }
+}
+
+#[derive(Debug, PartialEq, Eq)]
+enum ConnState {
+    /// initiated by a host process, waiting for the guest to accept
+    Connecting,
+    Established,
+    /// the host process closed its end, waiting for the guest to reset
+    Closing,
+}
+
+struct Connection {
+    stream: UnixStream,
+    state: ConnState,
+    /// guest data the host socket has not taken yet
+    tx_buf: VecDeque<u8>,
+    /// the guest will not send more data
+    tx_shut: bool,
+    /// the guest will not receive more data
+    rx_shut: bool,
+    /// the host socket is readable, see `Muxer::ready`
+    rx_ready: bool,
+    /// bytes sent to the guest
+    rx_cnt: u32,
+    /// bytes of guest data passed to the host socket
+    fwd_cnt: u32,
+    /// `fwd_cnt` when the guest was last told about it
+    fwd_cnt_sent: u32,
+    peer_buf_alloc: u32,
+    peer_fwd_cnt: u32,
+}
+
+impl Connection {
+    fn new(stream: UnixStream, state: ConnState) -> Self {
+        Connection {
+            stream,
+            state,
+            tx_buf: VecDeque::new(),
+            tx_shut: false,
+            rx_shut: false,
+            rx_ready: false,
+            rx_cnt: 0,
+            fwd_cnt: 0,
+            fwd_cnt_sent: 0,
+            peer_buf_alloc: 0,
+            peer_fwd_cnt: 0,
+        }
+    }
+
+    /// Bytes the guest can take without overflowing its buffer
+    fn peer_credit(&self) -> u32 {
+        let in_flight = self.rx_cnt.wrapping_sub(self.peer_fwd_cnt);
+        self.peer_buf_alloc.saturating_sub(in_flight)
+    }
+
+    fn credit_update_due(&self) -> bool {
+        self.fwd_cnt.wrapping_sub(self.fwd_cnt_sent) >= VSOCK_BUF_ALLOC / 2
+    }
+
+    /// Passes the guest data in `regions` to the host socket, buffering what
+    /// it does not take.
+    fn forward(&mut self, regions: &[(usize, usize)]) -> io::Result<()> {
+        let mut written = 0;
+        if self.tx_buf.is_empty() {
+            let iov: Vec<IoSlice> = regions
+                .iter()
+                .map(|&(addr, len)| {
+                    IoSlice::new(unsafe { slice::from_raw_parts(addr as *const u8, len) })
+                })
+                .collect();
+            written = loop {
+                match self.stream.write_vectored(&iov) {
+                    Ok(n) => break n,
+                    Err(e) if e.kind() == io::ErrorKind::WouldBlock => break 0,
+                    Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                    Err(e) => return Err(e),
+                }
+            };
+            self.fwd_cnt = self.fwd_cnt.wrapping_add(written as u32);
+        }
+        for (addr, len) in sub_regions(regions, written, usize::MAX) {
+            self.tx_buf
+                .extend(unsafe { slice::from_raw_parts(addr as *const u8, len) });
+        }
+        Ok(())
+    }
+
+    /// Writes buffered guest data to the host socket.
+    fn flush(&mut self) -> io::Result<()> {
+        while !self.tx_buf.is_empty() {
+            let (front, _) = self.tx_buf.as_slices();
+            match self.stream.write(front) {
+                Ok(n) => {
+                    self.tx_buf.drain(..n);
+                    self.fwd_cnt = self.fwd_cnt.wrapping_add(n as u32);
+                }
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => break,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            }
+        }
+        if self.tx_shut && self.tx_buf.is_empty() {
+            let _ = self.stream.shutdown(Shutdown::Write);
+        }
+        Ok(())
+    }
+}
+
+/// (host port, guest port)
+type ConnKey = (u32, u32);
+
+/// Maps guest connections to host sockets.
+struct Muxer {
+    guest_cid: u64,
+    uds_path: PathBuf,
+    conns: HashMap<ConnKey, Connection>,
+    /// packets without payload for the guest
+    control: VecDeque<VsockHdr>,
+    /// connections whose host socket is readable, in the order they are
+    /// served
+    ready: VecDeque<ConnKey>,
+    next_host_port: u32,
+    /// incremented by a device reset
+    generation: u64,
+}
+
+impl Muxer {
+    fn push_control(&mut self, key: ConnKey, op: u16, flags: u32) {
+        self.control.push_back(VsockHdr {
+            src_cid: VMADDR_CID_HOST,
+            dst_cid: self.guest_cid,
+            src_port: key.0,
+            dst_port: key.1,
+            type_: VIRTIO_VSOCK_TYPE_STREAM,
+            op,
+            flags,
+            ..Default::default()
+        });
+    }
+
+    fn reset_conn(&mut self, key: ConnKey) {
+        self.conns.remove(&key);
+        self.push_control(key, VIRTIO_VSOCK_OP_RST, 0);
+    }
+
+    /// Fills in the credit of the connection `hdr` belongs to.
+    fn stamp(&mut self, hdr: &mut VsockHdr) {
+        hdr.buf_alloc = VSOCK_BUF_ALLOC;
+        if let Some(conn) = self.conns.get_mut(&(hdr.src_port, hdr.dst_port)) {
+            hdr.fwd_cnt = conn.fwd_cnt;
+            conn.fwd_cnt_sent = conn.fwd_cnt;
+        }
+    }
+
+    fn alloc_host_port(&mut self, guest_port: u32) -> u32 {
+        loop {
+            let port = self.next_host_port;
+            self.next_host_port = port.checked_add(1).unwrap_or(VSOCK_HOST_PORT_BASE);
+            if !self.conns.contains_key(&(port, guest_port)) {
+                return port;
+            }
+        }
+    }
+
+    fn connect_host(&self, port: u32) -> io::Result<UnixStream> {
+        let mut path = self.uds_path.clone().into_os_string();
+        path.push(format!("_{}", port));
+        let stream = UnixStream::connect(path)?;
+        stream.set_nonblocking(true)?;
+        Ok(stream)
+    }
+
+    /// Handles a packet from the guest with its payload in `payload`.
+    fn handle_tx(&mut self, hdr: &VsockHdr, payload: &[(usize, usize)]) {
+        let key = (hdr.dst_port, hdr.src_port);
+        let op = hdr.op;
+        if hdr.src_cid != self.guest_cid
+            || hdr.dst_cid != VMADDR_CID_HOST
+            || hdr.type_ != VIRTIO_VSOCK_TYPE_STREAM
+        {
+            if op != VIRTIO_VSOCK_OP_RST {
+                self.push_control(key, VIRTIO_VSOCK_OP_RST, 0);
+            }
+            return;
+        }
+        if let Some(conn) = self.conns.get_mut(&key) {
+            conn.peer_buf_alloc = hdr.buf_alloc;
+            conn.peer_fwd_cnt = hdr.fwd_cnt;
+        }
+        match op {
+            VIRTIO_VSOCK_OP_REQUEST => {
+                if self.conns.contains_key(&key) {
+                    self.reset_conn(key);
+                    return;
+                }
+                match self.connect_host(key.0) {
+                    Ok(stream) => {
+                        let mut conn = Connection::new(stream, ConnState::Established);
+                        conn.peer_buf_alloc = hdr.buf_alloc;
+                        conn.peer_fwd_cnt = hdr.fwd_cnt;
+                        self.conns.insert(key, conn);
+                        self.push_control(key, VIRTIO_VSOCK_OP_RESPONSE, 0);
+                    }
+                    Err(e) => {
+                        warn!("vsock: cannot connect to host port {}: {}", key.0, e);
+                        self.push_control(key, VIRTIO_VSOCK_OP_RST, 0);
+                    }
+                }
+            }
+            VIRTIO_VSOCK_OP_RESPONSE => {
+                let accepted = match self.conns.get_mut(&key) {
+                    Some(conn) if conn.state == ConnState::Connecting => {
+                        conn.state = ConnState::Established;
+                        conn.stream
+                            .write_all(format!("OK {}\n", key.0).as_bytes())
+                            .is_ok()
+                    }
+                    _ => false,
+                };
+                if !accepted {
+                    self.reset_conn(key);
+                }
+            }
+            VIRTIO_VSOCK_OP_RW => {
+                let len = hdr.len;
+                let result = match self.conns.get_mut(&key) {
+                    Some(conn) if conn.state != ConnState::Connecting && !conn.tx_shut => {
+                        if conn.tx_buf.len() + len as usize > VSOCK_BUF_ALLOC as usize {
+                            Err(format!("guest port {} exceeds its credit", key.1))
+                        } else if let Err(e) = conn.forward(&sub_regions(payload, 0, len as usize))
+                        {
+                            Err(format!("host port {}: {}", key.0, e))
+                        } else {
+                            Ok(conn.credit_update_due())
+                        }
+                    }
+                    _ => Err(format!("no connection for guest port {}", key.1)),
+                };
+                match result {
+                    Ok(true) => self.push_control(key, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0),
+                    Ok(false) => {}
+                    Err(e) => {
+                        warn!("vsock: {}", e);
+                        self.reset_conn(key);
+                    }
+                }
+            }
+            VIRTIO_VSOCK_OP_SHUTDOWN => {
+                let flags = hdr.flags;
+                let closed = match self.conns.get_mut(&key) {
+                    Some(conn) => {
+                        conn.tx_shut |= flags & VIRTIO_VSOCK_SHUTDOWN_SEND != 0;
+                        conn.rx_shut |= flags & VIRTIO_VSOCK_SHUTDOWN_RCV != 0;
+                        conn.tx_shut && conn.rx_shut || conn.flush().is_err()
+                    }
+                    None => true,
+                };
+                if closed {
+                    self.reset_conn(key);
+                }
+            }
+            VIRTIO_VSOCK_OP_RST => {
+                self.conns.remove(&key);
+            }
+            // the credit is updated above
+            VIRTIO_VSOCK_OP_CREDIT_UPDATE => {}
+            VIRTIO_VSOCK_OP_CREDIT_REQUEST => {
+                if self.conns.contains_key(&key) {
+                    self.push_control(key, VIRTIO_VSOCK_OP_CREDIT_UPDATE, 0);
+                }
+            }
+            _ => {
+                warn!("vsock: unknown operation {}", op);
+                self.reset_conn(key);
+            }
+        }
+    }
+
+    /// Fills the receive buffer `chain` with the next packet for the guest.
+    /// Returns the number of bytes written, or `None` if there is nothing to
+    /// send. Sets `rearm` if a connection has to be polled again.
+    fn fill_rx(&mut self, chain: &[(usize, usize)], rearm: &mut bool) -> Option<u32> {
+        if let Some(mut hdr) = self.control.pop_front() {
+            self.stamp(&mut hdr);
+            scatter(chain, hdr.as_bytes());
+            return Some(VSOCK_HDR_SIZE as u32);
+        }
+        while let Some(key) = self.ready.pop_front() {
+            let conn = match self.conns.get_mut(&key) {
+                Some(conn) if conn.rx_ready => conn,
+                _ => continue,
+            };
+            let credit = conn.peer_credit();
+            if credit == 0 || conn.rx_shut || conn.state != ConnState::Established {
+                conn.rx_ready = false;
+                *rearm = true;
+                continue;
+            }
+            let space = sub_regions(chain, VSOCK_HDR_SIZE, credit as usize);
+            if space.is_empty() {
+                warn!("vsock: receive buffer without room for data");
+                self.ready.push_front(key);
+                return None;
+            }
+            let mut iov: Vec<IoSliceMut> = space
+                .iter()
+                .map(|&(addr, len)| {
+                    IoSliceMut::new(unsafe { slice::from_raw_parts_mut(addr as *mut u8, len) })
+                })
+                .collect();
+            let (op, flags, len) = match conn.stream.read_vectored(&mut iov) {
+                // the host process closed its end
+                Ok(0) => {
+                    conn.rx_ready = false;
+                    conn.state = ConnState::Closing;
+                    let flags = VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND;
+                    (VIRTIO_VSOCK_OP_SHUTDOWN, flags, 0)
+                }
+                Ok(n) => {
+                    conn.rx_cnt = conn.rx_cnt.wrapping_add(n as u32);
+                    self.ready.push_back(key);
+                    (VIRTIO_VSOCK_OP_RW, 0, n as u32)
+                }
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
+                    conn.rx_ready = false;
+                    *rearm = true;
+                    continue;
+                }
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => {
+                    self.ready.push_front(key);
+                    continue;
+                }
+                Err(e) => {
+                    warn!("vsock: host port {}: {}", key.0, e);
+                    self.reset_conn(key);
+                    return self.fill_rx(chain, rearm);
+                }
+            };
+            let mut hdr = VsockHdr {
+                src_cid: VMADDR_CID_HOST,
+                dst_cid: self.guest_cid,
+                src_port: key.0,
+                dst_port: key.1,
+                len,
+                type_: VIRTIO_VSOCK_TYPE_STREAM,
+                op,
+                flags,
+                ..Default::default()
+            };
+            self.stamp(&mut hdr);
+            scatter(chain, hdr.as_bytes());
+            return Some(VSOCK_HDR_SIZE as u32 + len);
+        }
+        None
+    }
+
+    fn reset(&mut self) {
+        self.conns.clear();
+        self.control.clear();
+        self.ready.clear();
+        self.generation += 1;
+    }
+}
+
+struct VsockShared {
+    muxer: Mutex<Muxer>,
+    /// signaled when there are packets for the guest or the device is reset
+    rx_cond: Condvar,
+    /// makes the poller thread rebuild its list of sockets
+    poller_wake: EventFd,
+}
+
+impl VsockShared {
+    fn wake(&self) {
+        self.rx_cond.notify_all();
+        self.poller_wake.signal();
+    }
+}
+
+/// Polls the host sockets for data to send to the guest and for room to
+/// write buffered guest data.
+fn poll_host(shared: Arc<VsockShared>) {
+    loop {
+        let wake_fd = libc::pollfd {
+            fd: shared.poller_wake.rx,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        let mut fds = vec![wake_fd];
+        let mut keys = Vec::new();
+        for (key, conn) in shared.muxer.lock().unwrap().conns.iter() {
+            let mut events = 0;
+            if conn.state == ConnState::Established
+                && !conn.rx_ready
+                && !conn.rx_shut
+                && conn.peer_credit() > 0
+            {
+                events |= libc::POLLIN;
+            }
+            if !conn.tx_buf.is_empty() {
+                events |= libc::POLLOUT;
+            }
+            if events != 0 {
+                fds.push(libc::pollfd {
+                    fd: conn.stream.as_raw_fd(),
+                    events,
+                    revents: 0,
+                });
+                keys.push(*key);
+            }
+        }
+        if unsafe { libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, -1) } < 0 {
+            let e = io::Error::last_os_error();
+            if e.kind() != io::ErrorKind::Interrupted {
+                error!("vsock: poll: {}", e);
+            }
+            continue;
+        }
+        if fds[0].revents != 0 {
+            let _ = shared.poller_wake.wait();
+        }
+        let mut guard = shared.muxer.lock().unwrap();
+        let muxer = &mut *guard;
+        let mut replies = Vec::new();
+        for (pfd, key) in fds[1..].iter().zip(keys) {
+            let conn = match muxer.conns.get_mut(&key) {
+                Some(conn) if pfd.revents != 0 => conn,
+                _ => continue,
+            };
+            let readable = libc::POLLIN | libc::POLLHUP | libc::POLLERR;
+            if pfd.events & libc::POLLIN != 0 && pfd.revents & readable != 0 {
+                conn.rx_ready = true;
+                muxer.ready.push_back(key);
+            }
+            if pfd.revents & libc::POLLOUT != 0 {
+                match conn.flush() {
+                    Ok(()) if conn.credit_update_due() => {
+                        replies.push((key, VIRTIO_VSOCK_OP_CREDIT_UPDATE))
+                    }
+                    Ok(()) => {}
+                    Err(_) => replies.push((key, VIRTIO_VSOCK_OP_RST)),
+                }
+            }
+        }
+        for (key, op) in replies {
+            if op == VIRTIO_VSOCK_OP_RST {
+                muxer.reset_conn(key);
+            } else {
+                muxer.push_control(key, op, 0);
+            }
+        }
+        if !muxer.ready.is_empty() || !muxer.control.is_empty() {
+            shared.rx_cond.notify_all();
+        }
+    }
+}
+
+/// Reads `CONNECT <port>\n` from a host process and asks the guest to accept
+/// the connection.
+fn connect_guest(shared: &VsockShared, mut stream: UnixStream) -> Result<(), Error> {
+    let mut line = Vec::new();
+    let mut byte = [0u8; 1];
+    while line.len() < 32 {
+        stream.read_exact(&mut byte)?;
+        if byte[0] == b'\n' {
+            break;
+        }
+        line.push(byte[0]);
+    }
+    let line = String::from_utf8_lossy(&line);
+    let port: u32 = line
+        .trim()
+        .strip_prefix("CONNECT ")
+        .and_then(|port| port.trim().parse().ok())
+        .ok_or_else(|| format!("vsock: invalid request {:?}", line))?;
+    stream.set_nonblocking(true)?;
+    let mut muxer = shared.muxer.lock().unwrap();
+    let key = (muxer.alloc_host_port(port), port);
+    muxer
+        .conns
+        .insert(key, Connection::new(stream, ConnState::Connecting));
+    muxer.push_control(key, VIRTIO_VSOCK_OP_REQUEST, 0);
+    shared.rx_cond.notify_all();
+    Ok(())
+}
+
+fn accept_host(shared: Arc<VsockShared>, listener: UnixListener) {
+    for stream in listener.incoming() {
+        match stream {
+            Ok(stream) => {
+                let shared = shared.clone();
+                std::thread::spawn(move || {
+                    if let Err(e) = connect_guest(&shared, stream) {
+                        warn!("vsock: {:?}", e);
+                    }
+                });
+            }
+            Err(e) => warn!("vsock: accept: {}", e),
+        }
+    }
+}
+
+struct VsockRxDescHandler {
+    shared: Arc<VsockShared>,
+}
+
+impl VirtqDescHandle for VsockRxDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        self.handle_desc_chains(virtq, index, 1, gpa2hva)
+            .first()
+            .cloned()
+            .unwrap_or(0)
+    }
+
+    /// Fills as many of the posted buffers as there are packets for, and waits
+    /// if there are none.
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        let mut muxer = self.shared.muxer.lock().unwrap();
+        let generation = muxer.generation;
+        loop {
+            let mut lengths = Vec::new();
+            let mut rearm = false;
+            for i in 0..count {
+                let (chain, _) = virtq.get_desc_chain(index.wrapping_add(i), |gpa| gpa2hva(gpa));
+                match muxer.fill_rx(&chain, &mut rearm) {
+                    Some(len) => lengths.push(len),
+                    None => break,
+                }
+            }
+            if rearm {
+                self.shared.poller_wake.signal();
+            }
+            if !lengths.is_empty() {
+                return lengths;
+            }
+            muxer = self.shared.rx_cond.wait(muxer).unwrap();
+            if muxer.generation != generation {
+                return vec![];
+            }
+        }
+    }
+}
+
+struct VsockTxDescHandler {
+    shared: Arc<VsockShared>,
+}
+
+impl VirtqDescHandle for VsockTxDescHandler {
+    fn handle_desc_chain(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        gpa2hva: &AddressConverter,
+    ) -> u32 {
+        self.handle_desc_chains(virtq, index, 1, gpa2hva);
+        0
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        virtq: &Virtq<usize>,
+        index: u16,
+        count: u16,
+        gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        let mut muxer = self.shared.muxer.lock().unwrap();
+        for i in 0..count {
+            let (chain, _) = virtq.get_desc_chain(index.wrapping_add(i), |gpa| gpa2hva(gpa));
+            match read_pod::<VsockHdr>(&chain, 0) {
+                Some(hdr) => {
+                    let payload = sub_regions(&chain, VSOCK_HDR_SIZE, hdr.len as usize);
+                    muxer.handle_tx(&hdr, &payload);
+                }
+                None => warn!("vsock: packet without a header"),
+            }
+        }
+        drop(muxer);
+        self.shared.wake();
+        vec![0; count as usize]
+    }
+}
+
+/// The event queue only carries transport resets, which xhype never sends,
+/// so its buffers stay with the device.
+struct VsockEventDescHandler;
+
+impl VirtqDescHandle for VsockEventDescHandler {
+    fn handle_desc_chain(&mut self, _: &Virtq<usize>, _: u16, _: &AddressConverter) -> u32 {
+        0
+    }
+
+    fn handle_desc_chains(
+        &mut self,
+        _virtq: &Virtq<usize>,
+        _index: u16,
+        _count: u16,
+        _gpa2hva: &AddressConverter,
+    ) -> Vec<u32> {
+        vec![]
+    }
+}
+
+struct VsockCfg {
+    guest_cid: u64,
+    shared: Arc<VsockShared>,
+}
+
+impl VirtioDevCfg for VsockCfg {
+    fn reset(&mut self) {
+        self.shared.muxer.lock().unwrap().reset();
+        self.shared.wake();
+    }
+
+    fn generation(&self) -> u32 {
+        0
+    }
+
+    fn read(&self, offset: usize, size: u8) -> Option<u32> {
+        let cid = self.guest_cid.to_le_bytes();
+        let bytes = cid.get(offset..offset + size as usize)?;
+        let mut value = [0u8; 4];
+        value[..bytes.len()].copy_from_slice(bytes);
+        Some(u32::from_le_bytes(value))
+    }
+
+    fn write(&mut self, _offset: usize, _size: u8, _value: u32) -> Option<()> {
+        None
+    }
+}
+
+impl VirtioDevice {
+    /// Creates a virtio socket device for a guest with context ID
+    /// `guest_cid`, whose connections are mapped to unix sockets at
+    /// `uds_path`.
+    pub fn new_vsock(
+        name: String,
+        irq: u32,
+        irq_sender: Sender<u32>,
+        gpa2hva: AddressConverter,
+        guest_cid: u64,
+        uds_path: impl AsRef<Path>,
+    ) -> Result<Self, Error> {
+        let uds_path = uds_path.as_ref().to_path_buf();
+        // a socket left behind by a previous run
+        if let Ok(metadata) = std::fs::symlink_metadata(&uds_path) {
+            if metadata.file_type().is_socket() {
+                std::fs::remove_file(&uds_path)?;
+            }
+        }
+        let listener = UnixListener::bind(&uds_path)?;
+        let shared = Arc::new(VsockShared {
+            muxer: Mutex::new(Muxer {
+                guest_cid,
+                uds_path,
+                conns: HashMap::new(),
+                control: VecDeque::new(),
+                ready: VecDeque::new(),
+                next_host_port: VSOCK_HOST_PORT_BASE,
+                generation: 0,
+            }),
+            rx_cond: Condvar::new(),
+            poller_wake: EventFd::new()?,
+        });
+        let poller_shared = shared.clone();
+        std::thread::Builder::new()
+            .name(format!("{}_poll", name))
+            .spawn(move || poll_host(poller_shared))?;
+        let listener_shared = shared.clone();
+        std::thread::Builder::new()
+            .name(format!("{}_accept", name))
+            .spawn(move || accept_host(listener_shared, listener))?;
+
+        let isr = Arc::new(RwLock::new(0));
+        let rx = VirtqManager::new(
+            format!("{}_rx", name),
+            256,
+            irq,
+            irq_sender.clone(),
+            isr.clone(),
+            gpa2hva.clone(),
+            VsockRxDescHandler {
+                shared: shared.clone(),
+            },
+        );
+        let tx = VirtqManager::new(
+            format!("{}_tx", name),
+            256,
+            irq,
+            irq_sender.clone(),
+            isr.clone(),
+            gpa2hva.clone(),
+            VsockTxDescHandler {
+                shared: shared.clone(),
+            },
+        );
+        let event = VirtqManager::new(
+            format!("{}_event", name),
+            16,
+            irq,
+            irq_sender,
+            isr.clone(),
+            gpa2hva,
+            VsockEventDescHandler,
+        );
+        Ok(VirtioDevice {
+            name,
+            dev_id: VirtioId::Vsock,
+            dev_feat: 1 << VIRTIO_F_VERSION_1,
+            dri_feat: 0,
+            dev_feat_sel: 0,
+            dri_feat_sel: 0,
+            qsel: 0,
+            cfg: Box::new(VsockCfg { guest_cid, shared }),
+            vqs: vec![rx, tx, event],
+            isr,
+            status: 0,
+            cfg_gen: 0,
+            irq,
+        })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn vsock_hdr_test() {
+        assert_eq!(VSOCK_HDR_SIZE, 44);
+    }
+
+    #[test]
+    fn vsock_credit_test() {
+        let (stream, _peer) = UnixStream::pair().unwrap();
+        let mut conn = Connection::new(stream, ConnState::Established);
+        conn.peer_buf_alloc = 100;
+        conn.rx_cnt = 60;
+        conn.peer_fwd_cnt = 20;
+        assert_eq!(conn.peer_credit(), 60);
+        // the counters wrap around
+        conn.rx_cnt = 10;
+        conn.peer_fwd_cnt = u32::MAX - 9;
+        assert_eq!(conn.peer_credit(), 80);
+        conn.peer_buf_alloc = 10;
+        assert_eq!(conn.peer_credit(), 0);
+    }
+
+    #[test]
+    fn vsock_forward_test() {
+        let (stream, mut peer) = UnixStream::pair().unwrap();
+        stream.set_nonblocking(true).unwrap();
+        let mut conn = Connection::new(stream, ConnState::Established);
+        let data = b"hello, host".to_vec();
+        let regions = [(data.as_ptr() as usize, 5), (data.as_ptr() as usize + 5, 6)];
+        conn.forward(&regions).unwrap();
+        assert_eq!(conn.fwd_cnt, 11);
+        let mut buf = [0u8; 11];
+        peer.read_exact(&mut buf).unwrap();
+        assert_eq!(&buf, b"hello, host");
+    }
+}
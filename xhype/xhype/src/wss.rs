@@ -0,0 +1,352 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*! Estimates how much of a guest's RAM is actually in use: its working set.
+
+A [`WorkingSetSampler`] periodically looks at every page of guest RAM. It
+checks whether the host has memory behind the page and whether the guest
+touched it since the last look. The age of a page is the number of samples
+since it was last touched. The working set is the resident pages younger
+than `window` samples.
+
+How touched pages are found depends on the host:
+
+* Linux, with access to `/sys/kernel/mm/page_idle/bitmap` (usually root):
+  the page frames are looked up in `/proc/self/pagemap` and marked idle
+  after every sample. Reads and writes both count.
+* Linux otherwise: the soft-dirty bits of `/proc/self/pagemap`, cleared for
+  the whole process through `/proc/self/clear_refs`. Only writes count.
+* macOS: the referenced bit reported by `mincore(2)`. The kernel clears it
+  as it scans for pages to reclaim, so the estimate is coarser and follows
+  the pace of the pageout daemon.
+
+The estimate and a histogram of page ages are read with
+[`WorkingSetSampler::working_set`].
+*/
+
+use crate::{GuestRamRegion, VirtualMachine, PAGE_SIZE};
+#[allow(unused_imports)]
+use log::*;
+use std::collections::HashMap;
+use std::io;
+use std::sync::{Arc, Mutex, RwLock};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+/// Number of buckets of the age histogram.
+pub const AGE_BUCKETS: usize = 8;
+
+/// How the sampler finds the pages the guest touched.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Tracking {
+    PageIdle,
+    SoftDirty,
+    Mincore,
+}
+
+/// The last estimate of the working set.
+#[derive(Debug, Clone, Default)]
+pub struct WorkingSet {
+    /// all of guest RAM
+    pub total_bytes: u64,
+    /// guest RAM the host has memory behind
+    pub resident_bytes: u64,
+    /// resident guest RAM touched in the last `window` samples
+    pub wss_bytes: u64,
+    /// Resident pages by age. Bucket 0 holds the pages touched since the
+    /// previous sample, bucket k the ones untouched for 2^(k-1) to 2^k - 1
+    /// samples, and the last bucket all older ones.
+    pub age_histogram: [u64; AGE_BUCKETS],
+    /// number of samples taken
+    pub samples: u64,
+    pub updated: Option<Instant>,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum PageState {
+    Absent,
+    Idle,
+    Accessed,
+}
+
+fn age_bucket(age: u8) -> usize {
+    std::cmp::min(8 - age.leading_zeros() as usize, AGE_BUCKETS - 1)
+}
+
+/// Ages the pages of a region by one sample and adds them to `ws`.
+fn account(ages: &mut [u8], states: &[PageState], window: u8, ws: &mut WorkingSet) {
+    for (age, state) in ages.iter_mut().zip(states.iter()) {
+        match state {
+            PageState::Absent => {
+                *age = u8::MAX;
+                continue;
+            }
+            PageState::Accessed => *age = 0,
+            PageState::Idle => *age = age.saturating_add(1),
+        }
+        ws.resident_bytes += PAGE_SIZE as u64;
+        ws.age_histogram[age_bucket(*age)] += 1;
+        if *age < window {
+            ws.wss_bytes += PAGE_SIZE as u64;
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+mod tracker {
+    use super::{PageState, Tracking};
+    use crate::PAGE_SIZE;
+    use std::collections::BTreeMap;
+    use std::fs::{File, OpenOptions};
+    use std::io;
+    use std::os::unix::fs::FileExt;
+
+    const PM_PRESENT: u64 = 1 << 63;
+    const PM_SOFT_DIRTY: u64 = 1 << 55;
+    const PM_PFN_MASK: u64 = (1 << 55) - 1;
+    /// pagemap entries read at once
+    const CHUNK: usize = 4096;
+
+    pub struct Tracker {
+        pagemap: File,
+        /// the page idle bitmap, if we may use it
+        bitmap: Option<File>,
+    }
+
+    fn read_pagemap(pagemap: &File, hva: usize, n: usize) -> io::Result<Vec<u64>> {
+        let mut buf = vec![0u8; n * 8];
+        pagemap.read_exact_at(&mut buf, (hva / PAGE_SIZE * 8) as u64)?;
+        Ok(buf
+            .chunks_exact(8)
+            .map(|e| {
+                let mut b = [0u8; 8];
+                b.copy_from_slice(e);
+                u64::from_le_bytes(b)
+            })
+            .collect())
+    }
+
+    impl Tracker {
+        pub fn open() -> io::Result<Self> {
+            let pagemap = File::open("/proc/self/pagemap")?;
+            let bitmap = OpenOptions::new()
+                .read(true)
+                .write(true)
+                .open("/sys/kernel/mm/page_idle/bitmap")
+                .ok();
+            // without CAP_SYS_ADMIN, pagemap hides page frame numbers
+            let probe = [1u8; PAGE_SIZE];
+            let entry = read_pagemap(&pagemap, probe.as_ptr() as usize, 1)?[0];
+            let bitmap = bitmap.filter(|_| entry & PM_PFN_MASK != 0);
+            Ok(Tracker { pagemap, bitmap })
+        }
+
+        pub fn tracking(&self) -> Tracking {
+            if self.bitmap.is_some() {
+                Tracking::PageIdle
+            } else {
+                Tracking::SoftDirty
+            }
+        }
+
+        /// Finds the state of the `n` pages at `hva` and, with page idle
+        /// tracking, marks them idle again.
+        pub fn sample(&mut self, hva: usize, n: usize, out: &mut Vec<PageState>) -> io::Result<()> {
+            out.clear();
+            for start in (0..n).step_by(CHUNK) {
+                let count = std::cmp::min(CHUNK, n - start);
+                let entries = read_pagemap(&self.pagemap, hva + start * PAGE_SIZE, count)?;
+                match &self.bitmap {
+                    Some(bitmap) => Self::sample_idle(bitmap, &entries, out)?,
+                    None => out.extend(entries.iter().map(|&e| match e {
+                        e if e & PM_PRESENT == 0 => PageState::Absent,
+                        e if e & PM_SOFT_DIRTY != 0 => PageState::Accessed,
+                        _ => PageState::Idle,
+                    })),
+                }
+            }
+            Ok(())
+        }
+
+        fn sample_idle(bitmap: &File, entries: &[u64], out: &mut Vec<PageState>) -> io::Result<()> {
+            // the bitmap is read and written in words of 64 page frames
+            let mut words: BTreeMap<u64, (u64, u64)> = BTreeMap::new();
+            for &e in entries.iter().filter(|&&e| e & PM_PRESENT != 0) {
+                let pfn = e & PM_PFN_MASK;
+                words.entry(pfn / 64).or_default().0 |= 1 << (pfn % 64);
+            }
+            for (&word, (_, idle)) in words.iter_mut() {
+                let mut buf = [0u8; 8];
+                bitmap.read_exact_at(&mut buf, word * 8)?;
+                *idle = u64::from_le_bytes(buf);
+            }
+            out.extend(entries.iter().map(|&e| {
+                if e & PM_PRESENT == 0 {
+                    return PageState::Absent;
+                }
+                let pfn = e & PM_PFN_MASK;
+                if words[&(pfn / 64)].1 & 1 << (pfn % 64) != 0 {
+                    PageState::Idle
+                } else {
+                    PageState::Accessed
+                }
+            }));
+            for (&word, &(mask, _)) in words.iter() {
+                bitmap.write_all_at(&mask.to_le_bytes(), word * 8)?;
+            }
+            Ok(())
+        }
+
+        /// Starts the next sampling interval.
+        pub fn rearm(&mut self) -> io::Result<()> {
+            if self.bitmap.is_none() {
+                // 4: clear the soft-dirty bits
+                std::fs::write("/proc/self/clear_refs", b"4")?;
+            }
+            Ok(())
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+mod tracker {
+    use super::{PageState, Tracking};
+    use crate::PAGE_SIZE;
+    use std::io;
+
+    pub struct Tracker;
+
+    impl Tracker {
+        pub fn open() -> io::Result<Self> {
+            Ok(Tracker)
+        }
+
+        pub fn tracking(&self) -> Tracking {
+            Tracking::Mincore
+        }
+
+        pub fn sample(&mut self, hva: usize, n: usize, out: &mut Vec<PageState>) -> io::Result<()> {
+            let mut vec = vec![0 as libc::c_char; n];
+            let ret = unsafe {
+                libc::mincore(hva as *const libc::c_void, n * PAGE_SIZE, vec.as_mut_ptr())
+            };
+            if ret != 0 {
+                return Err(io::Error::last_os_error());
+            }
+            let referenced = libc::MINCORE_REFERENCED | libc::MINCORE_REFERENCED_OTHER;
+            out.clear();
+            out.extend(vec.iter().map(|&v| match v as libc::c_int {
+                v if v & libc::MINCORE_INCORE == 0 => PageState::Absent,
+                v if v & referenced != 0 => PageState::Accessed,
+                _ => PageState::Idle,
+            }));
+            Ok(())
+        }
+
+        pub fn rearm(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+}
+
+use tracker::Tracker;
+
+/// Samples the pages of a VM's RAM in a background thread.
+pub struct WorkingSetSampler {
+    ram: Arc<RwLock<Vec<GuestRamRegion>>>,
+    window: u8,
+    tracking: Mutex<Option<Tracking>>,
+    working_set: RwLock<WorkingSet>,
+}
+
+impl WorkingSetSampler {
+    /// Creates a sampler for the RAM of `vm` that counts the pages touched
+    /// in the last `window` samples as the working set.
+    pub fn new(vm: &VirtualMachine, window: u8) -> Arc<Self> {
+        Arc::new(WorkingSetSampler {
+            ram: vm.ram_regions.clone(),
+            window: std::cmp::max(window, 1),
+            tracking: Mutex::new(None),
+            working_set: RwLock::new(WorkingSet::default()),
+        })
+    }
+
+    /// The last estimate.
+    pub fn working_set(&self) -> WorkingSet {
+        self.working_set.read().unwrap().clone()
+    }
+
+    /// How pages are tracked, once the sampler has started.
+    pub fn tracking(&self) -> Option<Tracking> {
+        *self.tracking.lock().unwrap()
+    }
+
+    fn sample(&self, tracker: &mut Tracker, ages: &mut HashMap<u64, Vec<u8>>) -> io::Result<()> {
+        let regions = self.ram.read().unwrap().clone();
+        let mut ws = WorkingSet::default();
+        let mut states = Vec::new();
+        for region in regions.iter() {
+            let pages = region.size as usize / PAGE_SIZE;
+            let region_ages = ages
+                .entry(region.gpa)
+                .or_insert_with(|| vec![u8::MAX; pages]);
+            tracker.sample(region.hva, pages, &mut states)?;
+            account(region_ages, &states, self.window, &mut ws);
+            ws.total_bytes += region.size;
+        }
+        tracker.rearm()?;
+        let mut working_set = self.working_set.write().unwrap();
+        ws.samples = working_set.samples + 1;
+        ws.updated = Some(Instant::now());
+        debug!(
+            "working set: {} of {} resident bytes, ages {:?}",
+            ws.wss_bytes, ws.resident_bytes, ws.age_histogram
+        );
+        *working_set = ws;
+        Ok(())
+    }
+
+    /// Starts sampling every `interval`.
+    pub fn start(self: &Arc<Self>, interval: Duration) -> io::Result<JoinHandle<()>> {
+        let mut tracker = Tracker::open()?;
+        *self.tracking.lock().unwrap() = Some(tracker.tracking());
+        info!("working set sampler: {:?}", tracker.tracking());
+        let sampler = self.clone();
+        std::thread::Builder::new()
+            .name("wss".into())
+            .spawn(move || {
+                let mut ages = HashMap::new();
+                loop {
+                    if let Err(e) = sampler.sample(&mut tracker, &mut ages) {
+                        warn!("working set sampler: {}", e);
+                    }
+                    std::thread::sleep(interval);
+                }
+            })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn age_bucket_test() {
+        let buckets: Vec<usize> = [0, 1, 2, 3, 4, 63, 64, 255]
+            .iter()
+            .map(|&age| age_bucket(age))
+            .collect();
+        assert_eq!(buckets, vec![0, 1, 2, 2, 3, 6, 7, 7]);
+    }
+
+    #[test]
+    fn account_test() {
+        use PageState::*;
+        let mut ages = vec![u8::MAX, 0, 1, 5];
+        let mut ws = WorkingSet::default();
+        account(&mut ages, &[Accessed, Idle, Idle, Absent], 2, &mut ws);
+        assert_eq!(ages, vec![0, 1, 2, u8::MAX]);
+        assert_eq!(ws.resident_bytes, 3 * PAGE_SIZE as u64);
+        assert_eq!(ws.wss_bytes, 2 * PAGE_SIZE as u64);
+        assert_eq!(ws.age_histogram[..3], [1, 1, 1]);
+    }
+}